@@ -0,0 +1,64 @@
+#include "MmlModelIR.h"
+#include "MmlCodegen.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <cctype>
+
+// Usage: maxml_codegen <model.nn> <outputPrefix> [namespace]
+// Writes <outputPrefix>.h and <outputPrefix>.cpp, a standalone predict for the model
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <model.nn> <outputPrefix> [namespace]" << std::endl;
+		return 1;
+	}
+
+	std::filesystem::path modelPath = argv[1];
+	std::filesystem::path outputPrefix = argv[2];
+
+	// The namespace defaults to the model's file name, made into an identifier
+	std::string name = argc > 3 ? argv[3] : modelPath.stem().string();
+	for (char &c : name)
+	{
+		if (!std::isalnum(static_cast<unsigned char>(c)))
+		{
+			c = '_';
+		}
+	}
+	if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+	{
+		name = "model_" + name;
+	}
+
+	if (!std::filesystem::exists(modelPath))
+	{
+		std::cerr << "Could not find " << modelPath << std::endl;
+		return 1;
+	}
+
+	// The same passes as an inference model, so batch norms fold into their producers
+	maxml::ModelIR ir = maxml::readIR(modelPath.string());
+	ir.Description.Mode = maxml::ModelMode::Inference;
+	maxml::optimizeIR(ir);
+
+	std::string headerPath = outputPrefix.string() + ".h";
+	std::string sourcePath = outputPrefix.string() + ".cpp";
+
+	std::ofstream header(headerPath);
+	std::ofstream source(sourcePath);
+	if (!header.is_open() || !source.is_open())
+	{
+		std::cerr << "Could not write " << headerPath << " and " << sourcePath << std::endl;
+		return 1;
+	}
+
+	maxml::generateHeader(ir, name, header);
+	maxml::generateSource(ir, name, outputPrefix.filename().string() + ".h", source);
+
+	std::cout << "Wrote " << headerPath << " and " << sourcePath << std::endl;
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,270 @@
+#include "maxml/MmlSequential.h"
+#include "MmlModelIR.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <bit>
+#include <limits>
+
+// Samples the models are compared on, and the batch of the batched latency
+static constexpr size_t k_NumRandomSamples = 1000;
+static constexpr size_t k_Batch = 32;
+
+static int32_t ReadBigEndian(std::ifstream &f)
+{
+	uint32_t num = 0;
+	f.read(reinterpret_cast<char *>(&num), sizeof(num));
+	if constexpr (std::endian::native == std::endian::little)
+	{
+		num = (num & 0x000000FF) << 24 | (num & 0x0000FF00) << 8 | (num & 0x00FF0000) >> 8 | (num & 0xFF000000) >> 24;
+	}
+	return static_cast<int32_t>(num);
+}
+
+// MNIST style idx files, pixels scaled to [0, 1] as the example trains on them
+static bool ReadIdxSamples(const std::string &imagesPath, const std::string &labelsPath, size_t sampleSize,
+	std::vector<float> &samples, std::vector<uint8_t> &labels)
+{
+	std::ifstream images(imagesPath, std::ios::binary);
+	std::ifstream labelsFile(labelsPath, std::ios::binary);
+	if (!images.is_open() || !labelsFile.is_open() || ReadBigEndian(images) != 2051 || ReadBigEndian(labelsFile) != 2049)
+	{
+		return false;
+	}
+
+	int32_t numImages = ReadBigEndian(images);
+	int32_t imageSize = ReadBigEndian(images) * ReadBigEndian(images);
+	int32_t numLabels = ReadBigEndian(labelsFile);
+	if (numImages != numLabels || static_cast<size_t>(imageSize) != sampleSize)
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> pixels(static_cast<size_t>(numImages) * imageSize);
+	labels.resize(numLabels);
+	images.read(reinterpret_cast<char *>(pixels.data()), pixels.size());
+	labelsFile.read(reinterpret_cast<char *>(labels.data()), labels.size());
+
+	samples.resize(pixels.size());
+	for (size_t i = 0; i < pixels.size(); ++i)
+	{
+		samples[i] = static_cast<float>(pixels[i]) / 255.f;
+	}
+	return true;
+}
+
+// Outputs of every sample, k_Batch at a time
+static std::vector<float> PredictAll(maxml::Sequential &model, const std::vector<float> &samples, const std::array<size_t, 3> &inShape, size_t outputSize)
+{
+	size_t sampleSize = inShape[0] * inShape[1] * inShape[2];
+	size_t numSamples = samples.size() / sampleSize;
+	std::vector<float> outputs(numSamples * outputSize);
+
+	for (size_t first = 0; first < numSamples; first += k_Batch)
+	{
+		size_t batch = std::min(k_Batch, numSamples - first);
+		maxml::Tensor inputs(batch * inShape[0], inShape[1], inShape[2]);
+		maxml::Tensor::copy(inputs, samples.data() + first * sampleSize, batch * sampleSize);
+
+		const maxml::Tensor &output = model.predict(inputs, batch);
+		maxml::Tensor::copy(outputs.data() + first * outputSize, batch * outputSize, output);
+	}
+	return outputs;
+}
+
+// Best of several runs, in microseconds per call
+static double Latency(maxml::Sequential &model, const std::array<size_t, 3> &inShape, size_t batch)
+{
+	maxml::Tensor inputs(batch * inShape[0], inShape[1], inShape[2]);
+	inputs.fill(0.5f);
+
+	size_t numCalls = std::max<size_t>(200 / batch, 5);
+	double best = std::numeric_limits<double>::infinity();
+	for (size_t run = 0; run < 7; ++run)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < numCalls; ++i)
+		{
+			model.predict(inputs, batch);
+		}
+		auto end = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::micro>(end - start).count() / static_cast<double>(numCalls));
+	}
+	return best;
+}
+
+static size_t ArgMax(const float *values, size_t size)
+{
+	return static_cast<size_t>(std::max_element(values, values + size) - values);
+}
+
+// Usage: maxml_compress <model.nn> <output.nn> <rank | energy> [images.idx3-ubyte labels.idx1-ubyte]
+// Factorizes the fully connected layers of a trained model through their truncated SVD, keeping
+// a fixed rank, or enough singular values to hold a fraction of the energy when given a number
+// below one, and writes the result. Reports each layer's reconstruction error, how closely the
+// outputs follow the original on the labelled samples or on random inputs, and the latencies.
+int main(int argc, char **argv)
+{
+	if (argc != 4 && argc != 6)
+	{
+		std::cerr << "Usage: " << argv[0] << " <model.nn> <output.nn> <rank | energy> [images.idx3-ubyte labels.idx1-ubyte]" << std::endl;
+		return 1;
+	}
+
+	std::filesystem::path modelPath = argv[1];
+	std::filesystem::path outputPath = argv[2];
+	double threshold = std::stod(argv[3]);
+
+	bool byEnergy = threshold < 1.0;
+	size_t rank = byEnergy ? 0 : static_cast<size_t>(threshold);
+	float energy = byEnergy ? static_cast<float>(threshold) : 0.0f;
+	if (threshold <= 0.0)
+	{
+		std::cerr << "The rank or energy must be positive" << std::endl;
+		return 1;
+	}
+
+	if (!std::filesystem::exists(modelPath))
+	{
+		std::cerr << "Could not find " << modelPath << std::endl;
+		return 1;
+	}
+
+	maxml::ModelIR original = maxml::readIR(modelPath.string());
+	maxml::inferShapes(original);
+
+	maxml::ModelIR ir = original;
+	maxml::factorizeFullyConnected(ir, rank, energy);
+	maxml::writeIR(ir, outputPath.string());
+
+	// Relative Frobenius error of each replaced weight matrix
+	size_t paramsBefore = 0;
+	size_t paramsAfter = 0;
+	std::cout << std::fixed;
+	for (size_t i = 0; i < ir.Nodes.size(); ++i)
+	{
+		for (const maxml::Tensor &tensor : original.Nodes[i].Tensors)
+		{
+			paramsBefore += tensor.size();
+		}
+		for (const maxml::Tensor &tensor : ir.Nodes[i].Tensors)
+		{
+			paramsAfter += tensor.size();
+		}
+
+		if (!std::holds_alternative<maxml::FactorizedFullyConnectedDesc>(ir.Nodes[i].Desc))
+		{
+			continue;
+		}
+
+		const maxml::Tensor &weights = original.Nodes[i].Tensors[0];
+		maxml::Tensor product = maxml::Tensor::matMult(ir.Nodes[i].Tensors[2], ir.Nodes[i].Tensors[0]);
+
+		double error = 0.0;
+		double norm = 0.0;
+		for (size_t k = 0; k < weights.size(); ++k)
+		{
+			error += (weights[k] - product[k]) * (weights[k] - product[k]);
+			norm += weights[k] * weights[k];
+		}
+
+		std::cout << "Layer " << i << ": " << weights.rows() << " x " << weights.cols()
+			<< " -> rank " << std::get<maxml::FactorizedFullyConnectedDesc>(ir.Nodes[i].Desc).Rank
+			<< ", relative error " << std::setprecision(6) << std::sqrt(error / std::max(norm, 1e-30)) << std::endl;
+	}
+	std::cout << "Parameters: " << paramsBefore << " -> " << paramsAfter
+		<< " (" << std::setprecision(1) << 100.0 * static_cast<double>(paramsAfter) / static_cast<double>(paramsBefore) << "%)" << std::endl;
+	std::cout << "Wrote " << outputPath << std::endl;
+
+	maxml::Sequential before(modelPath.string(), k_Batch, maxml::ModelMode::Inference);
+	maxml::Sequential after(outputPath.string(), k_Batch, maxml::ModelMode::Inference);
+
+	const std::array<size_t, 3> &inShape = original.Nodes.front().Shape;
+	const std::array<size_t, 3> &outShape = original.Nodes.back().Shape;
+	size_t sampleSize = inShape[0] * inShape[1] * inShape[2];
+	size_t outputSize = outShape[0] * outShape[1] * outShape[2];
+
+	std::vector<float> samples;
+	std::vector<uint8_t> labels;
+	if (argc == 6)
+	{
+		if (!ReadIdxSamples(argv[4], argv[5], sampleSize, samples, labels))
+		{
+			std::cerr << "Could not load " << argv[4] << " and " << argv[5] << " for this model's input" << std::endl;
+			return 1;
+		}
+	}
+	else
+	{
+		std::mt19937 mt(0);
+		std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+		samples.resize(k_NumRandomSamples * sampleSize);
+		for (float &x : samples)
+		{
+			x = dist(mt);
+		}
+	}
+
+	std::vector<float> outputsBefore = PredictAll(before, samples, inShape, outputSize);
+	std::vector<float> outputsAfter = PredictAll(after, samples, inShape, outputSize);
+	size_t numSamples = samples.size() / sampleSize;
+
+	double maxDiff = 0.0;
+	double meanDiff = 0.0;
+	size_t agreements = 0;
+	size_t correctBefore = 0;
+	size_t correctAfter = 0;
+	for (size_t n = 0; n < numSamples; ++n)
+	{
+		const float *y0 = outputsBefore.data() + n * outputSize;
+		const float *y1 = outputsAfter.data() + n * outputSize;
+		for (size_t k = 0; k < outputSize; ++k)
+		{
+			double diff = std::abs(y0[k] - y1[k]);
+			maxDiff = std::max(maxDiff, diff);
+			meanDiff += diff;
+		}
+
+		size_t class0 = ArgMax(y0, outputSize);
+		size_t class1 = ArgMax(y1, outputSize);
+		agreements += class0 == class1;
+		if (!labels.empty())
+		{
+			correctBefore += class0 == labels[n];
+			correctAfter += class1 == labels[n];
+		}
+	}
+	meanDiff /= static_cast<double>(numSamples * outputSize);
+
+	std::cout << (labels.empty() ? "Random inputs: " : "Labelled samples: ") << numSamples << std::endl;
+	std::cout << "Output difference: mean " << std::setprecision(6) << meanDiff << ", max " << maxDiff << std::endl;
+	if (outputSize > 1)
+	{
+		std::cout << "Top-1 agreement: " << std::setprecision(2) << 100.0 * static_cast<double>(agreements) / static_cast<double>(numSamples) << "%" << std::endl;
+	}
+	if (!labels.empty())
+	{
+		std::cout << "Accuracy: " << std::setprecision(2)
+			<< 100.0 * static_cast<double>(correctBefore) / static_cast<double>(numSamples) << "% -> "
+			<< 100.0 * static_cast<double>(correctAfter) / static_cast<double>(numSamples) << "%" << std::endl;
+	}
+
+	for (size_t batch : { size_t(1), k_Batch })
+	{
+		double latencyBefore = Latency(before, inShape, batch);
+		double latencyAfter = Latency(after, inShape, batch);
+		std::cout << "Latency, batch " << batch << ": " << std::setprecision(1) << latencyBefore << "us -> " << latencyAfter
+			<< "us (" << std::setprecision(2) << latencyBefore / latencyAfter << "x)" << std::endl;
+	}
+
+	return 0;
+}
\ No newline at end of file
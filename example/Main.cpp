@@ -196,7 +196,7 @@ static void RegressionExample()
 			float x = lower + (upper - lower) * ((float)i / (float)points);
 
 			maxml::Tensor inp = {x};
-			maxml::Tensor out = seq.feedForward(inp);
+			maxml::Tensor out = seq.predict(inp);
 
 			if (i < points)
 				ss << "(" << inp[0] << ", " << out[0] * supremum << "),";
@@ -353,7 +353,7 @@ static void MnistExample()
 
 			const auto &inp = testData[choice].first;
 			const auto &exp = testData[choice].second;
-			const auto &out = seq.feedForward(inp);
+			const auto &out = seq.predict(inp);
 
 			float currentMax = -std::numeric_limits<float>::infinity();
 			int expected = 0;
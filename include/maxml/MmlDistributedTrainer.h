@@ -0,0 +1,48 @@
+#pragma once
+
+#include "maxml/MmlSequential.h"
+
+namespace maxml
+{
+	class Transport;
+
+	// Data-parallel training across processes, each running its own copy of the model on its
+	// own part of every mini-batch. Parameters start out as rank 0's, and after every backward
+	// pass the deltas are averaged over all ranks by ring all-reduce, so every rank takes the
+	// same optimizer step and the copies never drift apart. Ranks must use equal batch sizes.
+	//
+	// Communication overlaps backward: the delta arena is cut at layer boundaries into buckets
+	// of MML_ALLREDUCE_BUCKET_BYTES, and a second thread all-reduces each bucket as soon as
+	// backward has finished its layers, starting from the last. Buckets only depend on the
+	// model, so all ranks reduce the same buckets in the same order. Layer buffers such as
+	// running statistics are averaged over the ranks after every step.
+	class DistributedTrainer
+	{
+	public:
+		DistributedTrainer() = delete;
+		DistributedTrainer(Sequential &model, Transport &transport);
+
+		DistributedTrainer(const DistributedTrainer &other) = delete;
+		DistributedTrainer &operator=(const DistributedTrainer &other) = delete;
+
+		// One optimizer step over this rank's batchSize samples stacked along the channels, as
+		// for Sequential::feedForward, returning the loss averaged over all ranks
+		float step(const Tensor &inputs, const Tensor &expected, size_t batchSize);
+
+	private:
+		// Range [Begin, End) of the delta arena, ready once backward is done with FirstLayer
+		struct Bucket
+		{
+			size_t Begin;
+			size_t End;
+			size_t FirstLayer;
+		};
+
+		Sequential &m_Model;
+		Transport &m_Transport;
+
+		// Backward runs on the caller's thread, communication on the other
+		std::shared_ptr<ThreadPool> m_Pool;
+		std::vector<Bucket> m_Buckets;
+	};
+}
\ No newline at end of file
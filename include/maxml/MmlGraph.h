@@ -0,0 +1,147 @@
+#pragma once
+
+#include "maxml/MmlSequential.h"
+
+namespace maxml
+{
+	enum class MergeFunc : uint32_t
+	{
+		Add = 0,   // Elementwise sum of inputs of one shape
+		Concat = 1 // Inputs stacked along the channels, with matching rows and cols
+	};
+
+	struct MergeDesc
+	{
+		MergeFunc Func = MergeFunc::Add;
+		ActivationFunc ActivFunc = ActivationFunc::None;
+	};
+
+	struct GraphDesc
+	{
+		using NodeDesc = std::variant<
+			InputDesc,          // Input
+			FullyConnectedDesc, // FullyConnected
+			ConvolutionalDesc,  // Convolutional
+			PoolingDesc,        // Pooling
+			FlattenDesc,        // Flatten
+			BatchNormDesc,      // BatchNorm
+			FactorizedFullyConnectedDesc, // FactorizedFullyConnected
+			MergeDesc           // Merge
+		>;
+
+		// Inputs are indices of earlier nodes, a single one for layers and two or more for
+		// merges. Layers without any read the node before them.
+		struct Node
+		{
+			NodeDesc Desc;
+			std::vector<uint64_t> Inputs = {};
+		};
+
+		LossFunc ObjectiveFunc = LossFunc::MSE;
+		float LearningRate = 0.1f;
+		OptimizerDesc Optimizer = {};
+
+		// The first node is the input and the last one the output
+		std::vector<Node> Nodes = {};
+
+		// Largest batch passed to feedForward, activations and deltas are sized for it
+		uint64_t MaxBatchSize = 1;
+
+		// Threads running independent branches at the same time, one runs them in turn
+		uint64_t BranchThreads = 1;
+	};
+
+	MergeDesc makeMerge(MergeFunc mergeFunc, ActivationFunc activFunc);
+
+	// Model whose layers form a directed acyclic graph, such as residual or inception-style
+	// networks, built from the same layer descriptions as Sequential. Passes run the graph
+	// level by level, a level being every node whose inputs are all computed by then, with
+	// the nodes of a level spread over the branch threads. Activations and deltas of all
+	// branches are planned into one arena by when each is alive. Layouts stay planar.
+	class Graph
+	{
+	public:
+		Graph() = delete;
+		Graph(const GraphDesc &description);
+
+		Graph(const Graph &other) = delete;
+		Graph &operator=(const Graph &other) = delete;
+
+		// As Sequential, inputs and expected outputs hold batchSize samples stacked along the channels
+		const Tensor &feedForward(const Tensor &inputs, size_t batchSize = 1);
+		float feedBackward(const Tensor &expected);
+
+		// The phases of feedBackward, as for Sequential
+		float backward(const Tensor &expected);
+		void step();
+		void zeroGrad();
+
+		// Replaces the optimizer used by step, discarding any optimizer state
+		void setOptimizer(const OptimizerDesc &optimizer);
+
+		// Bytes of the arena all activations and deltas are planned into
+		size_t activationBytes() const;
+
+	private:
+		// A layer reading one value, or a merge of several, writing the value of the same
+		// index. Node 0 stands for the input, written by feedForward.
+		struct Node
+		{
+			std::shared_ptr<Layer> Op;
+			MergeFunc Merge = MergeFunc::Add;
+			std::vector<size_t> Inputs;
+
+			// Longest path from the input
+			size_t Level = 0;
+
+			// Where backward writes the delta of each input. A value read by a single layer
+			// has it written straight into its delta, otherwise its node sums DeltaParts.
+			std::vector<Tensor *> InputDeltas;
+			std::vector<Tensor *> DeltaParts;
+		};
+
+		void build();
+
+		// Places every value, delta and partial delta into m_ActivationArena by the levels
+		// it is alive between, and wires the nodes' delta targets
+		void plan();
+
+		// Moves the parameters and deltas into arenas and rebuilds the optimizer over them
+		void buildOptimizer();
+
+		void forwardNode(size_t index, size_t batchSize);
+		void backwardNode(size_t index, size_t batchSize);
+
+		// Calls func with each node of a level, on the branch threads if there are several
+		void runLevel(const std::vector<size_t> &level, const std::function<void(size_t)> &func);
+
+		// View of batchSize samples of a tensor shaped like the value at index
+		Tensor batchView(Tensor &tensor, size_t index, size_t batchSize) const;
+
+	private:
+		std::vector<Node> m_Nodes;
+
+		// Planar shape of each node's value
+		std::vector<std::array<size_t, 3>> m_Shapes;
+
+		// Node indices of each level, from the first after the input
+		std::vector<std::vector<size_t>> m_Levels;
+
+		// Each node's value and the delta of the loss with respect to it, and the partial
+		// deltas of values read more than once, all views of m_ActivationArena
+		std::vector<Tensor> m_Values;
+		std::vector<Tensor> m_Deltas;
+		std::vector<std::shared_ptr<Tensor>> m_PartialDeltas;
+		Tensor m_ActivationArena;
+
+		Tensor m_ParameterArena;
+		Tensor m_DeltaArena;
+		std::shared_ptr<Optimizer> m_Optimizer;
+		std::shared_ptr<ThreadPool> m_Pool;
+
+		size_t m_BatchSize = 1;
+		Tensor m_Output;
+
+		GraphDesc m_Description;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "maxml/MmlSequential.h"
+
+namespace maxml
+{
+	// Forward-only runner for one serving thread, reading the parameters of a model it shares
+	// with any number of other sessions. The model must not change while sessions use it.
+	class InferenceSession
+	{
+	public:
+		InferenceSession() = delete;
+		InferenceSession(const std::shared_ptr<const Sequential> &weights, size_t maxBatchSize = 1);
+
+		InferenceSession(const InferenceSession &other) = delete;
+		InferenceSession &operator=(const InferenceSession &other) = delete;
+
+		// As Sequential::predict, the outputs stay valid until the session's next call
+		const Tensor &predict(const Tensor &inputs, size_t batchSize = 1);
+
+	private:
+		std::shared_ptr<const Sequential> m_Weights;
+		std::shared_ptr<Sequential> m_Model;
+	};
+}
\ No newline at end of file
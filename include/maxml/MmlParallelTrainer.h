@@ -0,0 +1,77 @@
+#pragma once
+
+#include "maxml/MmlSequential.h"
+
+namespace maxml
+{
+	class ThreadPool;
+
+	enum class TrainerMode : uint32_t
+	{
+		Synchronous = 0, // Deltas all-reduced into one optimizer step per mini-batch
+		Hogwild = 1      // Lock-free asynchronous SGD, see ParallelTrainer
+	};
+
+	// Data-parallel training on several threads. Each worker owns a replica of the model that
+	// shares its parameters, and runs a contiguous shard of every mini-batch through it. The
+	// replicas' deltas are then all-reduced into the model's, which takes one optimizer step.
+	// Results depend on the data, the number of workers and the seed, never on scheduling.
+	// Batch normalization normalizes each shard by its own statistics, and the running
+	// statistics are averaged over the workers after every step.
+	//
+	// In Hogwild mode there is no reduction: every worker runs plain SGD on its own samples
+	// and writes the shared parameters directly, without locks, so workers may read
+	// parameters another is halfway through updating and concurrent steps to the same
+	// element may be lost. These are deliberate data races, outside the C++ memory model and
+	// undefined behaviour by the standard: the update kernels use plain (vector) loads and
+	// stores, which on the supported x86 targets do not tear aligned floats in practice, and
+	// atomics would cost the fused GEMM updates their vectorization. Keep runs with more than
+	// one Hogwild worker out of ThreadSanitizer builds, which rightly report them. The
+	// staleness is bounded by one mini-batch per worker. This converges when updates are
+	// sparse or small relative to the parameters (lower the learning rate as workers are
+	// added), but results are not reproducible. Fused updates are kept, so layers step the
+	// shared weights straight from their gradient GEMMs.
+	class ParallelTrainer
+	{
+	public:
+		ParallelTrainer() = delete;
+		ParallelTrainer(Sequential &model, size_t numWorkers, size_t maxBatchSize, TrainerMode mode = TrainerMode::Synchronous);
+
+		ParallelTrainer(const ParallelTrainer &other) = delete;
+		ParallelTrainer &operator=(const ParallelTrainer &other) = delete;
+
+		// One optimizer step over batchSize samples stacked along the channels, as for
+		// Sequential::feedForward, returning the loss averaged over the batch. In Hogwild
+		// mode each worker steps on its own shard.
+		float step(const Tensor &inputs, const Tensor &expected, size_t batchSize);
+
+		// Steps over numSamples samples in mini-batches of batchSize, in an order shuffled
+		// with seed, returning the loss averaged over all samples. In Hogwild mode each worker
+		// takes a contiguous part of the shuffled samples and steps after every mini-batch of
+		// up to batchSize of its own, with no synchronization until the epoch ends.
+		float epoch(const Tensor &inputs, const Tensor &expected, size_t numSamples, size_t batchSize, uint64_t seed);
+
+	private:
+		float epochHogwild(const Tensor &inputs, const Tensor &expected, const std::vector<size_t> &order, size_t batchSize);
+
+		// Each thread sums its own chunk of every replica's delta arena, weighted by the
+		// replica's share of the batch, into the model's delta arena
+		void reduceDeltas(size_t threadIndex, size_t batchSize);
+
+		// Averages layer buffers such as running statistics into the model and back out
+		void syncBuffers(size_t batchSize);
+
+	private:
+		Sequential &m_Model;
+		std::shared_ptr<ThreadPool> m_Pool;
+		std::vector<std::shared_ptr<Sequential>> m_Replicas;
+
+		// Shard of the current batch and loss of each worker
+		std::vector<size_t> m_ShardBegins;
+		std::vector<size_t> m_ShardSizes;
+		std::vector<float> m_Losses;
+
+		size_t m_MaxBatchSize;
+		TrainerMode m_Mode;
+	};
+}
\ No newline at end of file
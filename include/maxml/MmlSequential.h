@@ -3,8 +3,10 @@
 #include "maxml/MmlTensor.h"
 
 #include <vector>
+#include <array>
 #include <variant>
 #include <memory>
+#include <functional>
 
 namespace maxml
 {
@@ -57,6 +59,12 @@ namespace maxml
 	*/
 
 	struct Layer;
+	class Optimizer;
+	struct ModelIR;
+	class ParallelTrainer;
+	class DistributedTrainer;
+	class InferenceSession;
+	class ThreadPool;
 
 	enum class ActivationFunc : uint32_t
 	{
@@ -78,13 +86,36 @@ namespace maxml
 		CrossEntropy = 1
 	};
 
+	enum class OptimizerFunc : uint32_t
+	{
+		SGD = 0,
+		Momentum = 1,
+		Nesterov = 2,
+		Adam = 3,
+		AdamW = 4
+	};
+
+	enum class TensorLayout : uint32_t
+	{
+		NCHW = 0,  // Planar, channel by channel
+		NCHW8c = 1 // Channels grouped in blocks of Tensor::k_BlockSize, innermost
+	};
+
+	enum class ModelMode : uint32_t
+	{
+		Training = 0, // Deltas, optimizer state and backward scratch for every layer
+		Inference = 1 // Forward passes only, see SequentialDesc::Mode
+	};
+
 	enum class LayerKind : uint32_t
 	{
 		Input = 0,
 		FullyConnected = 1,
 		Convolutional = 2,
 		Polling = 3,
-		Flatten = 4
+		Flatten = 4,
+		BatchNorm = 5,
+		FactorizedFullyConnected = 6
 	};
 
 	struct InputDesc
@@ -100,6 +131,16 @@ namespace maxml
 		ActivationFunc ActivFunc = ActivationFunc::None;
 	};
 
+	// A fully connected layer whose weights are the product of a (Rank x inputs) projection
+	// and a (NumOutputs x Rank) expansion, for fewer parameters and operations when Rank is
+	// small. Runs as two fully connected layers, the projection's biases included.
+	struct FactorizedFullyConnectedDesc
+	{
+		uint64_t NumOutputs = 0;
+		uint64_t Rank = 0;
+		ActivationFunc ActivFunc = ActivationFunc::None;
+	};
+
 	struct ConvolutionalDesc
 	{
 		uint64_t NumKernels = 8;
@@ -119,6 +160,25 @@ namespace maxml
 	{
 	};
 
+	// Normalizes each channel over the channel's elements, or for flat inputs, such as fully
+	// connected outputs, each feature
+	struct BatchNormDesc
+	{
+		float Momentum = 0.9f;
+		float Epsilon = 1e-5f;
+		ActivationFunc ActivFunc = ActivationFunc::None;
+	};
+
+	struct OptimizerDesc
+	{
+		OptimizerFunc Func = OptimizerFunc::SGD;
+		float Momentum = 0.9f;     // Momentum and Nesterov
+		float Beta1 = 0.9f;        // Adam and AdamW
+		float Beta2 = 0.999f;      // Adam and AdamW
+		float Epsilon = 1e-8f;     // Adam and AdamW
+		float WeightDecay = 0.0f;  // Added to the gradient, decoupled from it for AdamW
+	};
+
 	struct SequentialDesc
 	{
 		using LayerDesc = std::variant<
@@ -126,12 +186,47 @@ namespace maxml
 			FullyConnectedDesc, // FullyConnected
 			ConvolutionalDesc,  // Convolutional
 			PoolingDesc,        // Pooling
-			FlattenDesc         // Flatten
+			FlattenDesc,        // Flatten
+			BatchNormDesc,      // BatchNorm
+			FactorizedFullyConnectedDesc // FactorizedFullyConnected
 		>;
 
 		LossFunc ObjectiveFunc = LossFunc::MSE;
 		float LearningRate = 0.1f;
+		OptimizerDesc Optimizer = {};
 		std::vector<LayerDesc> LayerDescs = {};
+
+		// Opt-in blocked layout for convolution and pooling, other layers stay planar
+		TensorLayout Layout = TensorLayout::NCHW;
+
+		// Largest batch passed to feedForward or predict, activations and deltas are sized for it
+		uint64_t MaxBatchSize = 1;
+
+		// With plain SGD, fully connected and convolutional layers step their parameters inside
+		// backward straight from the gradient GEMMs and keep no deltas, so their gradients
+		// cannot be accumulated over several backward calls. Ignored by other optimizers.
+		bool FusedUpdate = false;
+
+		// Threads that fully connected layers too large for one core complex's cache are split
+		// across by output rows, pinned to different parts of the machine, with each thread's
+		// weight rows moved to its NUMA node. One disables it.
+		uint64_t TensorParallelThreads = 1;
+		// Inference models never allocate deltas, optimizer state or backward scratch, and keep
+		// their parameters in the layers. Batch normalization is folded or reads its running
+		// statistics, convolutions run direct kernels, and feedForward runs as predict.
+		ModelMode Mode = ModelMode::Training;
+
+		// Training keeps activations only at the outputs of these layer descriptions (indices
+		// into LayerDescs) and recomputes the others during backward, one segment at a time
+		// from the checkpoint before it, for up to one extra forward pass. Checkpoints directly
+		// followed by in-place layers move past them.
+		std::vector<uint64_t> Checkpoints = {};
+
+		// Layers with alternative kernels, such as training convolutions and fully connected
+		// layers split across the tensor parallel threads, run whichever was fastest on their
+		// shapes here. Winners are benchmarked once per machine and kept in this file, so later
+		// models start with them. Empty keeps the fixed heuristics.
+		std::string TuningCachePath = {};
 	};
 
 	InputDesc makeInput(size_t channels, size_t rows, size_t cols);
@@ -139,27 +234,126 @@ namespace maxml
 	ConvolutionalDesc makeConvolutional(size_t numKernels, size_t kernelWidth, size_t kernelHeight, ActivationFunc activFunc);
 	PoolingDesc makePooling(size_t tileWidth, size_t tileHeight, PoolingFunc poolFunc);
 	FlattenDesc makeFlatten();
+	BatchNormDesc makeBatchNorm(ActivationFunc activFunc);
+	FactorizedFullyConnectedDesc makeFactorizedFullyConnected(size_t numOutputs, size_t rank, ActivationFunc activFunc);
 
 	class Sequential
 	{
+		friend class ParallelTrainer;
+		friend class DistributedTrainer;
+		friend class InferenceSession;
+
 	public:
 		Sequential() = delete;
 		Sequential(const SequentialDesc &description);
-		Sequential(const std::string &path);
+		Sequential(const std::string &path, size_t maxBatchSize = 1, ModelMode mode = ModelMode::Training);
+
+		// Replica for another thread, with its own activations, deltas and layer state but
+		// sharing the parameters of master. Anything rebuilding the master's parameters
+		// (foldBatchNorm, setOptimizer, setFusedUpdate) invalidates its replicas. Replicas
+		// are already spread over threads, so they run without tensor parallelism.
+		Sequential(Sequential &master, size_t maxBatchSize);
 
 		Sequential(const Sequential &other) = delete;
 		Sequential(const Sequential &&other) = delete;
 		Sequential &operator=(const Sequential &other) = delete;
 		Sequential &operator=(const Sequential &&other) = delete;
 
-		const Tensor &feedForward(const Tensor &input);
+		// Inputs hold batchSize samples stacked along the channels, and the expected outputs
+		// one target per sample of the preceding feedForward. Deltas are averaged over the
+		// batch and the parameters updated once per batch.
+		const Tensor &feedForward(const Tensor &inputs, size_t batchSize = 1);
 		float feedBackward(const Tensor &expected);
 
+		// The phases of feedBackward. backward adds the parameter deltas of the preceding
+		// feedForward to those accumulated so far, step applies the accumulated deltas and
+		// zeroGrad clears them, so several batches can be accumulated into one update.
+		// layerDone, if given, is called with each layer's index as soon as its deltas are
+		// final, walking from the last layer to the first.
+		float backward(const Tensor &expected, const std::function<void(size_t)> &layerDone = nullptr);
+		void step();
+		void zeroGrad();
+
+		// Replaces the optimizer used by step, discarding any optimizer state
+		void setOptimizer(const OptimizerDesc &optimizer);
+
+		// Switches SequentialDesc::FusedUpdate, releasing or reallocating the affected deltas
+		void setFusedUpdate(bool fused);
+
+		// Sets SequentialDesc::Checkpoints and replans the activations, or picks about sqrt(n)
+		// evenly spaced ones for n layer descriptions, kept only if they lower activationBytes
+		void setCheckpoints(const std::vector<size_t> &checkpoints);
+		void setAutoCheckpoints();
+
+		// Sets SequentialDesc::TensorParallelThreads, starting or stopping the threads
+		void setTensorParallelism(size_t numThreads);
+
+		// Sets SequentialDesc::TuningCachePath and picks the kernels of the current layers
+		void autotune(const std::string &cachePath);
+
+		// Inference only forward pass, convolution -> activation -> pooling chains are run
+		// tile by tile so intermediates stay in cache. Cannot be followed by feedBackward.
+		const Tensor &predict(const Tensor &inputs, size_t batchSize = 1);
+
 		void save(const std::string &path);
 
+		// Folds batch normalization into the preceding fully connected or convolutional
+		// layer where it directly follows one without an activation, for inference or export.
+		// Any batch normalization that cannot be folded switches to its running statistics.
+		void foldBatchNorm();
+
+		void setLayout(TensorLayout layout);
+
+		// Bytes of the activation arena, the planned peak of the activations (and deltas when
+		// training) alive at once, at the maximum batch size
+		size_t activationBytes() const;
+
 	private:
-		void construct(const std::string &path);
-		void construct(const SequentialDesc &description);
+		// Inference model for an InferenceSession, whose layers read the parameters and
+		// buffers of weights in place
+		Sequential(const std::shared_ptr<const Sequential> &weights, size_t maxBatchSize);
+
+		// Runs the passes over the IR of either source and lowers it to the layers
+		void construct(ModelIR &ir);
+
+		// IR of the current layers, holding views of their tensors or taking them over
+		ModelIR toIR(bool moveTensors);
+
+		// Rebuilds the data and delta tensor chains from m_Shapes in the layers' layouts,
+		// planning them into m_ActivationArena by when each tensor is alive
+		void relink();
+
+		// Splits fully connected layers tuned to, or wide enough to, run across m_Pool, or joins them back
+		void partitionLayers();
+
+		// Gives each layer its fastest kernel variant from the tuning cache, benchmarking the
+		// layers it misses, then repartitions. Does nothing without a tuning cache.
+		void tuneKernels();
+
+		// Splits the layers into segments starting at the checkpoints of SequentialDesc
+		void planSegments();
+
+		void forwardLayer(size_t index, size_t batchSize);
+		void backwardLayer(size_t index);
+
+		// Runs the layers [begin, end) forward again, leaving their buffers untouched
+		void recomputeSegment(size_t begin, size_t end);
+
+		// Applies the fused update mode to the layers supporting it, then rebuilds the arenas
+		// and the optimizer over the parameters of the current layers. Inference models only
+		// mark their layers forward-only.
+		void buildOptimizer();
+
+		// Moves every parameter and delta of the current layers into m_ParameterArena and
+		// m_DeltaArena, leaving the layer tensors as views. Fused layers keep no deltas. A
+		// replica's parameter arena is a view of its master's, which the layers are bound to.
+		void buildArenas();
+
+		void planTiles();
+		void forwardTiled(size_t chainIndex, size_t batchSize);
+
+		// View of batchSize samples of the tensor at a layer boundary, in the given layout
+		Tensor batchView(Tensor &tensor, size_t shapeIndex, TensorLayout layout, size_t batchSize) const;
 
 		const Tensor &dataInputAt(size_t index) const;
 		const Tensor &dataOutputAt(size_t index) const;
@@ -177,6 +371,40 @@ namespace maxml
 		std::vector<std::pair<std::shared_ptr<Tensor>, std::shared_ptr<Tensor>>> m_Data;
 		std::vector<std::pair<std::shared_ptr<Tensor>, std::shared_ptr<Tensor>>> m_Delta;
 		std::vector<std::shared_ptr<Layer>> m_Layers;
+		std::shared_ptr<Optimizer> m_Optimizer;
+		std::shared_ptr<ThreadPool> m_Pool;
+
+		// All parameters, and all deltas, of the model back to back, each starting 32-byte aligned
+		Tensor m_ParameterArena;
+		Tensor m_DeltaArena;
+
+		// Every tensor of m_Data and m_Delta, tensors never alive at the same time sharing memory
+		Tensor m_ActivationArena;
+
+		// First layer of each checkpointed segment, starting with 0
+		std::vector<size_t> m_SegmentBegins;
+
+		// Planar shape at each layer boundary, the input followed by each layer's output
+		std::vector<std::array<size_t, 3>> m_Shapes;
+
+		// First layer of each layer description, followed by the number of layers
+		std::vector<size_t> m_DescLayers;
+
+		// Convolution -> activation -> pooling chains fused by predict, each
+		// computing BandRows convolution output rows at a time into Tile. Chains
+		// whose activation was left out have only two layers.
+		struct TiledChain
+		{
+			size_t LayerIndex;
+			size_t NumLayers;
+			size_t BandRows;
+			Tensor Tile;
+		};
+		std::vector<TiledChain> m_TiledChains;
+
+		// Batch of the last forward pass, and a view of its outputs
+		size_t m_BatchSize = 1;
+		Tensor m_Output;
 
 		SequentialDesc m_Description;
 	};
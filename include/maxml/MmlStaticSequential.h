@@ -0,0 +1,353 @@
+#pragma once
+
+#include "maxml/MmlSequential.h"
+
+#include <span>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+
+namespace maxml
+{
+	// Layers of a StaticSequential, mirroring makeInput and makeFullyConnected
+	template <size_t C, size_t R, size_t Cl>
+	struct Input
+	{
+		static constexpr size_t Channels = C;
+		static constexpr size_t Rows = R;
+		static constexpr size_t Cols = Cl;
+	};
+
+	template <size_t N, ActivationFunc A = ActivationFunc::None>
+	struct Dense
+	{
+		static constexpr size_t NumOutputs = N;
+		static constexpr ActivationFunc ActivFunc = A;
+	};
+
+	// Initializes, reads or writes the parameters of a StaticSequential, given as the weights
+	// then the biases of each layer, through the model file format. Reading checks the file's
+	// layers match description and takes its loss function and learning rate, or returns false
+	// and leaves the parameters untouched.
+	void initializeStaticParameters(const SequentialDesc &description, const std::vector<float *> &parameters);
+	bool readStaticParameters(const std::string &path, SequentialDesc &description, const std::vector<float *> &parameters);
+	void writeStaticParameters(const std::string &path, const SequentialDesc &description, const std::vector<const float *> &parameters);
+
+	// A fully connected network whose shapes are template arguments, for small models where
+	// the dispatch, shape checks and allocations of Sequential outweigh the math, such as
+	// StaticSequential<Input<1, 1, 1>, Dense<16, ActivationFunc::Tanh>, Dense<1>>. Shapes are
+	// checked at compile time, every loop has constant bounds for the compiler to unroll and
+	// all tensors are stored inline, so large models belong on the heap. Trains one sample at
+	// a time with plain SGD, and loads and saves the same files as the equivalent Sequential.
+	template <typename InputLayer, typename... Layers>
+	class StaticSequential
+	{
+		static_assert(sizeof...(Layers) > 0, "A static model needs at least one dense layer!");
+		static_assert(InputLayer::Channels == 1 && InputLayer::Cols == 1, "Fully connected layers need a flat input!");
+
+		static constexpr size_t k_NumLayers = sizeof...(Layers);
+
+		// Size of the input followed by the output size of every layer
+		static constexpr std::array<size_t, k_NumLayers + 1> k_Sizes = { InputLayer::Rows, Layers::NumOutputs... };
+		static constexpr std::array<ActivationFunc, k_NumLayers> k_ActivFuncs = { Layers::ActivFunc... };
+
+		// Every block starts on a 32 byte boundary
+		static constexpr size_t aligned(size_t size)
+		{
+			return (size + 7) / 8 * 8;
+		}
+
+		// Weights then biases of each layer, then the total
+		static constexpr std::array<size_t, 2 * k_NumLayers + 1> k_ParameterOffsets = [] {
+			std::array<size_t, 2 * k_NumLayers + 1> offsets = {};
+			for (size_t l = 0; l < k_NumLayers; ++l)
+			{
+				offsets[2 * l + 1] = offsets[2 * l] + aligned(k_Sizes[l + 1] * k_Sizes[l]);
+				offsets[2 * l + 2] = offsets[2 * l + 1] + aligned(k_Sizes[l + 1]);
+			}
+			return offsets;
+		}();
+
+		// The input then the output of each layer, then the total
+		static constexpr std::array<size_t, k_NumLayers + 2> k_ActivationOffsets = [] {
+			std::array<size_t, k_NumLayers + 2> offsets = {};
+			for (size_t l = 0; l <= k_NumLayers; ++l)
+			{
+				offsets[l + 1] = offsets[l] + aligned(k_Sizes[l]);
+			}
+			return offsets;
+		}();
+
+		static constexpr size_t k_MaxSize = [] {
+			size_t maxSize = 0;
+			for (size_t size : k_Sizes)
+			{
+				maxSize = size > maxSize ? size : maxSize;
+			}
+			return maxSize;
+		}();
+
+	public:
+		static constexpr size_t InputSize = k_Sizes.front();
+		static constexpr size_t OutputSize = k_Sizes.back();
+
+		StaticSequential(LossFunc objectiveFunc = LossFunc::MSE, float learningRate = 0.1f)
+			: m_Description(description(objectiveFunc, learningRate))
+		{
+			initializeStaticParameters(m_Description, parameterPointers<float *>());
+		}
+
+		// Keeps freshly initialized parameters when the file cannot be read, see loaded
+		explicit StaticSequential(const std::string &path)
+			: m_Description(description(LossFunc::MSE, 0.1f))
+		{
+			initializeStaticParameters(m_Description, parameterPointers<float *>());
+			m_Loaded = readStaticParameters(path, m_Description, parameterPointers<float *>());
+		}
+
+		// The equivalent description, for a Sequential that runs the same model
+		static SequentialDesc description(LossFunc objectiveFunc, float learningRate)
+		{
+			SequentialDesc desc;
+			desc.ObjectiveFunc = objectiveFunc;
+			desc.LearningRate = learningRate;
+			desc.LayerDescs = { makeInput(InputLayer::Channels, InputLayer::Rows, InputLayer::Cols),
+				makeFullyConnected(Layers::NumOutputs, Layers::ActivFunc)... };
+			return desc;
+		}
+
+		// The outputs stay valid until the next forward pass
+		std::span<const float, OutputSize> feedForward(std::span<const float, InputSize> input)
+		{
+			std::copy(input.begin(), input.end(), m_Activations + k_ActivationOffsets[0]);
+
+			[this]<size_t... L>(std::index_sequence<L...>) {
+				(forwardLayer<L>(), ...);
+			}(std::make_index_sequence<k_NumLayers>());
+
+			return std::span<const float, OutputSize>(m_Activations + k_ActivationOffsets[k_NumLayers], OutputSize);
+		}
+
+		std::span<const float, OutputSize> predict(std::span<const float, InputSize> input)
+		{
+			return feedForward(input);
+		}
+
+		// Backpropagates from the outputs of the last feedForward and updates the parameters,
+		// returning the loss as Sequential::feedBackward does
+		float feedBackward(std::span<const float, OutputSize> expected)
+		{
+			const float *output = m_Activations + k_ActivationOffsets[k_NumLayers];
+			float *outputDelta = m_Deltas[k_NumLayers % 2];
+			float error = 0.0f;
+
+			if (m_Description.ObjectiveFunc == LossFunc::MSE)
+			{
+				for (size_t i = 0; i < OutputSize; ++i)
+				{
+					outputDelta[i] = output[i] - expected[i];
+					error += outputDelta[i] * outputDelta[i];
+				}
+				error *= 1.0f / static_cast<float>(OutputSize);
+			}
+			else
+			{
+				for (size_t i = 0; i < OutputSize; ++i)
+				{
+					outputDelta[i] = -expected[i] / output[i];
+					error -= expected[i] * std::log(output[i]);
+				}
+			}
+
+			[this]<size_t... L>(std::index_sequence<L...>) {
+				(backwardLayer<k_NumLayers - 1 - L>(), ...);
+			}(std::make_index_sequence<k_NumLayers>());
+
+			return error;
+		}
+
+		void save(const std::string &path) const
+		{
+			writeStaticParameters(path, m_Description, parameterPointers<const float *>());
+		}
+
+		// Whether the parameters came from the model file given to the constructor
+		bool loaded() const
+		{
+			return m_Loaded;
+		}
+
+		float learningRate() const
+		{
+			return m_Description.LearningRate;
+		}
+
+		void setLearningRate(float learningRate)
+		{
+			m_Description.LearningRate = learningRate;
+		}
+
+	private:
+		template <typename Pointer>
+		std::vector<Pointer> parameterPointers() const
+		{
+			std::vector<Pointer> pointers;
+			for (size_t i = 0; i < 2 * k_NumLayers; ++i)
+			{
+				pointers.push_back(const_cast<float *>(m_Parameters + k_ParameterOffsets[i]));
+			}
+			return pointers;
+		}
+
+		// y = W x + b, then the activation in place, as the layers of Sequential compute them
+		template <size_t L>
+		void forwardLayer()
+		{
+			constexpr size_t NumInputs = k_Sizes[L];
+			constexpr size_t NumOutputs = k_Sizes[L + 1];
+
+			const float *w = m_Parameters + k_ParameterOffsets[2 * L];
+			const float *b = m_Parameters + k_ParameterOffsets[2 * L + 1];
+			const float *x = m_Activations + k_ActivationOffsets[L];
+			float *y = m_Activations + k_ActivationOffsets[L + 1];
+
+			for (size_t o = 0; o < NumOutputs; ++o)
+			{
+				float sum = 0.0f;
+				for (size_t i = 0; i < NumInputs; ++i)
+				{
+					sum += w[o * NumInputs + i] * x[i];
+				}
+				y[o] = sum + b[o];
+			}
+
+			if constexpr (k_ActivFuncs[L] == ActivationFunc::Sigmoid)
+			{
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					y[o] = (0.5f * y[o]) / (1.0f + std::abs(y[o])) + 0.5f;
+				}
+			}
+			else if constexpr (k_ActivFuncs[L] == ActivationFunc::Tanh)
+			{
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					y[o] = std::tanh(y[o]);
+				}
+			}
+			else if constexpr (k_ActivFuncs[L] == ActivationFunc::ReLU)
+			{
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					y[o] = y[o] > 0.0f ? y[o] : 0.0f;
+				}
+			}
+			else if constexpr (k_ActivFuncs[L] == ActivationFunc::Softmax)
+			{
+				float max = y[0];
+				for (size_t o = 1; o < NumOutputs; ++o)
+				{
+					max = y[o] > max ? y[o] : max;
+				}
+
+				float sum = 0.0f;
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					y[o] = std::exp(y[o] - max);
+					sum += y[o];
+				}
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					y[o] /= sum;
+				}
+			}
+		}
+
+		// Turns the delta of the layer's output into that of its sum, passes it to the input
+		// unless this is the first layer, then steps the weights and biases
+		template <size_t L>
+		void backwardLayer()
+		{
+			constexpr size_t NumInputs = k_Sizes[L];
+			constexpr size_t NumOutputs = k_Sizes[L + 1];
+
+			float *w = m_Parameters + k_ParameterOffsets[2 * L];
+			float *b = m_Parameters + k_ParameterOffsets[2 * L + 1];
+			const float *x = m_Activations + k_ActivationOffsets[L];
+			const float *y = m_Activations + k_ActivationOffsets[L + 1];
+			float *dy = m_Deltas[(L + 1) % 2];
+			float *dx = m_Deltas[L % 2];
+
+			if constexpr (k_ActivFuncs[L] == ActivationFunc::Sigmoid)
+			{
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					dy[o] *= y[o] * (1.0f - y[o]);
+				}
+			}
+			else if constexpr (k_ActivFuncs[L] == ActivationFunc::Tanh)
+			{
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					dy[o] *= 1.0f - y[o] * y[o];
+				}
+			}
+			else if constexpr (k_ActivFuncs[L] == ActivationFunc::ReLU)
+			{
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					dy[o] = y[o] > 0.0f ? dy[o] : 0.0f;
+				}
+			}
+			else if constexpr (k_ActivFuncs[L] == ActivationFunc::Softmax)
+			{
+				float dot = 0.0f;
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					dot += y[o] * dy[o];
+				}
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					dy[o] = y[o] * (dy[o] - dot);
+				}
+			}
+
+			// The input delta reads the weights before they step
+			if constexpr (L > 0)
+			{
+				for (size_t i = 0; i < NumInputs; ++i)
+				{
+					dx[i] = 0.0f;
+				}
+				for (size_t o = 0; o < NumOutputs; ++o)
+				{
+					for (size_t i = 0; i < NumInputs; ++i)
+					{
+						dx[i] += w[o * NumInputs + i] * dy[o];
+					}
+				}
+			}
+
+			float learningRate = m_Description.LearningRate;
+			for (size_t o = 0; o < NumOutputs; ++o)
+			{
+				float step = learningRate * dy[o];
+				for (size_t i = 0; i < NumInputs; ++i)
+				{
+					w[o * NumInputs + i] -= step * x[i];
+				}
+				b[o] -= step;
+			}
+		}
+
+		SequentialDesc m_Description;
+		bool m_Loaded = false;
+
+		alignas(32) float m_Parameters[k_ParameterOffsets.back()] = {};
+		alignas(32) float m_Activations[k_ActivationOffsets.back()] = {};
+
+		// Deltas of consecutive layer outputs alternate between the two
+		alignas(32) float m_Deltas[2][aligned(k_MaxSize)] = {};
+	};
+}
\ No newline at end of file
@@ -9,6 +9,13 @@ namespace maxml
 {
 	class Tensor
 	{
+	public:
+		// Channels per block of the blocked (NCHW8c) layout, matching the AVX register width
+		static constexpr size_t k_BlockSize = 8;
+
+		// Rows of b interleaved by packPanels, four AVX registers of outputs per step
+		static constexpr size_t k_PanelWidth = 4 * k_BlockSize;
+
 	private:
 		size_t m_Channels;
 		size_t m_Rows;
@@ -17,8 +24,11 @@ namespace maxml
 
 		float *m_Data;
 
+		// Views alias memory owned by another tensor and never free it.
+		bool m_View;
+
 	private:
-		Tensor(size_t channels, size_t rows, size_t cols, float *data);
+		Tensor(size_t channels, size_t rows, size_t cols, float *data, bool view = false);
 
 	public:
 		Tensor();
@@ -47,6 +57,7 @@ namespace maxml
 		size_t channels() const;
 		size_t rows() const;
 		size_t cols() const;
+		bool isView() const;
 
 		void fill(float val);
 		void resize(size_t channels, size_t rows, size_t cols);
@@ -64,6 +75,16 @@ namespace maxml
 		std::string str() const;
 
 	public:
+		static Tensor view(Tensor &a, size_t channels, size_t rows, size_t cols);
+		static const Tensor view(const Tensor &a, size_t channels, size_t rows, size_t cols);
+
+		// View starting offset floats into a, such as one parameter of a flat arena
+		static Tensor view(Tensor &a, size_t offset, size_t channels, size_t rows, size_t cols);
+
+		// View of the channels [channelBegin, channelBegin + channels), such as one sample of a batch
+		static Tensor slice(Tensor &a, size_t channelBegin, size_t channels);
+		static const Tensor slice(const Tensor &a, size_t channelBegin, size_t channels);
+
 		static Tensor resize(const Tensor &a, size_t channels, size_t rows, size_t cols);
 
 		static Tensor add(const Tensor &a, const Tensor &b);
@@ -80,6 +101,19 @@ namespace maxml
 		static Tensor matMult(const Tensor &a, const Tensor &b);
 		static void matMult(const Tensor &a, const Tensor &b, Tensor &y);
 
+		// Per channel y = transpose(a) * b and y = a * transpose(b), without materializing the
+		// transpose. When accumulating the product is added to y instead of overwriting it, and the
+		// product is multiplied by scale first, so y += -lr * a * b is an in-place SGD step.
+		static void matMultTransA(const Tensor &a, const Tensor &b, Tensor &y, bool accumulate = false, float scale = 1.0f);
+		static void matMultTransB(const Tensor &a, const Tensor &b, Tensor &y, bool accumulate = false, float scale = 1.0f);
+
+		// Interleaves the rows of each channel of b (n x k) into panels of k_PanelWidth rows, as
+		// (channels, panels * k, k_PanelWidth) with the last panel zero padded. matMultPacked then
+		// computes y = a * transpose(b) per channel streaming each panel once per block of rows
+		// of a, so operands that rarely change, such as weights, are packed once ahead of time.
+		static void packPanels(const Tensor &b, Tensor &packed);
+		static void matMultPacked(const Tensor &a, const Tensor &packed, Tensor &y);
+
 		static Tensor transpose(const Tensor &a);
 		static void transpose(const Tensor &a, Tensor &y);
 
@@ -99,6 +133,17 @@ namespace maxml
 		static void fastSig(const Tensor &a, Tensor &y);
 		static void fastRelu(const Tensor &a, Tensor &y);
 
+		// Per-channel operations, where per-channel tensors have shape (channels, 1, 1)
+		static void channelAdd(const Tensor &a, const Tensor &b, Tensor &y);
+		static void channelAffine(const Tensor &a, const Tensor &scale, const Tensor &shift, Tensor &y);
+		static void channelSum(const Tensor &a, Tensor &y);
+		static void channelMoments(const Tensor &a, Tensor &mean, Tensor &var);
+
+		// Reorders between the planar layout (channels, rows, cols) and the blocked layout
+		// (ceil(channels / k_BlockSize), rows, cols * k_BlockSize), padding channels are zeroed
+		static void toBlocked(const Tensor &a, Tensor &y);
+		static void fromBlocked(const Tensor &a, Tensor &y);
+
 		static void copy(const Tensor &dst, Tensor &src);
 		static void copy(Tensor &dst, const float *src, size_t size);
 		static void copy(float *dst, size_t size, const Tensor &src);
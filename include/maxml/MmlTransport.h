@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace maxml
+{
+	// Ring of processes exchanging data for distributed training. Each rank only ever talks
+	// to its two neighbours, sending to rank + 1 and receiving from rank - 1, which is all a
+	// ring all-reduce needs.
+	class Transport
+	{
+	public:
+		virtual ~Transport() {}
+
+		virtual size_t rank() const = 0;
+		virtual size_t size() const = 0;
+
+		// Sends sendBytes to the next rank while receiving recvBytes from the previous one,
+		// interleaving both so that neither side of the ring can block the other
+		virtual void exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes) = 0;
+
+		// Ring all-reduce of count floats, leaving the sum (or mean) over all ranks on every
+		// rank. Each rank sends and receives 2 * (size - 1) / size of the data, and every
+		// element is summed in the same ring order on all ranks.
+		void allReduce(float *data, size_t count, bool average = false);
+
+		// Copies count floats from rank 0 to every other rank
+		void broadcast(float *data, size_t count);
+
+	private:
+		std::vector<float> m_Scratch;
+	};
+
+	// Ranks on one host, passing data through single producer single consumer ring buffers
+	// in a POSIX shared memory segment. Every rank opens the segment under the same name.
+	// Rank 0 replaces whatever an earlier run left under it and the other ranks wait until
+	// rank 0 has accepted them, so none of them exchanges through a stale segment. Rank 0
+	// unlinks it when done.
+	class SharedMemoryTransport : public Transport
+	{
+	public:
+		SharedMemoryTransport() = delete;
+		SharedMemoryTransport(const std::string &name, size_t rank, size_t size, size_t channelBytes = 1 << 20);
+		virtual ~SharedMemoryTransport() override;
+
+		SharedMemoryTransport(const SharedMemoryTransport &other) = delete;
+		SharedMemoryTransport &operator=(const SharedMemoryTransport &other) = delete;
+
+		virtual size_t rank() const override { return m_Rank; }
+		virtual size_t size() const override { return m_Size; }
+
+		virtual void exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes) override;
+
+	private:
+		std::string m_Name;
+		size_t m_Rank;
+		size_t m_Size;
+		size_t m_ChannelBytes;
+
+		void *m_Memory;
+		size_t m_MemoryBytes;
+	};
+
+	// Ranks on any hosts, connected to their ring neighbours by TCP ("host:port") or Unix
+	// domain ("unix:/path") stream sockets. addresses holds the address every rank listens
+	// on, in rank order.
+	class SocketTransport : public Transport
+	{
+	public:
+		SocketTransport() = delete;
+		SocketTransport(const std::vector<std::string> &addresses, size_t rank);
+		virtual ~SocketTransport() override;
+
+		SocketTransport(const SocketTransport &other) = delete;
+		SocketTransport &operator=(const SocketTransport &other) = delete;
+
+		virtual size_t rank() const override { return m_Rank; }
+		virtual size_t size() const override { return m_Size; }
+
+		virtual void exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes) override;
+
+	private:
+		size_t m_Rank;
+		size_t m_Size;
+
+		int m_Listener;
+		int m_Next;
+		int m_Previous;
+	};
+}
\ No newline at end of file
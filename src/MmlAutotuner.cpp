@@ -0,0 +1,218 @@
+#include "MmlAutotuner.h"
+#include "MmlThreadPool.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace maxml
+{
+	// Timed runs of each candidate, each repeating the pass for at least k_BenchmarkSeconds
+	static constexpr size_t k_BenchmarkRuns = 5;
+	static constexpr double k_BenchmarkSeconds = 1e-3;
+
+	static const char *variantName(KernelVariant variant)
+	{
+		switch (variant)
+		{
+		case KernelVariant::Windowed:
+			return "windowed";
+		case KernelVariant::Direct:
+			return "direct";
+		case KernelVariant::Serial:
+			return "serial";
+		case KernelVariant::Partitioned:
+			return "partitioned";
+		default:
+			return "default";
+		}
+	}
+
+	static KernelVariant parseVariant(const std::string &name)
+	{
+		for (KernelVariant variant : { KernelVariant::Windowed, KernelVariant::Direct, KernelVariant::Serial, KernelVariant::Partitioned })
+		{
+			if (name == variantName(variant))
+			{
+				return variant;
+			}
+		}
+		return KernelVariant::Default;
+	}
+
+	// Brand string of the CPU, or unknown where it cannot be queried
+	static std::string cpuName()
+	{
+		std::array<uint32_t, 12> brand = {};
+#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 0x80000000);
+		if (static_cast<uint32_t>(regs[0]) >= 0x80000004)
+		{
+			for (uint32_t i = 0; i < 3; ++i)
+			{
+				__cpuid(reinterpret_cast<int *>(&brand[4 * i]), 0x80000002 + i);
+			}
+		}
+#elif defined(__x86_64__) || defined(__i386__)
+		for (uint32_t i = 0; i < 3; ++i)
+		{
+			__get_cpuid(0x80000002 + i, &brand[4 * i], &brand[4 * i + 1], &brand[4 * i + 2], &brand[4 * i + 3]);
+		}
+#endif
+		std::string name(reinterpret_cast<const char *>(brand.data()), strnlen(reinterpret_cast<const char *>(brand.data()), sizeof(brand)));
+
+		// Tabs separate the fields of the cache
+		std::replace(name.begin(), name.end(), '\t', ' ');
+		name.erase(0, name.find_first_not_of(' '));
+		name.erase(name.find_last_not_of(' ') + 1);
+		return name.empty() ? "unknown" : name;
+	}
+
+	// Widest vector extension the kernels were compiled for
+	static const char *isaName()
+	{
+#if defined(__AVX512F__)
+		return "avx512f";
+#elif defined(__AVX2__)
+		return "avx2";
+#elif defined(__AVX__)
+		return "avx";
+#else
+		return "sse";
+#endif
+	}
+
+	static std::string shapeName(const std::array<size_t, 3> &shape)
+	{
+		return std::to_string(shape[0]) + "x" + std::to_string(shape[1]) + "x" + std::to_string(shape[2]);
+	}
+
+	// Seconds per pass over a batch of the fastest run, after one run to warm up
+	static double benchmark(Layer &layer, const std::array<size_t, 3> &inShape, const std::array<size_t, 3> &outShape, size_t batchSize, bool training)
+	{
+		Tensor input(inShape[0] * batchSize, inShape[1], inShape[2]);
+		Tensor output(outShape[0] * batchSize, outShape[1], outShape[2]);
+		Tensor inputDelta(input.channels(), input.rows(), input.cols());
+		Tensor outputDelta(output.channels(), output.rows(), output.cols());
+		input.fill(0.01f);
+		outputDelta.fill(0.01f);
+
+		double best = std::numeric_limits<double>::infinity();
+		for (size_t run = 0; run <= k_BenchmarkRuns; ++run)
+		{
+			size_t passes = 0;
+			double seconds = 0.0;
+			auto start = std::chrono::steady_clock::now();
+			while (seconds < k_BenchmarkSeconds)
+			{
+				layer.forwardBatch(input, output, batchSize);
+				if (training)
+				{
+					layer.backwardBatch(input, output, inputDelta, outputDelta, batchSize);
+				}
+
+				++passes;
+				seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			if (run > 0)
+			{
+				best = std::min(best, seconds / static_cast<double>(passes));
+			}
+		}
+		return best;
+	}
+
+	Autotuner::Autotuner(const std::string &cachePath)
+		: m_CachePath(cachePath)
+		, m_Machine(cpuName() + " " + isaName())
+	{
+		std::ifstream file(m_CachePath);
+
+		std::string line;
+		while (std::getline(file, line))
+		{
+			size_t machineEnd = line.find('\t');
+			size_t configEnd = line.find('\t', machineEnd + 1);
+			if (configEnd == std::string::npos || line.compare(0, machineEnd, m_Machine) != 0)
+			{
+				continue;
+			}
+
+			m_Cache[line.substr(machineEnd + 1, configEnd - machineEnd - 1)] = parseVariant(line.substr(configEnd + 1));
+		}
+	}
+
+	KernelVariant Autotuner::tune(const Layer &layer, const std::array<size_t, 3> &inShape, const std::array<size_t, 3> &outShape,
+		size_t batchSize, bool training, const std::shared_ptr<ThreadPool> &pool)
+	{
+		std::string config;
+		std::vector<KernelVariant> candidates;
+
+		// Forward-only and blocked convolutions have a single kernel
+		if (const ConvolutionalLayer *convLayer = dynamic_cast<const ConvolutionalLayer *>(&layer))
+		{
+			if (training && convLayer->Layout == TensorLayout::NCHW)
+			{
+				config = "conv " + shapeName(inShape) + " " + shapeName(outShape) + " kernel " + std::to_string(convLayer->KernelRows) + "x" + std::to_string(convLayer->KernelCols);
+				candidates = { KernelVariant::Windowed, KernelVariant::Direct };
+			}
+		}
+		else if (dynamic_cast<const FullyConnectedLayer *>(&layer))
+		{
+			if (pool)
+			{
+				config = "fc " + shapeName(inShape) + " " + shapeName(outShape) + " threads " + std::to_string(pool->size());
+				candidates = { KernelVariant::Serial, KernelVariant::Partitioned };
+			}
+		}
+
+		if (candidates.empty())
+		{
+			return KernelVariant::Default;
+		}
+
+		config += " batch " + std::to_string(batchSize) + (training ? " training" : " inference");
+
+		auto cached = m_Cache.find(config);
+		if (cached != m_Cache.end() && cached->second != KernelVariant::Default)
+		{
+			return cached->second;
+		}
+
+		// Benchmarked on a copy, so the layer's parameters and state are left alone
+		KernelVariant fastest = KernelVariant::Default;
+		double fastestSeconds = std::numeric_limits<double>::infinity();
+		for (KernelVariant variant : candidates)
+		{
+			std::shared_ptr<Layer> candidate = layer.clone();
+			candidate->Variant = variant;
+			if (FullyConnectedLayer *fcLayer = dynamic_cast<FullyConnectedLayer *>(candidate.get()))
+			{
+				fcLayer->partition(variant == KernelVariant::Partitioned ? pool : nullptr, batchSize);
+			}
+
+			double seconds = benchmark(*candidate, inShape, outShape, batchSize, training);
+			if (seconds < fastestSeconds)
+			{
+				fastest = variant;
+				fastestSeconds = seconds;
+			}
+		}
+
+		m_Cache[config] = fastest;
+
+		std::ofstream file(m_CachePath, std::ios::app);
+		if (!file.is_open())
+		{
+			MML_ASSERT(false, "Tuning cache could not open path '%s' !", m_CachePath.c_str());
+			return fastest;
+		}
+		file << m_Machine << '\t' << config << '\t' << variantName(fastest) << '\n';
+
+		return fastest;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "MmlLayer.h"
+
+namespace maxml
+{
+	// Picks the fastest kernel variant of each layer for its actual shapes by benchmarking the
+	// candidates on a copy of the layer. Winners are kept in a cache file of tab separated
+	// "machine, layer configuration, variant" lines, the machine being the CPU model and the
+	// instruction set the kernels were built for, so a cache shared between machines or
+	// builds only ever misses. Each winner is appended as soon as it is found.
+	class Autotuner
+	{
+	public:
+		Autotuner() = delete;
+		explicit Autotuner(const std::string &cachePath);
+
+		// Default when the layer has a single candidate, such as a fully connected layer
+		// without a pool to split it across
+		KernelVariant tune(const Layer &layer, const std::array<size_t, 3> &inShape, const std::array<size_t, 3> &outShape,
+			size_t batchSize, bool training, const std::shared_ptr<ThreadPool> &pool);
+
+	private:
+		std::string m_CachePath;
+		std::string m_Machine;
+
+		// Variants of this machine by layer configuration
+		std::unordered_map<std::string, KernelVariant> m_Cache;
+	};
+}
\ No newline at end of file
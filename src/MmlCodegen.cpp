@@ -0,0 +1,359 @@
+#include "MmlCodegen.h"
+#include "MmlUtils.h"
+
+namespace maxml
+{
+	// Loop nest of a generated layer function reading x and writing y, which are the same
+	// buffer for elementwise layers running in place
+	struct GeneratedLayer
+	{
+		std::string Body;
+		bool Elementwise;
+		size_t OutputSize;
+	};
+
+	// Exact, as a hexadecimal literal
+	static std::string floatLiteral(float x)
+	{
+		std::ostringstream os;
+		os << std::hexfloat << x << 'f';
+		return os.str();
+	}
+
+	static void writeArray(std::ostream &out, const std::string &name, const float *data, size_t size)
+	{
+		out << "\talignas(32) static const float " << name << "[" << size << "] = {";
+		for (size_t i = 0; i < size; ++i)
+		{
+			out << (i % 8 == 0 ? "\n\t\t" : " ") << floatLiteral(data[i]) << (i + 1 < size ? "," : "");
+		}
+		out << "\n\t};\n\n";
+	}
+
+	// Mirrors ActivationLayer::forward, the sigmoid being the runtime's fast approximation
+	static void addActivation(ActivationFunc activFunc, const std::array<size_t, 3> &shape, std::vector<GeneratedLayer> &layers)
+	{
+		size_t size = shape[0] * shape[1] * shape[2];
+
+		std::ostringstream body;
+		body << "\t\tconstexpr size_t Size = " << size << ";\n\n";
+
+		switch (activFunc)
+		{
+		case ActivationFunc::None:
+			return;
+		case ActivationFunc::Sigmoid:
+			body << "\t\tfor (size_t i = 0; i < Size; ++i)\n"
+			        "\t\t{\n"
+			        "\t\t\ty[i] = (0.5f * x[i]) / (1.0f + std::abs(x[i])) + 0.5f;\n"
+			        "\t\t}\n";
+			break;
+		case ActivationFunc::Tanh:
+			body << "\t\tfor (size_t i = 0; i < Size; ++i)\n"
+			        "\t\t{\n"
+			        "\t\t\ty[i] = std::tanh(x[i]);\n"
+			        "\t\t}\n";
+			break;
+		case ActivationFunc::ReLU:
+			body << "\t\tfor (size_t i = 0; i < Size; ++i)\n"
+			        "\t\t{\n"
+			        "\t\t\ty[i] = x[i] > 0.0f ? x[i] : 0.0f;\n"
+			        "\t\t}\n";
+			break;
+		case ActivationFunc::Softmax:
+			body << "\t\tfloat max = x[0];\n"
+			        "\t\tfor (size_t i = 1; i < Size; ++i)\n"
+			        "\t\t{\n"
+			        "\t\t\tmax = x[i] > max ? x[i] : max;\n"
+			        "\t\t}\n"
+			        "\n"
+			        "\t\tfloat sum = 0.0f;\n"
+			        "\t\tfor (size_t i = 0; i < Size; ++i)\n"
+			        "\t\t{\n"
+			        "\t\t\tsum += std::exp(x[i] - max);\n"
+			        "\t\t}\n"
+			        "\n"
+			        "\t\tfor (size_t i = 0; i < Size; ++i)\n"
+			        "\t\t{\n"
+			        "\t\t\ty[i] = std::exp(x[i] - max) / sum;\n"
+			        "\t\t}\n";
+			break;
+		}
+
+		layers.push_back({ body.str(), true, size });
+	}
+
+	// y = W x + b, as the layers of Sequential compute it
+	static void addFullyConnected(const Tensor &weights, const Tensor &biases, const std::string &suffix, std::ostream &arrays, std::vector<GeneratedLayer> &layers)
+	{
+		writeArray(arrays, "k_Weights" + suffix, weights.data(), weights.size());
+		writeArray(arrays, "k_Biases" + suffix, biases.data(), biases.size());
+
+		std::ostringstream body;
+		body << "\t\tconstexpr size_t NumInputs = " << weights.cols() << ";\n"
+		        "\t\tconstexpr size_t NumOutputs = " << weights.rows() << ";\n"
+		        "\n"
+		        "\t\tfor (size_t o = 0; o < NumOutputs; ++o)\n"
+		        "\t\t{\n"
+		        "\t\t\tconst float *w_o = k_Weights" << suffix << " + o * NumInputs;\n"
+		        "\n"
+		        "\t\t\tfloat sum = 0.0f;\n"
+		        "\t\t\tfor (size_t i = 0; i < NumInputs; ++i)\n"
+		        "\t\t\t{\n"
+		        "\t\t\t\tsum += w_o[i] * x[i];\n"
+		        "\t\t\t}\n"
+		        "\t\t\ty[o] = sum + k_Biases" << suffix << "[o];\n"
+		        "\t\t}\n";
+		layers.push_back({ body.str(), false, weights.rows() });
+	}
+
+	// Loop nests of every node, embedding the tensors they read into arrays
+	static std::vector<GeneratedLayer> generateLayers(const ModelIR &ir, std::ostream &arrays)
+	{
+		std::vector<GeneratedLayer> layers;
+
+		for (size_t i = 1; i < ir.Nodes.size(); ++i)
+		{
+			const ModelIR::Node &node = ir.Nodes[i];
+			const std::array<size_t, 3> &inShape = ir.Nodes[i - 1].Shape;
+			const std::array<size_t, 3> &outShape = node.Shape;
+			std::string suffix = std::to_string(i);
+
+			if (node.Dead || std::holds_alternative<FlattenDesc>(node.Desc))
+			{
+				continue;
+			}
+
+			std::ostringstream body;
+			if (std::holds_alternative<FullyConnectedDesc>(node.Desc))
+			{
+				addFullyConnected(node.Tensors[0], node.Tensors[1], suffix, arrays, layers);
+				addActivation(std::get<FullyConnectedDesc>(node.Desc).ActivFunc, outShape, layers);
+			}
+			else if (std::holds_alternative<FactorizedFullyConnectedDesc>(node.Desc))
+			{
+				addFullyConnected(node.Tensors[0], node.Tensors[1], suffix + "_0", arrays, layers);
+				addFullyConnected(node.Tensors[2], node.Tensors[3], suffix + "_1", arrays, layers);
+				addActivation(std::get<FactorizedFullyConnectedDesc>(node.Desc).ActivFunc, outShape, layers);
+			}
+			else if (std::holds_alternative<ConvolutionalDesc>(node.Desc))
+			{
+				ConvolutionalDesc convLayerDesc = std::get<ConvolutionalDesc>(node.Desc);
+				const Tensor &kernelWindowed = node.Tensors[0];
+				const Tensor &biases = node.Tensors[1];
+
+				// As at runtime, only the first input channel of the windowed kernel contributes
+				writeArray(arrays, "k_Kernel" + suffix, kernelWindowed.data(), kernelWindowed.rows() * kernelWindowed.cols());
+				writeArray(arrays, "k_Biases" + suffix, biases.data(), biases.size());
+
+				body << "\t\tconstexpr size_t InCols = " << inShape[2] << ";\n"
+				        "\t\tconstexpr size_t OutChannels = " << outShape[0] << ";\n"
+				        "\t\tconstexpr size_t OutRows = " << outShape[1] << ";\n"
+				        "\t\tconstexpr size_t OutCols = " << outShape[2] << ";\n"
+				        "\t\tconstexpr size_t KernelRows = " << convLayerDesc.KernelWidth << ";\n"
+				        "\t\tconstexpr size_t KernelCols = " << convLayerDesc.KernelHeight << ";\n"
+				        "\n"
+				        "\t\tfor (size_t k = 0; k < OutChannels; ++k)\n"
+				        "\t\t{\n"
+				        "\t\t\tconst float *w_k = k_Kernel" << suffix << " + k * KernelRows * KernelCols;\n"
+				        "\n"
+				        "\t\t\tfor (size_t i = 0; i < OutRows; ++i)\n"
+				        "\t\t\t{\n"
+				        "\t\t\t\tfloat *y_ki = y + (k * OutRows + i) * OutCols;\n"
+				        "\t\t\t\tstd::fill(y_ki, y_ki + OutCols, k_Biases" << suffix << "[k]);\n"
+				        "\n"
+				        "\t\t\t\tfor (size_t kRow = 0; kRow < KernelRows; ++kRow)\n"
+				        "\t\t\t\t{\n"
+				        "\t\t\t\t\tconst float *x_i = x + (i + kRow) * InCols;\n"
+				        "\n"
+				        "\t\t\t\t\tfor (size_t kCol = 0; kCol < KernelCols; ++kCol)\n"
+				        "\t\t\t\t\t{\n"
+				        "\t\t\t\t\t\tfloat w = w_k[kRow * KernelCols + kCol];\n"
+				        "\t\t\t\t\t\tfor (size_t j = 0; j < OutCols; ++j)\n"
+				        "\t\t\t\t\t\t{\n"
+				        "\t\t\t\t\t\t\ty_ki[j] += w * x_i[j + kCol];\n"
+				        "\t\t\t\t\t\t}\n"
+				        "\t\t\t\t\t}\n"
+				        "\t\t\t\t}\n"
+				        "\t\t\t}\n"
+				        "\t\t}\n";
+				layers.push_back({ body.str(), false, outShape[0] * outShape[1] * outShape[2] });
+
+				addActivation(convLayerDesc.ActivFunc, outShape, layers);
+			}
+			else if (std::holds_alternative<PoolingDesc>(node.Desc))
+			{
+				PoolingDesc poolLayerDesc = std::get<PoolingDesc>(node.Desc);
+
+				body << "\t\tconstexpr size_t Channels = " << outShape[0] << ";\n"
+				        "\t\tconstexpr size_t InRows = " << inShape[1] << ";\n"
+				        "\t\tconstexpr size_t InCols = " << inShape[2] << ";\n"
+				        "\t\tconstexpr size_t OutRows = " << outShape[1] << ";\n"
+				        "\t\tconstexpr size_t OutCols = " << outShape[2] << ";\n"
+				        "\t\tconstexpr size_t TileRows = " << poolLayerDesc.TileWidth << ";\n"
+				        "\t\tconstexpr size_t TileCols = " << poolLayerDesc.TileHeight << ";\n"
+				        "\n"
+				        "\t\tfor (size_t c = 0; c < Channels; ++c)\n"
+				        "\t\t{\n"
+				        "\t\t\tfor (size_t i = 0; i < OutRows; ++i)\n"
+				        "\t\t\t{\n"
+				        "\t\t\t\tfor (size_t j = 0; j < OutCols; ++j)\n"
+				        "\t\t\t\t{\n"
+				        "\t\t\t\t\tfloat max = -std::numeric_limits<float>::infinity();\n"
+				        "\t\t\t\t\tfor (size_t tRow = 0; tRow < TileRows; ++tRow)\n"
+				        "\t\t\t\t\t{\n"
+				        "\t\t\t\t\t\tconst float *x_row = x + (c * InRows + i * TileRows + tRow) * InCols + j * TileCols;\n"
+				        "\t\t\t\t\t\tfor (size_t tCol = 0; tCol < TileCols; ++tCol)\n"
+				        "\t\t\t\t\t\t{\n"
+				        "\t\t\t\t\t\t\tmax = x_row[tCol] > max ? x_row[tCol] : max;\n"
+				        "\t\t\t\t\t\t}\n"
+				        "\t\t\t\t\t}\n"
+				        "\t\t\t\t\ty[(c * OutRows + i) * OutCols + j] = max;\n"
+				        "\t\t\t\t}\n"
+				        "\t\t\t}\n"
+				        "\t\t}\n";
+				layers.push_back({ body.str(), false, outShape[0] * outShape[1] * outShape[2] });
+			}
+			else if (std::holds_alternative<BatchNormDesc>(node.Desc))
+			{
+				BatchNormDesc bnLayerDesc = std::get<BatchNormDesc>(node.Desc);
+				const std::vector<Tensor> &tensors = node.Tensors;
+
+				// The running statistics reduce to a scale and shift, computed as at runtime
+				size_t channels = tensors[0].channels();
+				std::vector<float> scale(channels);
+				std::vector<float> shift(channels);
+				for (size_t c = 0; c < channels; ++c)
+				{
+					float invStd = 1.0f / std::sqrt(tensors[3][c] + bnLayerDesc.Epsilon);
+					scale[c] = tensors[0][c] * invStd;
+					shift[c] = tensors[1][c] - tensors[2][c] * scale[c];
+				}
+				writeArray(arrays, "k_Scale" + suffix, scale.data(), channels);
+				writeArray(arrays, "k_Shift" + suffix, shift.data(), channels);
+
+				// Flat inputs have one channel of a single element per feature
+				body << "\t\tconstexpr size_t Channels = " << channels << ";\n"
+				        "\t\tconstexpr size_t ChanSize = " << outShape[0] * outShape[1] * outShape[2] / channels << ";\n"
+				        "\n"
+				        "\t\tfor (size_t c = 0; c < Channels; ++c)\n"
+				        "\t\t{\n"
+				        "\t\t\tfor (size_t i = c * ChanSize; i < (c + 1) * ChanSize; ++i)\n"
+				        "\t\t\t{\n"
+				        "\t\t\t\ty[i] = x[i] * k_Scale" << suffix << "[c] + k_Shift" << suffix << "[c];\n"
+				        "\t\t\t}\n"
+				        "\t\t}\n";
+				layers.push_back({ body.str(), true, outShape[0] * outShape[1] * outShape[2] });
+
+				addActivation(bnLayerDesc.ActivFunc, outShape, layers);
+			}
+		}
+
+		return layers;
+	}
+
+	void generateHeader(const ModelIR &ir, const std::string &name, std::ostream &out)
+	{
+		const std::array<size_t, 3> &inShape = ir.Nodes.front().Shape;
+		const std::array<size_t, 3> &outShape = ir.Nodes.back().Shape;
+
+		out << "// Generated by maxml_codegen, do not edit\n"
+		       "#pragma once\n"
+		       "\n"
+		       "#include <cstddef>\n"
+		       "\n"
+		       "namespace " << name << "\n"
+		       "{\n"
+		       "\tconstexpr size_t k_InputChannels = " << inShape[0] << ";\n"
+		       "\tconstexpr size_t k_InputRows = " << inShape[1] << ";\n"
+		       "\tconstexpr size_t k_InputCols = " << inShape[2] << ";\n"
+		       "\tconstexpr size_t k_InputSize = " << inShape[0] * inShape[1] * inShape[2] << ";\n"
+		       "\n"
+		       "\tconstexpr size_t k_OutputChannels = " << outShape[0] << ";\n"
+		       "\tconstexpr size_t k_OutputRows = " << outShape[1] << ";\n"
+		       "\tconstexpr size_t k_OutputCols = " << outShape[2] << ";\n"
+		       "\tconstexpr size_t k_OutputSize = " << outShape[0] * outShape[1] * outShape[2] << ";\n"
+		       "\n"
+		       "\t// Runs the model on one planar sample of k_InputSize floats, writing k_OutputSize\n"
+		       "\t// floats. Each thread has its own scratch, so threads may call it at once.\n"
+		       "\tvoid predict(const float *input, float *output);\n"
+		       "}\n";
+	}
+
+	void generateSource(const ModelIR &ir, const std::string &name, const std::string &headerName, std::ostream &out)
+	{
+		std::ostringstream arrays;
+		std::vector<GeneratedLayer> layers = generateLayers(ir, arrays);
+
+		out << "// Generated by maxml_codegen, do not edit\n"
+		       "#include \"" << headerName << "\"\n"
+		       "\n"
+		       "#include <cmath>\n"
+		       "#include <limits>\n"
+		       "#include <algorithm>\n"
+		       "\n"
+		       "namespace " << name << "\n"
+		       "{\n"
+		    << arrays.str();
+
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			const char *restrict = layers[i].Elementwise ? "" : "__restrict ";
+			out << "\tstatic void layer" << i << "(const float *" << restrict << "x, float *" << restrict << "y)\n"
+			       "\t{\n"
+			    << layers[i].Body
+			    << "\t}\n\n";
+		}
+
+		// Elementwise layers run in place unless they would write the input, the last layer
+		// that needs a buffer of its own writes the output and the others alternate scratch
+		size_t lastWriter = 0;
+		size_t scratchSize = 0;
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			if (i == 0 || !layers[i].Elementwise)
+			{
+				lastWriter = i;
+			}
+		}
+		for (size_t i = 0; i < lastWriter; ++i)
+		{
+			scratchSize = std::max(scratchSize, layers[i].OutputSize);
+		}
+
+		out << "\tvoid predict(const float *input, float *output)\n"
+		       "\t{\n";
+
+		if (layers.empty())
+		{
+			out << "\t\tstd::copy(input, input + k_InputSize, output);\n";
+		}
+		if (scratchSize > 0)
+		{
+			out << "\t\talignas(32) thread_local float scratch[2][" << scratchSize << "];\n"
+			       "\n";
+		}
+
+		std::string current = "input";
+		size_t nextScratch = 0;
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			std::string target = current;
+			if (i == lastWriter)
+			{
+				target = "output";
+			}
+			else if (i == 0 || !layers[i].Elementwise)
+			{
+				target = "scratch[" + std::to_string(nextScratch) + "]";
+				nextScratch ^= 1;
+			}
+
+			out << "\t\tlayer" << i << "(" << current << ", " << target << ");\n";
+			current = target;
+		}
+
+		out << "\t}\n"
+		       "}\n";
+	}
+}
\ No newline at end of file
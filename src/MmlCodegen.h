@@ -0,0 +1,14 @@
+#pragma once
+
+#include "MmlModelIR.h"
+
+namespace maxml
+{
+	// Ahead-of-time C++ for the inference of a model, one sample at a time, that needs nothing
+	// but the standard library. Every shape is a constant, each layer a loop nest specialized
+	// to it and every tensor an embedded array. The IR must have been through optimizeIR in
+	// inference mode. The header declares, within namespace name, the input and output sizes
+	// and predict, the source defines them and includes the header by headerName.
+	void generateHeader(const ModelIR &ir, const std::string &name, std::ostream &out);
+	void generateSource(const ModelIR &ir, const std::string &name, const std::string &headerName, std::ostream &out);
+}
\ No newline at end of file
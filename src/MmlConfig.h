@@ -1,4 +1,15 @@
 #pragma once
 
 #define MML_LOGGING                                                                               1
-#define MML_ASSERTION                                                                             1
\ No newline at end of file
+#define MML_ASSERTION                                                                             1
+
+// Working set targeted by each tile of fused layer chains, roughly half an L2 cache
+#define MML_TILE_BUDGET_BYTES                                                          (128 * 1024)
+
+// Fully connected weight matrices at least this large are split across the tensor parallel
+// threads, roughly the last level cache shared by one core complex
+#define MML_TENSOR_PARALLEL_MIN_BYTES                                            (4 * 1024 * 1024)
+
+// Deltas are all-reduced across processes in buckets of at least this many bytes, starting
+// with the last layers while backward is still working through the earlier ones
+#define MML_ALLREDUCE_BUCKET_BYTES                                               (1024 * 1024)
\ No newline at end of file
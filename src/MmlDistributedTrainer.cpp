@@ -0,0 +1,101 @@
+#include "maxml/MmlDistributedTrainer.h"
+#include "maxml/MmlTransport.h"
+#include "MmlLayer.h"
+#include "MmlThreadPool.h"
+
+namespace maxml
+{
+	DistributedTrainer::DistributedTrainer(Sequential &model, Transport &transport)
+		: m_Model(model)
+		, m_Transport(transport)
+		, m_Pool(std::make_shared<ThreadPool>(2))
+	{
+		if (model.m_Description.FusedUpdate)
+		{
+			MML_ASSERT(false, "Fused updates cannot be all-reduced, switching them off!");
+			model.setFusedUpdate(false);
+		}
+
+		m_Transport.broadcast(model.m_ParameterArena.data(), model.m_ParameterArena.size());
+		for (std::shared_ptr<Layer> &layer : model.m_Layers)
+		{
+			for (Tensor *buffer : layer->buffers())
+			{
+				m_Transport.broadcast(buffer->data(), buffer->size());
+			}
+		}
+
+		// First delta of each layer within the arena, layers without parameters take the next
+		// layer's so that every layer owns the range up to the next one
+		size_t numLayers = model.m_Layers.size();
+		std::vector<size_t> layerBegins(numLayers + 1, model.m_DeltaArena.size());
+		for (size_t i = numLayers; i-- > 0;)
+		{
+			std::vector<Parameter> params = model.m_Layers[i]->parameters();
+			layerBegins[i] = params.empty() ? layerBegins[i + 1] : static_cast<size_t>(params.front().Delta->data() - model.m_DeltaArena.data());
+		}
+
+		// Buckets are filled from the last layer back, the order backward finishes them in
+		size_t bucketSize = MML_ALLREDUCE_BUCKET_BYTES / sizeof(float);
+		size_t end = layerBegins[numLayers];
+		for (size_t i = numLayers; i-- > 0;)
+		{
+			if (end - layerBegins[i] >= bucketSize || (i == 0 && end > 0))
+			{
+				m_Buckets.push_back({ layerBegins[i], end, i });
+				end = layerBegins[i];
+			}
+		}
+	}
+
+	float DistributedTrainer::step(const Tensor &inputs, const Tensor &expected, size_t batchSize)
+	{
+		m_Model.feedForward(inputs, batchSize);
+		m_Model.zeroGrad();
+
+		// Lowest layer whose deltas are final
+		std::mutex mutex;
+		std::condition_variable finished;
+		size_t finishedLayer = m_Model.m_Layers.size();
+		float loss = 0.0f;
+
+		float *deltas = m_Model.m_DeltaArena.data();
+		m_Pool->run([&](size_t threadIndex) {
+			if (threadIndex == 0)
+			{
+				loss = m_Model.backward(expected, [&](size_t layer) {
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						finishedLayer = layer;
+					}
+					finished.notify_one();
+				});
+				return;
+			}
+
+			for (const Bucket &bucket : m_Buckets)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					finished.wait(lock, [&]() {
+						return finishedLayer <= bucket.FirstLayer;
+					});
+				}
+				m_Transport.allReduce(deltas + bucket.Begin, bucket.End - bucket.Begin, true);
+			}
+		});
+
+		m_Model.step();
+
+		for (std::shared_ptr<Layer> &layer : m_Model.m_Layers)
+		{
+			for (Tensor *buffer : layer->buffers())
+			{
+				m_Transport.allReduce(buffer->data(), buffer->size(), true);
+			}
+		}
+		m_Transport.allReduce(&loss, 1, true);
+
+		return loss;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,506 @@
+#include "maxml/MmlGraph.h"
+#include "MmlLayer.h"
+#include "MmlOptimizer.h"
+#include "MmlThreadPool.h"
+#include "MmlMemoryPlanner.h"
+#include "MmlUtils.h"
+
+namespace maxml
+{
+	MergeDesc makeMerge(MergeFunc mergeFunc, ActivationFunc activFunc)
+	{
+		return { mergeFunc, activFunc };
+	}
+
+	Graph::Graph(const GraphDesc &description)
+		: m_Description(description)
+	{
+		build();
+
+		if (m_Description.BranchThreads > 1)
+		{
+			m_Pool = std::make_shared<ThreadPool>(m_Description.BranchThreads);
+		}
+
+		buildOptimizer();
+		plan();
+	}
+
+	const Tensor &Graph::feedForward(const Tensor &inputs, size_t batchSize)
+	{
+		MML_ASSERT(batchSize > 0 && batchSize <= m_Description.MaxBatchSize, "Batch exceeds the maximum batch size!");
+
+		Tensor input = batchView(m_Values.front(), 0, batchSize);
+		Tensor::copy(inputs, input);
+
+		for (const std::vector<size_t> &level : m_Levels)
+		{
+			runLevel(level, [&](size_t index) {
+				forwardNode(index, batchSize);
+			});
+		}
+
+		m_BatchSize = batchSize;
+		m_Output = batchView(m_Values.back(), m_Nodes.size() - 1, batchSize);
+
+		return m_Output;
+	}
+
+	float Graph::feedBackward(const Tensor &expected)
+	{
+		float error = backward(expected);
+		step();
+		zeroGrad();
+
+		return error;
+	}
+
+	float Graph::backward(const Tensor &expected)
+	{
+		Tensor outputDelta = batchView(m_Deltas.back(), m_Nodes.size() - 1, m_BatchSize);
+		float error = lossDelta(m_Description.ObjectiveFunc, m_Output, expected, outputDelta, m_BatchSize);
+
+		for (size_t level = m_Levels.size(); level-- > 0;)
+		{
+			runLevel(m_Levels[level], [&](size_t index) {
+				backwardNode(index, m_BatchSize);
+			});
+		}
+
+		return error;
+	}
+
+	void Graph::step()
+	{
+		if (!m_Optimizer)
+		{
+			Tensor::aMinusXMultB(m_ParameterArena, m_DeltaArena, m_Description.LearningRate, m_ParameterArena);
+			return;
+		}
+
+		m_Optimizer->step(m_Description.LearningRate);
+	}
+
+	void Graph::zeroGrad()
+	{
+		m_DeltaArena.fill(0.0f);
+	}
+
+	void Graph::setOptimizer(const OptimizerDesc &optimizer)
+	{
+		m_Description.Optimizer = optimizer;
+
+		buildOptimizer();
+	}
+
+	size_t Graph::activationBytes() const
+	{
+		return m_ActivationArena.size() * sizeof(float);
+	}
+
+	void Graph::build()
+	{
+		const std::vector<GraphDesc::Node> &descs = m_Description.Nodes;
+		MML_ASSERT(!descs.empty() && std::holds_alternative<InputDesc>(descs.front().Desc), "Must start with an input node!");
+
+		// Node whose value each description's output is
+		std::vector<size_t> outputs;
+
+		for (size_t descIndex = 0; descIndex < descs.size(); ++descIndex)
+		{
+			const GraphDesc::Node &desc = descs[descIndex];
+
+			std::vector<size_t> inputs;
+			for (uint64_t input : desc.Inputs)
+			{
+				MML_ASSERT(input < descIndex, "Nodes can only read earlier nodes!");
+				inputs.push_back(outputs[input]);
+			}
+			if (inputs.empty() && descIndex > 0)
+			{
+				inputs.push_back(outputs.back());
+			}
+
+			auto AddNode = [&](Node &&node, const std::array<size_t, 3> &shape) {
+				for (size_t input : node.Inputs)
+				{
+					node.Level = std::max(node.Level, m_Nodes[input].Level + 1);
+				}
+				m_Nodes.push_back(std::move(node));
+				m_Shapes.push_back(shape);
+			};
+
+			if (std::holds_alternative<InputDesc>(desc.Desc))
+			{
+				MML_ASSERT(descIndex == 0, "Cannot have more than one input node!");
+
+				InputDesc inpDesc = std::get<InputDesc>(desc.Desc);
+				AddNode({}, { inpDesc.Channels, inpDesc.Rows, inpDesc.Cols });
+			}
+			else if (std::holds_alternative<MergeDesc>(desc.Desc))
+			{
+				MergeDesc mergeDesc = std::get<MergeDesc>(desc.Desc);
+				MML_ASSERT(inputs.size() >= 2, "Merges need at least two inputs!");
+
+				std::array<size_t, 3> shape = m_Shapes[inputs.front()];
+				for (size_t k = 1; k < inputs.size(); ++k)
+				{
+					const std::array<size_t, 3> &inputShape = m_Shapes[inputs[k]];
+					if (mergeDesc.Func == MergeFunc::Add)
+					{
+						MML_ASSERT(inputShape == shape, "Added inputs must have the same shape!");
+					}
+					else
+					{
+						MML_ASSERT(inputShape[1] == shape[1] && inputShape[2] == shape[2], "Concatenated inputs must have the same rows and cols!");
+						shape[0] += inputShape[0];
+					}
+				}
+
+				Node node;
+				node.Merge = mergeDesc.Func;
+				node.Inputs = inputs;
+				AddNode(std::move(node), shape);
+
+				if (mergeDesc.ActivFunc != ActivationFunc::None)
+				{
+					Node activNode;
+					activNode.Op = std::make_shared<ActivationLayer>(mergeDesc.ActivFunc);
+					activNode.Inputs = { m_Nodes.size() - 1 };
+					AddNode(std::move(activNode), shape);
+				}
+			}
+			else
+			{
+				MML_ASSERT(inputs.size() == 1, "Layers read exactly one input!");
+
+				// Every layer a description expands into reads the one before it
+				std::vector<std::array<size_t, 3>> shapes = { m_Shapes[inputs.front()] };
+				std::vector<std::shared_ptr<Layer>> layers = makeLayers(std::visit([](const auto &layerDesc) {
+					if constexpr (std::is_same_v<std::decay_t<decltype(layerDesc)>, MergeDesc>)
+					{
+						return SequentialDesc::LayerDesc();
+					}
+					else
+					{
+						return SequentialDesc::LayerDesc(layerDesc);
+					}
+				}, desc.Desc), shapes);
+
+				size_t input = inputs.front();
+				for (size_t i = 0; i < layers.size(); ++i)
+				{
+					Node node;
+					node.Op = layers[i];
+					node.Inputs = { input };
+					AddNode(std::move(node), shapes[i + 1]);
+
+					input = m_Nodes.size() - 1;
+				}
+			}
+
+			outputs.push_back(m_Nodes.size() - 1);
+		}
+
+		MML_ASSERT(outputs.back() == m_Nodes.size() - 1);
+
+		for (size_t i = 1; i < m_Nodes.size(); ++i)
+		{
+			size_t level = m_Nodes[i].Level;
+			if (m_Levels.size() < level)
+			{
+				m_Levels.resize(level);
+			}
+			m_Levels[level - 1].push_back(i);
+		}
+	}
+
+	void Graph::plan()
+	{
+		size_t numNodes = m_Nodes.size();
+		size_t maxBatchSize = m_Description.MaxBatchSize;
+
+		// Values, then deltas, then partial deltas, each one block of the arena
+		std::vector<MemoryBlock> blocks;
+		std::vector<std::array<size_t, 3>> blockShapes;
+		std::vector<Tensor *> blockTensors;
+
+		auto AddBlock = [&](Tensor *tensor, const std::array<size_t, 3> &shape) {
+			MemoryBlock block;
+			block.Size = maxBatchSize * shape[0] * shape[1] * shape[2];
+			blocks.push_back(block);
+			blockShapes.push_back(shape);
+			blockTensors.push_back(tensor);
+
+			return blocks.size() - 1;
+		};
+
+		m_Values.assign(numNodes, Tensor());
+		m_Deltas.assign(numNodes, Tensor());
+		m_PartialDeltas.clear();
+
+		std::vector<size_t> valueBlocks(numNodes);
+		std::vector<size_t> deltaBlocks(numNodes);
+		for (size_t i = 0; i < numNodes; ++i)
+		{
+			valueBlocks[i] = AddBlock(&m_Values[i], m_Shapes[i]);
+		}
+		for (size_t i = 0; i < numNodes; ++i)
+		{
+			deltaBlocks[i] = AddBlock(&m_Deltas[i], m_Shapes[i]);
+		}
+
+		std::vector<size_t> numReaders(numNodes, 0);
+		for (const Node &node : m_Nodes)
+		{
+			for (size_t input : node.Inputs)
+			{
+				++numReaders[input];
+			}
+		}
+
+		// Where each node writes its inputs' deltas: a value read once by a layer takes it
+		// straight, anything else gets a partial delta its node sums. Added inputs share the
+		// merge's delta, so they need no partial of their own.
+		std::vector<std::vector<size_t>> inputDeltaBlocks(numNodes);
+		std::vector<std::vector<size_t>> partBlocks(numNodes);
+		for (size_t i = 1; i < numNodes; ++i)
+		{
+			Node &node = m_Nodes[i];
+			node.InputDeltas.clear();
+			node.DeltaParts.clear();
+
+			for (size_t input : node.Inputs)
+			{
+				if (!node.Op && node.Merge == MergeFunc::Add)
+				{
+					partBlocks[input].push_back(deltaBlocks[i]);
+					continue;
+				}
+
+				if (node.Op && numReaders[input] == 1)
+				{
+					inputDeltaBlocks[i].push_back(deltaBlocks[input]);
+					continue;
+				}
+
+				m_PartialDeltas.push_back(std::make_shared<Tensor>());
+				size_t block = AddBlock(m_PartialDeltas.back().get(), m_Shapes[input]);
+				inputDeltaBlocks[i].push_back(block);
+				partBlocks[input].push_back(block);
+			}
+		}
+
+		// Forward runs level L at step L, the loss follows, then backward walks the levels
+		// back. Nodes of one level run together, so they never share memory.
+		size_t numLevels = m_Levels.size();
+		size_t lossStep = numLevels + 1;
+		auto BackwardStep = [&](size_t level) {
+			return lossStep + numLevels + 1 - level;
+		};
+
+		blocks[valueBlocks[0]].write(0);
+		for (size_t i = 1; i < numNodes; ++i)
+		{
+			const Node &node = m_Nodes[i];
+			for (size_t input : node.Inputs)
+			{
+				blocks[valueBlocks[input]].read(node.Level);
+			}
+			blocks[valueBlocks[i]].write(node.Level);
+		}
+
+		blocks[valueBlocks.back()].read(lossStep);
+		blocks[deltaBlocks.back()].write(lossStep);
+
+		for (size_t i = numNodes; i-- > 1;)
+		{
+			const Node &node = m_Nodes[i];
+			size_t step = BackwardStep(node.Level);
+
+			if (!partBlocks[i].empty())
+			{
+				for (size_t part : partBlocks[i])
+				{
+					blocks[part].read(step);
+				}
+				blocks[deltaBlocks[i]].write(step);
+			}
+
+			if (node.Op)
+			{
+				if (node.Op->backwardReadsInput())
+				{
+					blocks[valueBlocks[node.Inputs.front()]].read(step);
+				}
+				if (node.Op->backwardReadsOutput())
+				{
+					blocks[valueBlocks[i]].read(step);
+				}
+			}
+			if (node.Op || node.Merge == MergeFunc::Concat)
+			{
+				blocks[deltaBlocks[i]].read(step);
+			}
+			for (size_t block : inputDeltaBlocks[i])
+			{
+				blocks[block].write(step);
+			}
+		}
+
+		// The outputs stay valid until the next pass
+		blocks[valueBlocks.back()].read(BackwardStep(1) + 1);
+
+		size_t arenaSize = planMemory(blocks);
+		m_ActivationArena = Tensor(1, 1, arenaSize);
+
+		for (size_t b = 0; b < blocks.size(); ++b)
+		{
+			const std::array<size_t, 3> &shape = blockShapes[b];
+			*blockTensors[b] = Tensor::view(m_ActivationArena, blocks[b].Offset, maxBatchSize * shape[0], shape[1], shape[2]);
+		}
+
+		for (size_t i = 1; i < numNodes; ++i)
+		{
+			for (size_t block : inputDeltaBlocks[i])
+			{
+				m_Nodes[i].InputDeltas.push_back(blockTensors[block]);
+			}
+			for (size_t block : partBlocks[i])
+			{
+				m_Nodes[i].DeltaParts.push_back(blockTensors[block]);
+			}
+		}
+	}
+
+	void Graph::buildOptimizer()
+	{
+		// The optimizer holds views of the arenas, so it goes before they are replaced
+		m_Optimizer.reset();
+
+		std::vector<Layer *> layers;
+		for (Node &node : m_Nodes)
+		{
+			if (node.Op)
+			{
+				layers.push_back(node.Op.get());
+			}
+		}
+		buildArenas(layers, m_ParameterArena, m_DeltaArena);
+
+		const OptimizerDesc &optimizer = m_Description.Optimizer;
+		if (optimizer.Func != OptimizerFunc::SGD || optimizer.WeightDecay != 0.0f)
+		{
+			m_Optimizer = std::make_shared<Optimizer>(optimizer, m_ParameterArena, m_DeltaArena);
+		}
+	}
+
+	void Graph::forwardNode(size_t index, size_t batchSize)
+	{
+		Node &node = m_Nodes[index];
+		Tensor output = batchView(m_Values[index], index, batchSize);
+
+		if (node.Op)
+		{
+			size_t input = node.Inputs.front();
+			node.Op->forwardBatch(batchView(m_Values[input], input, batchSize), output, batchSize);
+			return;
+		}
+
+		if (node.Merge == MergeFunc::Add)
+		{
+			Tensor::copy(batchView(m_Values[node.Inputs.front()], node.Inputs.front(), batchSize), output);
+			for (size_t k = 1; k < node.Inputs.size(); ++k)
+			{
+				Tensor::add(output, batchView(m_Values[node.Inputs[k]], node.Inputs[k], batchSize), output);
+			}
+			return;
+		}
+
+		// Each sample's channels follow the inputs in order
+		size_t outChannels = m_Shapes[index][0];
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			size_t channel = n * outChannels;
+			for (size_t input : node.Inputs)
+			{
+				size_t inChannels = m_Shapes[input][0];
+				Tensor outputSlice = Tensor::slice(output, channel, inChannels);
+				Tensor::copy(Tensor::slice(m_Values[input], n * inChannels, inChannels), outputSlice);
+				channel += inChannels;
+			}
+		}
+	}
+
+	void Graph::backwardNode(size_t index, size_t batchSize)
+	{
+		Node &node = m_Nodes[index];
+		Tensor delta = batchView(m_Deltas[index], index, batchSize);
+
+		// Every reader of this value has run backward by now, a level or more later
+		if (!node.DeltaParts.empty())
+		{
+			Tensor::copy(batchView(*node.DeltaParts.front(), index, batchSize), delta);
+			for (size_t k = 1; k < node.DeltaParts.size(); ++k)
+			{
+				Tensor::add(delta, batchView(*node.DeltaParts[k], index, batchSize), delta);
+			}
+		}
+
+		if (node.Op)
+		{
+			size_t input = node.Inputs.front();
+			Tensor inputDelta = batchView(*node.InputDeltas.front(), input, batchSize);
+			node.Op->backwardBatch(
+				batchView(m_Values[input], input, batchSize),
+				batchView(m_Values[index], index, batchSize),
+				inputDelta,
+				delta,
+				batchSize);
+			return;
+		}
+
+		// Added inputs read this delta as it is, concatenated ones get their channels back
+		if (node.Merge == MergeFunc::Concat)
+		{
+			size_t outChannels = m_Shapes[index][0];
+			for (size_t n = 0; n < batchSize; ++n)
+			{
+				size_t channel = n * outChannels;
+				for (size_t k = 0; k < node.Inputs.size(); ++k)
+				{
+					size_t inChannels = m_Shapes[node.Inputs[k]][0];
+					Tensor inputDelta = Tensor::slice(*node.InputDeltas[k], n * inChannels, inChannels);
+					Tensor::copy(Tensor::slice(delta, channel, inChannels), inputDelta);
+					channel += inChannels;
+				}
+			}
+		}
+	}
+
+	void Graph::runLevel(const std::vector<size_t> &level, const std::function<void(size_t)> &func)
+	{
+		if (!m_Pool || level.size() == 1)
+		{
+			for (size_t index : level)
+			{
+				func(index);
+			}
+			return;
+		}
+
+		m_Pool->run([&](size_t threadIndex) {
+			for (size_t k = threadIndex; k < level.size(); k += m_Pool->size())
+			{
+				func(level[k]);
+			}
+		});
+	}
+
+	Tensor Graph::batchView(Tensor &tensor, size_t index, size_t batchSize) const
+	{
+		const std::array<size_t, 3> &shape = m_Shapes[index];
+
+		return Tensor::view(tensor, batchSize * shape[0], shape[1], shape[2]);
+	}
+}
\ No newline at end of file
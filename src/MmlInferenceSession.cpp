@@ -0,0 +1,15 @@
+#include "maxml/MmlInferenceSession.h"
+
+namespace maxml
+{
+	InferenceSession::InferenceSession(const std::shared_ptr<const Sequential> &weights, size_t maxBatchSize)
+		: m_Weights(weights)
+		, m_Model(new Sequential(weights, maxBatchSize))
+	{
+	}
+
+	const Tensor &InferenceSession::predict(const Tensor &inputs, size_t batchSize)
+	{
+		return m_Model->predict(inputs, batchSize);
+	}
+}
\ No newline at end of file
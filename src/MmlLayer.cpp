@@ -1,27 +1,148 @@
 #include "MmlLayer.h"
+#include "MmlThreadPool.h"
 #include "MmlUtils.h"
 
 namespace maxml
 {
+	// Writable view of the whole of tensor. Shared layers never write their parameters or
+	// buffers, so nothing is written through the view of a const layer's tensor.
+	static Tensor viewOf(const Tensor &tensor)
+	{
+		return Tensor::view(const_cast<Tensor &>(tensor), tensor.channels(), tensor.rows(), tensor.cols());
+	}
+
+	// Settings a shared layer keeps from the layer it shares
+	static void shareSettings(const Layer &from, Layer &to)
+	{
+		to.Layout = from.Layout;
+		to.Variant = from.Variant;
+		to.ForwardOnly = true;
+		to.Shared = true;
+	}
+
+	void Layer::forwardBatch(const Tensor &input, Tensor &output, size_t batchSize)
+	{
+		size_t inChannels = input.channels() / batchSize;
+		size_t outChannels = output.channels() / batchSize;
+
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			Tensor output_n = Tensor::slice(output, n * outChannels, outChannels);
+			forward(Tensor::slice(input, n * inChannels, inChannels), output_n);
+		}
+	}
+
+	void Layer::backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
+	{
+		size_t inChannels = input.channels() / batchSize;
+		size_t outChannels = output.channels() / batchSize;
+
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			Tensor inputDelta_n = Tensor::slice(inputDelta, n * inChannels, inChannels);
+			backward(
+				Tensor::slice(input, n * inChannels, inChannels),
+				Tensor::slice(output, n * outChannels, outChannels),
+				inputDelta_n,
+				Tensor::slice(outputDelta, n * outChannels, outChannels));
+		}
+	}
+
 	FullyConnectedLayer::FullyConnectedLayer(Tensor &&weights, Tensor &&biases)
-		: DeltaWeights(weights.channels(), weights.rows(), weights.cols())
-		, DeltaBiases(weights.channels(), weights.rows(), 1)
-		, Weights(std::forward<Tensor>(weights))
+		: Weights(std::forward<Tensor>(weights))
 		, Biases(std::forward<Tensor>(biases))
 	{
 	}
 
+	// Activations a fully connected layer can run on its own outputs, as ActivationLayer runs them forward only
+	static void activateInPlace(ActivationFunc activFunc, Tensor &tensor)
+	{
+		switch (activFunc)
+		{
+		case ActivationFunc::Sigmoid:
+			Tensor::fastSig(tensor, tensor);
+			break;
+		case ActivationFunc::Tanh:
+			Tensor::mapWith(tensor, [](float x) {
+				return tanh(x);
+			}, tensor);
+			break;
+		case ActivationFunc::ReLU:
+			Tensor::fastRelu(tensor, tensor);
+			break;
+		default:
+			break;
+		}
+	}
+
 	void FullyConnectedLayer::forward(const Tensor &input, Tensor &output)
 	{
-		Tensor::matMult(Weights, input, output);
-		Tensor::add(output, Biases, output);
+		forwardBatch(input, output, 1);
 	}
 
 	void FullyConnectedLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
 	{
-		Tensor::matMult(Tensor::transpose(Weights), outputDelta, inputDelta);
-		Tensor::matMult(outputDelta, Tensor::transpose(input), DeltaWeights);
-		Tensor::copy(outputDelta, DeltaBiases);
+		backwardBatch(input, output, inputDelta, outputDelta, 1);
+	}
+
+	void FullyConnectedLayer::forwardBatch(const Tensor &input, Tensor &output, size_t batchSize)
+	{
+		if (Pool)
+		{
+			forwardPartitioned(input, output, batchSize);
+			return;
+		}
+
+		// Samples are the rows of (batch, inputs) and (batch, outputs) matrices, so Y = X * W^T
+		const Tensor x = Tensor::view(input, 1, batchSize, Weights.cols());
+		Tensor y = Tensor::view(output, 1, batchSize, Weights.rows());
+		if (WeightsPacked.size() > 0 && batchSize >= k_PackedMinBatch)
+		{
+			Tensor::matMultPacked(x, WeightsPacked, y);
+		}
+		else
+		{
+			Tensor::matMultTransB(x, Weights, y);
+		}
+
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			Tensor y_n = Tensor::slice(output, n, 1);
+			Tensor::add(y_n, Biases, y_n);
+			activateInPlace(FusedActivation, y_n);
+		}
+	}
+
+	void FullyConnectedLayer::backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
+	{
+		if (Pool)
+		{
+			backwardPartitioned(input, inputDelta, outputDelta, batchSize);
+			return;
+		}
+
+		const Tensor x = Tensor::view(input, 1, batchSize, Weights.cols());
+		const Tensor dy = Tensor::view(outputDelta, 1, batchSize, Weights.rows());
+		Tensor dx = Tensor::view(inputDelta, 1, batchSize, Weights.cols());
+
+		Tensor::matMult(dy, Weights, dx);
+
+		if (FusedUpdate)
+		{
+			// The input delta has already read the weights, so the GEMM can step them in place
+			Tensor::matMultTransA(dy, x, Weights, true, -FusedLearningRate);
+			for (size_t n = 0; n < batchSize; ++n)
+			{
+				Tensor::aMinusXMultB(Biases, Tensor::slice(outputDelta, n, 1), FusedLearningRate, Biases);
+			}
+			return;
+		}
+
+		Tensor::matMultTransA(dy, x, DeltaWeights, true);
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			Tensor::add(DeltaBiases, Tensor::slice(outputDelta, n, 1), DeltaBiases);
+		}
 	}
 
 	void FullyConnectedLayer::update(float learningRate)
@@ -30,155 +151,1135 @@ namespace maxml
 		Tensor::aMinusXMultB(Biases, DeltaBiases, learningRate, Biases);
 	}
 
-	ConvolutionalLayer::ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, const Tensor &kernel)
-		: KernelChannels(kernel.channels())
-		, KernelRows(kernel.rows())
-		, KernelCols(kernel.cols())
-		, KernelWindowed(inChannels, kernel.channels(), kernel.rows() * kernel.cols())
-		, InputWindowed(inChannels, kernel.rows() * kernel.cols(), outRows * outCols)
-		, DeltaKernelWindowed(inChannels, kernel.channels(), kernel.rows() * kernel.cols())
-		, DeltaInputWindowed(inChannels, kernel.rows() * kernel.cols(), outRows * outCols)
-	{
-		for (size_t chan = 0; chan < inChannels; ++chan)
+	void FullyConnectedLayer::zeroGrad()
+	{
+		DeltaWeights.fill(0.0f);
+		DeltaBiases.fill(0.0f);
+	}
+
+	void FullyConnectedLayer::releaseBackward()
+	{
+		DeltaWeights = Tensor();
+		DeltaBiases = Tensor();
+	}
+
+	std::shared_ptr<Layer> FullyConnectedLayer::share() const
+	{
+		std::shared_ptr<FullyConnectedLayer> layer = std::make_shared<FullyConnectedLayer>(viewOf(Weights), viewOf(Biases));
+		layer->FusedActivation = FusedActivation;
+		shareSettings(*this, *layer);
+
+		// Without panels the shared layer reads the row major weights
+		if (ForwardOnly && WeightsPacked.size() > 0)
+		{
+			layer->WeightsPacked = viewOf(WeightsPacked);
+		}
+		return layer;
+	}
+
+	std::vector<Parameter> FullyConnectedLayer::parameters()
+	{
+		return { { &Weights, &DeltaWeights }, { &Biases, &DeltaBiases } };
+	}
+
+	void FullyConnectedLayer::prepack()
+	{
+		size_t numPanels = (Weights.rows() + Tensor::k_PanelWidth - 1) / Tensor::k_PanelWidth;
+		if (WeightsPacked.size() != numPanels * Weights.cols() * Tensor::k_PanelWidth)
+		{
+			WeightsPacked = Tensor(1, numPanels * Weights.cols(), Tensor::k_PanelWidth);
+		}
+
+		Tensor::packPanels(Weights, WeightsPacked);
+	}
+
+	void FullyConnectedLayer::partition(const std::shared_ptr<ThreadPool> &pool, size_t maxBatchSize)
+	{
+		Pool = pool;
+		PartitionOutputs.clear();
+		PartitionOutputDeltas.clear();
+		PartitionInputDeltas.clear();
+
+		// Partitions read their rows of the unpacked weights
+		if (!Pool)
+		{
+			if (ForwardOnly && !Shared && WeightsPacked.size() == 0)
+			{
+				prepack();
+			}
+			return;
+		}
+
+		WeightsPacked = Tensor();
+
+		size_t numScratch = ForwardOnly ? 0 : Pool->size();
+		PartitionOutputs.resize(Pool->size());
+		PartitionOutputDeltas.resize(numScratch);
+		PartitionInputDeltas.resize(numScratch);
+
+		// Allocated by the owning thread, so the scratch is first touched where it is used. The
+		// weight rows were first touched by whoever built the arenas and are moved over instead.
+		Pool->run([&](size_t k) {
+			size_t rowBegin = partitionRow(k);
+			size_t rowEnd = partitionRow(k + 1);
+			size_t rows = std::max<size_t>(rowEnd - rowBegin, 1);
+
+			PartitionOutputs[k] = Tensor(1, maxBatchSize, rows);
+			if (!ForwardOnly)
+			{
+				PartitionOutputDeltas[k] = Tensor(1, maxBatchSize, rows);
+				PartitionInputDeltas[k] = Tensor(1, maxBatchSize, Weights.cols());
+			}
+
+			placeLocally(Weights.data() + rowBegin * Weights.cols(), (rowEnd - rowBegin) * Weights.cols());
+			if (DeltaWeights.size() > 0)
+			{
+				placeLocally(DeltaWeights.data() + rowBegin * Weights.cols(), (rowEnd - rowBegin) * Weights.cols());
+			}
+		});
+	}
+
+	size_t FullyConnectedLayer::partitionRow(size_t index) const
+	{
+		return Weights.rows() * index / Pool->size();
+	}
+
+	void FullyConnectedLayer::forwardPartitioned(const Tensor &input, Tensor &output, size_t batchSize)
+	{
+		const Tensor x = Tensor::view(input, 1, batchSize, Weights.cols());
+		size_t numOutputs = Weights.rows();
+
+		Pool->run([&](size_t k) {
+			size_t rowBegin = partitionRow(k);
+			size_t rows = partitionRow(k + 1) - rowBegin;
+			if (rows == 0)
+			{
+				return;
+			}
+
+			Tensor w_k = Tensor::view(Weights, rowBegin * Weights.cols(), 1, rows, Weights.cols());
+			Tensor b_k = Tensor::view(Biases, rowBegin, 1, rows, 1);
+			Tensor y_k = Tensor::view(PartitionOutputs[k], 1, batchSize, rows);
+			Tensor::matMultTransB(x, w_k, y_k);
+
+			// Each partition scatters its own columns of the outputs
+			for (size_t n = 0; n < batchSize; ++n)
+			{
+				Tensor y_nk = Tensor::view(output, n * numOutputs + rowBegin, 1, rows, 1);
+				Tensor::add(Tensor::view(y_k, n * rows, 1, rows, 1), b_k, y_nk);
+				activateInPlace(FusedActivation, y_nk);
+			}
+		});
+	}
+
+	void FullyConnectedLayer::backwardPartitioned(const Tensor &input, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
+	{
+		const Tensor x = Tensor::view(input, 1, batchSize, Weights.cols());
+		size_t numInputs = Weights.cols();
+		size_t numOutputs = Weights.rows();
+
+		Pool->run([&](size_t k) {
+			size_t rowBegin = partitionRow(k);
+			size_t rows = partitionRow(k + 1) - rowBegin;
+			if (rows == 0)
+			{
+				return;
+			}
+
+			Tensor dy_k = Tensor::view(PartitionOutputDeltas[k], 1, batchSize, rows);
+			for (size_t n = 0; n < batchSize; ++n)
+			{
+				Tensor dy_nk = Tensor::view(dy_k, n * rows, 1, 1, rows);
+				Tensor::copy(dy_nk, outputDelta.data() + n * numOutputs + rowBegin, rows);
+			}
+
+			// Partial input deltas of this block of rows, read before any fused step
+			Tensor w_k = Tensor::view(Weights, rowBegin * numInputs, 1, rows, numInputs);
+			Tensor b_k = Tensor::view(Biases, rowBegin, 1, rows, 1);
+			Tensor dx_k = Tensor::view(PartitionInputDeltas[k], 1, batchSize, numInputs);
+			Tensor::matMult(dy_k, w_k, dx_k);
+
+			Tensor &weightTarget = FusedUpdate ? Weights : DeltaWeights;
+			Tensor &biasTarget = FusedUpdate ? Biases : DeltaBiases;
+			float scale = FusedUpdate ? -FusedLearningRate : 1.0f;
+
+			Tensor dw_k = Tensor::view(weightTarget, rowBegin * numInputs, 1, rows, numInputs);
+			Tensor db_k = Tensor::view(biasTarget, rowBegin, 1, rows, 1);
+			Tensor::matMultTransA(dy_k, x, dw_k, true, scale);
+			for (size_t n = 0; n < batchSize; ++n)
+			{
+				Tensor::aMinusXMultB(db_k, Tensor::view(dy_k, n * rows, 1, rows, 1), -scale, db_k);
+			}
+		});
+
+		// Every thread sums its own cache line aligned chunk of the partial input deltas, always
+		// in partition order so the result is deterministic
+		Pool->run([&](size_t t) {
+			size_t size = batchSize * numInputs;
+			size_t numLines = (size + 15) / 16;
+			size_t begin = std::min(numLines * t / Pool->size() * 16, size);
+			size_t end = std::min(numLines * (t + 1) / Pool->size() * 16, size);
+			if (begin == end)
+			{
+				return;
+			}
+
+			Tensor dx_t = Tensor::view(inputDelta, begin, 1, 1, end - begin);
+			dx_t.fill(0.0f);
+			for (size_t k = 0; k < Pool->size(); ++k)
+			{
+				if (partitionRow(k + 1) > partitionRow(k))
+				{
+					Tensor::add(dx_t, Tensor::view(PartitionInputDeltas[k], begin, 1, 1, end - begin), dx_t);
+				}
+			}
+		});
+	}
+
+	ConvolutionalLayer::ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, const Tensor &kernel)
+		: KernelChannels(kernel.channels())
+		, KernelRows(kernel.rows())
+		, KernelCols(kernel.cols())
+		, OutRows(outRows)
+		, OutCols(outCols)
+		, KernelWindowed(inChannels, kernel.channels(), kernel.rows() * kernel.cols())
+		, Biases(kernel.channels(), 1, 1)
+	{
+		for (size_t chan = 0; chan < inChannels; ++chan)
+		{
+			Tensor::copy(
+				&KernelWindowed.at(chan), KernelWindowed.rows() * KernelWindowed.cols(),
+				kernel
+			);
+		}
+	}
+
+	ConvolutionalLayer::ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, size_t kernelChannels, size_t kernelRows, size_t kernelCols, const Tensor &kernelWindowed, const Tensor &biases)
+		: KernelChannels(kernelChannels)
+		, KernelRows(kernelRows)
+		, KernelCols(kernelCols)
+		, OutRows(outRows)
+		, OutCols(outCols)
+		, KernelWindowed(kernelWindowed)
+		, Biases(biases)
+	{
+	}
+
+	void ConvolutionalLayer::forward(const Tensor &input, Tensor &output)
+	{
+		if (Layout == TensorLayout::NCHW8c)
+		{
+			forwardBlocked(input, output);
+			return;
+		}
+
+		// Forward-only layers have no windowed input, tuned ones may be faster without it
+		if (ForwardOnly || Variant == KernelVariant::Direct)
+		{
+			forwardBand(input, output, 0);
+			return;
+		}
+
+		windowInput(input, output);
+		Tensor result = Tensor::matMult(KernelWindowed, InputWindowed);
+		result.resize(output.channels(), output.rows(), output.cols());
+		result.transpose();
+		Tensor::channelAdd(result, Biases, output);
+	}
+
+	void ConvolutionalLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		if (Layout == TensorLayout::NCHW8c)
+		{
+			backwardBlocked(input, output, inputDelta, outputDelta);
+			return;
+		}
+
+		backwardInput(output, inputDelta, outputDelta);
+		if (Variant == KernelVariant::Direct)
+		{
+			windowInput(input, output);
+		}
+		backwardKernel(outputDelta);
+	}
+
+	void ConvolutionalLayer::backwardInput(const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		// Growing into the other input channels zeroes them, as forward only reads the first
+		Tensor deltaOutputWindowed = Tensor::resize(Tensor::transpose(outputDelta), inputDelta.channels(), KernelChannels, outputDelta.rows() * outputDelta.cols());
+		Tensor::matMultTransA(KernelWindowed, deltaOutputWindowed, DeltaInputWindowed);
+		inputDelta.fill(0.0f);
+		for (size_t winRow = 0; winRow < DeltaInputWindowed.rows(); ++winRow)
+		{
+			for (size_t winCol = 0; winCol < DeltaInputWindowed.cols(); ++winCol)
+			{
+				size_t origRow = winCol % output.rows() + winRow / KernelRows;
+				size_t origCol = winCol / output.cols() + winRow % KernelRows;
+
+				for (size_t chan = 0; chan < inputDelta.channels(); ++chan)
+				{
+					inputDelta(chan, origRow, origCol) += DeltaInputWindowed(chan, winRow, winCol);
+				}
+			}
+		}
+	}
+
+	void ConvolutionalLayer::backwardKernel(const Tensor &outputDelta)
+	{
+		Tensor deltaOutputWindowed = Tensor::resize(Tensor::transpose(outputDelta), InputWindowed.channels(), KernelChannels, outputDelta.rows() * outputDelta.cols());
+
+		Tensor deltaBiases(KernelChannels, 1, 1);
+		Tensor::channelSum(outputDelta, deltaBiases);
+
+		if (FusedUpdate)
+		{
+			Tensor::matMultTransB(deltaOutputWindowed, InputWindowed, KernelWindowed, true, -FusedLearningRate);
+			Tensor::aMinusXMultB(Biases, deltaBiases, FusedLearningRate, Biases);
+			return;
+		}
+
+		Tensor::matMultTransB(deltaOutputWindowed, InputWindowed, DeltaKernelWindowed, true);
+		Tensor::add(DeltaBiases, deltaBiases, DeltaBiases);
+	}
+
+	void ConvolutionalLayer::backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
+	{
+		// The blocked pass reads the kernel packed by forward, so fused updates cannot leak into later samples
+		if (Layout == TensorLayout::NCHW8c)
+		{
+			Layer::backwardBatch(input, output, inputDelta, outputDelta, batchSize);
+			return;
+		}
+
+		size_t inChannels = input.channels() / batchSize;
+		size_t outChannels = output.channels() / batchSize;
+
+		// All input deltas go first so that they see the kernel from before any fused update
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			Tensor inputDelta_n = Tensor::slice(inputDelta, n * inChannels, inChannels);
+			backwardInput(Tensor::slice(output, n * outChannels, outChannels), inputDelta_n, Tensor::slice(outputDelta, n * outChannels, outChannels));
+		}
+
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			// The windowed input left by forward belongs to the last sample of the batch, and
+			// direct forward passes leave none
+			if (batchSize > 1 || Variant == KernelVariant::Direct)
+			{
+				windowInput(Tensor::slice(input, n * inChannels, inChannels), Tensor::slice(output, n * outChannels, outChannels));
+			}
+
+			backwardKernel(Tensor::slice(outputDelta, n * outChannels, outChannels));
+		}
+	}
+
+	void ConvolutionalLayer::windowInput(const Tensor &input, const Tensor &output)
+	{
+		for (size_t winRow = 0; winRow < InputWindowed.rows(); ++winRow)
+		{
+			for (size_t winCol = 0; winCol < InputWindowed.cols(); ++winCol)
+			{
+				size_t origRow = winCol % output.rows() + winRow / KernelRows;
+				size_t origCol = winCol / output.cols() + winRow % KernelRows;
+
+				for (size_t chan = 0; chan < input.channels(); ++chan)
+				{
+					InputWindowed(chan, winRow, winCol) = input(chan, origRow, origCol);
+				}
+			}
+		}
+	}
+
+	void ConvolutionalLayer::forwardBand(const Tensor &input, Tensor &output, size_t rowBegin)
+	{
+		// Matches forward, where only the first input channel of the windowed kernel contributes
+		size_t outCols = output.cols();
+		size_t vecCols = outCols - outCols % 8;
+
+		for (size_t k = 0; k < output.channels(); ++k)
+		{
+			const float *kernel_k = &KernelWindowed(0, k, 0);
+
+			for (size_t i = 0; i < output.rows(); ++i)
+			{
+				float *y_ki = &output(k, i, 0);
+				std::fill(y_ki, y_ki + outCols, Biases[k]);
+
+				for (size_t kRow = 0; kRow < KernelRows; ++kRow)
+				{
+					const float *x_i = &input(0, rowBegin + i + kRow, 0);
+
+					for (size_t kCol = 0; kCol < KernelCols; ++kCol)
+					{
+						float w = kernel_k[kRow * KernelCols + kCol];
+						__m256 wv = _mm256_set1_ps(w);
+
+						for (size_t j = 0; j < vecCols; j += 8)
+						{
+							__m256 xv = _mm256_loadu_ps(x_i + j + kCol);
+							__m256 yv = _mm256_loadu_ps(y_ki + j);
+							_mm256_storeu_ps(y_ki + j, _mm256_add_ps(yv, _mm256_mul_ps(wv, xv)));
+						}
+						for (size_t j = vecCols; j < outCols; ++j)
+						{
+							y_ki[j] += w * x_i[j + kCol];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void ConvolutionalLayer::forwardBlocked(const Tensor &input, Tensor &output)
+	{
+		constexpr size_t B = Tensor::k_BlockSize;
+
+		if (!ForwardOnly)
+		{
+			packBlocked();
+		}
+
+		// Layers sharing the parameters of a model that packed none pack a block at a time
+		bool packed = KernelBlocked.size() > 0;
+		if (!packed && KernelBlock.size() == 0)
+		{
+			KernelBlock = Tensor(1, 1 + KernelRows * KernelCols, B);
+		}
+
+		size_t inCols = input.cols() / B;
+		size_t outCols = output.cols() / B;
+
+		// Only the first input channel contributes, that is lane 0 of the first input block
+		const float *x = input.data();
+
+		for (size_t kb = 0; kb < output.channels(); ++kb)
+		{
+			if (!packed)
+			{
+				packBlock(kb, KernelBlock.data());
+			}
+
+			const float *k_kb = packed ? &KernelBlocked(kb, 0, 0) : KernelBlock.data();
+			const float *taps = k_kb + B;
+			__m256 biasv = _mm256_loadu_ps(k_kb);
+
+			for (size_t i = 0; i < output.rows(); ++i)
+			{
+				float *y_i = &output(kb, i, 0);
+
+				// Four output columns at a time share each kernel tap load
+				size_t j = 0;
+				for (; j + 4 <= outCols; j += 4)
+				{
+					__m256 acc0 = biasv;
+					__m256 acc1 = biasv;
+					__m256 acc2 = biasv;
+					__m256 acc3 = biasv;
+
+					for (size_t kRow = 0; kRow < KernelRows; ++kRow)
+					{
+						const float *x_r = x + ((i + kRow) * inCols + j) * B;
+						const float *w_r = taps + kRow * KernelCols * B;
+
+						for (size_t kCol = 0; kCol < KernelCols; ++kCol)
+						{
+							__m256 wv = _mm256_loadu_ps(w_r + kCol * B);
+							const float *x_c = x_r + kCol * B;
+
+							acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(wv, _mm256_set1_ps(x_c[0 * B])));
+							acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(wv, _mm256_set1_ps(x_c[1 * B])));
+							acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(wv, _mm256_set1_ps(x_c[2 * B])));
+							acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(wv, _mm256_set1_ps(x_c[3 * B])));
+						}
+					}
+
+					_mm256_storeu_ps(y_i + (j + 0) * B, acc0);
+					_mm256_storeu_ps(y_i + (j + 1) * B, acc1);
+					_mm256_storeu_ps(y_i + (j + 2) * B, acc2);
+					_mm256_storeu_ps(y_i + (j + 3) * B, acc3);
+				}
+				for (; j < outCols; ++j)
+				{
+					__m256 acc = biasv;
+
+					for (size_t kRow = 0; kRow < KernelRows; ++kRow)
+					{
+						const float *x_r = x + ((i + kRow) * inCols + j) * B;
+						const float *w_r = taps + kRow * KernelCols * B;
+
+						for (size_t kCol = 0; kCol < KernelCols; ++kCol)
+						{
+							__m256 wv = _mm256_loadu_ps(w_r + kCol * B);
+							acc = _mm256_add_ps(acc, _mm256_mul_ps(wv, _mm256_set1_ps(x_r[kCol * B])));
+						}
+					}
+
+					_mm256_storeu_ps(y_i + j * B, acc);
+				}
+			}
+		}
+	}
+
+	void ConvolutionalLayer::backwardBlocked(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		constexpr size_t B = Tensor::k_BlockSize;
+
+		size_t numTaps = KernelRows * KernelCols;
+		size_t inCols = input.cols() / B;
+		size_t outCols = outputDelta.cols() / B;
+
+		const float *x = input.data();
+		float *dx = inputDelta.data();
+
+		// Kernel and bias gradients, vectorized across output channels
+		DeltaKernelBlocked.fill(0.0f);
+		for (size_t kb = 0; kb < outputDelta.channels(); ++kb)
+		{
+			float *dk_kb = &DeltaKernelBlocked(kb, 0, 0);
+
+			for (size_t i = 0; i < outputDelta.rows(); ++i)
+			{
+				for (size_t j = 0; j < outCols; ++j)
+				{
+					__m256 dyv = _mm256_loadu_ps(&outputDelta(kb, i, j * B));
+					_mm256_storeu_ps(dk_kb, _mm256_add_ps(_mm256_loadu_ps(dk_kb), dyv));
+
+					for (size_t kRow = 0; kRow < KernelRows; ++kRow)
+					{
+						const float *x_r = x + ((i + kRow) * inCols + j) * B;
+						float *dw_r = dk_kb + (1 + kRow * KernelCols) * B;
+
+						for (size_t kCol = 0; kCol < KernelCols; ++kCol)
+						{
+							__m256 xv = _mm256_set1_ps(x_r[kCol * B]);
+							__m256 dwv = _mm256_loadu_ps(dw_r + kCol * B);
+							_mm256_storeu_ps(dw_r + kCol * B, _mm256_add_ps(dwv, _mm256_mul_ps(dyv, xv)));
+						}
+					}
+				}
+			}
+		}
+
+		// Fused updates step the parameters right away, the input gradient below reads the packed kernel
+		Tensor &kernelTarget = FusedUpdate ? KernelWindowed : DeltaKernelWindowed;
+		Tensor &biasTarget = FusedUpdate ? Biases : DeltaBiases;
+		float scale = FusedUpdate ? -FusedLearningRate : 1.0f;
+
+		for (size_t k = 0; k < KernelChannels; ++k)
+		{
+			size_t kb = k / B;
+			size_t lane = k % B;
+
+			biasTarget[k] += scale * DeltaKernelBlocked(kb, 0, lane);
+			for (size_t w = 0; w < numTaps; ++w)
+			{
+				kernelTarget(0, k, w) += scale * DeltaKernelBlocked(kb, 1 + w, lane);
+			}
+		}
+
+		// Input gradient, only the first input channel received any signal
+		inputDelta.fill(0.0f);
+		for (size_t i = 0; i < outputDelta.rows(); ++i)
+		{
+			for (size_t j = 0; j < outCols; ++j)
+			{
+				for (size_t w = 0; w < numTaps; ++w)
+				{
+					__m256 sumv = _mm256_setzero_ps();
+					for (size_t kb = 0; kb < outputDelta.channels(); ++kb)
+					{
+						__m256 wv = _mm256_loadu_ps(&KernelBlocked(kb, 1 + w, 0));
+						__m256 dyv = _mm256_loadu_ps(&outputDelta(kb, i, j * B));
+						sumv = _mm256_add_ps(sumv, _mm256_mul_ps(wv, dyv));
+					}
+
+					size_t kRow = w / KernelCols;
+					size_t kCol = w % KernelCols;
+					dx[((i + kRow) * inCols + j + kCol) * B] += hsum(sumv);
+				}
+			}
+		}
+	}
+
+	void ConvolutionalLayer::packBlocked()
+	{
+		size_t numBlocks = (KernelChannels + Tensor::k_BlockSize - 1) / Tensor::k_BlockSize;
+		if (KernelBlocked.channels() != numBlocks)
+		{
+			KernelBlocked = Tensor(numBlocks, 1 + KernelRows * KernelCols, Tensor::k_BlockSize);
+		}
+
+		for (size_t kb = 0; kb < numBlocks; ++kb)
+		{
+			packBlock(kb, &KernelBlocked(kb, 0, 0));
+		}
+	}
+
+	void ConvolutionalLayer::packBlock(size_t kb, float *packed) const
+	{
+		size_t numTaps = KernelRows * KernelCols;
+
+		for (size_t lane = 0; lane < Tensor::k_BlockSize; ++lane)
+		{
+			size_t k = kb * Tensor::k_BlockSize + lane;
+			bool valid = k < KernelChannels;
+
+			packed[lane] = valid ? Biases[k] : 0.0f;
+			for (size_t w = 0; w < numTaps; ++w)
+			{
+				packed[(1 + w) * Tensor::k_BlockSize + lane] = valid ? KernelWindowed(0, k, w) : 0.0f;
+			}
+		}
+	}
+
+	void ConvolutionalLayer::update(float learningRate)
+	{
+		Tensor::aMinusXMultB(KernelWindowed, DeltaKernelWindowed, learningRate, KernelWindowed);
+		Tensor::aMinusXMultB(Biases, DeltaBiases, learningRate, Biases);
+	}
+
+	void ConvolutionalLayer::zeroGrad()
+	{
+		DeltaKernelWindowed.fill(0.0f);
+		DeltaBiases.fill(0.0f);
+	}
+
+	void ConvolutionalLayer::reserveBackward()
+	{
+		size_t inChannels = KernelWindowed.channels();
+		size_t numTaps = KernelRows * KernelCols;
+
+		if (InputWindowed.size() == 0)
+		{
+			InputWindowed = Tensor(inChannels, numTaps, OutRows * OutCols);
+			DeltaInputWindowed = Tensor(inChannels, numTaps, OutRows * OutCols);
+			DeltaKernelBlocked = Tensor((KernelChannels + Tensor::k_BlockSize - 1) / Tensor::k_BlockSize, 1 + numTaps, Tensor::k_BlockSize);
+		}
+	}
+
+	void ConvolutionalLayer::releaseBackward()
+	{
+		InputWindowed = Tensor();
+		DeltaKernelWindowed = Tensor();
+		DeltaInputWindowed = Tensor();
+		DeltaBiases = Tensor();
+		DeltaKernelBlocked = Tensor();
+	}
+
+	std::shared_ptr<Layer> ConvolutionalLayer::share() const
+	{
+		std::shared_ptr<ConvolutionalLayer> layer = std::make_shared<ConvolutionalLayer>(
+			KernelWindowed.channels(), OutRows, OutCols, KernelChannels, KernelRows, KernelCols, Tensor(), Tensor());
+		layer->KernelWindowed = viewOf(KernelWindowed);
+		layer->Biases = viewOf(Biases);
+		shareSettings(*this, *layer);
+
+		// Training layers repack on every forward pass, so only forward-only ones are shared
+		if (ForwardOnly && KernelBlocked.size() > 0)
+		{
+			layer->KernelBlocked = viewOf(KernelBlocked);
+		}
+		return layer;
+	}
+
+	std::vector<Parameter> ConvolutionalLayer::parameters()
+	{
+		return { { &KernelWindowed, &DeltaKernelWindowed }, { &Biases, &DeltaBiases } };
+	}
+
+	MaxPoolingLayer::MaxPoolingLayer(size_t tileWidth, size_t tileHeight)
+		: TileWidth(tileWidth)
+		, TileHeight(tileHeight)
+	{
+		MML_ASSERT(tileWidth * tileHeight <= 256, "Tile positions must fit in a byte!");
+	}
+
+	void MaxPoolingLayer::forward(const Tensor &input, Tensor &output)
+	{
+		if (Layout == TensorLayout::NCHW8c)
+		{
+			forwardBlocked(input, output);
+			return;
+		}
+
+		uint8_t *indices = recordIndices(output.size());
+
+		for (size_t iChan = 0; iChan < output.channels(); ++iChan)
+		{
+			for (size_t iRow = 0; iRow < output.rows(); ++iRow)
+			{
+				for (size_t iCol = 0; iCol < output.cols(); ++iCol)
+				{
+					float max = -std::numeric_limits<float>::infinity();
+					size_t maxIndex = 0;
+
+					for (size_t tRow = 0; tRow < TileWidth; ++tRow)
+					{
+						for (size_t tCol = 0; tCol < TileHeight; ++tCol)
+						{
+							float val = input(iChan, iRow * TileWidth + tRow, iCol * TileHeight + tCol);
+
+							if (val > max)
+							{
+								max = val;
+								maxIndex = tRow * TileHeight + tCol;
+							}
+						}
+					}
+
+					output(iChan, iRow, iCol) = max;
+
+					if (indices)
+					{
+						*indices++ = static_cast<uint8_t>(maxIndex);
+					}
+				}
+			}
+		}
+	}
+
+	void MaxPoolingLayer::forwardBand(const Tensor &input, Tensor &output, size_t rowBegin)
+	{
+		size_t bandRows = input.rows() / TileWidth;
+
+		for (size_t iChan = 0; iChan < output.channels(); ++iChan)
+		{
+			for (size_t iRow = 0; iRow < bandRows; ++iRow)
+			{
+				for (size_t iCol = 0; iCol < output.cols(); ++iCol)
+				{
+					float max = -std::numeric_limits<float>::infinity();
+
+					for (size_t tRow = 0; tRow < TileWidth; ++tRow)
+					{
+						for (size_t tCol = 0; tCol < TileHeight; ++tCol)
+						{
+							float val = input(iChan, iRow * TileWidth + tRow, iCol * TileHeight + tCol);
+
+							if (val > max)
+							{
+								max = val;
+							}
+						}
+					}
+
+					output(iChan, rowBegin + iRow, iCol) = max;
+				}
+			}
+		}
+	}
+
+	void MaxPoolingLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		if (Layout == TensorLayout::NCHW8c)
+		{
+			backwardBlocked(input, output, inputDelta, outputDelta);
+			return;
+		}
+
+		inputDelta.fill(0.0);
+
+		// Each output delta goes to the maximum forward found in its tile
+		const uint8_t *indices = MaxIndices.data();
+
+		for (size_t iChan = 0; iChan < outputDelta.channels(); ++iChan)
+		{
+			for (size_t iRow = 0; iRow < outputDelta.rows(); ++iRow)
+			{
+				for (size_t iCol = 0; iCol < outputDelta.cols(); ++iCol)
+				{
+					size_t index = *indices++;
+
+					inputDelta(iChan, iRow * TileWidth + index / TileHeight, iCol * TileHeight + index % TileHeight) = outputDelta(iChan, iRow, iCol);
+				}
+			}
+		}
+	}
+
+	void MaxPoolingLayer::forwardBatch(const Tensor &input, Tensor &output, size_t batchSize)
+	{
+		forward(input, output);
+	}
+
+	void MaxPoolingLayer::backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
+	{
+		backward(input, output, inputDelta, outputDelta);
+	}
+
+	void MaxPoolingLayer::releaseBackward()
+	{
+		MaxIndices = {};
+	}
+
+	uint8_t *MaxPoolingLayer::recordIndices(size_t count)
+	{
+		if (ForwardOnly)
+		{
+			return nullptr;
+		}
+
+		if (MaxIndices.size() < count)
+		{
+			MaxIndices.resize(count);
+		}
+
+		return MaxIndices.data();
+	}
+
+	void MaxPoolingLayer::forwardBlocked(const Tensor &input, Tensor &output)
+	{
+		constexpr size_t B = Tensor::k_BlockSize;
+
+		size_t outCols = output.cols() / B;
+
+		uint8_t *indices = recordIndices(output.size());
+
+		for (size_t iChan = 0; iChan < output.channels(); ++iChan)
+		{
+			for (size_t iRow = 0; iRow < output.rows(); ++iRow)
+			{
+				for (size_t iCol = 0; iCol < outCols; ++iCol)
+				{
+					__m256 maxv = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+					__m256 indexv = _mm256_setzero_ps();
+
+					for (size_t tRow = 0; tRow < TileWidth; ++tRow)
+					{
+						for (size_t tCol = 0; tCol < TileHeight; ++tCol)
+						{
+							__m256 valv = _mm256_loadu_ps(&input(iChan, iRow * TileWidth + tRow, (iCol * TileHeight + tCol) * B));
+							__m256 greaterv = _mm256_cmp_ps(valv, maxv, _CMP_GT_OQ);
+
+							maxv = _mm256_max_ps(maxv, valv);
+							indexv = _mm256_blendv_ps(indexv, _mm256_set1_ps(static_cast<float>(tRow * TileHeight + tCol)), greaterv);
+						}
+					}
+
+					_mm256_storeu_ps(&output(iChan, iRow, iCol * B), maxv);
+
+					if (indices)
+					{
+						alignas(32) float lanes[B];
+						_mm256_store_ps(lanes, indexv);
+						for (size_t lane = 0; lane < B; ++lane)
+						{
+							*indices++ = static_cast<uint8_t>(lanes[lane]);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void MaxPoolingLayer::backwardBlocked(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		constexpr size_t B = Tensor::k_BlockSize;
+
+		size_t outCols = outputDelta.cols() / B;
+
+		inputDelta.fill(0.0);
+
+		const uint8_t *indices = MaxIndices.data();
+
+		for (size_t iChan = 0; iChan < outputDelta.channels(); ++iChan)
+		{
+			for (size_t iRow = 0; iRow < outputDelta.rows(); ++iRow)
+			{
+				for (size_t iCol = 0; iCol < outCols; ++iCol)
+				{
+					for (size_t lane = 0; lane < B; ++lane)
+					{
+						size_t index = *indices++;
+						size_t inCol = (iCol * TileHeight + index % TileHeight) * B + lane;
+
+						inputDelta(iChan, iRow * TileWidth + index / TileHeight, inCol) = outputDelta(iChan, iRow, iCol * B + lane);
+					}
+				}
+			}
+		}
+	}
+
+	void FlattenLayer::forward(const Tensor &input, Tensor &output)
+	{
+		// No-op when running in place on a view of the input
+		Tensor::copy(input, output);
+	}
+
+	void FlattenLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		Tensor::copy(outputDelta, inputDelta);
+	}
+
+	BatchNormLayer::BatchNormLayer(size_t channels, float momentum, float epsilon)
+		: Momentum(momentum)
+		, Epsilon(epsilon)
+		, Training(true)
+		, Gamma(channels, 1, 1)
+		, Beta(channels, 1, 1)
+		, RunningMean(channels, 1, 1)
+		, RunningVar(channels, 1, 1)
+		, Mean(channels, 1, 1)
+		, InvStd(channels, 1, 1)
+		, Scale(channels, 1, 1)
+		, Shift(channels, 1, 1)
+	{
+		Gamma.fill(1.0f);
+		RunningVar.fill(1.0f);
+	}
+
+	BatchNormLayer::BatchNormLayer(float momentum, float epsilon, Tensor &&gamma, Tensor &&beta, Tensor &&runningMean, Tensor &&runningVar)
+		: Momentum(momentum)
+		, Epsilon(epsilon)
+		, Training(true)
+		, Gamma(std::forward<Tensor>(gamma))
+		, Beta(std::forward<Tensor>(beta))
+		, RunningMean(std::forward<Tensor>(runningMean))
+		, RunningVar(std::forward<Tensor>(runningVar))
+		, Mean(Gamma.channels(), 1, 1)
+		, InvStd(Gamma.channels(), 1, 1)
+		, Scale(Gamma.channels(), 1, 1)
+		, Shift(Gamma.channels(), 1, 1)
+	{
+	}
+
+	void BatchNormLayer::forward(const Tensor &input, Tensor &output)
+	{
+		forwardBatch(input, output, 1);
+	}
+
+	void BatchNormLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	{
+		backwardBatch(input, output, inputDelta, outputDelta, 1);
+	}
+
+	void BatchNormLayer::forwardBatch(const Tensor &input, Tensor &output, size_t batchSize)
+	{
+		size_t channels = Gamma.channels();
+
+		// Each feature of a flat input is viewed as a channel of one element
+		size_t chanSize = input.size() / (batchSize * channels);
+		const Tensor x = Tensor::view(input, batchSize * channels, chanSize, 1);
+		Tensor y = Tensor::view(output, batchSize * channels, chanSize, 1);
+
+		if (Training)
+		{
+			// Per-sample moments combine exactly into the moments of the whole batch
+			Tensor sampleMean(batchSize * channels, 1, 1);
+			Tensor sampleVar(batchSize * channels, 1, 1);
+			for (size_t n = 0; n < batchSize; ++n)
+			{
+				Tensor mean_n = Tensor::slice(sampleMean, n * channels, channels);
+				Tensor var_n = Tensor::slice(sampleVar, n * channels, channels);
+				Tensor::channelMoments(Tensor::slice(x, n * channels, channels), mean_n, var_n);
+			}
+
+			size_t count = batchSize * chanSize;
+			float unbias = count > 1 ? static_cast<float>(count) / static_cast<float>(count - 1) : 1.0f;
+			float invBatch = 1.0f / static_cast<float>(batchSize);
+
+			for (size_t c = 0; c < channels; ++c)
+			{
+				float mean = 0.0f;
+				for (size_t n = 0; n < batchSize; ++n)
+				{
+					mean += sampleMean[n * channels + c];
+				}
+				mean *= invBatch;
+
+				float var = 0.0f;
+				for (size_t n = 0; n < batchSize; ++n)
+				{
+					float diff = sampleMean[n * channels + c] - mean;
+					var += sampleVar[n * channels + c] + diff * diff;
+				}
+				var *= invBatch;
+
+				RunningMean[c] = Momentum * RunningMean[c] + (1.0f - Momentum) * mean;
+				RunningVar[c] = Momentum * RunningVar[c] + (1.0f - Momentum) * var * unbias;
+
+				Mean[c] = mean;
+				InvStd[c] = 1.0f / std::sqrt(var + Epsilon);
+			}
+		}
+		else
+		{
+			for (size_t c = 0; c < channels; ++c)
+			{
+				Mean[c] = RunningMean[c];
+				InvStd[c] = 1.0f / std::sqrt(RunningVar[c] + Epsilon);
+			}
+		}
+
+		for (size_t c = 0; c < channels; ++c)
 		{
-			Tensor::copy(
-				&KernelWindowed.at(chan), KernelWindowed.rows() * KernelWindowed.cols(),
-				kernel
-			);
+			Scale[c] = Gamma[c] * InvStd[c];
+			Shift[c] = Beta[c] - Mean[c] * Scale[c];
 		}
-	}
 
-	ConvolutionalLayer::ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, size_t kernelChannels, size_t kernelRows, size_t kernelCols, const Tensor &kernelWindowed)
-		: KernelChannels(kernelChannels)
-		, KernelRows(kernelRows)
-		, KernelCols(kernelCols)
-		, KernelWindowed(kernelWindowed)
-		, InputWindowed(inChannels, kernelRows * kernelCols, outRows * outCols)
-		, DeltaKernelWindowed(inChannels, kernelChannels, kernelRows * kernelCols)
-		, DeltaInputWindowed(inChannels, kernelRows * kernelCols, outRows * outCols)
-	{
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			Tensor y_n = Tensor::slice(y, n * channels, channels);
+			Tensor::channelAffine(Tensor::slice(x, n * channels, channels), Scale, Shift, y_n);
+		}
 	}
 
-	void ConvolutionalLayer::forward(const Tensor &input, Tensor &output)
+	void BatchNormLayer::backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
 	{
-		for (size_t winRow = 0; winRow < InputWindowed.rows(); ++winRow)
+		size_t channels = Gamma.channels();
+		size_t chanSize = input.size() / (batchSize * channels);
+		float count = static_cast<float>(batchSize * chanSize);
+
+		const Tensor x = Tensor::view(input, batchSize * channels, chanSize, 1);
+		const Tensor dy = Tensor::view(outputDelta, batchSize * channels, chanSize, 1);
+		Tensor dx = Tensor::view(inputDelta, batchSize * channels, chanSize, 1);
+
+		for (size_t c = 0; c < channels; ++c)
 		{
-			for (size_t winCol = 0; winCol < InputWindowed.cols(); ++winCol)
+			float mu = Mean[c];
+			float invStd = InvStd[c];
+
+			float sumDy = 0.0f;
+			float sumDyXHat = 0.0f;
+			for (size_t n = 0; n < batchSize; ++n)
 			{
-				size_t origRow = winCol % output.rows() + winRow / KernelRows;
-				size_t origCol = winCol / output.cols() + winRow % KernelRows;
+				const float *x_c = &x.at(n * channels + c);
+				const float *dy_c = &dy.at(n * channels + c);
 
-				for (size_t chan = 0; chan < input.channels(); ++chan)
+				for (size_t i = 0; i < chanSize; ++i)
 				{
-					InputWindowed(chan, winRow, winCol) = input(chan, origRow, origCol);
+					sumDy += dy_c[i];
+					sumDyXHat += dy_c[i] * (x_c[i] - mu) * invStd;
 				}
 			}
-		}
-		Tensor result = Tensor::matMult(KernelWindowed, InputWindowed);
-		result.resize(output.channels(), output.rows(), output.cols());
-		result.transpose();
-		Tensor::copy(result, output);
-	}
 
-	void ConvolutionalLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
-	{
-		Tensor deltaOutputWindowed = Tensor::transpose(outputDelta);
-		deltaOutputWindowed.resize(inputDelta.channels(), KernelChannels, outputDelta.rows() * outputDelta.cols());
-		Tensor::matMult(Tensor::transpose(KernelWindowed), deltaOutputWindowed, DeltaInputWindowed);
-		for (size_t winRow = 0; winRow < DeltaInputWindowed.rows(); ++winRow)
-		{
-			for (size_t winCol = 0; winCol < DeltaInputWindowed.cols(); ++winCol)
+			DeltaBeta[c] += sumDy;
+			DeltaGamma[c] += sumDyXHat;
+
+			for (size_t n = 0; n < batchSize; ++n)
 			{
-				size_t origRow = winCol % output.rows() + winRow / KernelRows;
-				size_t origCol = winCol / output.cols() + winRow % KernelRows;
+				const float *x_c = &x.at(n * channels + c);
+				const float *dy_c = &dy.at(n * channels + c);
+				float *dx_c = &dx.at(n * channels + c);
 
-				for (size_t chan = 0; chan < input.channels(); ++chan)
+				if (Training)
+				{
+					// The statistics depend on the input, so their gradient flows back as well
+					float k = Gamma[c] * invStd / count;
+					for (size_t i = 0; i < chanSize; ++i)
+					{
+						float xHat = (x_c[i] - mu) * invStd;
+						dx_c[i] = k * (count * dy_c[i] - sumDy - xHat * sumDyXHat);
+					}
+				}
+				else
 				{
-					inputDelta(chan, origRow, origCol) = DeltaInputWindowed(chan, winRow, winCol);
+					float k = Gamma[c] * invStd;
+					for (size_t i = 0; i < chanSize; ++i)
+					{
+						dx_c[i] = k * dy_c[i];
+					}
 				}
 			}
 		}
-		Tensor::matMult(deltaOutputWindowed, Tensor::transpose(InputWindowed), DeltaKernelWindowed);
 	}
 
-	void ConvolutionalLayer::update(float learningRate)
+	void BatchNormLayer::update(float learningRate)
 	{
-		Tensor::aMinusXMultB(KernelWindowed, DeltaKernelWindowed, learningRate, KernelWindowed);
+		Tensor::aMinusXMultB(Gamma, DeltaGamma, learningRate, Gamma);
+		Tensor::aMinusXMultB(Beta, DeltaBeta, learningRate, Beta);
 	}
 
-	MaxPoolingLayer::MaxPoolingLayer(size_t tileWidth, size_t tileHeight)
-		: TileWidth(tileWidth)
-		, TileHeight(tileHeight)
+	void BatchNormLayer::zeroGrad()
 	{
+		DeltaGamma.fill(0.0f);
+		DeltaBeta.fill(0.0f);
 	}
 
-	void MaxPoolingLayer::forward(const Tensor &input, Tensor &output)
+	void BatchNormLayer::releaseBackward()
 	{
-		for (size_t iChan = 0; iChan < output.channels(); ++iChan)
-		{
-			for (size_t iRow = 0; iRow < output.rows(); ++iRow)
-			{
-				for (size_t iCol = 0; iCol < output.cols(); ++iCol)
-				{
-					float max = -std::numeric_limits<float>::infinity();
+		DeltaGamma = Tensor();
+		DeltaBeta = Tensor();
+	}
 
-					for (size_t tRow = 0; tRow < TileWidth; ++tRow)
-					{
-						for (size_t tCol = 0; tCol < TileHeight; ++tCol)
-						{
-							float val = input(iChan, iRow * TileWidth + tRow, iCol * TileHeight + tCol);
+	std::shared_ptr<Layer> BatchNormLayer::share() const
+	{
+		std::shared_ptr<BatchNormLayer> layer = std::make_shared<BatchNormLayer>(
+			Momentum, Epsilon, viewOf(Gamma), viewOf(Beta), viewOf(RunningMean), viewOf(RunningVar));
+		shareSettings(*this, *layer);
 
-							if (val > max)
-							{
-								max = val;
-							}
-						}
-					}
+		// Running statistics are only read, never updated from the batch
+		layer->Training = false;
+		return layer;
+	}
 
-					output(iChan, iRow, iCol) = max;
-				}
-			}
+	std::vector<Parameter> BatchNormLayer::parameters()
+	{
+		return { { &Gamma, &DeltaGamma }, { &Beta, &DeltaBeta } };
+	}
+
+	void BatchNormLayer::foldedScaleShift(const Tensor &gamma, const Tensor &beta, const Tensor &runningMean, const Tensor &runningVar, float epsilon, Tensor &scale, Tensor &shift)
+	{
+		for (size_t c = 0; c < gamma.channels(); ++c)
+		{
+			scale[c] = gamma[c] / std::sqrt(runningVar[c] + epsilon);
+			shift[c] = beta[c] - runningMean[c] * scale[c];
 		}
 	}
 
-	void MaxPoolingLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
+	// y = max(x, 0), setting bit i % 8 of mask[i / 8] where x is positive
+	static void reluMasked(const Tensor &input, Tensor &output, uint8_t *mask)
 	{
-		inputDelta.fill(0.0);
+		const float *x = input.data();
+		float *y = output.data();
+		size_t size = input.size();
+		size_t vecSize = size - size % 8;
 
-		for (size_t iChan = 0; iChan < output.channels(); ++iChan)
+		__m256 zerov = _mm256_setzero_ps();
+
+		for (size_t i = 0; i < vecSize; i += 8)
 		{
-			for (size_t iRow = 0; iRow < output.rows(); ++iRow)
-			{
-				for (size_t iCol = 0; iCol < output.cols(); ++iCol)
-				{
-					float max = output(iChan, iRow, iCol);
+			__m256 xv = _mm256_loadu_ps(x + i);
 
-					for (size_t tRow = 0; tRow < TileWidth; ++tRow)
-					{
-						for (size_t tCol = 0; tCol < TileHeight; ++tCol)
-						{
-							float val = input(iChan, iRow * TileWidth + tRow, iCol * TileHeight + tCol);
+			_mm256_storeu_ps(y + i, _mm256_max_ps(xv, zerov));
+			mask[i / 8] = static_cast<uint8_t>(_mm256_movemask_ps(_mm256_cmp_ps(xv, zerov, _CMP_GT_OQ)));
+		}
 
-							if (val >= max)
-							{
-								inputDelta(iChan, iRow * TileWidth + tRow, iCol * TileHeight + tCol) = outputDelta(iChan, iRow, iCol);
-								break;
-							}
-						}
-					}
-				}
+		if (vecSize < size)
+		{
+			uint8_t bits = 0;
+			for (size_t i = vecSize; i < size; ++i)
+			{
+				bits |= static_cast<uint8_t>(x[i] > 0.0f) << (i - vecSize);
+				y[i] = x[i] < 0.0f ? 0.0f : x[i];
 			}
+			mask[vecSize / 8] = bits;
 		}
 	}
 
-	void FlattenLayer::forward(const Tensor &input, Tensor &output)
+	// dx = dy where the mask bit is set, else 0
+	static void reluMaskedBackward(const uint8_t *mask, const Tensor &outputDelta, Tensor &inputDelta)
 	{
-		Tensor::copy(input, output);
-	}
+		const float *dy = outputDelta.data();
+		float *dx = inputDelta.data();
+		size_t size = outputDelta.size();
+		size_t vecSize = size - size % 8;
 
-	void FlattenLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
-	{
-		Tensor::copy(outputDelta, inputDelta);
+		__m256 zerov = _mm256_setzero_ps();
+		__m256 bitsv = _mm256_castsi256_ps(_mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128));
+
+		for (size_t i = 0; i < vecSize; i += 8)
+		{
+			// AVX has no 256-bit integer compare, so the lane bits are converted to floats first
+			__m256 laneBitsv = _mm256_and_ps(_mm256_castsi256_ps(_mm256_set1_epi32(mask[i / 8])), bitsv);
+			__m256 passv = _mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_castps_si256(laneBitsv)), zerov, _CMP_NEQ_OQ);
+
+			_mm256_storeu_ps(dx + i, _mm256_and_ps(_mm256_loadu_ps(dy + i), passv));
+		}
+		for (size_t i = vecSize; i < size; ++i)
+		{
+			dx[i] = (mask[i / 8] >> (i % 8)) & 1 ? dy[i] : 0.0f;
+		}
 	}
 
 	ActivationLayer::ActivationLayer(ActivationFunc activFunc)
@@ -202,7 +1303,18 @@ namespace maxml
 			}, output);
 			break;
 		case ActivationFunc::ReLU:
-			Tensor::fastRelu(input, output);
+			if (ForwardOnly)
+			{
+				Tensor::fastRelu(input, output);
+				break;
+			}
+
+			// Backward only needs to know which elements passed
+			if (ReluMask.size() < (input.size() + 7) / 8)
+			{
+				ReluMask.resize((input.size() + 7) / 8);
+			}
+			reluMasked(input, output, ReluMask.data());
 			break;
 		case ActivationFunc::Softmax:
 			float max = Tensor::max(input);
@@ -218,6 +1330,7 @@ namespace maxml
 
 	void ActivationLayer::backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta)
 	{
+		// Derivatives are expressed in terms of the output, or the ReLU mask, as the input may have been overwritten
 		switch (ActivFunc)
 		{
 		case ActivationFunc::None:
@@ -229,29 +1342,348 @@ namespace maxml
 			}, inputDelta);
 			break;
 		case ActivationFunc::Tanh:
-			Tensor::zipWith(input, outputDelta, [](float x, float y) {
-				return (tanhPrime(x)) * y;
+			Tensor::zipWith(output, outputDelta, [](float x, float y) {
+				return (1.0f - x * x) * y;
 			}, inputDelta);
 			break;
 		case ActivationFunc::ReLU:
-			Tensor::zipWith(input, outputDelta, [](float x, float y) {
-				return (reluPrime(x)) * y;
-			}, inputDelta);
+			reluMaskedBackward(ReluMask.data(), outputDelta, inputDelta);
 			break;
 		case ActivationFunc::Softmax:
-			Tensor jacobian(input.channels(), output.rows(), output.rows());
-			for (size_t c = 0; c < jacobian.channels(); ++c)
+			// Jacobian-vector product, dx_i = y_i * (dy_i - sum_j(y_j * dy_j))
+			size_t chanSize = output.rows() * output.cols();
+			for (size_t c = 0; c < output.channels(); ++c)
+			{
+				const float *y_c = &output.at(c);
+				const float *dy_c = &outputDelta.at(c);
+				float *dx_c = &inputDelta.at(c);
+
+				float dot = 0.0f;
+				for (size_t i = 0; i < chanSize; ++i)
+				{
+					dot += y_c[i] * dy_c[i];
+				}
+				for (size_t i = 0; i < chanSize; ++i)
+				{
+					dx_c[i] = y_c[i] * (dy_c[i] - dot);
+				}
+			}
+			break;
+		}
+	}
+
+	void ActivationLayer::forwardBatch(const Tensor &input, Tensor &output, size_t batchSize)
+	{
+		// Softmax normalizes each sample on its own, everything else is elementwise
+		if (ActivFunc == ActivationFunc::Softmax)
+		{
+			Layer::forwardBatch(input, output, batchSize);
+			return;
+		}
+
+		forward(input, output);
+	}
+
+	void ActivationLayer::backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize)
+	{
+		if (ActivFunc == ActivationFunc::Softmax)
+		{
+			Layer::backwardBatch(input, output, inputDelta, outputDelta, batchSize);
+			return;
+		}
+
+		backward(input, output, inputDelta, outputDelta);
+	}
+
+	void ActivationLayer::releaseBackward()
+	{
+		ReluMask = {};
+	}
+
+	// Normally distributed (numOutputs x numInputs) weights, scaled for the activation that follows
+	static Tensor initialWeights(size_t numOutputs, size_t numInputs, ActivationFunc activFunc)
+	{
+		float sigma;
+		if (activFunc == ActivationFunc::ReLU)
+		{
+			sigma = std::sqrt(2.0f / static_cast<float>(numInputs));
+		}
+		else
+		{
+			sigma = std::sqrt(2.0f / static_cast<float>(numInputs + numOutputs));
+		}
+		std::random_device rd;
+		std::mt19937 mt(rd());
+		std::normal_distribution dist(0.0f, sigma);
+
+		Tensor weights(1, numOutputs, numInputs);
+		for (size_t i = 0; i < weights.size(); i++)
+		{
+			weights[i] = dist(mt);
+		}
+		return weights;
+	}
+
+	std::vector<std::shared_ptr<Layer>> makeLayers(const SequentialDesc::LayerDesc &desc, std::vector<std::array<size_t, 3>> &shapes, std::vector<Tensor> tensors)
+	{
+		std::vector<std::shared_ptr<Layer>> layers;
+
+		size_t inChannels = shapes.back()[0];
+		size_t inRows = shapes.back()[1];
+		size_t inCols = shapes.back()[2];
+
+		if (std::holds_alternative<FullyConnectedDesc>(desc))
+		{
+			FullyConnectedDesc fcLayerDesc = std::get<FullyConnectedDesc>(desc);
+			size_t numInputs = inRows;
+			size_t numOutputs = fcLayerDesc.NumOutputs;
+			ActivationFunc activFunc = fcLayerDesc.ActivFunc;
+
+			// Fully connected layer
+			if (!tensors.empty())
+			{
+				layers.push_back(std::make_shared<FullyConnectedLayer>(std::move(tensors[0]), std::move(tensors[1])));
+				shapes.push_back({ 1, numOutputs, 1 });
+			}
+			else
+			{
+				layers.push_back(std::make_shared<FullyConnectedLayer>(initialWeights(numOutputs, numInputs, activFunc), Tensor(1, numOutputs, 1)));
+				shapes.push_back({ 1, numOutputs, 1 });
+			}
+
+			// Activation
+			{
+				layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+				shapes.push_back({ 1, numOutputs, 1 });
+			}
+		}
+		else if (std::holds_alternative<ConvolutionalDesc>(desc))
+		{
+			ConvolutionalDesc convLayerDesc = std::get<ConvolutionalDesc>(desc);
+			size_t kernelChannels = convLayerDesc.NumKernels;
+			size_t kernelRows = convLayerDesc.KernelWidth;
+			size_t kernelCols = convLayerDesc.KernelHeight;
+			ActivationFunc activFunc = convLayerDesc.ActivFunc;
+
+			size_t outChannels = kernelChannels;
+			size_t outRows = (inRows - kernelRows) + 1;
+			size_t outCols = (inCols - kernelCols) + 1;
+
+			// Convolutional layer
+			if (!tensors.empty())
+			{
+				layers.push_back(std::make_shared<ConvolutionalLayer>(
+					inChannels, outRows, outCols, kernelChannels, kernelRows, kernelCols, tensors[0], tensors[1]
+				));
+				shapes.push_back({ outChannels, outRows, outCols });
+			}
+			else
+			{
+				float sigma = std::sqrt(2.0f / static_cast<float>(outChannels * kernelRows * kernelCols));
+				std::random_device rd;
+				std::mt19937 mt(rd());
+				std::normal_distribution dist(0.0f, sigma);
+
+				Tensor kernel(kernelChannels, kernelRows, kernelCols);
+				for (size_t i = 0; i < kernel.size(); ++i)
+				{
+					kernel[i] = dist(mt);
+				}
+
+				layers.push_back(std::make_shared<ConvolutionalLayer>(inChannels, outRows, outCols, kernel));
+				shapes.push_back({ outChannels, outRows, outCols });
+			}
+
+			// Activation
+			{
+				layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+				shapes.push_back({ outChannels, outRows, outCols });
+			}
+		}
+		else if (std::holds_alternative<PoolingDesc>(desc))
+		{
+			PoolingDesc poolLayerDesc = std::get<PoolingDesc>(desc);
+			size_t tileWidth = poolLayerDesc.TileWidth;
+			size_t tileHeight = poolLayerDesc.TileHeight;
+
+			size_t outRows = ((inRows - tileWidth) / tileWidth) + 1;
+			size_t outCols = ((inCols - tileHeight) / tileHeight) + 1;
+
+			layers.push_back(std::make_shared<MaxPoolingLayer>(tileWidth, tileHeight));
+			shapes.push_back({ inChannels, outRows, outCols });
+		}
+		else if (std::holds_alternative<FlattenDesc>(desc))
+		{
+			layers.push_back(std::make_shared<FlattenLayer>());
+			shapes.push_back({ 1, inChannels * inRows * inCols, 1 });
+		}
+		else if (std::holds_alternative<BatchNormDesc>(desc))
+		{
+			BatchNormDesc bnLayerDesc = std::get<BatchNormDesc>(desc);
+
+			// Batch normalization, of each feature for flat inputs such as fully connected outputs
+			if (!tensors.empty())
+			{
+				layers.push_back(std::make_shared<BatchNormLayer>(
+					bnLayerDesc.Momentum, bnLayerDesc.Epsilon,
+					std::move(tensors[0]), std::move(tensors[1]), std::move(tensors[2]), std::move(tensors[3])
+				));
+				shapes.push_back({ inChannels, inRows, inCols });
+			}
+			else
+			{
+				size_t numFeatures = inChannels == 1 && inCols == 1 ? inRows : inChannels;
+				layers.push_back(std::make_shared<BatchNormLayer>(numFeatures, bnLayerDesc.Momentum, bnLayerDesc.Epsilon));
+				shapes.push_back({ inChannels, inRows, inCols });
+			}
+
+			// Activation
+			{
+				layers.push_back(std::make_shared<ActivationLayer>(bnLayerDesc.ActivFunc));
+				shapes.push_back({ inChannels, inRows, inCols });
+			}
+		}
+		else if (std::holds_alternative<FactorizedFullyConnectedDesc>(desc))
+		{
+			FactorizedFullyConnectedDesc ffcLayerDesc = std::get<FactorizedFullyConnectedDesc>(desc);
+			size_t numInputs = inRows;
+			size_t numOutputs = ffcLayerDesc.NumOutputs;
+			size_t rank = ffcLayerDesc.Rank;
+			ActivationFunc activFunc = ffcLayerDesc.ActivFunc;
+
+			if (tensors.empty())
+			{
+				tensors.push_back(initialWeights(rank, numInputs, ActivationFunc::None));
+				tensors.push_back(Tensor(1, rank, 1));
+				tensors.push_back(initialWeights(numOutputs, rank, activFunc));
+				tensors.push_back(Tensor(1, numOutputs, 1));
+			}
+
+			// Projection
+			{
+				layers.push_back(std::make_shared<FullyConnectedLayer>(std::move(tensors[0]), std::move(tensors[1])));
+				shapes.push_back({ 1, rank, 1 });
+			}
+
+			// Expansion
+			{
+				layers.push_back(std::make_shared<FullyConnectedLayer>(std::move(tensors[2]), std::move(tensors[3])));
+				shapes.push_back({ 1, numOutputs, 1 });
+			}
+
+			// Activation
+			{
+				layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+				shapes.push_back({ 1, numOutputs, 1 });
+			}
+		}
+		else
+		{
+			MML_ASSERT(false, "Unhandled layer description!");
+		}
+
+		return layers;
+	}
+
+	float lossDelta(LossFunc lossFunc, const Tensor &output, const Tensor &expected, Tensor &outputDelta, size_t batchSize)
+	{
+		size_t numOutputs = output.rows();
+		float error = std::numeric_limits<float>::infinity();
+
+		// Scaling the loss gradient by the batch size averages every parameter delta over the batch
+		float invBatch = 1.0f / static_cast<float>(batchSize);
+
+		if (lossFunc == LossFunc::MSE)
+		{
+			Tensor::sub(output, expected, outputDelta);
+			error = Tensor::sumWith(outputDelta, [](float x) {
+				return x * x;
+			}) * (1.0f / static_cast<float>(numOutputs)) * invBatch;
+		}
+		else if (lossFunc == LossFunc::CrossEntropy)
+		{
+			Tensor::zipWith(output, expected, [](float x, float y) {
+				return -y / x;
+			}, outputDelta);
+			error = -Tensor::sumWith(output, expected, [](float x, float y) {
+				return y * std::log(x);
+			}) * invBatch;
+		}
+		if (batchSize > 1)
+		{
+			Tensor::mult(outputDelta, invBatch, outputDelta);
+		}
+
+		return error;
+	}
+
+	void buildArenas(const std::vector<Layer *> &layers, Tensor &parameterArena, Tensor &deltaArena)
+	{
+		// Rounds every slot up to whole AVX registers so each view stays aligned
+		auto SlotSize = [](const Tensor &tensor) {
+			return (tensor.size() + 7) / 8 * 8;
+		};
+
+		size_t parameterSize = 0;
+		size_t deltaSize = 0;
+		for (Layer *layer : layers)
+		{
+			layer->reserveBackward();
+
+			for (Parameter &param : layer->parameters())
+			{
+				parameterSize += SlotSize(*param.Value);
+				deltaSize += layer->FusedUpdate ? 0 : SlotSize(*param.Value);
+			}
+		}
+
+		// Replicas keep viewing their master's parameters, which already hold the values
+		bool shared = parameterArena.isView();
+		MML_ASSERT(!shared || parameterArena.size() == parameterSize, "Replica does not match the shared parameters!");
+
+		// The old arenas may still back the layer tensors, so they are only released once
+		// every tensor has been copied across
+		Tensor newParameterArena = shared ? Tensor::view(parameterArena, 1, 1, parameterSize)
+		                         : parameterSize > 0 ? Tensor(1, 1, parameterSize) : Tensor();
+		Tensor newDeltaArena = deltaSize > 0 ? Tensor(1, 1, deltaSize) : Tensor();
+
+		size_t parameterOffset = 0;
+		size_t deltaOffset = 0;
+		for (Layer *layer : layers)
+		{
+			for (Parameter &param : layer->parameters())
 			{
-				for (size_t i = 0; i < jacobian.rows(); ++i)
+				Tensor &value = *param.Value;
+				Tensor &delta = *param.Delta;
+
+				Tensor valueView = Tensor::view(newParameterArena, parameterOffset, value.channels(), value.rows(), value.cols());
+				if (!shared)
+				{
+					Tensor::copy(valueView, value.data(), value.size());
+				}
+				parameterOffset += SlotSize(value);
+
+				if (layer->FusedUpdate)
+				{
+					delta = Tensor();
+				}
+				else
 				{
-					for (size_t j = 0; j < jacobian.cols(); ++j)
+					Tensor deltaView = Tensor::view(newDeltaArena, deltaOffset, value.channels(), value.rows(), value.cols());
+					if (delta.size() == value.size())
 					{
-						jacobian(c, i, j) = output(c, i, 0) * (static_cast<float>(i == j) - output(c, j, 0));
+						Tensor::copy(deltaView, delta.data(), delta.size());
 					}
+					deltaOffset += SlotSize(value);
+
+					delta = std::move(deltaView);
 				}
+
+				value = std::move(valueView);
 			}
-			Tensor::matMult(jacobian, outputDelta, inputDelta);
-			break;
 		}
+
+		parameterArena = std::move(newParameterArena);
+		deltaArena = std::move(newDeltaArena);
 	}
 }
\ No newline at end of file
@@ -5,6 +5,26 @@
 
 namespace maxml
 {
+	class ThreadPool;
+
+	// Alternative kernels of a layer, picked by the autotuner for the layer's shapes, Default
+	// leaving the choice to the fixed heuristics
+	enum class KernelVariant : uint32_t
+	{
+		Default = 0,
+		Windowed = 1,   // Convolution as a GEMM over the windowed input
+		Direct = 2,     // Direct convolution, the input only windowed in backward
+		Serial = 3,     // Fully connected on the calling thread
+		Partitioned = 4 // Fully connected split across the tensor parallel threads
+	};
+
+	// A trainable tensor and the delta accumulated for it
+	struct Parameter
+	{
+		Tensor *Value;
+		Tensor *Delta;
+	};
+
 	struct Layer
 	{
 		virtual ~Layer() {}
@@ -12,7 +32,66 @@ namespace maxml
 		virtual void forward(const Tensor &input, Tensor &output) = 0;
 		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) = 0;
 
+		// Passes over batchSize samples stacked along the channels. By default each sample goes
+		// through the single sample pass, layers with parameters sum their deltas over the batch.
+		virtual void forwardBatch(const Tensor &input, Tensor &output, size_t batchSize);
+		virtual void backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize);
+
+		// Backward passes add to the parameter deltas, update applies them and zeroGrad clears them
 		virtual void update(float learningRate) = 0;
+		virtual void zeroGrad() {}
+
+		virtual std::vector<Parameter> parameters() { return {}; }
+
+		// Non-trainable state written by training forward passes, such as running statistics
+		virtual std::vector<Tensor *> buffers() { return {}; }
+
+		// Deep copy, including the parameters, for another model replica
+		virtual std::shared_ptr<Layer> clone() const = 0;
+
+		// Forward-only copy for an InferenceSession whose parameters, buffers and any packed
+		// parameters view this layer's, so that it only allocates its own scratch
+		virtual std::shared_ptr<Layer> share() const { return clone(); }
+
+		// Allocate and free the scratch only backward passes use. Parameter deltas are bound
+		// to the owning model's delta arena and released along with the scratch.
+		virtual void reserveBackward() {}
+		virtual void releaseBackward() {}
+
+		// Packs the parameters into the layout forward reads them in. Forward-only layers are
+		// packed once, as their parameters never change, and read the packed form on every
+		// call. packedParameters are the tensors it fills, which shared layers view.
+		virtual void prepack() {}
+		virtual std::vector<Tensor *> packedParameters() { return {}; }
+
+		// Layers that can apply plain SGD to their parameters inside backward, in which case the
+		// owning model releases their deltas and update and zeroGrad must not be called
+		virtual bool canFuseUpdate() const { return false; }
+
+		// In-place layers may be given the same (or an aliasing) tensor for input and output,
+		// and likewise for their deltas, so backward must only depend on the output.
+		virtual bool inPlace() const { return false; }
+
+		// Whether backward reads the values of the input and output or only their shapes. Layers
+		// that record what backward needs in a compact form during forward read neither, letting
+		// the owning model reuse those activations as soon as forward is done with them.
+		virtual bool backwardReadsInput() const { return true; }
+		virtual bool backwardReadsOutput() const { return true; }
+
+		// Layout of both the input and output tensors, assigned by the owning model
+		TensorLayout Layout = TensorLayout::NCHW;
+
+		// Backward steps the parameters by FusedLearningRate instead of accumulating deltas
+		bool FusedUpdate = false;
+		float FusedLearningRate = 0.0f;
+
+		// Never runs backward, so forward may pick kernels that keep nothing for it
+		bool ForwardOnly = false;
+
+		// Views the parameters of another layer, so never packs its own copy of them
+		bool Shared = false;
+
+		KernelVariant Variant = KernelVariant::Default;
 	};
 
 	struct FullyConnectedLayer : public Layer
@@ -23,35 +102,129 @@ namespace maxml
 		virtual void forward(const Tensor &input, Tensor &output) override;
 		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) override;
 
+		virtual void forwardBatch(const Tensor &input, Tensor &output, size_t batchSize) override;
+		virtual void backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize) override;
+
 		virtual void update(float learningRate) override;
+		virtual void zeroGrad() override;
+
+		virtual std::shared_ptr<Layer> clone() const override { return std::make_shared<FullyConnectedLayer>(*this); }
+		virtual std::shared_ptr<Layer> share() const override;
+		virtual void releaseBackward() override;
+
+		virtual std::vector<Parameter> parameters() override;
+
+		virtual void prepack() override;
+		virtual std::vector<Tensor *> packedParameters() override { return { &WeightsPacked }; }
+
+		virtual bool canFuseUpdate() const override { return true; }
+		virtual bool backwardReadsOutput() const override { return false; }
+
+		// Splits the output rows across the threads of pool, each thread only ever touching its
+		// own block of rows so that it stays in that thread's cache. The pages of each block of
+		// weights and weight deltas move to the thread's NUMA node. A null pool undoes it.
+		void partition(const std::shared_ptr<ThreadPool> &pool, size_t maxBatchSize);
+
+		// First output row of each partition, the last entry being the number of outputs
+		size_t partitionRow(size_t index) const;
+
+		void forwardPartitioned(const Tensor &input, Tensor &output, size_t batchSize);
+		void backwardPartitioned(const Tensor &input, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize);
 
 		Tensor DeltaWeights;
 		Tensor DeltaBiases;
 
 		Tensor Weights;
 		Tensor Biases;
+
+		// Elementwise activation applied to each output row straight after the biases, for
+		// inference models whose IR fused it into this layer
+		ActivationFunc FusedActivation = ActivationFunc::None;
+
+		// Weights in the panels of Tensor::packPanels, only kept by forward-only layers that
+		// are not partitioned. Smaller batches stream the row major weights faster than the
+		// panels, so only batches of at least k_PackedMinBatch samples read them.
+		Tensor WeightsPacked;
+		static constexpr size_t k_PackedMinBatch = 4;
+
+		// Tensor parallel threads, and per partition scratch for its outputs, its gathered
+		// output deltas and its partial input deltas
+		std::shared_ptr<ThreadPool> Pool;
+		std::vector<Tensor> PartitionOutputs;
+		std::vector<Tensor> PartitionOutputDeltas;
+		std::vector<Tensor> PartitionInputDeltas;
 	};
 
 	struct ConvolutionalLayer : public Layer
 	{
 		ConvolutionalLayer() = delete;
 		ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, const Tensor &kernel);
-		ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, size_t kernelChannels, size_t kernelRows, size_t kernelCols, const Tensor &kernelWindowed);
+		ConvolutionalLayer(size_t inChannels, size_t outRows, size_t outCols, size_t kernelChannels, size_t kernelRows, size_t kernelCols, const Tensor &kernelWindowed, const Tensor &biases);
 
 		virtual void forward(const Tensor &input, Tensor &output) override;
 		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) override;
 
+		virtual void backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize) override;
+
 		virtual void update(float learningRate) override;
+		virtual void zeroGrad() override;
+
+		virtual std::shared_ptr<Layer> clone() const override { return std::make_shared<ConvolutionalLayer>(*this); }
+		virtual std::shared_ptr<Layer> share() const override;
+		virtual void reserveBackward() override;
+		virtual void releaseBackward() override;
+
+		virtual std::vector<Parameter> parameters() override;
+
+		virtual void prepack() override { packBlocked(); }
+		virtual std::vector<Tensor *> packedParameters() override { return { &KernelBlocked }; }
+
+		virtual bool canFuseUpdate() const override { return true; }
+		virtual bool backwardReadsOutput() const override { return false; }
+
+		// Gathers the input windows read by each output element into InputWindowed
+		void windowInput(const Tensor &input, const Tensor &output);
+
+		// Halves of the planar backward pass, the kernel half reads InputWindowed
+		void backwardInput(const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta);
+		void backwardKernel(const Tensor &outputDelta);
+
+		// Direct convolution of the output rows starting at rowBegin into a band of output.rows() rows
+		void forwardBand(const Tensor &input, Tensor &output, size_t rowBegin);
+
+		// Direct convolution on blocked tensors, vectorized across output channels
+		void forwardBlocked(const Tensor &input, Tensor &output);
+		void backwardBlocked(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta);
+
+		// Packs the first input channel of the windowed kernel, and the biases, into blocks of
+		// output channels. Training forward passes repack, as the kernel changes between them.
+		void packBlocked();
+
+		// Packs block kb of output channels into 1 + kernel rows * kernel cols vectors at packed
+		void packBlock(size_t kb, float *packed) const;
 
 		size_t KernelChannels;
 		size_t KernelRows;
 		size_t KernelCols;
+		size_t OutRows;
+		size_t OutCols;
 
+		// The input windows are only gathered when training, forward-only layers convolve directly
 		Tensor KernelWindowed;
 		Tensor InputWindowed;
 
 		Tensor DeltaKernelWindowed;
 		Tensor DeltaInputWindowed;
+
+		Tensor Biases;
+		Tensor DeltaBiases;
+
+		// (output channel blocks, 1 + kernel rows * kernel cols, k_BlockSize), biases first
+		Tensor KernelBlocked;
+		Tensor DeltaKernelBlocked;
+
+		// A single block, for shared layers of a model that keeps no packed kernel
+		Tensor KernelBlock;
 	};
 
 	struct MaxPoolingLayer : public Layer
@@ -62,10 +235,32 @@ namespace maxml
 		virtual void forward(const Tensor &input, Tensor &output) override;
 		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) override;
 
+		// Channels pool independently, so a batch goes through in one pass
+		virtual void forwardBatch(const Tensor &input, Tensor &output, size_t batchSize) override;
+		virtual void backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize) override;
+
 		virtual void update(float learningRate) override {};
 
+		virtual std::shared_ptr<Layer> clone() const override { return std::make_shared<MaxPoolingLayer>(*this); }
+		virtual void releaseBackward() override;
+
+		virtual bool backwardReadsInput() const override { return false; }
+		virtual bool backwardReadsOutput() const override { return false; }
+
+		// Pools a band of input rows into the output rows starting at rowBegin
+		void forwardBand(const Tensor &input, Tensor &output, size_t rowBegin);
+
+		void forwardBlocked(const Tensor &input, Tensor &output);
+		void backwardBlocked(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta);
+
+		// Room for the index of each output's maximum, or null for forward-only layers
+		uint8_t *recordIndices(size_t count);
+
 		size_t TileWidth;
 		size_t TileHeight;
+
+		// Position within its tile of the maximum behind each output of the last training forward pass
+		std::vector<uint8_t> MaxIndices;
 	};
 
 	struct FlattenLayer : public Layer
@@ -74,6 +269,60 @@ namespace maxml
 		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) override;
 
 		virtual void update(float learningRate) override {};
+
+		virtual std::shared_ptr<Layer> clone() const override { return std::make_shared<FlattenLayer>(*this); }
+
+		virtual bool inPlace() const override { return true; }
+		virtual bool backwardReadsInput() const override { return false; }
+		virtual bool backwardReadsOutput() const override { return false; }
+	};
+
+	struct BatchNormLayer : public Layer
+	{
+		BatchNormLayer() = delete;
+		BatchNormLayer(size_t channels, float momentum, float epsilon);
+		BatchNormLayer(float momentum, float epsilon, Tensor &&gamma, Tensor &&beta, Tensor &&runningMean, Tensor &&runningVar);
+
+		virtual void forward(const Tensor &input, Tensor &output) override;
+		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) override;
+
+		virtual void forwardBatch(const Tensor &input, Tensor &output, size_t batchSize) override;
+		virtual void backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize) override;
+
+		virtual void update(float learningRate) override;
+		virtual void zeroGrad() override;
+
+		virtual std::shared_ptr<Layer> clone() const override { return std::make_shared<BatchNormLayer>(*this); }
+		virtual std::shared_ptr<Layer> share() const override;
+		virtual void releaseBackward() override;
+
+		virtual std::vector<Parameter> parameters() override;
+		virtual std::vector<Tensor *> buffers() override { return { &RunningMean, &RunningVar }; }
+
+		virtual bool backwardReadsOutput() const override { return false; }
+
+		// Per-channel scale and shift equivalent to a layer using its running statistics
+		static void foldedScaleShift(const Tensor &gamma, const Tensor &beta, const Tensor &runningMean, const Tensor &runningVar, float epsilon, Tensor &scale, Tensor &shift);
+
+		float Momentum;
+		float Epsilon;
+
+		// Normalizes with the statistics of each input when training, else the running statistics
+		bool Training;
+
+		Tensor Gamma;
+		Tensor Beta;
+		Tensor RunningMean;
+		Tensor RunningVar;
+
+		Tensor DeltaGamma;
+		Tensor DeltaBeta;
+
+		// Statistics used by the last forward pass, and scratch for the applied scale and shift
+		Tensor Mean;
+		Tensor InvStd;
+		Tensor Scale;
+		Tensor Shift;
 	};
 
 	struct ActivationLayer : public Layer
@@ -84,8 +333,34 @@ namespace maxml
 		virtual void forward(const Tensor &input, Tensor &output) override;
 		virtual void backward(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta) override;
 
+		virtual void forwardBatch(const Tensor &input, Tensor &output, size_t batchSize) override;
+		virtual void backwardBatch(const Tensor &input, const Tensor &output, Tensor &inputDelta, const Tensor &outputDelta, size_t batchSize) override;
+
 		virtual void update(float learningRate) override {};
 
+		virtual std::shared_ptr<Layer> clone() const override { return std::make_shared<ActivationLayer>(*this); }
+		virtual void releaseBackward() override;
+
+		virtual bool inPlace() const override { return true; }
+		virtual bool backwardReadsInput() const override { return false; }
+		virtual bool backwardReadsOutput() const override { return ActivFunc != ActivationFunc::None && ActivFunc != ActivationFunc::ReLU; }
+
 		ActivationFunc ActivFunc;
+
+		// One bit per element, set where ReLU passed its input in the last training forward pass
+		std::vector<uint8_t> ReluMask;
 	};
+
+	// Layers a description expands into, reading their input shape from the back of shapes and
+	// appending the planar shape after each layer. The layers take the parameters and buffers
+	// in tensors in turn, stored as in a model file, or freshly initialized ones when empty.
+	std::vector<std::shared_ptr<Layer>> makeLayers(const SequentialDesc::LayerDesc &desc, std::vector<std::array<size_t, 3>> &shapes, std::vector<Tensor> tensors = {});
+
+	// Writes the gradient of the loss, averaged over the batch, into outputDelta and returns the loss
+	float lossDelta(LossFunc lossFunc, const Tensor &output, const Tensor &expected, Tensor &outputDelta, size_t batchSize);
+
+	// Moves the parameters of layers into parameterArena and their deltas, but those of fused
+	// layers, into deltaArena, each in a slot of whole AVX registers. An arena that is already
+	// a view keeps the values it holds, for replicas viewing their master's parameters.
+	void buildArenas(const std::vector<Layer *> &layers, Tensor &parameterArena, Tensor &deltaArena);
 }
\ No newline at end of file
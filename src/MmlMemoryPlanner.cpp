@@ -0,0 +1,117 @@
+#include "MmlMemoryPlanner.h"
+
+namespace maxml
+{
+	// Floats per cache line, every block starts on one
+	static constexpr size_t k_LineFloats = 16;
+
+	static size_t lineSize(const MemoryBlock &block)
+	{
+		return (block.Size + k_LineFloats - 1) / k_LineFloats * k_LineFloats;
+	}
+
+	// Inclusive step ranges the block's contents must survive. Accesses within one step keep
+	// the order they were recorded in, such as an in-place layer reading before it writes.
+	static std::vector<std::pair<size_t, size_t>> lifetimes(const MemoryBlock &block)
+	{
+		std::vector<std::pair<size_t, bool>> accesses = block.Accesses;
+		std::stable_sort(accesses.begin(), accesses.end(), [](const std::pair<size_t, bool> &a, const std::pair<size_t, bool> &b) {
+			return a.first < b.first;
+		});
+
+		std::vector<std::pair<size_t, size_t>> ranges;
+		for (const std::pair<size_t, bool> &access : accesses)
+		{
+			if (access.second)
+			{
+				ranges.push_back({ access.first, access.first });
+			}
+			else if (ranges.empty())
+			{
+				// Read before anything wrote it, so whatever it held from the start is needed
+				ranges.push_back({ 0, access.first });
+			}
+			else
+			{
+				ranges.back().second = access.first;
+			}
+		}
+
+		return ranges;
+	}
+
+	void MemoryBlock::write(size_t step)
+	{
+		Accesses.push_back({ step, true });
+	}
+
+	void MemoryBlock::read(size_t step)
+	{
+		Accesses.push_back({ step, false });
+	}
+
+	size_t planMemory(std::vector<MemoryBlock> &blocks)
+	{
+		std::vector<std::vector<std::pair<size_t, size_t>>> ranges(blocks.size());
+		std::vector<size_t> order(blocks.size());
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			ranges[i] = lifetimes(blocks[i]);
+			order[i] = i;
+		}
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return blocks[a].Size > blocks[b].Size;
+		});
+
+		auto Overlap = [&](size_t a, size_t b) {
+			for (const std::pair<size_t, size_t> &rangeA : ranges[a])
+			{
+				for (const std::pair<size_t, size_t> &rangeB : ranges[b])
+				{
+					if (rangeA.first <= rangeB.second && rangeB.first <= rangeA.second)
+					{
+						return true;
+					}
+				}
+			}
+			return false;
+		};
+
+		size_t arenaSize = 0;
+		std::vector<size_t> placed;
+		std::vector<std::pair<size_t, size_t>> taken;
+
+		for (size_t index : order)
+		{
+			MemoryBlock &block = blocks[index];
+			size_t size = lineSize(block);
+
+			// Memory of the placed blocks alive at some step this one is
+			taken.clear();
+			for (size_t other : placed)
+			{
+				if (Overlap(index, other))
+				{
+					taken.push_back({ blocks[other].Offset, blocks[other].Offset + lineSize(blocks[other]) });
+				}
+			}
+			std::sort(taken.begin(), taken.end());
+
+			size_t offset = 0;
+			for (const std::pair<size_t, size_t> &range : taken)
+			{
+				if (offset + size <= range.first)
+				{
+					break;
+				}
+				offset = std::max(offset, range.second);
+			}
+
+			block.Offset = offset;
+			arenaSize = std::max(arenaSize, offset + size);
+			placed.push_back(index);
+		}
+
+		return arenaSize;
+	}
+}
\ No newline at end of file
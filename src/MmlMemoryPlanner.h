@@ -0,0 +1,25 @@
+#pragma once
+
+namespace maxml
+{
+	// A buffer of Size floats, the steps its contents are written and read at, and its place
+	// in the arena. Each write starts a new lifetime, lasting until the last read before the
+	// next write, so a buffer whose contents are produced again later is free in between.
+	struct MemoryBlock
+	{
+		size_t Size = 0;
+		size_t Offset = 0;
+
+		void write(size_t step);
+		void read(size_t step);
+
+		// (step, write) pairs, those of one step in the order they happen
+		std::vector<std::pair<size_t, bool>> Accesses;
+	};
+
+	// Gives every block an offset into one arena such that blocks alive at the same step never
+	// overlap, each starting on a cache line. Blocks are placed largest first, each at the
+	// lowest offset that is free for all of its lifetimes. Returns the arena size in floats,
+	// the planned peak.
+	size_t planMemory(std::vector<MemoryBlock> &blocks);
+}
\ No newline at end of file
@@ -0,0 +1,652 @@
+#include "MmlModelIR.h"
+#include "MmlLayer.h"
+#include "MmlSerialization.h"
+#include "MmlUtils.h"
+
+namespace maxml
+{
+	static constexpr uint16_t k_MagicNumber = 0xBEEF;
+
+	// Version 0 files have no version marker after the magic number and no convolutional biases
+	static constexpr uint16_t k_VersionMarker = 0xF11E;
+	static constexpr uint16_t k_Version = 1;
+
+	// Tensors a model file stores after a description of this type
+	static size_t numTensors(const SequentialDesc::LayerDesc &desc)
+	{
+		if (std::holds_alternative<FullyConnectedDesc>(desc) || std::holds_alternative<ConvolutionalDesc>(desc))
+		{
+			return 2;
+		}
+		if (std::holds_alternative<BatchNormDesc>(desc) || std::holds_alternative<FactorizedFullyConnectedDesc>(desc))
+		{
+			return 4;
+		}
+		return 0;
+	}
+
+	ModelIR makeIR(const SequentialDesc &description)
+	{
+		ModelIR ir;
+		ir.Description = description;
+
+		for (const SequentialDesc::LayerDesc &desc : description.LayerDescs)
+		{
+			ir.Nodes.push_back({ desc });
+		}
+
+		return ir;
+	}
+
+	ModelIR readIR(const std::string &path)
+	{
+		ModelIR ir;
+		BinaryReader br(path);
+
+		uint16_t magicNumber;
+		br.read(magicNumber);
+		if (magicNumber != k_MagicNumber)
+		{
+			MML_ASSERT(false, "Invalid sequential model file !");
+			return ir;
+		}
+
+		uint16_t version = 0;
+		br.peek(magicNumber);
+		if (magicNumber == k_VersionMarker)
+		{
+			br.read(magicNumber);
+			br.read(version);
+		}
+		if (version > k_Version)
+		{
+			MML_ASSERT(false, "Unsupported sequential model file version %u !", version);
+			return ir;
+		}
+
+		br.read(ir.Description.ObjectiveFunc);
+		br.read(ir.Description.LearningRate);
+
+		while (true)
+		{
+			br.peek(magicNumber);
+			if (magicNumber == k_MagicNumber)
+			{
+				break;
+			}
+
+			// Layer desc type encoded using index
+			uint64_t descVariantIndex;
+			br.read(descVariantIndex);
+
+			ModelIR::Node node;
+			if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, InputDesc>())
+			{
+				InputDesc inpLayerDesc;
+				br.read(inpLayerDesc);
+				node.Desc = inpLayerDesc;
+			}
+			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, FullyConnectedDesc>())
+			{
+				FullyConnectedDesc fcLayerDesc;
+				br.read(fcLayerDesc);
+				node.Desc = fcLayerDesc;
+			}
+			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, ConvolutionalDesc>())
+			{
+				ConvolutionalDesc convLayerDesc;
+				br.read(convLayerDesc);
+				node.Desc = convLayerDesc;
+
+				// Version 0 convolutions have no biases, so they start at zero
+				if (version < 1)
+				{
+					node.Tensors.resize(2);
+					br.read(node.Tensors[0]);
+					node.Tensors[1] = Tensor(convLayerDesc.NumKernels, 1, 1);
+				}
+			}
+			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, PoolingDesc>())
+			{
+				PoolingDesc poolLayerDesc;
+				br.read(poolLayerDesc);
+				node.Desc = poolLayerDesc;
+			}
+			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, FlattenDesc>())
+			{
+				FlattenDesc flattenLayerDesc;
+				br.read(flattenLayerDesc);
+				node.Desc = flattenLayerDesc;
+			}
+			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, BatchNormDesc>())
+			{
+				BatchNormDesc bnLayerDesc;
+				br.read(bnLayerDesc);
+				node.Desc = bnLayerDesc;
+			}
+			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, FactorizedFullyConnectedDesc>())
+			{
+				FactorizedFullyConnectedDesc ffcLayerDesc;
+				br.read(ffcLayerDesc);
+				node.Desc = ffcLayerDesc;
+			}
+			else
+			{
+				MML_ASSERT(false, "Unhandled layer description!");
+				break;
+			}
+
+			if (node.Tensors.empty())
+			{
+				node.Tensors.resize(numTensors(node.Desc));
+				for (Tensor &tensor : node.Tensors)
+				{
+					br.read(tensor);
+				}
+			}
+
+			ir.Description.LayerDescs.push_back(node.Desc);
+			ir.Nodes.push_back(std::move(node));
+		}
+
+		return ir;
+	}
+
+	void writeIR(const ModelIR &ir, const std::string &path)
+	{
+		BinaryWriter bw(path);
+
+		bw.write(k_MagicNumber);
+		bw.write(k_VersionMarker);
+		bw.write(k_Version);
+		bw.write(ir.Description.ObjectiveFunc);
+		bw.write(ir.Description.LearningRate);
+
+		for (const ModelIR::Node &node : ir.Nodes)
+		{
+			MML_ASSERT(node.Tensors.size() == numTensors(node.Desc), "Node is missing its tensors!");
+
+			// Layer type encoded using index
+			uint64_t descVariantIndex = node.Desc.index();
+			bw.write(descVariantIndex);
+
+			std::visit([&](const auto &desc) {
+				bw.write(desc);
+			}, node.Desc);
+
+			for (const Tensor &tensor : node.Tensors)
+			{
+				bw.write(tensor);
+			}
+		}
+
+		bw.write(k_MagicNumber);
+	}
+
+	void inferShapes(ModelIR &ir)
+	{
+		MML_ASSERT(!ir.Nodes.empty() && std::holds_alternative<InputDesc>(ir.Nodes.front().Desc), "Must start with an input layer!");
+
+		std::array<size_t, 3> shape = {};
+		for (size_t i = 0; i < ir.Nodes.size(); ++i)
+		{
+			ModelIR::Node &node = ir.Nodes[i];
+			const SequentialDesc::LayerDesc &desc = node.Desc;
+
+			if (std::holds_alternative<InputDesc>(desc))
+			{
+				MML_ASSERT(i == 0, "Cannot have more than one input layer!");
+
+				InputDesc inpLayerDesc = std::get<InputDesc>(desc);
+				shape = { inpLayerDesc.Channels, inpLayerDesc.Rows, inpLayerDesc.Cols };
+			}
+			else if (std::holds_alternative<FullyConnectedDesc>(desc))
+			{
+				MML_ASSERT(shape[0] == 1 && shape[2] == 1, "Fully connected layers need a flat input!");
+
+				shape = { 1, std::get<FullyConnectedDesc>(desc).NumOutputs, 1 };
+			}
+			else if (std::holds_alternative<FactorizedFullyConnectedDesc>(desc))
+			{
+				MML_ASSERT(shape[0] == 1 && shape[2] == 1, "Fully connected layers need a flat input!");
+				MML_ASSERT(std::get<FactorizedFullyConnectedDesc>(desc).Rank > 0, "Factorized layers need a rank!");
+
+				shape = { 1, std::get<FactorizedFullyConnectedDesc>(desc).NumOutputs, 1 };
+			}
+			else if (std::holds_alternative<ConvolutionalDesc>(desc))
+			{
+				ConvolutionalDesc convLayerDesc = std::get<ConvolutionalDesc>(desc);
+				MML_ASSERT(convLayerDesc.KernelWidth <= shape[1] && convLayerDesc.KernelHeight <= shape[2], "Kernel is larger than its input!");
+
+				shape = { convLayerDesc.NumKernels, shape[1] - convLayerDesc.KernelWidth + 1, shape[2] - convLayerDesc.KernelHeight + 1 };
+			}
+			else if (std::holds_alternative<PoolingDesc>(desc))
+			{
+				PoolingDesc poolLayerDesc = std::get<PoolingDesc>(desc);
+				MML_ASSERT(poolLayerDesc.TileWidth <= shape[1] && poolLayerDesc.TileHeight <= shape[2], "Tile is larger than its input!");
+
+				shape = { shape[0], (shape[1] - poolLayerDesc.TileWidth) / poolLayerDesc.TileWidth + 1, (shape[2] - poolLayerDesc.TileHeight) / poolLayerDesc.TileHeight + 1 };
+			}
+			else if (std::holds_alternative<FlattenDesc>(desc))
+			{
+				shape = { 1, shape[0] * shape[1] * shape[2], 1 };
+			}
+
+			node.Shape = shape;
+		}
+	}
+
+	void initializeParameters(ModelIR &ir)
+	{
+		for (size_t i = 1; i < ir.Nodes.size(); ++i)
+		{
+			ModelIR::Node &node = ir.Nodes[i];
+			if (!node.Tensors.empty() || numTensors(node.Desc) == 0)
+			{
+				continue;
+			}
+
+			// The layers own their freshly initialized tensors, which are moved out of them
+			std::vector<std::array<size_t, 3>> shapes = { ir.Nodes[i - 1].Shape };
+			for (std::shared_ptr<Layer> &layer : makeLayers(node.Desc, shapes))
+			{
+				for (Parameter &param : layer->parameters())
+				{
+					node.Tensors.push_back(std::move(*param.Value));
+				}
+				for (Tensor *buffer : layer->buffers())
+				{
+					node.Tensors.push_back(std::move(*buffer));
+				}
+			}
+		}
+	}
+
+	void removeIdentities(ModelIR &ir)
+	{
+		// A model of nothing but identities still needs a layer to run
+		bool hasLayers = std::any_of(ir.Nodes.begin(), ir.Nodes.end(), [](const ModelIR::Node &node) {
+			return numTensors(node.Desc) > 0;
+		});
+		if (!hasLayers)
+		{
+			return;
+		}
+
+		for (size_t i = 1; i < ir.Nodes.size(); ++i)
+		{
+			ModelIR::Node &node = ir.Nodes[i];
+			const std::array<size_t, 3> &inShape = ir.Nodes[i - 1].Shape;
+
+			if (std::holds_alternative<FlattenDesc>(node.Desc))
+			{
+				node.Dead = inShape[0] == 1 && inShape[2] == 1;
+			}
+			else if (std::holds_alternative<PoolingDesc>(node.Desc))
+			{
+				PoolingDesc poolLayerDesc = std::get<PoolingDesc>(node.Desc);
+				node.Dead = poolLayerDesc.TileWidth == 1 && poolLayerDesc.TileHeight == 1;
+			}
+		}
+	}
+
+	void foldBatchNorm(ModelIR &ir)
+	{
+		for (size_t i = 1; i + 1 < ir.Nodes.size(); ++i)
+		{
+			ModelIR::Node &node = ir.Nodes[i];
+			ModelIR::Node &next = ir.Nodes[i + 1];
+
+			bool isFactorized = std::holds_alternative<FactorizedFullyConnectedDesc>(node.Desc);
+			bool isFullyConnected = std::holds_alternative<FullyConnectedDesc>(node.Desc) || isFactorized;
+			bool isConvolutional = std::holds_alternative<ConvolutionalDesc>(node.Desc);
+			if ((!isFullyConnected && !isConvolutional) || !std::holds_alternative<BatchNormDesc>(next.Desc))
+			{
+				continue;
+			}
+
+			ActivationFunc &activFunc = isFactorized ? std::get<FactorizedFullyConnectedDesc>(node.Desc).ActivFunc
+				: isFullyConnected ? std::get<FullyConnectedDesc>(node.Desc).ActivFunc
+				: std::get<ConvolutionalDesc>(node.Desc).ActivFunc;
+			if (activFunc != ActivationFunc::None)
+			{
+				continue;
+			}
+
+			BatchNormDesc bnLayerDesc = std::get<BatchNormDesc>(next.Desc);
+			const std::vector<Tensor> &bnTensors = next.Tensors;
+
+			Tensor scale(bnTensors[0].channels(), 1, 1);
+			Tensor shift(bnTensors[0].channels(), 1, 1);
+			BatchNormLayer::foldedScaleShift(bnTensors[0], bnTensors[1], bnTensors[2], bnTensors[3], bnLayerDesc.Epsilon, scale, shift);
+
+			// A factorized node only scales its expansion
+			Tensor &weights = node.Tensors[isFactorized ? 2 : 0];
+			Tensor &biases = node.Tensors[isFactorized ? 3 : 1];
+			if (isFullyConnected)
+			{
+				// Each row of the weights produces one output feature
+				for (size_t o = 0; o < weights.rows(); ++o)
+				{
+					for (size_t i = 0; i < weights.cols(); ++i)
+					{
+						weights(0, o, i) *= scale[o];
+					}
+					biases[o] = biases[o] * scale[o] + shift[o];
+				}
+			}
+			else
+			{
+				// Each row of the windowed kernel produces one output channel
+				for (size_t c = 0; c < weights.channels(); ++c)
+				{
+					for (size_t k = 0; k < weights.rows(); ++k)
+					{
+						for (size_t w = 0; w < weights.cols(); ++w)
+						{
+							weights(c, k, w) *= scale[k];
+						}
+					}
+				}
+				Tensor::channelAffine(biases, scale, shift, biases);
+			}
+
+			activFunc = bnLayerDesc.ActivFunc;
+			ir.Nodes.erase(ir.Nodes.begin() + i + 1);
+		}
+
+		ir.Description.LayerDescs.clear();
+		for (const ModelIR::Node &node : ir.Nodes)
+		{
+			ir.Description.LayerDescs.push_back(node.Desc);
+		}
+	}
+
+	// One-sided Jacobi SVD of a matrix with at least as many rows as cols, given by columns.
+	// Rotates pairs of columns until every pair is orthogonal, leaving each column its singular
+	// value times its left singular vector, and accumulates the rotations into right, which
+	// ends up holding the right singular vectors by column.
+	static void jacobiSVD(std::vector<double> &columns, std::vector<double> &right, size_t rows, size_t cols)
+	{
+		constexpr size_t k_MaxSweeps = 60;
+		constexpr double k_Tolerance = 1e-12;
+
+		right.assign(cols * cols, 0.0);
+		for (size_t j = 0; j < cols; ++j)
+		{
+			right[j * cols + j] = 1.0;
+		}
+
+		std::vector<double> norms(cols);
+		for (size_t sweep = 0; sweep < k_MaxSweeps; ++sweep)
+		{
+			// Squared norms are updated with each rotation, and recomputed every sweep
+			for (size_t j = 0; j < cols; ++j)
+			{
+				const double *a_j = &columns[j * rows];
+				norms[j] = std::inner_product(a_j, a_j + rows, a_j, 0.0);
+			}
+
+			bool rotated = false;
+			for (size_t p = 0; p + 1 < cols; ++p)
+			{
+				for (size_t q = p + 1; q < cols; ++q)
+				{
+					double *a_p = &columns[p * rows];
+					double *a_q = &columns[q * rows];
+					double alpha = norms[p];
+					double beta = norms[q];
+					double gamma = std::inner_product(a_p, a_p + rows, a_q, 0.0);
+					if (std::abs(gamma) <= k_Tolerance * std::sqrt(alpha * beta) || gamma == 0.0)
+					{
+						continue;
+					}
+					rotated = true;
+
+					double zeta = (beta - alpha) / (2.0 * gamma);
+					double t = (zeta >= 0.0 ? 1.0 : -1.0) / (std::abs(zeta) + std::sqrt(1.0 + zeta * zeta));
+					double c = 1.0 / std::sqrt(1.0 + t * t);
+					double s = c * t;
+
+					for (size_t i = 0; i < rows; ++i)
+					{
+						double x = a_p[i];
+						double y = a_q[i];
+						a_p[i] = c * x - s * y;
+						a_q[i] = s * x + c * y;
+					}
+
+					double *v_p = &right[p * cols];
+					double *v_q = &right[q * cols];
+					for (size_t i = 0; i < cols; ++i)
+					{
+						double x = v_p[i];
+						double y = v_q[i];
+						v_p[i] = c * x - s * y;
+						v_q[i] = s * x + c * y;
+					}
+
+					norms[p] = alpha - t * gamma;
+					norms[q] = beta + t * gamma;
+				}
+			}
+
+			if (!rotated)
+			{
+				break;
+			}
+		}
+	}
+
+	void factorizeFullyConnected(ModelIR &ir, size_t rank, float energy)
+	{
+		for (ModelIR::Node &node : ir.Nodes)
+		{
+			if (!std::holds_alternative<FullyConnectedDesc>(node.Desc) || node.Tensors.empty())
+			{
+				continue;
+			}
+
+			FullyConnectedDesc fcLayerDesc = std::get<FullyConnectedDesc>(node.Desc);
+			const Tensor &weights = node.Tensors[0];
+			size_t numOutputs = weights.rows();
+			size_t numInputs = weights.cols();
+
+			// Jacobi runs on the weights or their transpose, whichever has fewer columns, so
+			// the left singular vectors are the columns of the expansion or the rows of the
+			// projection respectively
+			bool transposed = numOutputs < numInputs;
+			size_t rows = transposed ? numInputs : numOutputs;
+			size_t cols = transposed ? numOutputs : numInputs;
+
+			std::vector<double> columns(rows * cols);
+			for (size_t o = 0; o < numOutputs; ++o)
+			{
+				for (size_t i = 0; i < numInputs; ++i)
+				{
+					columns[transposed ? o * numInputs + i : i * numOutputs + o] = weights(0, o, i);
+				}
+			}
+
+			std::vector<double> right;
+			jacobiSVD(columns, right, rows, cols);
+
+			// Singular values, largest first
+			std::vector<double> values(cols);
+			std::vector<size_t> order(cols);
+			for (size_t j = 0; j < cols; ++j)
+			{
+				const double *a_j = &columns[j * rows];
+				values[j] = std::sqrt(std::inner_product(a_j, a_j + rows, a_j, 0.0));
+				order[j] = j;
+			}
+			std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+				return values[a] > values[b];
+			});
+
+			size_t keep = std::min(rank, cols);
+			if (rank == 0)
+			{
+				double total = std::inner_product(values.begin(), values.end(), values.begin(), 0.0);
+				double kept = 0.0;
+				while (keep < cols && kept < static_cast<double>(energy) * total)
+				{
+					kept += values[order[keep]] * values[order[keep]];
+					++keep;
+				}
+			}
+			if (keep == 0 || keep * (numOutputs + numInputs) >= numOutputs * numInputs)
+			{
+				continue;
+			}
+
+			// Each factor takes the square root of the singular values
+			Tensor projection(1, keep, numInputs);
+			Tensor expansion(1, numOutputs, keep);
+			for (size_t k = 0; k < keep; ++k)
+			{
+				size_t j = order[k];
+				double sqrtValue = std::sqrt(values[j]);
+				double invValue = values[j] > 0.0 ? 1.0 / values[j] : 0.0;
+				const double *left = &columns[j * rows];
+				const double *rightVec = &right[j * cols];
+
+				for (size_t o = 0; o < numOutputs; ++o)
+				{
+					double u = transposed ? rightVec[o] : left[o] * invValue;
+					expansion(0, o, k) = static_cast<float>(u * sqrtValue);
+				}
+				for (size_t i = 0; i < numInputs; ++i)
+				{
+					double v = transposed ? left[i] * invValue : rightVec[i];
+					projection(0, k, i) = static_cast<float>(v * sqrtValue);
+				}
+			}
+
+			Tensor biases = std::move(node.Tensors[1]);
+			node.Desc = makeFactorizedFullyConnected(numOutputs, keep, fcLayerDesc.ActivFunc);
+			node.Tensors.clear();
+			node.Tensors.push_back(std::move(projection));
+			node.Tensors.push_back(Tensor(1, keep, 1));
+			node.Tensors.push_back(std::move(expansion));
+			node.Tensors.push_back(std::move(biases));
+		}
+
+		ir.Description.LayerDescs.clear();
+		for (const ModelIR::Node &node : ir.Nodes)
+		{
+			ir.Description.LayerDescs.push_back(node.Desc);
+		}
+	}
+
+	void fuseActivations(ModelIR &ir)
+	{
+		for (ModelIR::Node &node : ir.Nodes)
+		{
+			ActivationFunc activFunc = ActivationFunc::None;
+			if (std::holds_alternative<FullyConnectedDesc>(node.Desc))
+			{
+				activFunc = std::get<FullyConnectedDesc>(node.Desc).ActivFunc;
+			}
+			else if (std::holds_alternative<FactorizedFullyConnectedDesc>(node.Desc))
+			{
+				activFunc = std::get<FactorizedFullyConnectedDesc>(node.Desc).ActivFunc;
+			}
+
+			// Softmax normalizes the whole sample, so it stays a layer of its own
+			node.FusedActivation = activFunc == ActivationFunc::Sigmoid
+				|| activFunc == ActivationFunc::Tanh
+				|| activFunc == ActivationFunc::ReLU;
+		}
+	}
+
+	void selectLayouts(ModelIR &ir)
+	{
+		size_t last = ir.Nodes.size() - 1;
+		while (last > 0 && ir.Nodes[last].Dead)
+		{
+			--last;
+		}
+
+		for (size_t i = 0; i < ir.Nodes.size(); ++i)
+		{
+			ModelIR::Node &node = ir.Nodes[i];
+			bool blockable = std::holds_alternative<ConvolutionalDesc>(node.Desc) || std::holds_alternative<PoolingDesc>(node.Desc);
+			node.Layout = ir.Description.Layout == TensorLayout::NCHW8c && blockable && i != last ? TensorLayout::NCHW8c : TensorLayout::NCHW;
+		}
+	}
+
+	void optimizeIR(ModelIR &ir)
+	{
+		inferShapes(ir);
+		initializeParameters(ir);
+		removeIdentities(ir);
+
+		if (ir.Description.Mode == ModelMode::Inference)
+		{
+			foldBatchNorm(ir);
+			fuseActivations(ir);
+		}
+
+		selectLayouts(ir);
+	}
+
+	void lowerIR(ModelIR &ir, std::vector<std::shared_ptr<Layer>> &layers,
+		std::vector<std::array<size_t, 3>> &shapes, std::vector<size_t> &descLayers)
+	{
+		shapes.push_back(ir.Nodes.front().Shape);
+		descLayers.push_back(layers.size());
+
+		for (size_t i = 1; i < ir.Nodes.size(); ++i)
+		{
+			ModelIR::Node &node = ir.Nodes[i];
+			descLayers.push_back(layers.size());
+
+			if (node.Dead)
+			{
+				continue;
+			}
+
+			// Activations without a function would copy their input in place
+			std::vector<std::array<size_t, 3>> nodeShapes = { shapes.back() };
+			std::vector<std::shared_ptr<Layer>> nodeLayers = makeLayers(node.Desc, nodeShapes, std::move(node.Tensors));
+			for (size_t k = 0; k < nodeLayers.size(); ++k)
+			{
+				ActivationLayer *activLayer = dynamic_cast<ActivationLayer *>(nodeLayers[k].get());
+				if (activLayer && activLayer->ActivFunc == ActivationFunc::None)
+				{
+					continue;
+				}
+
+				// A fused activation runs inside the fully connected layer before it
+				if (activLayer && node.FusedActivation)
+				{
+					static_cast<FullyConnectedLayer *>(layers.back().get())->FusedActivation = activLayer->ActivFunc;
+					continue;
+				}
+
+				layers.push_back(std::move(nodeLayers[k]));
+				shapes.push_back(nodeShapes[k + 1]);
+			}
+
+			node.Tensors.clear();
+		}
+
+		descLayers.push_back(layers.size());
+		applyLayouts(ir, layers, descLayers);
+	}
+
+	void applyLayouts(const ModelIR &ir, std::vector<std::shared_ptr<Layer>> &layers, const std::vector<size_t> &descLayers)
+	{
+		for (size_t i = 0; i < ir.Nodes.size(); ++i)
+		{
+			for (size_t l = descLayers[i]; l < descLayers[i + 1]; ++l)
+			{
+				// Softmax normalizes over the planar sample
+				ActivationLayer *activLayer = dynamic_cast<ActivationLayer *>(layers[l].get());
+				bool softmax = activLayer && activLayer->ActivFunc == ActivationFunc::Softmax;
+				layers[l]->Layout = softmax ? TensorLayout::NCHW : ir.Nodes[i].Layout;
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "maxml/MmlTensor.h"
+#include "maxml/MmlSequential.h"
+
+namespace maxml
+{
+	struct Layer;
+
+	// A network between its description, or a model file, and the layers that run it. Both
+	// sources build the same IR, the passes below transform it and lowering turns it into the
+	// executable layer list, so an optimization written as a pass applies to either.
+	struct ModelIR
+	{
+		struct Node
+		{
+			SequentialDesc::LayerDesc Desc;
+
+			// The parameters followed by the buffers of each of the node's layers, in the order the
+			// model file stores them. Empty until read or initialized.
+			std::vector<Tensor> Tensors;
+
+			// Planar shape of the output
+			std::array<size_t, 3> Shape = {};
+
+			// Lowered to no layers, such as a flatten of an already flat input
+			bool Dead = false;
+
+			// Layout of the node's layers, but a softmax, picked by selectLayouts
+			TensorLayout Layout = TensorLayout::NCHW;
+
+			// The activation runs inside the fully connected kernel, set by fuseActivations
+			bool FusedActivation = false;
+		};
+
+		// Every setting of the model, its layer descriptions being those of Nodes
+		SequentialDesc Description;
+		std::vector<Node> Nodes;
+	};
+
+	ModelIR makeIR(const SequentialDesc &description);
+
+	// Reads a model file saved by writeIR, or any earlier version
+	ModelIR readIR(const std::string &path);
+	void writeIR(const ModelIR &ir, const std::string &path);
+
+	// Computes the output shape of every node, checking each fits the one before
+	void inferShapes(ModelIR &ir);
+
+	// Gives nodes without tensors freshly initialized ones
+	void initializeParameters(ModelIR &ir);
+
+	// Marks nodes whose layers would only copy their input as dead
+	void removeIdentities(ModelIR &ir);
+
+	// Folds batch normalization into the preceding fully connected or convolutional node
+	// where it directly follows one without an activation, removing the batch normalization
+	void foldBatchNorm(ModelIR &ir);
+
+	// Replaces fully connected nodes by factorized ones from the truncated SVD of their weights,
+	// W ~ (U S^1/2) (S^1/2 V^T), keeping rank singular values, or when rank is zero the fewest
+	// whose squares hold energy of their sum. Nodes the factors would not shrink are kept.
+	// Runs on nodes with tensors, so after readIR or initializeParameters.
+	void factorizeFullyConnected(ModelIR &ir, size_t rank, float energy);
+
+	// Moves the elementwise activation of fully connected nodes into their kernel, which
+	// applies it to each output row straight after the biases. Inference only, as backward
+	// needs the activation as a layer of its own.
+	void fuseActivations(ModelIR &ir);
+
+	// With SequentialDesc::Layout blocked, convolution and pooling nodes take the blocked
+	// layout, but the last node, whose output the loss reads. Everything else stays planar.
+	void selectLayouts(ModelIR &ir);
+
+	// Runs the passes every model goes through, the folding and fusion only for inference
+	void optimizeIR(ModelIR &ir);
+
+	// Moves the tensors of ir into its layers, leaving out identity activations. Appends the
+	// shape after each layer to shapes, starting with the input, and the index of the first
+	// layer of each node to descLayers, followed by the number of layers.
+	void lowerIR(ModelIR &ir, std::vector<std::shared_ptr<Layer>> &layers,
+		std::vector<std::array<size_t, 3>> &shapes, std::vector<size_t> &descLayers);
+
+	// Gives the layers of each node, as lowerIR recorded them in descLayers, the node's layout
+	void applyLayouts(const ModelIR &ir, std::vector<std::shared_ptr<Layer>> &layers, const std::vector<size_t> &descLayers);
+}
\ No newline at end of file
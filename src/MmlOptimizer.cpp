@@ -0,0 +1,147 @@
+#include "MmlOptimizer.h"
+#include "MmlUtils.h"
+
+namespace maxml
+{
+	// w -= lr * (g + wd * w)
+	static void sgdStep(Tensor &value, const Tensor &delta, float learningRate, float weightDecay)
+	{
+		float *w = value.data();
+		const float *g = delta.data();
+		size_t size = value.size();
+		size_t vecSize = size - size % 8;
+
+		__m256 lrv = _mm256_set1_ps(learningRate);
+		__m256 wdv = _mm256_set1_ps(weightDecay);
+
+		for (size_t i = 0; i < vecSize; i += 8)
+		{
+			__m256 wv = _mm256_loadu_ps(w + i);
+			__m256 gv = _mm256_add_ps(_mm256_loadu_ps(g + i), _mm256_mul_ps(wdv, wv));
+			_mm256_storeu_ps(w + i, _mm256_sub_ps(wv, _mm256_mul_ps(lrv, gv)));
+		}
+		for (size_t i = vecSize; i < size; ++i)
+		{
+			w[i] -= learningRate * (g[i] + weightDecay * w[i]);
+		}
+	}
+
+	// v = mu * v + (g + wd * w), then w -= lr * v, or w -= lr * (g + mu * v) for Nesterov
+	static void momentumStep(Tensor &value, const Tensor &delta, Tensor &velocity, float learningRate, float momentum, float weightDecay, bool nesterov)
+	{
+		float *w = value.data();
+		const float *g = delta.data();
+		float *v = velocity.data();
+		size_t size = value.size();
+		size_t vecSize = size - size % 8;
+
+		__m256 lrv = _mm256_set1_ps(learningRate);
+		__m256 muv = _mm256_set1_ps(momentum);
+		__m256 wdv = _mm256_set1_ps(weightDecay);
+
+		for (size_t i = 0; i < vecSize; i += 8)
+		{
+			__m256 wv = _mm256_loadu_ps(w + i);
+			__m256 gv = _mm256_add_ps(_mm256_loadu_ps(g + i), _mm256_mul_ps(wdv, wv));
+			__m256 vv = _mm256_add_ps(_mm256_mul_ps(muv, _mm256_loadu_ps(v + i)), gv);
+			__m256 stepv = nesterov ? _mm256_add_ps(gv, _mm256_mul_ps(muv, vv)) : vv;
+
+			_mm256_storeu_ps(v + i, vv);
+			_mm256_storeu_ps(w + i, _mm256_sub_ps(wv, _mm256_mul_ps(lrv, stepv)));
+		}
+		for (size_t i = vecSize; i < size; ++i)
+		{
+			float gi = g[i] + weightDecay * w[i];
+			v[i] = momentum * v[i] + gi;
+			w[i] -= learningRate * (nesterov ? gi + momentum * v[i] : v[i]);
+		}
+	}
+
+	// Moments of (g + wd * w), or of g with the decay applied straight to w when decoupled, and
+	// w -= lr * c1 * m / (sqrt(c2 * v) + eps) where c1 and c2 are the bias corrections
+	static void adamStep(Tensor &value, const Tensor &delta, Tensor &first, Tensor &second, float learningRate, const OptimizerDesc &desc, float c1, float c2, bool decoupled)
+	{
+		float *w = value.data();
+		const float *g = delta.data();
+		float *m = first.data();
+		float *v = second.data();
+		size_t size = value.size();
+		size_t vecSize = size - size % 8;
+
+		float gradDecay = decoupled ? 0.0f : desc.WeightDecay;
+		float weightScale = decoupled ? 1.0f - learningRate * desc.WeightDecay : 1.0f;
+
+		__m256 b1v = _mm256_set1_ps(desc.Beta1);
+		__m256 b2v = _mm256_set1_ps(desc.Beta2);
+		__m256 ob1v = _mm256_set1_ps(1.0f - desc.Beta1);
+		__m256 ob2v = _mm256_set1_ps(1.0f - desc.Beta2);
+		__m256 epsv = _mm256_set1_ps(desc.Epsilon);
+		__m256 lrc1v = _mm256_set1_ps(learningRate * c1);
+		__m256 c2v = _mm256_set1_ps(c2);
+		__m256 gdv = _mm256_set1_ps(gradDecay);
+		__m256 wsv = _mm256_set1_ps(weightScale);
+
+		for (size_t i = 0; i < vecSize; i += 8)
+		{
+			__m256 wv = _mm256_loadu_ps(w + i);
+			__m256 gv = _mm256_add_ps(_mm256_loadu_ps(g + i), _mm256_mul_ps(gdv, wv));
+			__m256 mv = _mm256_add_ps(_mm256_mul_ps(b1v, _mm256_loadu_ps(m + i)), _mm256_mul_ps(ob1v, gv));
+			__m256 vv = _mm256_add_ps(_mm256_mul_ps(b2v, _mm256_loadu_ps(v + i)), _mm256_mul_ps(ob2v, _mm256_mul_ps(gv, gv)));
+			__m256 denomv = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(c2v, vv)), epsv);
+
+			_mm256_storeu_ps(m + i, mv);
+			_mm256_storeu_ps(v + i, vv);
+			_mm256_storeu_ps(w + i, _mm256_sub_ps(_mm256_mul_ps(wsv, wv), _mm256_div_ps(_mm256_mul_ps(lrc1v, mv), denomv)));
+		}
+		for (size_t i = vecSize; i < size; ++i)
+		{
+			float gi = g[i] + gradDecay * w[i];
+			m[i] = desc.Beta1 * m[i] + (1.0f - desc.Beta1) * gi;
+			v[i] = desc.Beta2 * v[i] + (1.0f - desc.Beta2) * gi * gi;
+			w[i] = weightScale * w[i] - learningRate * c1 * m[i] / (std::sqrt(c2 * v[i]) + desc.Epsilon);
+		}
+	}
+
+	Optimizer::Optimizer(const OptimizerDesc &description, Tensor &parameters, Tensor &deltas)
+		: m_Description(description)
+		, m_Parameters(Tensor::view(parameters, parameters.channels(), parameters.rows(), parameters.cols()))
+		, m_Deltas(Tensor::view(deltas, deltas.channels(), deltas.rows(), deltas.cols()))
+		, m_Steps(0)
+	{
+		MML_ASSERT(parameters.size() == deltas.size(), "Every parameter needs a delta!");
+
+		if (m_Description.Func != OptimizerFunc::SGD)
+		{
+			m_FirstMoments = Tensor(parameters.channels(), parameters.rows(), parameters.cols());
+		}
+		if (m_Description.Func == OptimizerFunc::Adam || m_Description.Func == OptimizerFunc::AdamW)
+		{
+			m_SecondMoments = Tensor(parameters.channels(), parameters.rows(), parameters.cols());
+		}
+	}
+
+	void Optimizer::step(float learningRate)
+	{
+		++m_Steps;
+
+		float c1 = 1.0f / (1.0f - std::pow(m_Description.Beta1, static_cast<float>(m_Steps)));
+		float c2 = 1.0f / (1.0f - std::pow(m_Description.Beta2, static_cast<float>(m_Steps)));
+
+		switch (m_Description.Func)
+		{
+		case OptimizerFunc::SGD:
+			sgdStep(m_Parameters, m_Deltas, learningRate, m_Description.WeightDecay);
+			break;
+		case OptimizerFunc::Momentum:
+		case OptimizerFunc::Nesterov:
+			momentumStep(m_Parameters, m_Deltas, m_FirstMoments, learningRate, m_Description.Momentum, m_Description.WeightDecay,
+				m_Description.Func == OptimizerFunc::Nesterov);
+			break;
+		case OptimizerFunc::Adam:
+		case OptimizerFunc::AdamW:
+			adamStep(m_Parameters, m_Deltas, m_FirstMoments, m_SecondMoments, learningRate, m_Description, c1, c2,
+				m_Description.Func == OptimizerFunc::AdamW);
+			break;
+		}
+	}
+}
\ No newline at end of file
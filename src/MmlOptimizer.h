@@ -0,0 +1,32 @@
+#pragma once
+
+#include "maxml/MmlTensor.h"
+#include "maxml/MmlSequential.h"
+
+namespace maxml
+{
+	// Applies the delta arena of a model to its parameter arena, keeping state such as
+	// velocities and moments in matching arenas. Each step is a single streaming pass over
+	// the parameters, their deltas and the state.
+	class Optimizer
+	{
+	public:
+		Optimizer() = delete;
+		Optimizer(const OptimizerDesc &description, Tensor &parameters, Tensor &deltas);
+
+		void step(float learningRate);
+
+	private:
+		OptimizerDesc m_Description;
+
+		// Views of the model's arenas
+		Tensor m_Parameters;
+		Tensor m_Deltas;
+
+		// Velocities for momentum, first and second moments for Adam
+		Tensor m_FirstMoments;
+		Tensor m_SecondMoments;
+
+		size_t m_Steps;
+	};
+}
\ No newline at end of file
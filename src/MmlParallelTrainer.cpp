@@ -0,0 +1,244 @@
+#include "maxml/MmlParallelTrainer.h"
+#include "MmlLayer.h"
+#include "MmlThreadPool.h"
+
+namespace maxml
+{
+	// Floats per cache line, reduction chunks start on one so no two threads write the same line
+	static constexpr size_t k_LineFloats = 16;
+
+	// Copies the samples order[begin, begin + size) into the front of the batch tensors
+	static void gatherSamples(const Tensor &inputs, const Tensor &expected, size_t numSamples, const size_t *order, size_t size, Tensor &batchInputs, Tensor &batchExpected)
+	{
+		size_t inChannels = inputs.channels() / numSamples;
+		size_t outChannels = expected.channels() / numSamples;
+		size_t inSize = inChannels * inputs.rows() * inputs.cols();
+		size_t outSize = outChannels * expected.rows() * expected.cols();
+
+		for (size_t i = 0; i < size; ++i)
+		{
+			Tensor input_i = Tensor::slice(batchInputs, i * inChannels, inChannels);
+			Tensor expected_i = Tensor::slice(batchExpected, i * outChannels, outChannels);
+
+			Tensor::copy(input_i, inputs.data() + order[i] * inSize, inSize);
+			Tensor::copy(expected_i, expected.data() + order[i] * outSize, outSize);
+		}
+	}
+
+	ParallelTrainer::ParallelTrainer(Sequential &model, size_t numWorkers, size_t maxBatchSize, TrainerMode mode)
+		: m_Model(model)
+		, m_Pool(std::make_shared<ThreadPool>(numWorkers))
+		, m_Replicas(numWorkers)
+		, m_ShardBegins(numWorkers)
+		, m_ShardSizes(numWorkers)
+		, m_Losses(numWorkers)
+		, m_MaxBatchSize(maxBatchSize)
+		, m_Mode(mode)
+	{
+		if (mode == TrainerMode::Hogwild)
+		{
+			MML_ASSERT(!model.m_Optimizer, "Hogwild workers step with plain SGD, the model's optimizer is ignored!");
+		}
+		else if (model.m_Description.FusedUpdate)
+		{
+			MML_ASSERT(false, "Fused updates cannot be all-reduced, switching them off!");
+			model.setFusedUpdate(false);
+		}
+
+		// Each replica is built on its own thread so its buffers are first touched there.
+		// Hogwild workers run whole mini-batches of their own.
+		size_t shardSize = mode == TrainerMode::Hogwild ? maxBatchSize : (maxBatchSize + numWorkers - 1) / numWorkers;
+		m_Pool->run([&](size_t k) {
+			m_Replicas[k] = std::make_shared<Sequential>(model, shardSize);
+		});
+	}
+
+	float ParallelTrainer::step(const Tensor &inputs, const Tensor &expected, size_t batchSize)
+	{
+		MML_ASSERT(batchSize > 0 && batchSize <= m_MaxBatchSize, "Batch exceeds the maximum batch size!");
+
+		size_t numWorkers = m_Replicas.size();
+		size_t inChannels = m_Model.m_Shapes.front()[0];
+		size_t outChannels = m_Model.m_Shapes.back()[0];
+
+		for (size_t k = 0; k < numWorkers; ++k)
+		{
+			m_ShardBegins[k] = batchSize * k / numWorkers;
+			m_ShardSizes[k] = batchSize * (k + 1) / numWorkers - m_ShardBegins[k];
+		}
+
+		m_Pool->run([&](size_t k) {
+			m_Losses[k] = 0.0f;
+			if (m_ShardSizes[k] == 0)
+			{
+				return;
+			}
+
+			Sequential &replica = *m_Replicas[k];
+			const Tensor shardInputs = Tensor::slice(inputs, m_ShardBegins[k] * inChannels, m_ShardSizes[k] * inChannels);
+			const Tensor shardExpected = Tensor::slice(expected, m_ShardBegins[k] * outChannels, m_ShardSizes[k] * outChannels);
+
+			replica.feedForward(shardInputs, m_ShardSizes[k]);
+			if (m_Mode == TrainerMode::Hogwild)
+			{
+				m_Losses[k] = replica.feedBackward(shardExpected);
+				return;
+			}
+
+			replica.zeroGrad();
+			m_Losses[k] = replica.backward(shardExpected);
+		});
+
+		if (m_Mode == TrainerMode::Synchronous)
+		{
+			m_Pool->run([&](size_t threadIndex) {
+				reduceDeltas(threadIndex, batchSize);
+			});
+			m_Model.step();
+		}
+		syncBuffers(batchSize);
+
+		float loss = 0.0f;
+		for (size_t k = 0; k < numWorkers; ++k)
+		{
+			loss += m_Losses[k] * static_cast<float>(m_ShardSizes[k]) / static_cast<float>(batchSize);
+		}
+
+		return loss;
+	}
+
+	float ParallelTrainer::epoch(const Tensor &inputs, const Tensor &expected, size_t numSamples, size_t batchSize, uint64_t seed)
+	{
+		MML_ASSERT(batchSize > 0 && batchSize <= m_MaxBatchSize, "Batch exceeds the maximum batch size!");
+
+		std::vector<size_t> order(numSamples);
+		for (size_t i = 0; i < numSamples; ++i)
+		{
+			order[i] = i;
+		}
+		std::mt19937_64 rng(seed);
+		std::shuffle(order.begin(), order.end(), rng);
+
+		if (m_Mode == TrainerMode::Hogwild)
+		{
+			return epochHogwild(inputs, expected, order, batchSize);
+		}
+
+		size_t inChannels = inputs.channels() / numSamples;
+		size_t outChannels = expected.channels() / numSamples;
+		Tensor batchInputs(batchSize * inChannels, inputs.rows(), inputs.cols());
+		Tensor batchExpected(batchSize * outChannels, expected.rows(), expected.cols());
+
+		float loss = 0.0f;
+		for (size_t begin = 0; begin < numSamples; begin += batchSize)
+		{
+			size_t size = std::min(batchSize, numSamples - begin);
+			gatherSamples(inputs, expected, numSamples, &order[begin], size, batchInputs, batchExpected);
+
+			loss += step(batchInputs, batchExpected, size) * static_cast<float>(size);
+		}
+
+		return loss / static_cast<float>(numSamples);
+	}
+
+	float ParallelTrainer::epochHogwild(const Tensor &inputs, const Tensor &expected, const std::vector<size_t> &order, size_t batchSize)
+	{
+		size_t numSamples = order.size();
+		size_t numWorkers = m_Replicas.size();
+
+		for (size_t k = 0; k < numWorkers; ++k)
+		{
+			m_ShardBegins[k] = numSamples * k / numWorkers;
+			m_ShardSizes[k] = numSamples * (k + 1) / numWorkers - m_ShardBegins[k];
+		}
+
+		m_Pool->run([&](size_t k) {
+			Sequential &replica = *m_Replicas[k];
+			size_t inChannels = inputs.channels() / numSamples;
+			size_t outChannels = expected.channels() / numSamples;
+
+			// Gathered on the worker's own thread, so the batches stay in its cache
+			Tensor batchInputs(batchSize * inChannels, inputs.rows(), inputs.cols());
+			Tensor batchExpected(batchSize * outChannels, expected.rows(), expected.cols());
+
+			float loss = 0.0f;
+			size_t end = m_ShardBegins[k] + m_ShardSizes[k];
+			for (size_t begin = m_ShardBegins[k]; begin < end; begin += batchSize)
+			{
+				size_t size = std::min(batchSize, end - begin);
+				gatherSamples(inputs, expected, numSamples, &order[begin], size, batchInputs, batchExpected);
+
+				replica.feedForward(batchInputs, size);
+				loss += replica.feedBackward(batchExpected) * static_cast<float>(size);
+			}
+
+			m_Losses[k] = loss;
+		});
+
+		syncBuffers(numSamples);
+
+		float loss = 0.0f;
+		for (size_t k = 0; k < numWorkers; ++k)
+		{
+			loss += m_Losses[k];
+		}
+
+		return loss / static_cast<float>(numSamples);
+	}
+
+	void ParallelTrainer::reduceDeltas(size_t threadIndex, size_t batchSize)
+	{
+		Tensor &deltas = m_Model.m_DeltaArena;
+		size_t numWorkers = m_Replicas.size();
+		size_t numLines = (deltas.size() + k_LineFloats - 1) / k_LineFloats;
+
+		size_t begin = std::min(numLines * threadIndex / numWorkers * k_LineFloats, deltas.size());
+		size_t end = std::min(numLines * (threadIndex + 1) / numWorkers * k_LineFloats, deltas.size());
+		if (begin == end)
+		{
+			return;
+		}
+
+		// Replicas average over their own shard, so weighting by the shard's share of the batch
+		// gives the batch average. Summing in replica order keeps the result deterministic.
+		Tensor chunk = Tensor::view(deltas, begin, 1, 1, end - begin);
+		chunk.fill(0.0f);
+		for (size_t k = 0; k < numWorkers; ++k)
+		{
+			if (m_ShardSizes[k] == 0)
+			{
+				continue;
+			}
+
+			float weight = static_cast<float>(m_ShardSizes[k]) / static_cast<float>(batchSize);
+			Tensor::aMinusXMultB(chunk, Tensor::view(m_Replicas[k]->m_DeltaArena, begin, 1, 1, end - begin), -weight, chunk);
+		}
+	}
+
+	void ParallelTrainer::syncBuffers(size_t batchSize)
+	{
+		for (size_t i = 0; i < m_Model.m_Layers.size(); ++i)
+		{
+			std::vector<Tensor *> buffers = m_Model.m_Layers[i]->buffers();
+
+			for (size_t j = 0; j < buffers.size(); ++j)
+			{
+				Tensor &buffer = *buffers[j];
+				buffer.fill(0.0f);
+
+				for (size_t k = 0; k < m_Replicas.size(); ++k)
+				{
+					if (m_ShardSizes[k] > 0)
+					{
+						float weight = static_cast<float>(m_ShardSizes[k]) / static_cast<float>(batchSize);
+						Tensor::aMinusXMultB(buffer, *m_Replicas[k]->m_Layers[i]->buffers()[j], -weight, buffer);
+					}
+				}
+				for (size_t k = 0; k < m_Replicas.size(); ++k)
+				{
+					*m_Replicas[k]->m_Layers[i]->buffers()[j] = buffer;
+				}
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -1,11 +1,51 @@
 #include "maxml/MmlSequential.h"
 #include "MmlLayer.h"
-#include "MmlSerialization.h"
+#include "MmlOptimizer.h"
+#include "MmlThreadPool.h"
+#include "MmlMemoryPlanner.h"
+#include "MmlModelIR.h"
+#include "MmlAutotuner.h"
 #include "MmlUtils.h"
 
 namespace maxml
 {
-	static constexpr uint16_t k_MagicNumber = 0xBEEF;
+	static std::array<size_t, 3> layoutShape(const std::array<size_t, 3> &shape, TensorLayout layout)
+	{
+		if (layout == TensorLayout::NCHW8c)
+		{
+			return { (shape[0] + Tensor::k_BlockSize - 1) / Tensor::k_BlockSize, shape[1], shape[2] * Tensor::k_BlockSize };
+		}
+
+		return shape;
+	}
+
+	static void reorder(const Tensor &src, TensorLayout srcLayout, Tensor &dst, TensorLayout dstLayout, size_t batchSize)
+	{
+		if (srcLayout == dstLayout)
+		{
+			Tensor::copy(src, dst);
+			return;
+		}
+
+		// Channel blocks never straddle two samples
+		size_t srcChannels = src.channels() / batchSize;
+		size_t dstChannels = dst.channels() / batchSize;
+
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			const Tensor src_n = Tensor::slice(src, n * srcChannels, srcChannels);
+			Tensor dst_n = Tensor::slice(dst, n * dstChannels, dstChannels);
+
+			if (dstLayout == TensorLayout::NCHW8c)
+			{
+				Tensor::toBlocked(src_n, dst_n);
+			}
+			else
+			{
+				Tensor::fromBlocked(src_n, dst_n);
+			}
+		}
+	}
 
 	InputDesc makeInput(size_t channels, size_t rows, size_t cols)
 	{
@@ -32,542 +72,830 @@ namespace maxml
 		return {};
 	}
 
+	BatchNormDesc makeBatchNorm(ActivationFunc activFunc)
+	{
+		BatchNormDesc desc;
+		desc.ActivFunc = activFunc;
+		return desc;
+	}
+
+	FactorizedFullyConnectedDesc makeFactorizedFullyConnected(size_t numOutputs, size_t rank, ActivationFunc activFunc)
+	{
+		return { numOutputs, rank, activFunc };
+	}
+
 	Sequential::Sequential(const SequentialDesc &description)
 	{
-		construct(description);
+		ModelIR ir = makeIR(description);
+		construct(ir);
 	}
 
-	Sequential::Sequential(const std::string &path)
+	Sequential::Sequential(const std::string &path, size_t maxBatchSize, ModelMode mode)
 	{
-		construct(path);
+		ModelIR ir = readIR(path);
+		ir.Description.MaxBatchSize = maxBatchSize;
+		ir.Description.Mode = mode;
+
+		construct(ir);
 	}
 
-	const Tensor &Sequential::feedForward(const Tensor &input)
+	Sequential::Sequential(Sequential &master, size_t maxBatchSize)
+		: m_Shapes(master.m_Shapes)
+		, m_DescLayers(master.m_DescLayers)
+		, m_Description(master.m_Description)
 	{
-		dataInputAt(0) = input;
+		m_Description.MaxBatchSize = maxBatchSize;
+		m_Description.TensorParallelThreads = 1;
 
-		for (auto it = m_Layers.begin(); it != m_Layers.end(); ++it)
+		for (const std::shared_ptr<Layer> &layer : master.m_Layers)
 		{
-			std::shared_ptr<Layer> currentLayer = *it;
-			size_t currIdx = static_cast<size_t>(it - m_Layers.begin());
-
-			currentLayer->forward(
-				dataInputAt(currIdx),
-				dataOutputAt(currIdx));
+			m_Layers.push_back(layer->clone());
 		}
 
-		return *m_Data.back().second;
+		// Replicas never step, so they get arenas but no optimizer
+		Tensor &arena = master.m_ParameterArena;
+		m_ParameterArena = Tensor::view(arena, arena.channels(), arena.rows(), arena.cols());
+
+		buildArenas();
+		relink();
 	}
 
-	float Sequential::feedBackward(const Tensor &expected)
+	Sequential::Sequential(const std::shared_ptr<const Sequential> &weights, size_t maxBatchSize)
+		: m_Shapes(weights->m_Shapes)
+		, m_DescLayers(weights->m_DescLayers)
+		, m_Description(weights->m_Description)
 	{
-		size_t lastLayerIdx = m_Layers.size() - 1;
-		size_t numOutputs = deltaOutputAt(lastLayerIdx).rows();
-		float error = std::numeric_limits<float>::infinity();
+		m_Description.MaxBatchSize = maxBatchSize;
+		m_Description.TensorParallelThreads = 1;
+		m_Description.Mode = ModelMode::Inference;
+
+		// Kernel variants come with the shared layers, tuning would benchmark copies of them
+		m_Description.TuningCachePath.clear();
+
+		// Each shared layer keeps its own scratch and views the parameters, buffers and packed
+		// parameters of its model. Layers the model keeps nothing packed for, in training mode
+		// or partitioned, read the parameters as they are rather than packing a copy.
+		for (const std::shared_ptr<const Layer> &layer : weights->m_Layers)
+		{
+			std::shared_ptr<Layer> session = layer->share();
+			session->ForwardOnly = true;
+			session->releaseBackward();
+
+			m_Layers.push_back(session);
+		}
 
-		if (m_Description.ObjectiveFunc == LossFunc::MSE)
+		relink();
+	}
+
+	const Tensor &Sequential::feedForward(const Tensor &inputs, size_t batchSize)
+	{
+		if (m_Description.Mode == ModelMode::Inference)
 		{
-			Tensor::sub(dataOutputAt(lastLayerIdx), expected, deltaOutputAt(lastLayerIdx));
-			error = Tensor::sumWith(deltaOutputAt(lastLayerIdx), [](float x) {
-				return x * x;
-			}) * (1.0f / static_cast<float>(numOutputs));
+			return predict(inputs, batchSize);
 		}
-		else if (m_Description.ObjectiveFunc == LossFunc::CrossEntropy)
+
+		MML_ASSERT(batchSize > 0 && batchSize <= m_Description.MaxBatchSize, "Batch exceeds the maximum batch size!");
+
+		Tensor dataInput = batchView(dataInputAt(0), 0, m_Layers.front()->Layout, batchSize);
+		reorder(inputs, TensorLayout::NCHW, dataInput, m_Layers.front()->Layout, batchSize);
+
+		for (size_t currIdx = 0; currIdx < m_Layers.size(); ++currIdx)
 		{
-			Tensor::zipWith(dataOutputAt(lastLayerIdx), expected, [](float x, float y) {
-				return -y / x;
-			}, deltaOutputAt(lastLayerIdx));
-			error = -Tensor::sumWith(dataOutputAt(lastLayerIdx), expected, [](float x, float y) {
-				return y * std::log(x);
-			});			
+			forwardLayer(currIdx, batchSize);
 		}
 
-		for (auto it = m_Layers.rbegin(); it != m_Layers.rend(); ++it)
+		m_BatchSize = batchSize;
+		m_Output = batchView(*m_Data.back().second, m_Layers.size(), TensorLayout::NCHW, batchSize);
+
+		return m_Output;
+	}
+
+	const Tensor &Sequential::predict(const Tensor &inputs, size_t batchSize)
+	{
+		MML_ASSERT(batchSize > 0 && batchSize <= m_Description.MaxBatchSize, "Batch exceeds the maximum batch size!");
+
+		Tensor dataInput = batchView(dataInputAt(0), 0, m_Layers.front()->Layout, batchSize);
+		reorder(inputs, TensorLayout::NCHW, dataInput, m_Layers.front()->Layout, batchSize);
+
+		auto chainIt = m_TiledChains.begin();
+		for (size_t currIdx = 0; currIdx < m_Layers.size();)
 		{
-			std::shared_ptr<Layer> currentLayer = *it;
-			size_t currIdx = static_cast<size_t>(m_Layers.rend() - it - 1);
+			if (chainIt != m_TiledChains.end() && chainIt->LayerIndex == currIdx)
+			{
+				forwardTiled(static_cast<size_t>(chainIt - m_TiledChains.begin()), batchSize);
 
-			currentLayer->backward(
-				dataInputAt(currIdx),
-				dataOutputAt(currIdx),
-				deltaInputAt(currIdx),
-				deltaOutputAt(currIdx));
-			currentLayer->update(m_Description.LearningRate);
+				currIdx += chainIt->NumLayers;
+				++chainIt;
+				continue;
+			}
+
+			forwardLayer(currIdx, batchSize);
+			++currIdx;
 		}
 
+		m_BatchSize = batchSize;
+		m_Output = batchView(*m_Data.back().second, m_Layers.size(), TensorLayout::NCHW, batchSize);
+
+		return m_Output;
+	}
+
+	float Sequential::feedBackward(const Tensor &expected)
+	{
+		float error = backward(expected);
+		step();
+		zeroGrad();
+
 		return error;
 	}
 
-	void Sequential::save(const std::string &path)
+	float Sequential::backward(const Tensor &expected, const std::function<void(size_t)> &layerDone)
 	{
-		BinaryWriter bw(path);
+		if (m_Description.Mode == ModelMode::Inference)
+		{
+			MML_ASSERT(false, "Inference models cannot run backward!");
+			return std::numeric_limits<float>::infinity();
+		}
+
+		size_t lastLayerIdx = m_Layers.size() - 1;
+		Tensor outputDelta = batchView(deltaOutputAt(lastLayerIdx), m_Layers.size(), TensorLayout::NCHW, m_BatchSize);
 
-		bw.write(k_MagicNumber);
-		bw.write(m_Description.ObjectiveFunc);
-		bw.write(m_Description.LearningRate);
+		float error = lossDelta(m_Description.ObjectiveFunc, m_Output, expected, outputDelta, m_BatchSize);
 
-		size_t layerIndex = 0;
-		for (auto it  = m_Description.LayerDescs.begin();
-		          it != m_Description.LayerDescs.end()  ; it++)
+		// Segments before the last kept only their checkpoint, so each is recomputed from it
+		// right before its layers run backward
+		for (size_t k = m_SegmentBegins.size(); k-- > 0;)
 		{
-			// Layer type encoded using index
-			uint64_t descVariantIndex = it->index();
-			bw.write(descVariantIndex);
+			size_t begin = m_SegmentBegins[k];
+			size_t end = k + 1 < m_SegmentBegins.size() ? m_SegmentBegins[k + 1] : m_Layers.size();
 
-			if (std::holds_alternative<InputDesc>(*it))
+			if (end < m_Layers.size())
 			{
-				InputDesc inpLayerDesc = std::get<InputDesc>(*it);
-				bw.write(inpLayerDesc);
+				recomputeSegment(begin, end);
 			}
-			else if (std::holds_alternative<FullyConnectedDesc>(*it))
-			{
-				FullyConnectedDesc fcLayerDesc = std::get<FullyConnectedDesc>(*it);
-				bw.write(fcLayerDesc);
 
-				FullyConnectedLayer *fcLayer = static_cast<FullyConnectedLayer *>(
-					m_Layers[layerIndex].get()
-				);
-				bw.write(fcLayer->Weights);
-				bw.write(fcLayer->Biases);
+			for (size_t currIdx = end; currIdx-- > begin;)
+			{
+				backwardLayer(currIdx);
 
-				layerIndex += 2;
+				if (layerDone)
+				{
+					layerDone(currIdx);
+				}
 			}
-			else if (std::holds_alternative<ConvolutionalDesc>(*it))
-			{
-				ConvolutionalDesc convLayerDesc = std::get<ConvolutionalDesc>(*it);
-				bw.write(convLayerDesc);
+		}
 
-				ConvolutionalLayer *convLayer = static_cast<ConvolutionalLayer *>(
-					m_Layers[layerIndex].get()
-				);
-				bw.write(convLayer->KernelWindowed);
+		return error;
+	}
 
-				layerIndex += 2;
-			}
-			else if (std::holds_alternative<PoolingDesc>(*it))
+	void Sequential::step()
+	{
+		// Plain SGD needs no state, so the deltas are applied in one pass over the arenas, or by
+		// each remaining layer when fused layers leave the arenas out of step
+		if (!m_Optimizer)
+		{
+			if (!m_Description.FusedUpdate)
 			{
-				PoolingDesc poolLayerDesc = std::get<PoolingDesc>(*it);
-				bw.write(poolLayerDesc);
-
-				layerIndex += 1;
+				Tensor::aMinusXMultB(m_ParameterArena, m_DeltaArena, m_Description.LearningRate, m_ParameterArena);
+				return;
 			}
-			else if (std::holds_alternative<FlattenDesc>(*it))
-			{
-				FlattenDesc flattenLayerDesc = std::get<FlattenDesc>(*it);
-				bw.write(flattenLayerDesc);
 
-				layerIndex += 1;
-			}
-			else
+			for (std::shared_ptr<Layer> &layer : m_Layers)
 			{
-				MML_ASSERT(false, "Unhandled layer description!");
-				layerIndex += 1;
+				if (!layer->FusedUpdate)
+				{
+					layer->update(m_Description.LearningRate);
+				}
 			}
+			return;
 		}
 
-		bw.write(k_MagicNumber);
+		m_Optimizer->step(m_Description.LearningRate);
+	}
+
+	void Sequential::zeroGrad()
+	{
+		m_DeltaArena.fill(0.0f);
+	}
+
+	void Sequential::setOptimizer(const OptimizerDesc &optimizer)
+	{
+		m_Description.Optimizer = optimizer;
+
+		buildOptimizer();
 	}
 
-	void Sequential::construct(const std::string &path)
+	void Sequential::setFusedUpdate(bool fused)
 	{
-		BinaryReader br(path);
+		m_Description.FusedUpdate = fused;
 
-		uint16_t magicNumber;
-		br.read(magicNumber);
-		if (magicNumber != k_MagicNumber)
+		buildOptimizer();
+	}
+
+	void Sequential::buildOptimizer()
+	{
+		// Inference models keep their parameters in the layers and never step
+		if (m_Description.Mode == ModelMode::Inference)
 		{
-			MML_ASSERT(false, "Invalid sequential model file !");
+			m_Optimizer.reset();
+			for (std::shared_ptr<Layer> &layer : m_Layers)
+			{
+				layer->ForwardOnly = true;
+				layer->releaseBackward();
+				layer->prepack();
+			}
+			return;
 		}
 
-		SequentialDesc description;
+		const OptimizerDesc &optimizer = m_Description.Optimizer;
+		bool plainSgd = optimizer.Func == OptimizerFunc::SGD && optimizer.WeightDecay == 0.0f;
 
-		size_t inChannels = 0;
-		size_t inRows = 0;
-		size_t inCols = 0;
+		MML_ASSERT(plainSgd || !m_Description.FusedUpdate, "Fused updates require plain SGD, falling back to separate steps!");
+		bool fused = plainSgd && m_Description.FusedUpdate;
 
-		size_t outChannels = 0;
-		size_t outRows = 0;
-		size_t outCols = 0;
+		// Fused layers step themselves during backward, so the arenas leave out their deltas
+		for (std::shared_ptr<Layer> &layer : m_Layers)
+		{
+			if (layer->canFuseUpdate())
+			{
+				layer->FusedUpdate = fused;
+				layer->FusedLearningRate = m_Description.LearningRate;
+			}
+		}
 
-		auto MakeInputOutputPair = [&]() {
-			m_Data.push_back(std::make_pair(
-				m_Data.empty()
-				? std::make_shared<Tensor>(inChannels, inRows, inCols)
-				: m_Data.back().second,
-				std::make_shared<Tensor>(outChannels, outRows, outCols)
-			));
-		};
+		// The optimizer holds views of the arenas, so it goes before they are replaced
+		m_Optimizer.reset();
+		buildArenas();
 
-		auto MakeDeltaInputOutputPair = [&]() {
-			m_Delta.push_back(std::make_pair(
-				m_Delta.empty()
-				? std::make_shared<Tensor>(inChannels, inRows, inCols)
-				: m_Delta.back().second,
-				std::make_shared<Tensor>(outChannels, outRows, outCols)
-			));
-		};
+		// The new arenas were first touched here, so partitions move their rows over again
+		if (m_Pool)
+		{
+			partitionLayers();
+		}
+
+		if (!plainSgd)
+		{
+			m_Optimizer = std::make_shared<Optimizer>(optimizer, m_ParameterArena, m_DeltaArena);
+		}
+	}
+
+	void Sequential::buildArenas()
+	{
+		std::vector<Layer *> layers;
+		for (std::shared_ptr<Layer> &layer : m_Layers)
+		{
+			layers.push_back(layer.get());
+		}
+		maxml::buildArenas(layers, m_ParameterArena, m_DeltaArena);
+	}
 
-		br.read(description.ObjectiveFunc);
-		br.read(description.LearningRate);
+	void Sequential::backwardLayer(size_t index)
+	{
+		Layer *layer = m_Layers[index].get();
+		TensorLayout layout = layer->Layout;
+
+		Tensor deltaInput = batchView(deltaInputAt(index), index, layout, m_BatchSize);
+		layer->backwardBatch(
+			batchView(dataInputAt(index), index, layout, m_BatchSize),
+			batchView(dataOutputAt(index), index + 1, layout, m_BatchSize),
+			deltaInput,
+			batchView(deltaOutputAt(index), index + 1, layout, m_BatchSize),
+			m_BatchSize);
+
+		if (index > 0 && m_Delta[index].first != m_Delta[index - 1].second)
+		{
+			TensorLayout prevLayout = m_Layers[index - 1]->Layout;
+			Tensor prevDeltaOutput = batchView(deltaOutputAt(index - 1), index, prevLayout, m_BatchSize);
+			reorder(deltaInput, layout, prevDeltaOutput, prevLayout, m_BatchSize);
+		}
+	}
 
-		while (true)
+	void Sequential::recomputeSegment(size_t begin, size_t end)
+	{
+		// Running statistics were already updated by the forward pass
+		std::vector<Tensor> saved;
+		for (size_t i = begin; i < end; ++i)
 		{
-			br.peek(magicNumber);
-			if (magicNumber == k_MagicNumber)
+			for (Tensor *buffer : m_Layers[i]->buffers())
 			{
-				break;
+				saved.push_back(*buffer);
 			}
+		}
 
-			// Layer desc type encoded using index
-			uint64_t descVariantIndex;
-			br.read(descVariantIndex);
+		for (size_t i = begin; i < end; ++i)
+		{
+			forwardLayer(i, m_BatchSize);
+		}
 
-			if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, InputDesc>())
+		size_t savedIndex = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			for (Tensor *buffer : m_Layers[i]->buffers())
 			{
-				InputDesc inpLayerDesc;
-				br.read(inpLayerDesc);
-				description.LayerDescs.push_back(inpLayerDesc);
+				Tensor::copy(saved[savedIndex++], *buffer);
+			}
+		}
+	}
+
+	void Sequential::planSegments()
+	{
+		m_SegmentBegins = { 0 };
+		if (m_Description.Mode == ModelMode::Inference)
+		{
+			return;
+		}
+
+		std::vector<size_t> checkpoints(m_Description.Checkpoints.begin(), m_Description.Checkpoints.end());
+		std::sort(checkpoints.begin(), checkpoints.end());
 
-				inChannels = inpLayerDesc.Channels;
-				inRows = inpLayerDesc.Rows;
-				inCols = inpLayerDesc.Cols;
+		for (size_t checkpoint : checkpoints)
+		{
+			if (checkpoint + 1 >= m_DescLayers.size())
+			{
+				break;
+			}
 
-				outChannels = inpLayerDesc.Channels;
-				outRows = inpLayerDesc.Rows;
-				outCols = inpLayerDesc.Cols;
+			// In-place layers would overwrite the checkpoint when their segment is recomputed
+			size_t begin = m_DescLayers[checkpoint + 1];
+			while (begin < m_Layers.size() && m_Layers[begin]->inPlace())
+			{
+				++begin;
 			}
-			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, FullyConnectedDesc>())
+			if (begin > m_SegmentBegins.back() && begin < m_Layers.size())
 			{
-				FullyConnectedDesc fcLayerDesc;
-				br.read(fcLayerDesc);
-				description.LayerDescs.push_back(fcLayerDesc);
+				m_SegmentBegins.push_back(begin);
+			}
+		}
+	}
 
-				Tensor weights, biases;
-				br.read(weights);
-				br.read(biases);
+	void Sequential::setCheckpoints(const std::vector<size_t> &checkpoints)
+	{
+		m_Description.Checkpoints.assign(checkpoints.begin(), checkpoints.end());
 
-				size_t numInputs = outRows;
-				size_t numOutputs = fcLayerDesc.NumOutputs;
-				ActivationFunc activFunc = fcLayerDesc.ActivFunc;
+		relink();
+	}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+	void Sequential::setAutoCheckpoints()
+	{
+		// Segments of about sqrt(n) layers keep O(sqrt(n)) activations alive at once
+		size_t numDescs = m_Description.LayerDescs.size();
+		size_t spacing = std::max<size_t>(static_cast<size_t>(std::lround(std::sqrt(static_cast<double>(numDescs - 1)))), 1);
 
-				outChannels = 1;
-				outRows = numOutputs;
-				outCols = 1;
+		std::vector<size_t> checkpoints;
+		for (size_t descIndex = spacing; descIndex + 1 < numDescs; descIndex += spacing)
+		{
+			checkpoints.push_back(descIndex);
+		}
 
-				// Fully connected layer
-				{
-					m_Layers.push_back(std::make_shared<FullyConnectedLayer>(std::move(weights), std::move(biases)));
+		// Recomputation buffers can outweigh what the segments free on short or uneven
+		// models, so the checkpoints are kept only when they shrink the plan
+		setCheckpoints({});
+		size_t plainBytes = activationBytes();
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
-				}
+		setCheckpoints(checkpoints);
+		if (activationBytes() > plainBytes)
+		{
+			setCheckpoints({});
+		}
+	}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+	void Sequential::forwardLayer(size_t index, size_t batchSize)
+	{
+		Layer *layer = m_Layers[index].get();
 
-				// Activation
-				{
-					m_Layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+		Tensor input = batchView(dataInputAt(index), index, layer->Layout, batchSize);
+		Tensor output = batchView(dataOutputAt(index), index + 1, layer->Layout, batchSize);
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
-				}
-			}
-			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, ConvolutionalDesc>())
-			{
-				ConvolutionalDesc convLayerDesc;
-				br.read(convLayerDesc);
-				description.LayerDescs.push_back(convLayerDesc);
+		if (index > 0 && m_Data[index].first != m_Data[index - 1].second)
+		{
+			TensorLayout prevLayout = m_Layers[index - 1]->Layout;
+			reorder(batchView(dataOutputAt(index - 1), index, prevLayout, batchSize), prevLayout, input, layer->Layout, batchSize);
+		}
+
+		layer->forwardBatch(input, output, batchSize);
+	}
 
-				size_t kernelChannels = convLayerDesc.NumKernels;
-				size_t kernelRows = convLayerDesc.KernelWidth;
-				size_t kernelCols = convLayerDesc.KernelHeight;
-				ActivationFunc activFunc = convLayerDesc.ActivFunc;
+	Tensor Sequential::batchView(Tensor &tensor, size_t shapeIndex, TensorLayout layout, size_t batchSize) const
+	{
+		std::array<size_t, 3> shape = layoutShape(m_Shapes[shapeIndex], layout);
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+		return Tensor::view(tensor, batchSize * shape[0], shape[1], shape[2]);
+	}
 
-				outChannels = kernelChannels;
-				outRows = (inRows - kernelRows) + 1;
-				outCols = (inCols - kernelCols) + 1;
+	void Sequential::save(const std::string &path)
+	{
+		writeIR(toIR(false), path);
+	}
 
-				// Convolutional layer
-				{
-					Tensor kernelWindowed;
-					br.read(kernelWindowed);
+	void Sequential::construct(ModelIR &ir)
+	{
+		optimizeIR(ir);
+		lowerIR(ir, m_Layers, m_Shapes, m_DescLayers);
 
-					m_Layers.push_back(std::make_shared<ConvolutionalLayer>(
-						inChannels, outRows, outCols, kernelChannels, kernelRows, kernelRows, kernelWindowed
-					));
+		m_Description = ir.Description;
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
+		// Inference models only ever read the running statistics of what was not folded
+		if (m_Description.Mode == ModelMode::Inference)
+		{
+			for (std::shared_ptr<Layer> &layer : m_Layers)
+			{
+				if (BatchNormLayer *bnLayer = dynamic_cast<BatchNormLayer *>(layer.get()))
+				{
+					bnLayer->Training = false;
 				}
+			}
+		}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+		buildOptimizer();
+		relink();
+	}
 
-				// Activation
-				{
-					m_Layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+	ModelIR Sequential::toIR(bool moveTensors)
+	{
+		ModelIR ir = makeIR(m_Description);
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
-				}
+		for (size_t descIndex = 0; descIndex < ir.Nodes.size(); ++descIndex)
+		{
+			if (m_DescLayers[descIndex] == m_DescLayers[descIndex + 1])
+			{
+				continue;
 			}
-			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, PoolingDesc>())
+
+			auto Take = [&](Tensor &tensor) {
+				return moveTensors ? std::move(tensor) : Tensor::view(tensor, tensor.channels(), tensor.rows(), tensor.cols());
+			};
+
+			for (size_t i = m_DescLayers[descIndex]; i < m_DescLayers[descIndex + 1]; ++i)
 			{
-				PoolingDesc poolLayerDesc;
-				br.read(poolLayerDesc);
-				description.LayerDescs.push_back(poolLayerDesc);
+				Layer *layer = m_Layers[i].get();
+				for (Parameter &param : layer->parameters())
+				{
+					ir.Nodes[descIndex].Tensors.push_back(Take(*param.Value));
+				}
+				for (Tensor *buffer : layer->buffers())
+				{
+					ir.Nodes[descIndex].Tensors.push_back(Take(*buffer));
+				}
+			}
+		}
+
+		inferShapes(ir);
+		removeIdentities(ir);
+		selectLayouts(ir);
 
-				size_t tileWidth = poolLayerDesc.TileWidth;
-				size_t tileHeight = poolLayerDesc.TileHeight;
+		return ir;
+	}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+	void Sequential::foldBatchNorm()
+	{
+		// The optimizer holds views of the arenas the moved parameters may still live in
+		m_Optimizer.reset();
 
-				outChannels = outChannels;
-				outRows = ((inRows - tileWidth) / tileWidth) + 1;
-				outCols = ((inCols - tileHeight) / tileHeight) + 1;
+		ModelIR ir = toIR(true);
+		maxml::foldBatchNorm(ir);
 
-				m_Layers.push_back(std::make_shared<MaxPoolingLayer>(tileWidth, tileHeight));
+		m_Layers.clear();
+		m_Shapes.clear();
+		m_DescLayers.clear();
+		lowerIR(ir, m_Layers, m_Shapes, m_DescLayers);
 
-				MakeInputOutputPair();
-				MakeDeltaInputOutputPair();
-			}
-			else if (descVariantIndex == variantIndex<SequentialDesc::LayerDesc, FlattenDesc>())
+		m_Description = ir.Description;
+
+		// What was not folded keeps normalizing, by its running statistics
+		for (std::shared_ptr<Layer> &layer : m_Layers)
+		{
+			if (BatchNormLayer *bnLayer = dynamic_cast<BatchNormLayer *>(layer.get()))
 			{
-				FlattenDesc flattenLayerDesc;
-				br.read(flattenLayerDesc);
-				description.LayerDescs.push_back(flattenLayerDesc);
-				
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
-
-				outChannels = 1;
-				outRows = inChannels * inRows * inCols;
-				outCols = 1;
-
-				m_Layers.push_back(std::make_shared<FlattenLayer>());
-
-				MakeInputOutputPair();
-				MakeDeltaInputOutputPair();
+				bnLayer->Training = false;
 			}
-			else
+		}
+
+		buildOptimizer();
+		relink();
+	}
+
+	void Sequential::setLayout(TensorLayout layout)
+	{
+		m_Description.Layout = layout;
+
+		// Picked on an IR that only views the layers' tensors
+		ModelIR ir = toIR(false);
+		applyLayouts(ir, m_Layers, m_DescLayers);
+
+		relink();
+	}
+
+	void Sequential::setTensorParallelism(size_t numThreads)
+	{
+		m_Description.TensorParallelThreads = numThreads;
+
+		partitionLayers();
+		tuneKernels();
+	}
+
+	void Sequential::autotune(const std::string &cachePath)
+	{
+		m_Description.TuningCachePath = cachePath;
+
+		tuneKernels();
+	}
+
+	void Sequential::partitionLayers()
+	{
+		size_t numThreads = std::max<size_t>(m_Description.TensorParallelThreads, 1);
+		if (!m_Pool || m_Pool->size() != numThreads)
+		{
+			m_Pool = numThreads > 1 ? std::make_shared<ThreadPool>(numThreads, true) : nullptr;
+		}
+
+		for (std::shared_ptr<Layer> &layer : m_Layers)
+		{
+			if (FullyConnectedLayer *fcLayer = dynamic_cast<FullyConnectedLayer *>(layer.get()))
 			{
-				MML_ASSERT(false, "Unhandled layer description!");
+				bool wide = fcLayer->Weights.size() * sizeof(float) >= MML_TENSOR_PARALLEL_MIN_BYTES;
+				bool split = fcLayer->Variant == KernelVariant::Default ? wide : fcLayer->Variant == KernelVariant::Partitioned;
+				fcLayer->partition(split ? m_Pool : nullptr, m_Description.MaxBatchSize);
 			}
 		}
-
-		m_Description = description;
 	}
 
-	void Sequential::construct(const SequentialDesc &description)
+	void Sequential::tuneKernels()
 	{
-		m_Description = description;
+		if (m_Description.TuningCachePath.empty())
+		{
+			return;
+		}
 
-		size_t inChannels = 0;
-		size_t inRows = 0;
-		size_t inCols = 0;
+		Autotuner tuner(m_Description.TuningCachePath);
+		bool training = m_Description.Mode == ModelMode::Training;
 
-		size_t outChannels = 0;
-		size_t outRows = 0;
-		size_t outCols = 0;
+		for (size_t i = 0; i < m_Layers.size(); ++i)
+		{
+			m_Layers[i]->Variant = tuner.tune(*m_Layers[i], m_Shapes[i], m_Shapes[i + 1], m_Description.MaxBatchSize, training, m_Pool);
+		}
+
+		partitionLayers();
+	}
 
-		auto MakeInputOutputPair = [&]() {
-			m_Data.push_back(std::make_pair(
-				m_Data.empty()
-				? std::make_shared<Tensor>(inChannels, inRows, inCols)
-				: m_Data.back().second,
-				std::make_shared<Tensor>(outChannels, outRows, outCols)
-			));
+	void Sequential::relink()
+	{
+		// Layers already carry the layouts selectLayouts picked, which are only applied here
+		m_Data.clear();
+		m_Delta.clear();
+
+		// Every tensor of the chains is a view of the activation arena, into a block of memory
+		// that in-place layers share with their producer. Tensors are only placed once the
+		// lifetimes of all blocks are known.
+		struct Placement
+		{
+			std::shared_ptr<Tensor> Target;
+			size_t Block;
+			std::array<size_t, 3> Shape;
 		};
+		std::vector<Placement> placements;
+		std::vector<MemoryBlock> blocks;
+
+		auto MakeTensor = [&](const std::array<size_t, 3> &shape) {
+			MemoryBlock block;
+			block.Size = shape[0] * shape[1] * shape[2];
+			blocks.push_back(block);
+			placements.push_back({ std::make_shared<Tensor>(), blocks.size() - 1, shape });
 
-		auto MakeDeltaInputOutputPair = [&]() {
-			m_Delta.push_back(std::make_pair(
-				m_Delta.empty()
-				? std::make_shared<Tensor>(inChannels, inRows, inCols)
-				: m_Delta.back().second,
-				std::make_shared<Tensor>(outChannels, outRows, outCols)
-			));
+			return placements.size() - 1;
 		};
 
-		for (auto it = m_Description.LayerDescs.begin();
-		     it != m_Description.LayerDescs.end(); it++)
-		{
-			if (std::holds_alternative<InputDesc>(*it))
+		// In-place layers share their producer's tensor, reshaped through another view if needed
+		auto MakeOutput = [&](const Layer &layer, size_t input, const std::array<size_t, 3> &shape) {
+			if (!layer.inPlace())
+			{
+				return MakeTensor(shape);
+			}
+			if (placements[input].Shape == shape)
 			{
-				MML_ASSERT(it == m_Description.LayerDescs.begin(), "Cannot have more than one input layer!");
+				return input;
+			}
+
+			placements.push_back({ std::make_shared<Tensor>(), placements[input].Block, shape });
+			return placements.size() - 1;
+		};
+
+		// Consecutive layers share tensors unless their layouts differ, then forward and
+		// backward reorder between the producer's tensor and the consumer's own
+		bool training = m_Description.Mode == ModelMode::Training;
+		size_t numLayers = m_Layers.size();
+		size_t maxBatchSize = m_Description.MaxBatchSize;
 
-				InputDesc inpLayerDesc = std::get<InputDesc>(*it);
+		std::vector<std::pair<size_t, size_t>> data;
+		std::vector<std::pair<size_t, size_t>> delta;
+		for (size_t i = 0; i < numLayers; ++i)
+		{
+			TensorLayout layout = m_Layers[i]->Layout;
+			bool reorder = i == 0 || m_Layers[i - 1]->Layout != layout;
+
+			std::array<size_t, 3> inShape = layoutShape(m_Shapes[i], layout);
+			std::array<size_t, 3> outShape = layoutShape(m_Shapes[i + 1], layout);
+			inShape[0] *= maxBatchSize;
+			outShape[0] *= maxBatchSize;
 
-				inChannels = inpLayerDesc.Channels;
-				inRows = inpLayerDesc.Rows;
-				inCols = inpLayerDesc.Cols;
+			size_t dataInput = reorder ? MakeTensor(inShape) : data.back().second;
+			data.push_back({ dataInput, MakeOutput(*m_Layers[i], dataInput, outShape) });
 
-				outChannels = inpLayerDesc.Channels;
-				outRows = inpLayerDesc.Rows;
-				outCols = inpLayerDesc.Cols;
+			if (training)
+			{
+				size_t deltaInput = reorder ? MakeTensor(inShape) : delta.back().second;
+				delta.push_back({ deltaInput, MakeOutput(*m_Layers[i], deltaInput, outShape) });
 			}
-			else if (std::holds_alternative<FullyConnectedDesc>(*it))
+		}
+
+		planTiles();
+		planSegments();
+
+		// Steps follow the order the passes touch the tensors in, forward running layer i at
+		// step i. Backward then computes the loss and walks the segments from the last one,
+		// recomputing each earlier segment from its checkpoint before running it in reverse.
+		auto Read = [&](size_t placement, size_t step) {
+			blocks[placements[placement].Block].read(step);
+		};
+		auto Write = [&](size_t placement, size_t step) {
+			blocks[placements[placement].Block].write(step);
+		};
+		auto Forward = [&](size_t i, size_t step) {
+			if (i > 0 && data[i].first != data[i - 1].second)
 			{
-				MML_ASSERT(it != m_Description.LayerDescs.begin(), "Must start with an input layer!");
+				Read(data[i - 1].second, step);
+				Write(data[i].first, step);
+			}
+			Read(data[i].first, step);
+			Write(data[i].second, step);
+		};
 
-				FullyConnectedDesc fcLayerDesc = std::get<FullyConnectedDesc>(*it);
-				size_t numInputs = outRows;
-				size_t numOutputs = fcLayerDesc.NumOutputs;
-				ActivationFunc activFunc = fcLayerDesc.ActivFunc;
+		Write(data.front().first, 0);
+		for (size_t i = 0; i < numLayers; ++i)
+		{
+			Forward(i, i);
+		}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+		// Tiled chains read their input while writing the output of their last layer
+		for (const TiledChain &chain : m_TiledChains)
+		{
+			size_t last = chain.LayerIndex + chain.NumLayers - 1;
+			Read(data[chain.LayerIndex].first, last);
+			Write(data[last].second, chain.LayerIndex);
+		}
 
-				outChannels = 1;
-				outRows = numOutputs;
-				outCols = 1;
+		size_t step = numLayers;
+		if (training)
+		{
+			Read(data.back().second, step);
+			Write(delta.back().second, step);
+
+			for (size_t k = m_SegmentBegins.size(); k-- > 0;)
+			{
+				size_t begin = m_SegmentBegins[k];
+				size_t end = k + 1 < m_SegmentBegins.size() ? m_SegmentBegins[k + 1] : numLayers;
 
-				// Fully connected layer
+				for (size_t i = begin; end < numLayers && i < end; ++i)
+				{
+					Forward(i, ++step);
+				}
+				for (size_t i = end; i-- > begin;)
 				{
-					float sigma;
-					if (activFunc == ActivationFunc::ReLU)
+					++step;
+					if (m_Layers[i]->backwardReadsInput())
 					{
-						sigma = std::sqrt(2.0f / static_cast<float>(inRows));
+						Read(data[i].first, step);
 					}
-					else
+					if (m_Layers[i]->backwardReadsOutput())
 					{
-						sigma = std::sqrt(2.0f / static_cast<float>(inRows + outRows));
+						Read(data[i].second, step);
 					}
-					std::random_device rd;
-					std::mt19937 mt(rd());
-					std::normal_distribution dist(0.0f, sigma);
-
-					Tensor weights(1, numOutputs, numInputs);
-					for (size_t i = 0; i < weights.size(); i++)
+					Read(delta[i].second, step);
+					Write(delta[i].first, step);
+					if (i > 0 && delta[i].first != delta[i - 1].second)
 					{
-						weights[i] = dist(mt);
+						Read(delta[i].first, step);
+						Write(delta[i - 1].second, step);
 					}
-					Tensor biases(1, numOutputs, 1);
-
-					m_Layers.push_back(std::make_shared<FullyConnectedLayer>(std::move(weights), std::move(biases)));
-
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
 				}
+			}
+		}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+		// The outputs stay valid until the next pass
+		Read(data.back().second, step);
 
-				// Activation
-				{
-					m_Layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+		size_t arenaSize = planMemory(blocks);
+		m_ActivationArena = arenaSize > 0 ? Tensor(1, 1, arenaSize) : Tensor();
+		for (Placement &placement : placements)
+		{
+			const std::array<size_t, 3> &shape = placement.Shape;
+			*placement.Target = Tensor::view(m_ActivationArena, blocks[placement.Block].Offset, shape[0], shape[1], shape[2]);
+		}
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
-				}
-			}
-			else if (std::holds_alternative<ConvolutionalDesc>(*it))
+		for (size_t i = 0; i < numLayers; ++i)
+		{
+			m_Data.push_back({ placements[data[i].first].Target, placements[data[i].second].Target });
+			if (training)
 			{
-				MML_ASSERT(it != m_Description.LayerDescs.begin(), "Must start with an input layer!");
+				m_Delta.push_back({ placements[delta[i].first].Target, placements[delta[i].second].Target });
+			}
+		}
 
-				ConvolutionalDesc convLayerDesc = std::get<ConvolutionalDesc>(*it);
-				size_t kernelChannels = convLayerDesc.NumKernels;
-				size_t kernelRows = convLayerDesc.KernelWidth;
-				size_t kernelCols = convLayerDesc.KernelHeight;
-				ActivationFunc activFunc = convLayerDesc.ActivFunc;
+		partitionLayers();
+		tuneKernels();
+	}
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+	size_t Sequential::activationBytes() const
+	{
+		return m_ActivationArena.size() * sizeof(float);
+	}
 
-				outChannels = kernelChannels;
-				outRows = (inRows - kernelRows) + 1;
-				outCols = (inCols - kernelCols) + 1;
+	void Sequential::planTiles()
+	{
+		m_TiledChains.clear();
 
-				// Convolutional layer
-				{
-					float sigma = std::sqrt(2.0f / static_cast<float>(outChannels * kernelRows * kernelCols));
-					std::random_device rd;
-					std::mt19937 mt(rd());
-					std::normal_distribution dist(0.0f, sigma);
+		for (size_t i = 0; i + 1 < m_Layers.size(); ++i)
+		{
+			// The activation is left out when it has no function
+			ConvolutionalLayer *convLayer = dynamic_cast<ConvolutionalLayer *>(m_Layers[i].get());
+			ActivationLayer *activLayer = dynamic_cast<ActivationLayer *>(m_Layers[i + 1].get());
+			size_t numLayers = activLayer ? 3 : 2;
 
-					Tensor kernel(kernelChannels, kernelRows, kernelCols);
-					for (size_t i = 0; i < kernel.size(); ++i)
-					{
-						kernel[i] = dist(mt);
-					}
+			if (!convLayer || i + numLayers > m_Layers.size() || convLayer->Layout != TensorLayout::NCHW
+				|| (activLayer && activLayer->ActivFunc == ActivationFunc::Softmax))
+			{
+				continue;
+			}
 
-					m_Layers.push_back(std::make_shared<ConvolutionalLayer>(inChannels, outRows, outCols, kernel));
+			MaxPoolingLayer *poolLayer = dynamic_cast<MaxPoolingLayer *>(m_Layers[i + numLayers - 1].get());
+			if (!poolLayer)
+			{
+				continue;
+			}
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
-				}
+			const std::array<size_t, 3> &convOutput = m_Shapes[i + 1];
+			const std::array<size_t, 3> &poolOutput = m_Shapes[i + numLayers];
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+			// Grow the band a pooling row at a time while its working set fits the budget
+			size_t rowBytes = convOutput[0] * convOutput[2] * sizeof(float);
+			size_t inputRowBytes = m_Shapes[i][2] * sizeof(float);
+			size_t poolRowBytes = poolOutput[0] * poolOutput[2] * sizeof(float);
 
-				// Activation
-				{
-					m_Layers.push_back(std::make_shared<ActivationLayer>(activFunc));
+			size_t bandPoolRows = 1;
+			while (bandPoolRows < poolOutput[1])
+			{
+				size_t bandRows = (bandPoolRows + 1) * poolLayer->TileWidth;
+				size_t bytes = bandRows * rowBytes
+					+ (bandRows + convLayer->KernelRows - 1) * inputRowBytes
+					+ (bandPoolRows + 1) * poolRowBytes;
 
-					MakeInputOutputPair();
-					MakeDeltaInputOutputPair();
+				if (bytes > MML_TILE_BUDGET_BYTES)
+				{
+					break;
 				}
+
+				++bandPoolRows;
 			}
-			else if (std::holds_alternative<PoolingDesc>(*it))
-			{
-				MML_ASSERT(it != m_Description.LayerDescs.begin(), "Must start with an input layer!");
 
-				PoolingDesc poolLayerDesc = std::get<PoolingDesc>(*it);
-				size_t tileWidth = poolLayerDesc.TileWidth;
-				size_t tileHeight = poolLayerDesc.TileHeight;
+			size_t bandRows = bandPoolRows * poolLayer->TileWidth;
+			m_TiledChains.push_back({ i, numLayers, bandRows, Tensor(convOutput[0], bandRows, convOutput[2]) });
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+			i += numLayers - 1;
+		}
+	}
 
-				outChannels = outChannels;
-				outRows = ((inRows - tileWidth) / tileWidth) + 1;
-				outCols = ((inCols - tileHeight) / tileHeight) + 1;
+	void Sequential::forwardTiled(size_t chainIndex, size_t batchSize)
+	{
+		TiledChain &chain = m_TiledChains[chainIndex];
 
-				m_Layers.push_back(std::make_shared<MaxPoolingLayer>(tileWidth, tileHeight));
+		size_t last = chain.LayerIndex + chain.NumLayers - 1;
+		ConvolutionalLayer *convLayer = static_cast<ConvolutionalLayer *>(m_Layers[chain.LayerIndex].get());
+		ActivationLayer *activLayer = chain.NumLayers == 3 ? static_cast<ActivationLayer *>(m_Layers[chain.LayerIndex + 1].get()) : nullptr;
+		MaxPoolingLayer *poolLayer = static_cast<MaxPoolingLayer *>(m_Layers[last].get());
 
-				MakeInputOutputPair();
-				MakeDeltaInputOutputPair();
-			}
-			else if (std::holds_alternative<FlattenDesc>(*it))
-			{
-				MML_ASSERT(it != m_Description.LayerDescs.begin(), "Must start with an input layer!");
-
-				FlattenDesc flattenLayerDesc = std::get<FlattenDesc>(*it);
+		Tensor inputs = batchView(dataInputAt(chain.LayerIndex), chain.LayerIndex, TensorLayout::NCHW, batchSize);
+		Tensor outputs = batchView(dataOutputAt(last), last + 1, TensorLayout::NCHW, batchSize);
 
-				inChannels = outChannels;
-				inRows = outRows;
-				inCols = outCols;
+		size_t inChannels = inputs.channels() / batchSize;
+		size_t outChannels = outputs.channels() / batchSize;
 
-				outChannels = 1;
-				outRows = inChannels * inRows * inCols;
-				outCols = 1;
+		// Convolution rows past the last full pooling tile are never read
+		size_t usedRows = outputs.rows() * poolLayer->TileWidth;
 
-				m_Layers.push_back(std::make_shared<FlattenLayer>());
+		for (size_t n = 0; n < batchSize; ++n)
+		{
+			const Tensor input = Tensor::slice(inputs, n * inChannels, inChannels);
+			Tensor output = Tensor::slice(outputs, n * outChannels, outChannels);
 
-				MakeInputOutputPair();
-				MakeDeltaInputOutputPair();
-			}
-			else
+			for (size_t rowBegin = 0; rowBegin < usedRows; rowBegin += chain.BandRows)
 			{
-				MML_ASSERT(false, "Unhandled layer description!");
+				size_t bandRows = std::min(chain.BandRows, usedRows - rowBegin);
+				Tensor tile = Tensor::view(chain.Tile, chain.Tile.channels(), bandRows, chain.Tile.cols());
+
+				convLayer->forwardBand(input, tile, rowBegin);
+				if (activLayer)
+				{
+					activLayer->forward(tile, tile);
+				}
+				poolLayer->forwardBand(tile, output, rowBegin / poolLayer->TileWidth);
 			}
 		}
 	}
@@ -0,0 +1,98 @@
+#include "maxml/MmlStaticSequential.h"
+#include "MmlModelIR.h"
+#include "MmlUtils.h"
+
+namespace maxml
+{
+	// A static model only has an input followed by fully connected layers
+	static bool sameLayer(const SequentialDesc::LayerDesc &a, const SequentialDesc::LayerDesc &b)
+	{
+		if (a.index() != b.index())
+		{
+			return false;
+		}
+
+		if (std::holds_alternative<InputDesc>(a))
+		{
+			const InputDesc &inpA = std::get<InputDesc>(a);
+			const InputDesc &inpB = std::get<InputDesc>(b);
+			return inpA.Channels == inpB.Channels && inpA.Rows == inpB.Rows && inpA.Cols == inpB.Cols;
+		}
+		if (std::holds_alternative<FullyConnectedDesc>(a))
+		{
+			const FullyConnectedDesc &fcA = std::get<FullyConnectedDesc>(a);
+			const FullyConnectedDesc &fcB = std::get<FullyConnectedDesc>(b);
+			return fcA.NumOutputs == fcB.NumOutputs && fcA.ActivFunc == fcB.ActivFunc;
+		}
+		return false;
+	}
+
+	void initializeStaticParameters(const SequentialDesc &description, const std::vector<float *> &parameters)
+	{
+		ModelIR ir = makeIR(description);
+		inferShapes(ir);
+		initializeParameters(ir);
+
+		size_t paramIdx = 0;
+		for (const ModelIR::Node &node : ir.Nodes)
+		{
+			for (const Tensor &tensor : node.Tensors)
+			{
+				Tensor::copy(parameters[paramIdx++], tensor.size(), tensor);
+			}
+		}
+	}
+
+	bool readStaticParameters(const std::string &path, SequentialDesc &description, const std::vector<float *> &parameters)
+	{
+		ModelIR ir = readIR(path);
+
+		bool matches = ir.Nodes.size() == description.LayerDescs.size();
+		for (size_t i = 0; matches && i < ir.Nodes.size(); ++i)
+		{
+			matches = sameLayer(ir.Nodes[i].Desc, description.LayerDescs[i]);
+		}
+		if (!matches)
+		{
+			MML_ASSERT(false, "Model file '%s' does not match the static model !", path.c_str());
+			return false;
+		}
+
+		description.ObjectiveFunc = ir.Description.ObjectiveFunc;
+		description.LearningRate = ir.Description.LearningRate;
+
+		size_t paramIdx = 0;
+		for (const ModelIR::Node &node : ir.Nodes)
+		{
+			for (const Tensor &tensor : node.Tensors)
+			{
+				Tensor::copy(parameters[paramIdx++], tensor.size(), tensor);
+			}
+		}
+		return true;
+	}
+
+	void writeStaticParameters(const std::string &path, const SequentialDesc &description, const std::vector<const float *> &parameters)
+	{
+		ModelIR ir = makeIR(description);
+		inferShapes(ir);
+
+		// Every layer after the input is fully connected, with (1, out, in) weights and (1, out, 1) biases
+		size_t paramIdx = 0;
+		for (size_t i = 1; i < ir.Nodes.size(); ++i)
+		{
+			size_t numInputs = ir.Nodes[i - 1].Shape[1];
+			size_t numOutputs = ir.Nodes[i].Shape[1];
+
+			ModelIR::Node &node = ir.Nodes[i];
+			node.Tensors.emplace_back(1, numOutputs, numInputs);
+			node.Tensors.emplace_back(1, numOutputs, 1);
+			for (Tensor &tensor : node.Tensors)
+			{
+				Tensor::copy(tensor, parameters[paramIdx++], tensor.size());
+			}
+		}
+
+		writeIR(ir, path);
+	}
+}
\ No newline at end of file
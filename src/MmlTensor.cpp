@@ -1,22 +1,21 @@
 #include "maxml/MmlTensor.h"
 #include "MmlLog.h"
-
-#include <immintrin.h>
+#include "MmlUtils.h"
 
 namespace maxml
 {
-	Tensor::Tensor(size_t channels, size_t rows, size_t cols, float *data)
-		: m_Channels(channels), m_Rows(rows), m_Cols(cols), m_Size(channels * rows * cols), m_Data(data)
+	Tensor::Tensor(size_t channels, size_t rows, size_t cols, float *data, bool view)
+		: m_Channels(channels), m_Rows(rows), m_Cols(cols), m_Size(channels * rows * cols), m_Data(data), m_View(view)
 	{
 	}
 
 	Tensor::Tensor()
-		: m_Channels(0), m_Rows(0), m_Cols(0), m_Size(0), m_Data(nullptr)
+		: m_Channels(0), m_Rows(0), m_Cols(0), m_Size(0), m_Data(nullptr), m_View(false)
 	{
 	}
 
 	Tensor::Tensor(size_t channels, size_t rows, size_t cols)
-		: m_Channels(channels), m_Rows(rows), m_Cols(cols), m_Size(channels * rows * cols), m_Data(nullptr)
+		: m_Channels(channels), m_Rows(rows), m_Cols(cols), m_Size(channels * rows * cols), m_Data(nullptr), m_View(false)
 	{
 		m_Data = reinterpret_cast<float *>(_mm_malloc(m_Size * sizeof(float), 32));
 		MML_ASSERT(m_Data != nullptr, "Failed to allocate memory for tensor!");
@@ -25,7 +24,7 @@ namespace maxml
 	}
 
 	Tensor::Tensor(std::initializer_list<float> data)
-		: m_Channels(1), m_Rows(data.size()), m_Cols(1), m_Size(m_Channels * m_Rows * m_Cols), m_Data(nullptr)
+		: m_Channels(1), m_Rows(data.size()), m_Cols(1), m_Size(m_Channels * m_Rows * m_Cols), m_Data(nullptr), m_View(false)
 	{
 		m_Data = reinterpret_cast<float *>(_mm_malloc(m_Size * sizeof(float), 32));
 		MML_ASSERT(m_Data != nullptr, "Failed to allocate memory for tensor!");
@@ -34,7 +33,7 @@ namespace maxml
 	}
 
 	Tensor::Tensor(std::initializer_list<std::initializer_list<float>> data)
-		: m_Channels(1), m_Rows(data.size()), m_Cols(data.begin()->size()), m_Size(m_Channels * m_Rows * m_Cols), m_Data(nullptr)
+		: m_Channels(1), m_Rows(data.size()), m_Cols(data.begin()->size()), m_Size(m_Channels * m_Rows * m_Cols), m_Data(nullptr), m_View(false)
 	{
 		m_Data = reinterpret_cast<float *>(_mm_malloc(m_Size * sizeof(float), 32));
 		MML_ASSERT(m_Data != nullptr, "Failed to allocate memory for tensor!");
@@ -48,7 +47,7 @@ namespace maxml
 	}
 	
 	Tensor::Tensor(std::initializer_list<std::initializer_list<std::initializer_list<float>>> data)
-		: m_Channels(data.size()), m_Rows(data.begin()->size()), m_Cols(data.begin()->begin()->size()), m_Size(m_Channels * m_Rows * m_Cols), m_Data(nullptr)
+		: m_Channels(data.size()), m_Rows(data.begin()->size()), m_Cols(data.begin()->begin()->size()), m_Size(m_Channels * m_Rows * m_Cols), m_Data(nullptr), m_View(false)
 	{
 		m_Data = reinterpret_cast<float *>(_mm_malloc(m_Size * sizeof(float), 32));
 		MML_ASSERT(m_Data != nullptr, "Failed to allocate memory for tensor!");
@@ -67,7 +66,7 @@ namespace maxml
 	}
 
 	Tensor::Tensor(const Tensor &tensor)
-		: m_Channels(tensor.m_Channels), m_Rows(tensor.m_Rows), m_Cols(tensor.m_Cols), m_Size(tensor.m_Size), m_Data(nullptr)
+		: m_Channels(tensor.m_Channels), m_Rows(tensor.m_Rows), m_Cols(tensor.m_Cols), m_Size(tensor.m_Size), m_Data(nullptr), m_View(false)
 	{
 		m_Data = reinterpret_cast<float *>(_mm_malloc(m_Size * sizeof(float), 32));
 		MML_ASSERT(m_Data != nullptr, "Failed to allocate memory for tensor!");
@@ -76,18 +75,22 @@ namespace maxml
 	}
 
 	Tensor::Tensor(Tensor &&tensor) noexcept
-		: m_Channels(tensor.m_Channels), m_Rows(tensor.m_Rows), m_Cols(tensor.m_Cols), m_Size(tensor.m_Size), m_Data(tensor.m_Data)
+		: m_Channels(tensor.m_Channels), m_Rows(tensor.m_Rows), m_Cols(tensor.m_Cols), m_Size(tensor.m_Size), m_Data(tensor.m_Data), m_View(tensor.m_View)
 	{
 		tensor.m_Channels = 0;
 		tensor.m_Rows = 0;
 		tensor.m_Cols = 0;
 		tensor.m_Size = 0;
 		tensor.m_Data = nullptr;
+		tensor.m_View = false;
 	}
 
 	Tensor::~Tensor()
 	{
-		_mm_free(m_Data);
+		if (!m_View)
+		{
+			_mm_free(m_Data);
+		}
 	}
 
 	Tensor &Tensor::operator=(const Tensor &tensor)
@@ -103,6 +106,8 @@ namespace maxml
 
 		if (m_Size != tensor.m_Size)
 		{
+			MML_ASSERT(!m_View, "Cannot reallocate a tensor view!");
+
 			_mm_free(m_Data);
 
 			m_Size = tensor.m_Size;
@@ -120,19 +125,24 @@ namespace maxml
 	{
 		MML_ASSERT(this != &tensor);
 
-		_mm_free(m_Data);
+		if (!m_View)
+		{
+			_mm_free(m_Data);
+		}
 
 		m_Channels = tensor.m_Channels;
 		m_Rows = tensor.m_Rows;
 		m_Cols = tensor.m_Cols;
 		m_Size = tensor.m_Size;
 		m_Data = tensor.m_Data;
+		m_View = tensor.m_View;
 
 		tensor.m_Channels = 0;
 		tensor.m_Rows = 0;
 		tensor.m_Cols = 0;
 		tensor.m_Size = 0;
 		tensor.m_Data = nullptr;
+		tensor.m_View = false;
 
 		return *this;
 	}
@@ -191,6 +201,11 @@ namespace maxml
 		return m_Cols;
 	}
 
+	bool Tensor::isView() const
+	{
+		return m_View;
+	}
+
 	void Tensor::fill(float val)
 	{
 		std::fill(m_Data, m_Data + m_Size, val);
@@ -207,6 +222,8 @@ namespace maxml
 
 		if (size != m_Size)
 		{
+			MML_ASSERT(!m_View, "Cannot reallocate a tensor view!");
+
 			float *data = reinterpret_cast<float *>(_mm_malloc(size * sizeof(float), 32));
 			MML_ASSERT(data != nullptr, "Failed to allocate memory for tensor!");
 
@@ -237,10 +254,18 @@ namespace maxml
 			}
 		}
 
-		_mm_free(m_Data);
-
 		std::swap(m_Rows, m_Cols);
-		m_Data = data;
+
+		if (m_View)
+		{
+			std::copy(data, data + m_Size, m_Data);
+			_mm_free(data);
+		}
+		else
+		{
+			_mm_free(m_Data);
+			m_Data = data;
+		}
 	}
 
 	float &Tensor::at(size_t channel)
@@ -355,6 +380,41 @@ namespace maxml
 		return ss.str();
 	}
 
+	Tensor Tensor::view(Tensor &a, size_t channels, size_t rows, size_t cols)
+	{
+		MML_ASSERT(channels * rows * cols <= a.m_Size, "View must fit within the tensor!");
+
+		return Tensor(channels, rows, cols, a.m_Data, true);
+	}
+
+	const Tensor Tensor::view(const Tensor &a, size_t channels, size_t rows, size_t cols)
+	{
+		MML_ASSERT(channels * rows * cols <= a.m_Size, "View must fit within the tensor!");
+
+		return Tensor(channels, rows, cols, a.m_Data, true);
+	}
+
+	Tensor Tensor::view(Tensor &a, size_t offset, size_t channels, size_t rows, size_t cols)
+	{
+		MML_ASSERT(offset + channels * rows * cols <= a.m_Size, "View must fit within the tensor!");
+
+		return Tensor(channels, rows, cols, a.m_Data + offset, true);
+	}
+
+	Tensor Tensor::slice(Tensor &a, size_t channelBegin, size_t channels)
+	{
+		MML_ASSERT(channelBegin + channels <= a.m_Channels, "Slice must fit within the tensor!");
+
+		return Tensor(channels, a.m_Rows, a.m_Cols, a.m_Data + channelBegin * a.m_Rows * a.m_Cols, true);
+	}
+
+	const Tensor Tensor::slice(const Tensor &a, size_t channelBegin, size_t channels)
+	{
+		MML_ASSERT(channelBegin + channels <= a.m_Channels, "Slice must fit within the tensor!");
+
+		return Tensor(channels, a.m_Rows, a.m_Cols, a.m_Data + channelBegin * a.m_Rows * a.m_Cols, true);
+	}
+
 	Tensor Tensor::resize(const Tensor &a, size_t channels, size_t rows, size_t cols)
 	{
 		size_t size = channels * rows * cols;
@@ -377,20 +437,16 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
 			{
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 bv = _mm256_loadu_ps(b.m_Data + i);
 				__m256 resultv = _mm256_add_ps(av, bv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] + b.m_Data[k];
 			}
@@ -412,20 +468,16 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
 			{
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 bv = _mm256_loadu_ps(b.m_Data + i);
 				__m256 resultv = _mm256_add_ps(av, bv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] + b.m_Data[k];
 			}
@@ -447,19 +499,16 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
 			{
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 bv = _mm256_loadu_ps(b.m_Data + i);
 				__m256 resultv = _mm256_sub_ps(av, bv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] - b.m_Data[k];
 			}
@@ -481,20 +530,16 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
 			{
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 bv = _mm256_loadu_ps(b.m_Data + i);
 				__m256 resultv = _mm256_sub_ps(av, bv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] - b.m_Data[k];
 			}
@@ -514,9 +559,6 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			const __m256 sv = _mm256_set1_ps(s);
 
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
@@ -524,10 +566,10 @@ namespace maxml
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 resultv = _mm256_mul_ps(av, sv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] * s;
 			}
@@ -549,9 +591,6 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			const __m256 sv = _mm256_set1_ps(s);
 
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
@@ -559,10 +598,10 @@ namespace maxml
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 resultv = _mm256_mul_ps(av, sv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] * s;
 			}
@@ -586,20 +625,16 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
 			{
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 bv = _mm256_loadu_ps(b.m_Data + i);
 				__m256 resultv = _mm256_mul_ps(av, bv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] * b.m_Data[k];
 			}
@@ -621,20 +656,16 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
 			{
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 bv = _mm256_loadu_ps(b.m_Data + i);
 				__m256 resultv = _mm256_mul_ps(av, bv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] * b.m_Data[k];
 			}
@@ -648,77 +679,279 @@ namespace maxml
 		}
 	}
 
-	Tensor Tensor::matMult(const Tensor &a, const Tensor &b)
+	// Rows of y (+)= scale * A * B, with A(r, p) = a[r * aRowStride + p * aColStride] and the rows of B (k x n)
+	// and y contiguous. Each element of A is broadcast against 16 columns of B for R rows at once.
+	template<size_t R>
+	static void gemmBroadcastRows(const float *a, size_t aRowStride, size_t aColStride, const float *b, float *y, size_t n, size_t k, bool accumulate, float scale)
 	{
-		MML_ASSERT(a.m_Channels == b.m_Channels && a.m_Cols == b.m_Rows);
+		size_t j = 0;
+		for (; j + 16 <= n; j += 16)
+		{
+			__m256 acc0[R];
+			__m256 acc1[R];
+			for (size_t r = 0; r < R; ++r)
+			{
+				acc0[r] = accumulate ? _mm256_loadu_ps(y + r * n + j) : _mm256_setzero_ps();
+				acc1[r] = accumulate ? _mm256_loadu_ps(y + r * n + j + 8) : _mm256_setzero_ps();
+			}
 
-		Tensor y(a.m_Channels, a.m_Rows, b.m_Cols);
+			for (size_t p = 0; p < k; ++p)
+			{
+				__m256 b0v = _mm256_loadu_ps(b + p * n + j);
+				__m256 b1v = _mm256_loadu_ps(b + p * n + j + 8);
 
-		float *b_ckj = reinterpret_cast<float *>(_mm_malloc(a.m_Cols * sizeof(float), 32));
-		MML_ASSERT(b_ckj != nullptr, "Failed to allocate memory for tensor!");
+				for (size_t r = 0; r < R; ++r)
+				{
+					__m256 av = _mm256_set1_ps(scale * a[r * aRowStride + p * aColStride]);
+					acc0[r] = _mm256_add_ps(acc0[r], _mm256_mul_ps(av, b0v));
+					acc1[r] = _mm256_add_ps(acc1[r], _mm256_mul_ps(av, b1v));
+				}
+			}
 
-		for (size_t c = 0; c < y.m_Channels; c++)
+			for (size_t r = 0; r < R; ++r)
+			{
+				_mm256_storeu_ps(y + r * n + j, acc0[r]);
+				_mm256_storeu_ps(y + r * n + j + 8, acc1[r]);
+			}
+		}
+		for (; j + 8 <= n; j += 8)
 		{
-			const float *a_c = &a.m_Data[c * (a.m_Rows * a.m_Cols)];
-			const float *b_c = &b.m_Data[c * (b.m_Rows * b.m_Cols)];
-			float *y_c = &y.m_Data[c * (y.m_Rows * y.m_Cols)];
+			__m256 acc[R];
+			for (size_t r = 0; r < R; ++r)
+			{
+				acc[r] = accumulate ? _mm256_loadu_ps(y + r * n + j) : _mm256_setzero_ps();
+			}
 
-			for (size_t j = 0; j < y.m_Cols; j++)
+			for (size_t p = 0; p < k; ++p)
 			{
-				for (size_t k = 0; k < a.m_Cols; k++)
+				__m256 bv = _mm256_loadu_ps(b + p * n + j);
+
+				for (size_t r = 0; r < R; ++r)
 				{
-					b_ckj[k] = b_c[k * b.m_Cols + j];
+					acc[r] = _mm256_add_ps(acc[r], _mm256_mul_ps(_mm256_set1_ps(scale * a[r * aRowStride + p * aColStride]), bv));
 				}
+			}
 
-				for (size_t i = 0; i < y.m_Rows; i++)
+			for (size_t r = 0; r < R; ++r)
+			{
+				_mm256_storeu_ps(y + r * n + j, acc[r]);
+			}
+		}
+		for (; j < n; ++j)
+		{
+			for (size_t r = 0; r < R; ++r)
+			{
+				float sum = accumulate ? y[r * n + j] : 0.0f;
+				for (size_t p = 0; p < k; ++p)
 				{
-					const float *a_cik = &a_c[i * a.m_Cols];
+					sum += scale * a[r * aRowStride + p * aColStride] * b[p * n + j];
+				}
+				y[r * n + j] = sum;
+			}
+		}
+	}
 
-					float sum{};
+	static void gemmBroadcast(const float *a, size_t aRowStride, size_t aColStride, const float *b, float *y, size_t m, size_t n, size_t k, bool accumulate, float scale)
+	{
+		size_t i = 0;
+		for (; i + 4 <= m; i += 4)
+		{
+			gemmBroadcastRows<4>(a + i * aRowStride, aRowStride, aColStride, b, y + i * n, n, k, accumulate, scale);
+		}
+		for (; i < m; ++i)
+		{
+			gemmBroadcastRows<1>(a + i * aRowStride, aRowStride, aColStride, b, y + i * n, n, k, accumulate, scale);
+		}
+	}
 
-					if (a.m_Cols >= 8)
-					{
-						MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-						MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
+	// Block of y (+)= scale * A * transpose(B) for R rows of A (m x k) and C rows of B (n x k), all row major
+	template<size_t R, size_t C>
+	static void gemmDotBlock(const float *a, const float *b, float *y, size_t n, size_t k, bool accumulate, float scale)
+	{
+		__m256 acc[R][C];
+		for (size_t r = 0; r < R; ++r)
+		{
+			for (size_t c = 0; c < C; ++c)
+			{
+				acc[r][c] = _mm256_setzero_ps();
+			}
+		}
 
-						for (size_t k = 0; k < a.m_Cols - 7; k += 8)
-						{
-							__m256 av = _mm256_loadu_ps(a_cik + k);
-							__m256 bv = _mm256_loadu_ps(b_ckj + k);
-							__m256 abv = _mm256_mul_ps(av, bv);
+		size_t vecK = k - k % 8;
+		for (size_t p = 0; p < vecK; p += 8)
+		{
+			__m256 bv[C];
+			for (size_t c = 0; c < C; ++c)
+			{
+				bv[c] = _mm256_loadu_ps(b + c * k + p);
+			}
 
-							__m128 hiQuadv = _mm256_extractf128_ps(abv, 1);
-							__m128 loQuadv = _mm256_castps256_ps128(abv);
-							__m128 sumQuadv = _mm_add_ps(loQuadv, hiQuadv);
-							__m128 loDualv = sumQuadv;
-							__m128 hiDualv = _mm_movehl_ps(sumQuadv, sumQuadv);
-							__m128 sumDualv = _mm_add_ps(loDualv, hiDualv);
-							__m128 lov = sumDualv;
-							__m128 hiv = _mm_shuffle_ps(sumDualv, sumDualv, 0x1);
-							__m128 sumv = _mm_add_ss(lov, hiv);
+			for (size_t r = 0; r < R; ++r)
+			{
+				__m256 av = _mm256_loadu_ps(a + r * k + p);
+				for (size_t c = 0; c < C; ++c)
+				{
+					acc[r][c] = _mm256_add_ps(acc[r][c], _mm256_mul_ps(av, bv[c]));
+				}
+			}
+		}
 
-							sum += _mm_cvtss_f32(sumv);
-						}
+		for (size_t r = 0; r < R; ++r)
+		{
+			for (size_t c = 0; c < C; ++c)
+			{
+				float sum = hsum(acc[r][c]);
+				for (size_t p = vecK; p < k; ++p)
+				{
+					sum += a[r * k + p] * b[c * k + p];
+				}
+				sum *= scale;
+				y[r * n + c] = accumulate ? y[r * n + c] + sum : sum;
+			}
+		}
+	}
 
-						for (size_t k = a.m_Cols - 7; k < a.m_Cols; k++)
-						{
-							sum += a_cik[k] * b_ckj[k];
-						}
-					}
-					else
+	static void gemmDot(const float *a, const float *b, float *y, size_t m, size_t n, size_t k, bool accumulate, float scale)
+	{
+		size_t i = 0;
+		for (; i + 2 <= m; i += 2)
+		{
+			size_t j = 0;
+			for (; j + 4 <= n; j += 4)
+			{
+				gemmDotBlock<2, 4>(a + i * k, b + j * k, y + i * n + j, n, k, accumulate, scale);
+			}
+			for (; j < n; ++j)
+			{
+				gemmDotBlock<2, 1>(a + i * k, b + j * k, y + i * n + j, n, k, accumulate, scale);
+			}
+		}
+		for (; i < m; ++i)
+		{
+			size_t j = 0;
+			for (; j + 4 <= n; j += 4)
+			{
+				gemmDotBlock<1, 4>(a + i * k, b + j * k, y + i * n + j, n, k, accumulate, scale);
+			}
+			for (; j < n; ++j)
+			{
+				gemmDotBlock<1, 1>(a + i * k, b + j * k, y + i * n + j, n, k, accumulate, scale);
+			}
+		}
+	}
+
+	// Block of y = A * transpose(B) for R rows of A (m x k) and one panel of B packed by
+	// packPanels, n being the rows of B so that the padding of the last panel is never stored.
+	// Each step reads one contiguous row of the panel, prefetching a few rows ahead. Single rows
+	// can alternate between U sets of accumulators to keep more additions in flight.
+	template<size_t R, size_t U>
+	static void gemmPackedBlock(const float *a, const float *panel, float *y, size_t n, size_t k, size_t col)
+	{
+		constexpr size_t B = Tensor::k_BlockSize;
+		constexpr size_t V = Tensor::k_PanelWidth / B;
+
+		__m256 acc[U][R][V];
+		for (size_t u = 0; u < U; ++u)
+		{
+			for (size_t r = 0; r < R; ++r)
+			{
+				for (size_t v = 0; v < V; ++v)
+				{
+					acc[u][r][v] = _mm256_setzero_ps();
+				}
+			}
+		}
+
+		size_t unrolledK = k - k % U;
+		for (size_t p = 0; p < unrolledK; p += U)
+		{
+			for (size_t u = 0; u < U; ++u)
+			{
+				const float *panel_p = panel + (p + u) * Tensor::k_PanelWidth;
+				_mm_prefetch(reinterpret_cast<const char *>(panel_p + 16 * Tensor::k_PanelWidth), _MM_HINT_T0);
+				_mm_prefetch(reinterpret_cast<const char *>(panel_p + 16 * Tensor::k_PanelWidth + 16), _MM_HINT_T0);
+
+				__m256 bv[V];
+				for (size_t v = 0; v < V; ++v)
+				{
+					bv[v] = _mm256_loadu_ps(panel_p + v * B);
+				}
+
+				for (size_t r = 0; r < R; ++r)
+				{
+					__m256 av = _mm256_broadcast_ss(a + r * k + p + u);
+					for (size_t v = 0; v < V; ++v)
 					{
-						for (size_t k = 0; k < a.m_Cols; k++)
-						{
-							sum += a_cik[k] * b_ckj[k];
-						}
+						acc[u][r][v] = _mm256_add_ps(acc[u][r][v], _mm256_mul_ps(av, bv[v]));
 					}
+				}
+			}
+		}
+		for (size_t p = unrolledK; p < k; ++p)
+		{
+			const float *panel_p = panel + p * Tensor::k_PanelWidth;
+			for (size_t r = 0; r < R; ++r)
+			{
+				__m256 av = _mm256_broadcast_ss(a + r * k + p);
+				for (size_t v = 0; v < V; ++v)
+				{
+					acc[0][r][v] = _mm256_add_ps(acc[0][r][v], _mm256_mul_ps(av, _mm256_loadu_ps(panel_p + v * B)));
+				}
+			}
+		}
 
-					y_c[i * y.m_Cols + j] = sum;
+		for (size_t r = 0; r < R; ++r)
+		{
+			for (size_t v = 0; v < V; ++v)
+			{
+				for (size_t u = 1; u < U; ++u)
+				{
+					acc[0][r][v] = _mm256_add_ps(acc[0][r][v], acc[u][r][v]);
+				}
+
+				size_t j = col + v * B;
+				if (j + B <= n)
+				{
+					_mm256_storeu_ps(y + r * n + j, acc[0][r][v]);
+				}
+				else if (j < n)
+				{
+					alignas(32) float tail[B];
+					_mm256_store_ps(tail, acc[0][r][v]);
+					std::copy(tail, tail + (n - j), y + r * n + j);
 				}
 			}
 		}
+	}
 
-		_mm_free(b_ckj);
+	// Panels are the outer loop so that each stays in cache while every row of A reads it
+	static void gemmPacked(const float *a, const float *panels, float *y, size_t m, size_t n, size_t k)
+	{
+		size_t numPanels = (n + Tensor::k_PanelWidth - 1) / Tensor::k_PanelWidth;
+
+		for (size_t q = 0; q < numPanels; ++q)
+		{
+			const float *panel = panels + q * k * Tensor::k_PanelWidth;
+			size_t col = q * Tensor::k_PanelWidth;
+
+			size_t i = 0;
+			for (; i + 2 <= m; i += 2)
+			{
+				gemmPackedBlock<2, 1>(a + i * k, panel, y + i * n, n, k, col);
+			}
+			for (; i < m; ++i)
+			{
+				gemmPackedBlock<1, 1>(a + i * k, panel, y + i * n, n, k, col);
+			}
+		}
+	}
+
+	Tensor Tensor::matMult(const Tensor &a, const Tensor &b)
+	{
+		MML_ASSERT(a.m_Channels == b.m_Channels && a.m_Cols == b.m_Rows);
+
+		Tensor y(a.m_Channels, a.m_Rows, b.m_Cols);
+		matMult(a, b, y);
 
 		return y;
 	}
@@ -727,6 +960,29 @@ namespace maxml
 	{
 		MML_ASSERT(a.m_Channels == b.m_Channels && a.m_Cols == b.m_Rows);
 
+		// Wide products broadcast a against rows of b, and a single column of b is contiguous
+		// so matrix-vector products are plain dot products. Narrow ones gather b's columns.
+		if (y.m_Cols >= 8 || b.m_Cols == 1)
+		{
+			for (size_t c = 0; c < y.m_Channels; c++)
+			{
+				const float *a_c = &a.m_Data[c * (a.m_Rows * a.m_Cols)];
+				const float *b_c = &b.m_Data[c * (b.m_Rows * b.m_Cols)];
+				float *y_c = &y.m_Data[c * (y.m_Rows * y.m_Cols)];
+
+				if (b.m_Cols == 1)
+				{
+					gemmDot(a_c, b_c, y_c, a.m_Rows, 1, a.m_Cols, false, 1.0f);
+				}
+				else
+				{
+					gemmBroadcast(a_c, a.m_Cols, 1, b_c, y_c, a.m_Rows, b.m_Cols, a.m_Cols, false, 1.0f);
+				}
+			}
+
+			return;
+		}
+
 		float *b_ckj = reinterpret_cast<float *>(_mm_malloc(a.m_Cols * sizeof(float), 32));
 		MML_ASSERT(b_ckj != nullptr, "Failed to allocate memory for tensor!");
 
@@ -751,9 +1007,6 @@ namespace maxml
 
 					if (a.m_Cols >= 8)
 					{
-						MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-						MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-
 						for (size_t k = 0; k < a.m_Cols - 7; k += 8)
 						{
 							__m256 av = _mm256_loadu_ps(a_cik + k);
@@ -773,7 +1026,7 @@ namespace maxml
 							sum += _mm_cvtss_f32(sumv);
 						}
 
-						for (size_t k = a.m_Cols - 7; k < a.m_Cols; k++)
+						for (size_t k = a.m_Cols - a.m_Cols % 8; k < a.m_Cols; k++)
 						{
 							sum += a_cik[k] * b_ckj[k];
 						}
@@ -794,6 +1047,77 @@ namespace maxml
 		_mm_free(b_ckj);
 	}
 
+	void Tensor::matMultTransA(const Tensor &a, const Tensor &b, Tensor &y, bool accumulate, float scale)
+	{
+		MML_ASSERT(a.m_Channels == b.m_Channels && a.m_Rows == b.m_Rows);
+		MML_ASSERT(y.m_Channels == a.m_Channels && y.m_Rows == a.m_Cols && y.m_Cols == b.m_Cols);
+
+		for (size_t c = 0; c < y.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * (a.m_Rows * a.m_Cols)];
+			const float *b_c = &b.m_Data[c * (b.m_Rows * b.m_Cols)];
+			float *y_c = &y.m_Data[c * (y.m_Rows * y.m_Cols)];
+
+			gemmBroadcast(a_c, 1, a.m_Cols, b_c, y_c, a.m_Cols, b.m_Cols, a.m_Rows, accumulate, scale);
+		}
+	}
+
+	void Tensor::matMultTransB(const Tensor &a, const Tensor &b, Tensor &y, bool accumulate, float scale)
+	{
+		MML_ASSERT(a.m_Channels == b.m_Channels && a.m_Cols == b.m_Cols);
+		MML_ASSERT(y.m_Channels == a.m_Channels && y.m_Rows == a.m_Rows && y.m_Cols == b.m_Rows);
+
+		for (size_t c = 0; c < y.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * (a.m_Rows * a.m_Cols)];
+			const float *b_c = &b.m_Data[c * (b.m_Rows * b.m_Cols)];
+			float *y_c = &y.m_Data[c * (y.m_Rows * y.m_Cols)];
+
+			gemmDot(a_c, b_c, y_c, a.m_Rows, b.m_Rows, a.m_Cols, accumulate, scale);
+		}
+	}
+
+	void Tensor::packPanels(const Tensor &b, Tensor &packed)
+	{
+		size_t numPanels = (b.m_Rows + k_PanelWidth - 1) / k_PanelWidth;
+		MML_ASSERT(packed.m_Channels == b.m_Channels && packed.m_Rows == numPanels * b.m_Cols && packed.m_Cols == k_PanelWidth);
+
+		for (size_t c = 0; c < b.m_Channels; c++)
+		{
+			const float *b_c = &b.m_Data[c * (b.m_Rows * b.m_Cols)];
+			float *packed_c = &packed.m_Data[c * (packed.m_Rows * packed.m_Cols)];
+
+			for (size_t q = 0; q < numPanels; ++q)
+			{
+				for (size_t p = 0; p < b.m_Cols; ++p)
+				{
+					float *panel_qp = packed_c + (q * b.m_Cols + p) * k_PanelWidth;
+					for (size_t lane = 0; lane < k_PanelWidth; ++lane)
+					{
+						size_t row = q * k_PanelWidth + lane;
+						panel_qp[lane] = row < b.m_Rows ? b_c[row * b.m_Cols + p] : 0.0f;
+					}
+				}
+			}
+		}
+	}
+
+	void Tensor::matMultPacked(const Tensor &a, const Tensor &packed, Tensor &y)
+	{
+		size_t numPanels = (y.m_Cols + k_PanelWidth - 1) / k_PanelWidth;
+		MML_ASSERT(a.m_Channels == packed.m_Channels && packed.m_Rows == numPanels * a.m_Cols && packed.m_Cols == k_PanelWidth);
+		MML_ASSERT(y.m_Channels == a.m_Channels && y.m_Rows == a.m_Rows);
+
+		for (size_t c = 0; c < y.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * (a.m_Rows * a.m_Cols)];
+			const float *packed_c = &packed.m_Data[c * (packed.m_Rows * packed.m_Cols)];
+			float *y_c = &y.m_Data[c * (y.m_Rows * y.m_Cols)];
+
+			gemmPacked(a_c, packed_c, y_c, a.m_Rows, y.m_Cols, a.m_Cols);
+		}
+	}
+
 	
 	Tensor Tensor::transpose(const Tensor &a)
 	{
@@ -927,10 +1251,6 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			__m256 xv = _mm256_set1_ps(x);
 
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
@@ -940,10 +1260,10 @@ namespace maxml
 				__m256 xbv = _mm256_mul_ps(xv, bv);
 				__m256 resultv = _mm256_add_ps(av, xbv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] + x * b.m_Data[k];
 			}
@@ -963,10 +1283,6 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(b.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			__m256 xv = _mm256_set1_ps(x);
 
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
@@ -976,10 +1292,10 @@ namespace maxml
 				__m256 xbv = _mm256_mul_ps(xv, bv);
 				__m256 resultv = _mm256_sub_ps(av, xbv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] - x * b.m_Data[k];
 			}
@@ -999,9 +1315,6 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			static const __m256 zerov = _mm256_set1_ps(0.0f);
 			static const __m256 onev = _mm256_set1_ps(1.0f);
 			static const __m256 halfv = _mm256_set1_ps(0.5f);
@@ -1016,10 +1329,10 @@ namespace maxml
 				__m256 quotientv = _mm256_div_ps(halfav, oneplusabsav);
 				__m256 resultv = _mm256_add_ps(quotientv, halfv);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = (0.5f * a.m_Data[k]) / (1 + std::abs(a.m_Data[k])) + 0.5f;
 			}
@@ -1039,9 +1352,6 @@ namespace maxml
 
 		if (y.m_Size >= 8)
 		{
-			MML_ASSERT(((uintptr_t)(a.m_Data) & 31) == 0);
-			MML_ASSERT(((uintptr_t)(y.m_Data) & 31) == 0);
-
 			static const __m256 zerov = _mm256_set1_ps(0.0f);
 
 			for (size_t i = 0; i < y.m_Size - 7; i += 8)
@@ -1049,10 +1359,10 @@ namespace maxml
 				__m256 av = _mm256_loadu_ps(a.m_Data + i);
 				__m256 resultv = _mm256_max_ps(av, zerov);
 
-				_mm256_store_ps(y.m_Data + i, resultv);
+				_mm256_storeu_ps(y.m_Data + i, resultv);
 			}
 
-			for (size_t k = y.m_Size - 7; k < y.m_Size; k++)
+			for (size_t k = y.m_Size - y.m_Size % 8; k < y.m_Size; k++)
 			{
 				y.m_Data[k] = a.m_Data[k] < 0.0f ? 0.0f : a.m_Data[k];
 			}
@@ -1066,9 +1376,205 @@ namespace maxml
 		}
 	}
 	
+	void Tensor::channelAdd(const Tensor &a, const Tensor &b, Tensor &y)
+	{
+		MML_ASSERT(b.m_Channels == a.m_Channels && b.m_Rows == 1 && b.m_Cols == 1);
+		MML_ASSERT(y.m_Channels == a.m_Channels && y.m_Rows == a.m_Rows && y.m_Cols == a.m_Cols);
+
+		size_t chanSize = a.m_Rows * a.m_Cols;
+
+		for (size_t c = 0; c < a.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * chanSize];
+			float *y_c = &y.m_Data[c * chanSize];
+
+			const __m256 bv = _mm256_set1_ps(b.m_Data[c]);
+
+			size_t i = 0;
+			for (; i + 8 <= chanSize; i += 8)
+			{
+				__m256 av = _mm256_loadu_ps(a_c + i);
+				__m256 resultv = _mm256_add_ps(av, bv);
+
+				_mm256_storeu_ps(y_c + i, resultv);
+			}
+
+			for (; i < chanSize; i++)
+			{
+				y_c[i] = a_c[i] + b.m_Data[c];
+			}
+		}
+	}
+
+	void Tensor::channelAffine(const Tensor &a, const Tensor &scale, const Tensor &shift, Tensor &y)
+	{
+		MML_ASSERT(scale.m_Channels == a.m_Channels && scale.m_Rows == 1 && scale.m_Cols == 1);
+		MML_ASSERT(shift.m_Channels == a.m_Channels && shift.m_Rows == 1 && shift.m_Cols == 1);
+		MML_ASSERT(y.m_Channels == a.m_Channels && y.m_Rows == a.m_Rows && y.m_Cols == a.m_Cols);
+
+		size_t chanSize = a.m_Rows * a.m_Cols;
+
+		for (size_t c = 0; c < a.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * chanSize];
+			float *y_c = &y.m_Data[c * chanSize];
+
+			const __m256 scalev = _mm256_set1_ps(scale.m_Data[c]);
+			const __m256 shiftv = _mm256_set1_ps(shift.m_Data[c]);
+
+			size_t i = 0;
+			for (; i + 8 <= chanSize; i += 8)
+			{
+				__m256 av = _mm256_loadu_ps(a_c + i);
+				__m256 resultv = _mm256_add_ps(_mm256_mul_ps(av, scalev), shiftv);
+
+				_mm256_storeu_ps(y_c + i, resultv);
+			}
+
+			for (; i < chanSize; i++)
+			{
+				y_c[i] = a_c[i] * scale.m_Data[c] + shift.m_Data[c];
+			}
+		}
+	}
+
+	void Tensor::channelSum(const Tensor &a, Tensor &y)
+	{
+		MML_ASSERT(y.m_Channels == a.m_Channels && y.m_Rows == 1 && y.m_Cols == 1);
+
+		size_t chanSize = a.m_Rows * a.m_Cols;
+
+		for (size_t c = 0; c < a.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * chanSize];
+
+			__m256 sumv = _mm256_setzero_ps();
+
+			size_t i = 0;
+			for (; i + 8 <= chanSize; i += 8)
+			{
+				sumv = _mm256_add_ps(sumv, _mm256_loadu_ps(a_c + i));
+			}
+
+			float sum = hsum(sumv);
+			for (; i < chanSize; i++)
+			{
+				sum += a_c[i];
+			}
+
+			y.m_Data[c] = sum;
+		}
+	}
+
+	void Tensor::channelMoments(const Tensor &a, Tensor &mean, Tensor &var)
+	{
+		MML_ASSERT(mean.m_Channels == a.m_Channels && mean.m_Rows == 1 && mean.m_Cols == 1);
+		MML_ASSERT(var.m_Channels == a.m_Channels && var.m_Rows == 1 && var.m_Cols == 1);
+
+		size_t chanSize = a.m_Rows * a.m_Cols;
+		float invChanSize = 1.0f / static_cast<float>(chanSize);
+
+		// Two passes, the variance is taken around the mean to avoid cancellation
+		for (size_t c = 0; c < a.m_Channels; c++)
+		{
+			const float *a_c = &a.m_Data[c * chanSize];
+
+			__m256 sumv = _mm256_setzero_ps();
+
+			size_t i = 0;
+			for (; i + 8 <= chanSize; i += 8)
+			{
+				sumv = _mm256_add_ps(sumv, _mm256_loadu_ps(a_c + i));
+			}
+
+			float sum = hsum(sumv);
+			for (; i < chanSize; i++)
+			{
+				sum += a_c[i];
+			}
+
+			float mu = sum * invChanSize;
+
+			const __m256 muv = _mm256_set1_ps(mu);
+			__m256 sqSumv = _mm256_setzero_ps();
+
+			i = 0;
+			for (; i + 8 <= chanSize; i += 8)
+			{
+				__m256 diffv = _mm256_sub_ps(_mm256_loadu_ps(a_c + i), muv);
+				sqSumv = _mm256_add_ps(sqSumv, _mm256_mul_ps(diffv, diffv));
+			}
+
+			float sqSum = hsum(sqSumv);
+			for (; i < chanSize; i++)
+			{
+				float diff = a_c[i] - mu;
+				sqSum += diff * diff;
+			}
+
+			mean.m_Data[c] = mu;
+			var.m_Data[c] = sqSum * invChanSize;
+		}
+	}
+
+	void Tensor::toBlocked(const Tensor &a, Tensor &y)
+	{
+		MML_ASSERT(y.m_Channels == (a.m_Channels + k_BlockSize - 1) / k_BlockSize && y.m_Rows == a.m_Rows && y.m_Cols == a.m_Cols * k_BlockSize);
+
+		size_t chanSize = a.m_Rows * a.m_Cols;
+
+		for (size_t cb = 0; cb < y.m_Channels; cb++)
+		{
+			float *y_cb = &y.m_Data[cb * chanSize * k_BlockSize];
+
+			for (size_t lane = 0; lane < k_BlockSize; lane++)
+			{
+				size_t c = cb * k_BlockSize + lane;
+
+				if (c < a.m_Channels)
+				{
+					const float *a_c = &a.m_Data[c * chanSize];
+					for (size_t i = 0; i < chanSize; i++)
+					{
+						y_cb[i * k_BlockSize + lane] = a_c[i];
+					}
+				}
+				else
+				{
+					for (size_t i = 0; i < chanSize; i++)
+					{
+						y_cb[i * k_BlockSize + lane] = 0.0f;
+					}
+				}
+			}
+		}
+	}
+
+	void Tensor::fromBlocked(const Tensor &a, Tensor &y)
+	{
+		MML_ASSERT(a.m_Channels == (y.m_Channels + k_BlockSize - 1) / k_BlockSize && a.m_Rows == y.m_Rows && a.m_Cols == y.m_Cols * k_BlockSize);
+
+		size_t chanSize = y.m_Rows * y.m_Cols;
+
+		for (size_t c = 0; c < y.m_Channels; c++)
+		{
+			const float *a_cb = &a.m_Data[(c / k_BlockSize) * chanSize * k_BlockSize + c % k_BlockSize];
+			float *y_c = &y.m_Data[c * chanSize];
+
+			for (size_t i = 0; i < chanSize; i++)
+			{
+				y_c[i] = a_cb[i * k_BlockSize];
+			}
+		}
+	}
+
 	void Tensor::copy(const Tensor &src, Tensor &dst)
 	{
 		MML_ASSERT(dst.m_Size == src.m_Size);
+		if (src.m_Data == dst.m_Data)
+		{
+			return;
+		}
 		std::copy(src.m_Data, src.m_Data + src.m_Size, dst.m_Data);
 	}
 
@@ -0,0 +1,209 @@
+#include "MmlThreadPool.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <filesystem>
+#endif
+
+namespace maxml
+{
+	// Binds a thread to one CPU, a no-op where affinity is not supported
+	static void pinThread(std::thread &thread, size_t cpu)
+	{
+#if defined(__linux__)
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		int result = pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpus);
+		MML_ASSERT(result == 0, "Could not pin a pool thread to CPU %zu: %s", cpu, std::strerror(result));
+#else
+		(void)thread;
+		(void)cpu;
+#endif
+	}
+
+	// The CPUs this process may run on grouped by NUMA node, or a single group of every CPU
+	// where affinity or the topology cannot be read
+	static std::vector<std::vector<size_t>> allowedCpusByNode()
+	{
+		std::vector<std::vector<size_t>> nodes;
+#if defined(__linux__)
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0)
+		{
+			for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (!CPU_ISSET(cpu, &allowed))
+				{
+					continue;
+				}
+
+				// Each CPU's directory links the node it belongs to as node<index>
+				size_t node = 0;
+				std::error_code error;
+				for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator("/sys/devices/system/cpu/cpu" + std::to_string(cpu), error))
+				{
+					std::string name = entry.path().filename().string();
+					if (name.rfind("node", 0) == 0 && name.size() > 4 && std::isdigit(static_cast<unsigned char>(name[4])))
+					{
+						node = std::stoul(name.substr(4));
+						break;
+					}
+				}
+
+				if (nodes.size() <= node)
+				{
+					nodes.resize(node + 1);
+				}
+				nodes[node].push_back(cpu);
+			}
+
+			nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const std::vector<size_t> &cpus) { return cpus.empty(); }), nodes.end());
+		}
+#endif
+		if (nodes.empty())
+		{
+			nodes.emplace_back();
+			for (size_t cpu = 0; cpu < std::max<size_t>(std::thread::hardware_concurrency(), 1); ++cpu)
+			{
+				nodes.back().push_back(cpu);
+			}
+		}
+		return nodes;
+	}
+
+	void placeLocally(const float *data, size_t size)
+	{
+#if defined(__linux__)
+		uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+		uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + pageSize - 1) / pageSize * pageSize;
+		uintptr_t end = reinterpret_cast<uintptr_t>(data + size) / pageSize * pageSize;
+
+		unsigned cpu = 0;
+		unsigned node = 0;
+		if (begin >= end || syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+		{
+			return;
+		}
+
+		size_t numPages = (end - begin) / pageSize;
+		std::vector<void *> pages(numPages);
+		std::vector<int> nodes(numPages, static_cast<int>(node));
+		std::vector<int> status(numPages);
+		for (size_t i = 0; i < numPages; ++i)
+		{
+			pages[i] = reinterpret_cast<void *>(begin + i * pageSize);
+		}
+
+		// Fails without NUMA support or permission, leaving the pages where they are
+		syscall(SYS_move_pages, 0, numPages, pages.data(), nodes.data(), status.data(), MPOL_MF_MOVE);
+#else
+		(void)data;
+		(void)size;
+#endif
+	}
+
+	ThreadPool::ThreadPool(size_t numThreads, bool pinned)
+		: m_Task(nullptr)
+		, m_Generation(0)
+		, m_Pending(0)
+		, m_Stop(false)
+		, m_CallerRuns(!pinned)
+	{
+		MML_ASSERT(numThreads > 0, "Thread pool needs at least one thread!");
+
+		if (!pinned)
+		{
+			for (size_t i = 1; i < numThreads; ++i)
+			{
+				m_Threads.emplace_back(&ThreadPool::work, this, i);
+			}
+			return;
+		}
+
+		// Thread i goes to node i % numNodes, and the threads of a node spread evenly over its CPUs
+		std::vector<std::vector<size_t>> nodes = allowedCpusByNode();
+		size_t numNodes = std::min(nodes.size(), numThreads);
+		for (size_t i = 0; i < numThreads; ++i)
+		{
+			const std::vector<size_t> &cpus = nodes[i % numNodes];
+			size_t nodeThreads = (numThreads - i % numNodes + numNodes - 1) / numNodes;
+
+			m_Threads.emplace_back(&ThreadPool::work, this, i);
+			pinThread(m_Threads.back(), cpus[i / numNodes * cpus.size() / nodeThreads]);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Stop = true;
+		}
+		m_Start.notify_all();
+
+		for (std::thread &thread : m_Threads)
+		{
+			thread.join();
+		}
+	}
+
+	void ThreadPool::run(const std::function<void(size_t)> &task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Task = &task;
+			m_Pending = m_Threads.size();
+			++m_Generation;
+		}
+		m_Start.notify_all();
+
+		if (m_CallerRuns)
+		{
+			task(0);
+		}
+
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Done.wait(lock, [this]() { return m_Pending == 0; });
+		m_Task = nullptr;
+	}
+
+	void ThreadPool::work(size_t threadIndex)
+	{
+		size_t generation = 0;
+
+		while (true)
+		{
+			const std::function<void(size_t)> *task;
+			{
+				std::unique_lock<std::mutex> lock(m_Mutex);
+				m_Start.wait(lock, [&]() { return m_Stop || m_Generation != generation; });
+				if (m_Stop)
+				{
+					return;
+				}
+
+				generation = m_Generation;
+				task = m_Task;
+			}
+
+			(*task)(threadIndex);
+
+			bool last;
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				last = --m_Pending == 0;
+			}
+			if (last)
+			{
+				m_Done.notify_one();
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+
+namespace maxml
+{
+	// Moves the memory pages lying wholly inside [data, data + size) to the NUMA node of the
+	// calling thread, as if it had touched them first. Pages shared with neighbouring data
+	// stay put, and so does everything where the OS cannot move pages.
+	void placeLocally(const float *data, size_t size);
+
+	// Fixed set of threads running one task per thread at a time. The calling thread takes
+	// part as thread 0, so a pool of one thread runs everything inline. Each task always
+	// lands on the same thread, which keeps per-thread data in that core's cache. Pinned
+	// pools run thread 0 on a thread of their own too, while the caller waits, and spread
+	// their threads over the NUMA nodes of the CPUs the process may use, then evenly over
+	// each node's CPUs.
+	class ThreadPool
+	{
+	public:
+		ThreadPool() = delete;
+		ThreadPool(size_t numThreads, bool pinned = false);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool &other) = delete;
+		ThreadPool &operator=(const ThreadPool &other) = delete;
+
+		// Calls task(threadIndex) on every thread and returns once all of them have finished
+		void run(const std::function<void(size_t)> &task);
+
+		size_t size() const { return m_Threads.size() + (m_CallerRuns ? 1 : 0); }
+
+	private:
+		void work(size_t threadIndex);
+
+	private:
+		std::vector<std::thread> m_Threads;
+
+		std::mutex m_Mutex;
+		std::condition_variable m_Start;
+		std::condition_variable m_Done;
+
+		const std::function<void(size_t)> *m_Task;
+		size_t m_Generation;
+		size_t m_Pending;
+		bool m_Stop;
+
+		// Whether run calls task 0 on the calling thread
+		bool m_CallerRuns;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,557 @@
+#include "maxml/MmlTransport.h"
+
+#include <atomic>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#define MML_POSIX_TRANSPORT 1
+#else
+#define MML_POSIX_TRANSPORT 0
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace maxml
+{
+	void Transport::allReduce(float *data, size_t count, bool average)
+	{
+		size_t numRanks = size();
+		if (numRanks == 1 || count == 0)
+		{
+			return;
+		}
+
+		size_t r = rank();
+		auto chunkBegin = [&](size_t chunk) {
+			return count * chunk / numRanks;
+		};
+		auto chunkSize = [&](size_t chunk) {
+			return chunkBegin(chunk + 1) - chunkBegin(chunk);
+		};
+
+		m_Scratch.resize(chunkSize(numRanks - 1) + 1);
+
+		// Reduce-scatter: every step passes on the chunk summed so far and adds the previous
+		// rank's partial sum of the next one, leaving rank r with the full sum of chunk r + 1
+		for (size_t s = 0; s < numRanks - 1; ++s)
+		{
+			size_t sendChunk = (r + numRanks - s) % numRanks;
+			size_t recvChunk = (r + numRanks - s - 1) % numRanks;
+
+			exchange(data + chunkBegin(sendChunk), chunkSize(sendChunk) * sizeof(float),
+				m_Scratch.data(), chunkSize(recvChunk) * sizeof(float));
+
+			float *y = data + chunkBegin(recvChunk);
+			for (size_t i = 0, n = chunkSize(recvChunk); i < n; ++i)
+			{
+				y[i] += m_Scratch[i];
+			}
+		}
+
+		size_t ownChunk = (r + 1) % numRanks;
+		if (average)
+		{
+			float invRanks = 1.0f / static_cast<float>(numRanks);
+			float *y = data + chunkBegin(ownChunk);
+			for (size_t i = 0, n = chunkSize(ownChunk); i < n; ++i)
+			{
+				y[i] *= invRanks;
+			}
+		}
+
+		// All-gather: the finished chunks travel once around the ring
+		for (size_t s = 0; s < numRanks - 1; ++s)
+		{
+			size_t sendChunk = (ownChunk + numRanks - s) % numRanks;
+			size_t recvChunk = (ownChunk + numRanks - s - 1) % numRanks;
+
+			exchange(data + chunkBegin(sendChunk), chunkSize(sendChunk) * sizeof(float),
+				data + chunkBegin(recvChunk), chunkSize(recvChunk) * sizeof(float));
+		}
+	}
+
+	void Transport::broadcast(float *data, size_t count)
+	{
+		// Rank 0's data is passed along the ring, the last rank has no one left to send to
+		size_t numRanks = size();
+		size_t r = rank();
+		size_t bytes = count * sizeof(float);
+
+		for (size_t s = 0; s + 1 < numRanks; ++s)
+		{
+			if (r == s)
+			{
+				exchange(data, bytes, nullptr, 0);
+			}
+			else if (r == s + 1)
+			{
+				exchange(nullptr, 0, data, bytes);
+			}
+		}
+	}
+
+#if MML_POSIX_TRANSPORT
+	// Ring buffer from one rank to the next, the counters only ever grow and each is written by
+	// one side, so the writer publishes data with a release and the reader sees it on acquire.
+	// The sending rank also joins through its channel, posting a token rank 0 hands back.
+	struct Channel
+	{
+		alignas(64) std::atomic<uint64_t> Written;
+		alignas(64) std::atomic<uint64_t> Read;
+		alignas(64) std::atomic<uint64_t> Joined;
+		std::atomic<uint64_t> Accepted;
+	};
+
+	// Leads the segment, rank 0 marks it ready once the channels are set up and abandoned
+	// before replacing a segment left behind under the same name
+	struct Segment
+	{
+		alignas(64) std::atomic<uint64_t> State;
+	};
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory channels need lock-free counters!");
+
+	static constexpr size_t k_ChannelHeaderBytes = sizeof(Channel);
+	static constexpr uint64_t k_SegmentReady = 1;
+	static constexpr uint64_t k_SegmentAbandoned = 2;
+
+	// Polls until done returns true, giving up after about as long as sockets try to connect
+	static bool waitUntil(const std::function<bool()> &done)
+	{
+		for (size_t attempt = 0; attempt < 30000; ++attempt)
+		{
+			if (done())
+			{
+				return true;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return done();
+	}
+
+	SharedMemoryTransport::SharedMemoryTransport(const std::string &name, size_t rank, size_t size, size_t channelBytes)
+		: m_Name(name[0] == '/' ? name : "/" + name)
+		, m_Rank(rank)
+		, m_Size(size)
+		, m_ChannelBytes((channelBytes + 63) / 64 * 64)
+		, m_Memory(nullptr)
+		, m_MemoryBytes(sizeof(Segment) + size * (k_ChannelHeaderBytes + m_ChannelBytes))
+	{
+		MML_ASSERT(rank < size, "Rank out of range!");
+		MML_ASSERT(channelBytes > 0, "Channels need room for data!");
+
+		auto channelAt = [&](void *memory, size_t index) {
+			return reinterpret_cast<Channel *>(static_cast<uint8_t *>(memory) + sizeof(Segment) + index * (k_ChannelHeaderBytes + m_ChannelBytes));
+		};
+
+		if (rank == 0)
+		{
+			// Ranks that already opened a segment left behind by an earlier run see it abandoned
+			// and open the name again, which by then is a fresh segment
+			int stale = shm_open(m_Name.c_str(), O_RDWR, 0600);
+			if (stale >= 0)
+			{
+				struct stat info;
+				if (fstat(stale, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(Segment))
+				{
+					void *memory = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, stale, 0);
+					if (memory != MAP_FAILED)
+					{
+						static_cast<Segment *>(memory)->State.store(k_SegmentAbandoned, std::memory_order_release);
+						munmap(memory, sizeof(Segment));
+					}
+				}
+				close(stale);
+			}
+			shm_unlink(m_Name.c_str());
+
+			int fd = shm_open(m_Name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+			MML_ASSERT(fd >= 0, "Failed to create shared memory!");
+			if (fd < 0)
+			{
+				return;
+			}
+			bool sized = ftruncate(fd, static_cast<off_t>(m_MemoryBytes)) == 0;
+			MML_ASSERT(sized, "Failed to size shared memory!");
+
+			void *memory = sized ? mmap(nullptr, m_MemoryBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+			close(fd);
+			MML_ASSERT(memory != MAP_FAILED, "Failed to map shared memory!");
+			if (memory == MAP_FAILED)
+			{
+				return;
+			}
+
+			for (size_t i = 0; i < size; ++i)
+			{
+				Channel *channel = channelAt(memory, i);
+				channel->Written.store(0, std::memory_order_relaxed);
+				channel->Read.store(0, std::memory_order_relaxed);
+				channel->Joined.store(0, std::memory_order_relaxed);
+				channel->Accepted.store(0, std::memory_order_relaxed);
+			}
+			static_cast<Segment *>(memory)->State.store(k_SegmentReady, std::memory_order_release);
+
+			// Every other rank is accepted before the first exchange, so none of them is still
+			// attached to a segment that has been replaced
+			for (size_t i = 1; i < size; ++i)
+			{
+				Channel *channel = channelAt(memory, i);
+				bool joined = waitUntil([&]() { return channel->Joined.load(std::memory_order_acquire) != 0; });
+				MML_ASSERT(joined, "Rank did not join the shared memory!");
+				channel->Accepted.store(channel->Joined.load(std::memory_order_relaxed), std::memory_order_release);
+			}
+
+			m_Memory = memory;
+			return;
+		}
+
+		// Unique to this process and this transport, so an answer left in a stale segment never matches
+		uint64_t token = (static_cast<uint64_t>(getpid()) << 32 ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())) | 1;
+
+		bool accepted = waitUntil([&]() {
+			int fd = shm_open(m_Name.c_str(), O_RDWR, 0600);
+			if (fd < 0)
+			{
+				return false;
+			}
+
+			// Rank 0 may not have sized the segment yet
+			struct stat info;
+			void *memory = fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) == m_MemoryBytes
+				? mmap(nullptr, m_MemoryBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+				: MAP_FAILED;
+			close(fd);
+			if (memory == MAP_FAILED)
+			{
+				return false;
+			}
+
+			Segment *segment = static_cast<Segment *>(memory);
+			Channel *channel = channelAt(memory, rank);
+			bool ready = waitUntil([&]() { return segment->State.load(std::memory_order_acquire) != 0; });
+			if (ready && segment->State.load(std::memory_order_acquire) == k_SegmentReady)
+			{
+				channel->Joined.store(token, std::memory_order_release);
+				waitUntil([&]() {
+					return channel->Accepted.load(std::memory_order_acquire) == token || segment->State.load(std::memory_order_acquire) != k_SegmentReady;
+				});
+				if (channel->Accepted.load(std::memory_order_acquire) == token)
+				{
+					m_Memory = memory;
+					return true;
+				}
+			}
+
+			munmap(memory, m_MemoryBytes);
+			return false;
+		});
+		MML_ASSERT(accepted, "Failed to join the shared memory!");
+	}
+
+	SharedMemoryTransport::~SharedMemoryTransport()
+	{
+		if (m_Memory)
+		{
+			munmap(m_Memory, m_MemoryBytes);
+		}
+		if (m_Rank == 0)
+		{
+			shm_unlink(m_Name.c_str());
+		}
+	}
+
+	void SharedMemoryTransport::exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes)
+	{
+		if (!m_Memory)
+		{
+			return;
+		}
+
+		auto channelAt = [&](size_t index) {
+			return static_cast<uint8_t *>(m_Memory) + sizeof(Segment) + index * (k_ChannelHeaderBytes + m_ChannelBytes);
+		};
+		uint8_t *outBase = channelAt(m_Rank);
+		uint8_t *inBase = channelAt((m_Rank + m_Size - 1) % m_Size);
+		Channel *out = reinterpret_cast<Channel *>(outBase);
+		Channel *in = reinterpret_cast<Channel *>(inBase);
+		uint8_t *outRing = outBase + k_ChannelHeaderBytes;
+		uint8_t *inRing = inBase + k_ChannelHeaderBytes;
+
+		const uint8_t *src = static_cast<const uint8_t *>(sendData);
+		uint8_t *dst = static_cast<uint8_t *>(recvData);
+		size_t sent = 0;
+		size_t received = 0;
+
+		while (sent < sendBytes || received < recvBytes)
+		{
+			bool progress = false;
+
+			if (sent < sendBytes)
+			{
+				uint64_t written = out->Written.load(std::memory_order_relaxed);
+				uint64_t read = out->Read.load(std::memory_order_acquire);
+				size_t n = std::min<size_t>(m_ChannelBytes - static_cast<size_t>(written - read), sendBytes - sent);
+				size_t at = static_cast<size_t>(written % m_ChannelBytes);
+				size_t first = std::min(n, m_ChannelBytes - at);
+
+				std::memcpy(outRing + at, src + sent, first);
+				std::memcpy(outRing, src + sent + first, n - first);
+				out->Written.store(written + n, std::memory_order_release);
+
+				sent += n;
+				progress |= n > 0;
+			}
+
+			if (received < recvBytes)
+			{
+				uint64_t written = in->Written.load(std::memory_order_acquire);
+				uint64_t read = in->Read.load(std::memory_order_relaxed);
+				size_t n = std::min<size_t>(static_cast<size_t>(written - read), recvBytes - received);
+				size_t at = static_cast<size_t>(read % m_ChannelBytes);
+				size_t first = std::min(n, m_ChannelBytes - at);
+
+				std::memcpy(dst + received, inRing + at, first);
+				std::memcpy(dst + received + first, inRing, n - first);
+				in->Read.store(read + n, std::memory_order_release);
+
+				received += n;
+				progress |= n > 0;
+			}
+
+			if (!progress)
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// Fills address with "unix:/path" or "host:port", returning its length or 0 if malformed
+	static socklen_t resolveAddress(const std::string &text, sockaddr_storage &address)
+	{
+		std::memset(&address, 0, sizeof(address));
+
+		if (text.rfind("unix:", 0) == 0)
+		{
+			std::string path = text.substr(5);
+			sockaddr_un *local = reinterpret_cast<sockaddr_un *>(&address);
+			if (path.empty() || path.size() >= sizeof(local->sun_path))
+			{
+				return 0;
+			}
+
+			local->sun_family = AF_UNIX;
+			std::memcpy(local->sun_path, path.c_str(), path.size() + 1);
+			return static_cast<socklen_t>(sizeof(sockaddr_un));
+		}
+
+		size_t colon = text.rfind(':');
+		if (colon == std::string::npos)
+		{
+			return 0;
+		}
+
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo *result = nullptr;
+		if (getaddrinfo(text.substr(0, colon).c_str(), text.substr(colon + 1).c_str(), &hints, &result) != 0 || !result)
+		{
+			return 0;
+		}
+
+		socklen_t length = static_cast<socklen_t>(result->ai_addrlen);
+		std::memcpy(&address, result->ai_addr, length);
+		freeaddrinfo(result);
+
+		return length;
+	}
+
+	// Streams to another host don't wait to fill packets, the ring sends many small chunks
+	static void configureSocket(int fd)
+	{
+		int one = 1;
+		sockaddr_storage address;
+		socklen_t length = sizeof(address);
+		if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) == 0 && address.ss_family != AF_UNIX)
+		{
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	}
+
+	SocketTransport::SocketTransport(const std::vector<std::string> &addresses, size_t rank)
+		: m_Rank(rank)
+		, m_Size(addresses.size())
+		, m_Listener(-1)
+		, m_Next(-1)
+		, m_Previous(-1)
+	{
+		MML_ASSERT(rank < m_Size, "Rank out of range!");
+		if (m_Size < 2)
+		{
+			return;
+		}
+
+		// Listen before connecting, the kernel completes a connection to a listening socket
+		// without waiting for accept, so the ranks can come up in any order
+		sockaddr_storage own;
+		socklen_t ownLength = resolveAddress(addresses[rank], own);
+		MML_ASSERT(ownLength > 0, "Malformed transport address!");
+
+		m_Listener = socket(own.ss_family, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(m_Listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (own.ss_family == AF_UNIX)
+		{
+			unlink(reinterpret_cast<sockaddr_un *>(&own)->sun_path);
+		}
+		if (bind(m_Listener, reinterpret_cast<sockaddr *>(&own), ownLength) != 0 || listen(m_Listener, 1) != 0)
+		{
+			MML_ASSERT(false, "Failed to listen on transport address!");
+			return;
+		}
+
+		sockaddr_storage next;
+		socklen_t nextLength = resolveAddress(addresses[(rank + 1) % m_Size], next);
+		MML_ASSERT(nextLength > 0, "Malformed transport address!");
+
+		for (size_t attempt = 0; attempt < 3000 && m_Next < 0; ++attempt)
+		{
+			m_Next = socket(next.ss_family, SOCK_STREAM, 0);
+			if (connect(m_Next, reinterpret_cast<sockaddr *>(&next), nextLength) != 0)
+			{
+				close(m_Next);
+				m_Next = -1;
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+		MML_ASSERT(m_Next >= 0, "Failed to connect to the next rank!");
+
+		m_Previous = accept(m_Listener, nullptr, nullptr);
+		MML_ASSERT(m_Previous >= 0, "Failed to accept the previous rank!");
+
+		if (m_Next >= 0 && m_Previous >= 0)
+		{
+			configureSocket(m_Next);
+			configureSocket(m_Previous);
+		}
+	}
+
+	SocketTransport::~SocketTransport()
+	{
+		for (int fd : { m_Next, m_Previous, m_Listener })
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+	}
+
+	void SocketTransport::exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes)
+	{
+		if (m_Next < 0 || m_Previous < 0)
+		{
+			return;
+		}
+
+		const uint8_t *src = static_cast<const uint8_t *>(sendData);
+		uint8_t *dst = static_cast<uint8_t *>(recvData);
+		size_t sent = 0;
+		size_t received = 0;
+
+		while (sent < sendBytes || received < recvBytes)
+		{
+			// Hangups are reported even for a direction that is done, and a neighbour that has
+			// finished may already have closed, so finished directions are left out of the poll
+			pollfd fds[2] = {
+				{ sent < sendBytes ? m_Next : -1, POLLOUT, 0 },
+				{ received < recvBytes ? m_Previous : -1, POLLIN, 0 }
+			};
+			if (poll(fds, 2, -1) < 0)
+			{
+				continue;
+			}
+
+			if (fds[0].revents & (POLLOUT | POLLERR | POLLHUP))
+			{
+				ssize_t n = send(m_Next, src + sent, sendBytes - sent, MSG_NOSIGNAL);
+				if (n > 0)
+				{
+					sent += static_cast<size_t>(n);
+				}
+				else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				{
+					MML_ASSERT(false, "Lost the connection to the next rank!");
+					return;
+				}
+			}
+
+			if (fds[1].revents & (POLLIN | POLLERR | POLLHUP))
+			{
+				ssize_t n = recv(m_Previous, dst + received, recvBytes - received, 0);
+				if (n > 0)
+				{
+					received += static_cast<size_t>(n);
+				}
+				else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				{
+					MML_ASSERT(false, "Lost the connection to the previous rank!");
+					return;
+				}
+			}
+		}
+	}
+#else
+	SharedMemoryTransport::SharedMemoryTransport(const std::string &name, size_t rank, size_t size, size_t channelBytes)
+		: m_Name(name)
+		, m_Rank(rank)
+		, m_Size(size)
+		, m_ChannelBytes(channelBytes)
+		, m_Memory(nullptr)
+		, m_MemoryBytes(0)
+	{
+		MML_ASSERT(size == 1, "Shared memory transport is not supported on this platform!");
+	}
+
+	SharedMemoryTransport::~SharedMemoryTransport()
+	{
+	}
+
+	void SharedMemoryTransport::exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes)
+	{
+	}
+
+	SocketTransport::SocketTransport(const std::vector<std::string> &addresses, size_t rank)
+		: m_Rank(rank)
+		, m_Size(addresses.size())
+		, m_Listener(-1)
+		, m_Next(-1)
+		, m_Previous(-1)
+	{
+		MML_ASSERT(m_Size == 1, "Socket transport is not supported on this platform!");
+	}
+
+	SocketTransport::~SocketTransport()
+	{
+	}
+
+	void SocketTransport::exchange(const void *sendData, size_t sendBytes, void *recvData, size_t recvBytes)
+	{
+	}
+#endif
+}
\ No newline at end of file
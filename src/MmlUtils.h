@@ -1,7 +1,22 @@
 #pragma once
 
+#include <immintrin.h>
+
 namespace maxml
 {
+	static inline float hsum(__m256 v)
+	{
+		__m128 hiQuadv = _mm256_extractf128_ps(v, 1);
+		__m128 loQuadv = _mm256_castps256_ps128(v);
+		__m128 sumQuadv = _mm_add_ps(loQuadv, hiQuadv);
+		__m128 hiDualv = _mm_movehl_ps(sumQuadv, sumQuadv);
+		__m128 sumDualv = _mm_add_ps(sumQuadv, hiDualv);
+		__m128 hiv = _mm_shuffle_ps(sumDualv, sumDualv, 0x1);
+		__m128 sumv = _mm_add_ss(sumDualv, hiv);
+
+		return _mm_cvtss_f32(sumv);
+	}
+
 	static float sig(float x)
 	{
 		return 1.0f / (1.0f + std::exp(-x));
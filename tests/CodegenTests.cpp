@@ -0,0 +1,41 @@
+#include "Tests.h"
+
+#include "mnist.h"
+#include "regression.h"
+
+#include <string>
+#include <algorithm>
+
+using namespace maxml;
+
+// Runs samples random inputs through the generated predict and the model it was generated from,
+// loaded for inference, and returns the largest output difference
+static float GeneratedDifference(const std::string &name, void (*predict)(const float *, float *),
+	size_t channels, size_t rows, size_t cols, size_t outputSize)
+{
+	Sequential model(std::string(MML_TEST_MODELS_DIR) + "/" + name + ".nn", 1, ModelMode::Inference);
+
+	float difference = 0.0f;
+	for (uint32_t s = 0; s < 8; ++s)
+	{
+		Tensor sample = RandomTensor(channels, rows, cols, s);
+		Tensor generated(outputSize, 1, 1);
+		predict(&sample[0], &generated[0]);
+
+		const Tensor &expected = model.predict(sample);
+		difference = std::max(difference, MaxDifference(generated, Tensor::view(expected, outputSize, 1, 1)));
+	}
+	return difference;
+}
+
+bool CheckCodegen()
+{
+	// The generated loops sum in a different order than the runtime's kernels
+	bool passed = true;
+	passed &= Expect("mnist.nn, generated vs Sequential",
+		GeneratedDifference("mnist", mnist::predict, mnist::k_InputChannels, mnist::k_InputRows, mnist::k_InputCols, mnist::k_OutputSize), 1e-6f);
+	passed &= Expect("regression.nn, generated vs Sequential",
+		GeneratedDifference("regression", regression::predict, regression::k_InputChannels, regression::k_InputRows, regression::k_InputCols,
+			regression::k_OutputSize), 1e-6f);
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "Tests.h"
+#include "MmlModelIR.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+using namespace maxml;
+
+// Orthonormal DCT-II basis vector k of length n
+static double Basis(size_t k, size_t i, size_t n)
+{
+	const double pi = 3.14159265358979323846;
+	return std::sqrt((k == 0 ? 1.0 : 2.0) / static_cast<double>(n)) * std::cos(pi * (static_cast<double>(i) + 0.5) * static_cast<double>(k) / static_cast<double>(n));
+}
+
+// IR of one fully connected layer whose weights have singular values 0.95^k, along orthonormal
+// bases so that the truncation error of any rank is known
+static ModelIR KnownSpectrum(size_t numOutputs, size_t numInputs)
+{
+	SequentialDesc description;
+	description.LayerDescs = { makeInput(1, numInputs, 1), makeFullyConnected(numOutputs, ActivationFunc::None) };
+
+	ModelIR ir = makeIR(description);
+	inferShapes(ir);
+	initializeParameters(ir);
+
+	Tensor &weights = ir.Nodes[1].Tensors[0];
+	for (size_t o = 0; o < numOutputs; ++o)
+	{
+		for (size_t i = 0; i < numInputs; ++i)
+		{
+			double w = 0.0;
+			for (size_t k = 0; k < std::min(numOutputs, numInputs); ++k)
+			{
+				w += std::pow(0.95, static_cast<double>(k)) * Basis(k, o, numOutputs) * Basis(k, i, numInputs);
+			}
+			weights(0, o, i) = static_cast<float>(w);
+		}
+	}
+	return ir;
+}
+
+// Relative Frobenius error of the factorized node against the original weights, or infinity
+// if the node was kept
+static float RelativeError(const ModelIR &original, const ModelIR &factorized)
+{
+	if (!std::holds_alternative<FactorizedFullyConnectedDesc>(factorized.Nodes[1].Desc))
+	{
+		return std::numeric_limits<float>::infinity();
+	}
+
+	const Tensor &weights = original.Nodes[1].Tensors[0];
+	Tensor product = Tensor::matMult(factorized.Nodes[1].Tensors[2], factorized.Nodes[1].Tensors[0]);
+
+	double error = 0.0;
+	double norm = 0.0;
+	for (size_t i = 0; i < weights.size(); ++i)
+	{
+		error += (weights[i] - product[i]) * (weights[i] - product[i]);
+		norm += weights[i] * weights[i];
+	}
+	return static_cast<float>(std::sqrt(error / norm));
+}
+
+bool CheckCompression()
+{
+	const size_t numOutputs = 256;
+	const size_t numInputs = 192;
+	const ModelIR original = KnownSpectrum(numOutputs, numInputs);
+
+	// Singular values past rank hold the error, 0.95^2rank of the energy up to the last ones
+	const size_t rank = 16;
+	double tailEnergy = std::pow(0.95, 2.0 * rank) * (1.0 - std::pow(0.95, 2.0 * (numInputs - rank))) / (1.0 - std::pow(0.95, 2.0 * numInputs));
+
+	ModelIR fixed = original;
+	factorizeFullyConnected(fixed, rank, 0.0f);
+	bool passed = Expect("rank 16 relative error vs the dropped singular values",
+		std::abs(RelativeError(original, fixed) - static_cast<float>(std::sqrt(tailEnergy))), 1e-4f);
+
+	// Keeping 90% of the energy leaves just under sqrt(0.1) of the norm, by at most the share of
+	// the last singular value kept
+	ModelIR energy = original;
+	factorizeFullyConnected(energy, 0, 0.9f);
+	float error = RelativeError(original, energy);
+	passed &= Expect("energy 0.9 relative error vs sqrt(0.1)", std::abs(error - std::sqrt(0.1f)), 0.02f);
+	passed &= Expect("energy 0.9 relative error over sqrt(0.1)", error - std::sqrt(0.1f), 0.0f);
+	return passed;
+}
\ No newline at end of file
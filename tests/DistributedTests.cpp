@@ -0,0 +1,234 @@
+#include "Tests.h"
+#include "maxml/MmlTransport.h"
+#include "maxml/MmlDistributedTrainer.h"
+
+#include <iostream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/wait.h>
+#define MML_TEST_FORK 1
+#else
+#define MML_TEST_FORK 0
+#endif
+
+using namespace maxml;
+
+#if MML_TEST_FORK
+enum class TransportKind
+{
+	SharedMemory,
+	UnixSocket,
+	TcpSocket
+};
+
+static const TransportKind k_TransportKinds[] = { TransportKind::SharedMemory, TransportKind::UnixSocket, TransportKind::TcpSocket };
+
+static std::string KindName(TransportKind kind)
+{
+	return kind == TransportKind::SharedMemory ? "shared memory" : kind == TransportKind::UnixSocket ? "unix sockets" : "tcp sockets";
+}
+
+// Names and addresses every rank agrees on, picked by the parent before forking
+struct RingConfig
+{
+	TransportKind Kind;
+	size_t NumRanks;
+	std::string SegmentName;
+	std::vector<std::string> Addresses;
+};
+
+static RingConfig MakeRing(TransportKind kind, size_t numRanks, const std::string &name)
+{
+	static size_t ringIndex = 0;
+	++ringIndex;
+
+	RingConfig config = { kind, numRanks, "maxml_test_" + std::to_string(getpid()) + "_" + name, {} };
+	for (size_t k = 0; k < numRanks; ++k)
+	{
+		if (kind == TransportKind::UnixSocket)
+		{
+			config.Addresses.push_back("unix:" + TempPath(name + "_" + std::to_string(k)));
+		}
+		else
+		{
+			// Spread by process so that concurrent test runs stay apart, and below the ports
+			// Linux hands out to outgoing connections
+			size_t port = 20000 + getpid() % 300 * 40 + ringIndex * 3 + k;
+			config.Addresses.push_back("127.0.0.1:" + std::to_string(port));
+		}
+	}
+	return config;
+}
+
+static std::unique_ptr<Transport> Connect(const RingConfig &config, size_t rank, size_t channelBytes)
+{
+	if (config.Kind == TransportKind::SharedMemory)
+	{
+		return std::make_unique<SharedMemoryTransport>(config.SegmentName, rank, config.NumRanks, channelBytes);
+	}
+	return std::make_unique<SocketTransport>(config.Addresses, rank);
+}
+
+// Runs rankMain in numRanks forked processes, passing if every one of them returns true
+static bool RunRanks(size_t numRanks, const std::function<bool(size_t)> &rankMain)
+{
+	std::cout.flush();
+
+	std::vector<pid_t> pids;
+	for (size_t rank = 0; rank < numRanks; ++rank)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			bool passed = rankMain(rank);
+			std::cout.flush();
+			_exit(passed ? 0 : 1);
+		}
+		pids.push_back(pid);
+	}
+
+	bool passed = true;
+	for (pid_t pid : pids)
+	{
+		int status = 0;
+		passed &= pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	return passed;
+}
+
+bool CheckAllReduce()
+{
+	// Channels far smaller than the data make every exchange wrap around the ring buffers
+	const size_t count = 1001;
+	const size_t channelBytes = 256;
+
+	bool passed = true;
+	for (TransportKind kind : k_TransportKinds)
+	{
+		for (size_t numRanks : { 2, 3 })
+		{
+			RingConfig config = MakeRing(kind, numRanks, "all_reduce");
+			std::string what = KindName(kind) + ", " + std::to_string(numRanks) + " ranks";
+
+			passed &= RunRanks(numRanks, [&](size_t rank) {
+				std::unique_ptr<Transport> transport = Connect(config, rank, channelBytes);
+
+				// Small integers sum exactly in any order
+				auto Value = [](size_t r, size_t i) {
+					return static_cast<float>(r * 1000 + i % 997);
+				};
+
+				Tensor sum(1, 1, count);
+				Tensor mean(1, 1, count);
+				Tensor broadcast(1, 1, count);
+				Tensor expectedSum(1, 1, count);
+				Tensor expectedMean(1, 1, count);
+				Tensor expectedBroadcast(1, 1, count);
+				for (size_t i = 0; i < count; ++i)
+				{
+					sum[i] = mean[i] = Value(rank, i);
+					broadcast[i] = Value(rank + 1, i);
+					for (size_t r = 0; r < numRanks; ++r)
+					{
+						expectedSum[i] += Value(r, i);
+					}
+					expectedMean[i] = expectedSum[i] / static_cast<float>(numRanks);
+					expectedBroadcast[i] = Value(1, i);
+				}
+
+				transport->allReduce(sum.data(), count);
+				transport->allReduce(mean.data(), count, true);
+				transport->broadcast(broadcast.data(), count);
+
+				std::string prefix = what + ", rank " + std::to_string(rank);
+				bool rankPassed = Expect(prefix + " sum", MaxDifference(sum, expectedSum), 0.0f);
+				rankPassed &= Expect(prefix + " mean", MaxDifference(mean, expectedMean), 1e-3f);
+				rankPassed &= Expect(prefix + " broadcast", MaxDifference(broadcast, expectedBroadcast), 0.0f);
+				return rankPassed;
+			});
+		}
+	}
+	return passed;
+}
+
+bool CheckDistributedTrainer()
+{
+	const size_t batchSize = 12;
+	const size_t numSteps = 8;
+
+	SequentialDesc description;
+	description.ObjectiveFunc = LossFunc::CrossEntropy;
+	description.LearningRate = 0.2f;
+	description.MaxBatchSize = batchSize;
+	description.LayerDescs = {
+		makeInput(1, 12, 12),
+		makeConvolutional(6, 3, 3, ActivationFunc::ReLU),
+		makePooling(2, 2, PoolingFunc::Max),
+		makeFlatten(),
+		makeFullyConnected(300, ActivationFunc::Tanh),
+		makeFullyConnected(4, ActivationFunc::Softmax)
+	};
+
+	// The other ranks start from different parameters, which rank 0's broadcast replaces
+	std::string path = SaveModel(description, "distributed");
+	std::string otherPath = SaveModel(description, "distributed_other");
+
+	Tensor inputs = RandomTensor(batchSize * numSteps, 12, 12, 7);
+	Tensor targets = OneHotTargets(batchSize * numSteps, 4);
+
+	Tensor expected;
+	{
+		Sequential model(path, batchSize);
+		for (size_t s = 0; s < numSteps; ++s)
+		{
+			model.feedForward(Tensor::slice(inputs, s * batchSize, batchSize), batchSize);
+			model.feedBackward(Tensor::slice(targets, s * batchSize, batchSize));
+		}
+		expected = Tensor(model.feedForward(Tensor::slice(inputs, 0, batchSize), batchSize));
+	}
+
+	bool passed = true;
+	for (TransportKind kind : k_TransportKinds)
+	{
+		for (size_t numRanks : { 2, 3 })
+		{
+			RingConfig config = MakeRing(kind, numRanks, "distributed");
+			std::string what = KindName(kind) + ", " + std::to_string(numRanks) + " ranks";
+
+			passed &= RunRanks(numRanks, [&](size_t rank) {
+				std::unique_ptr<Transport> transport = Connect(config, rank, 1 << 16);
+
+				size_t shardSize = batchSize / numRanks;
+				Sequential model(rank == 0 ? path : otherPath, batchSize);
+				DistributedTrainer trainer(model, *transport);
+				for (size_t s = 0; s < numSteps; ++s)
+				{
+					size_t first = s * batchSize + rank * shardSize;
+					trainer.step(Tensor::slice(inputs, first, shardSize), Tensor::slice(targets, first, shardSize), shardSize);
+				}
+
+				Tensor outputs(model.feedForward(Tensor::slice(inputs, 0, batchSize), batchSize));
+				return Expect(what + ", rank " + std::to_string(rank) + " vs one process", MaxDifference(expected, outputs), 1e-4f);
+			});
+		}
+	}
+	return passed;
+}
+#else
+bool CheckAllReduce()
+{
+	std::cout << "  skipped, needs fork" << std::endl;
+	return true;
+}
+
+bool CheckDistributedTrainer()
+{
+	std::cout << "  skipped, needs fork" << std::endl;
+	return true;
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "Tests.h"
+#include "maxml/MmlGraph.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+using namespace maxml;
+
+// Batch normalization starts from unit scales and zero shifts, so graphs of it, pooling and
+// merges build with the same parameters every time and can be compared after training
+static GraphDesc BranchingGraph(size_t branchThreads)
+{
+	GraphDesc description;
+	description.ObjectiveFunc = LossFunc::CrossEntropy;
+	description.LearningRate = 0.1f;
+	description.MaxBatchSize = 4;
+	description.BranchThreads = branchThreads;
+	description.Nodes = {
+		{ makeInput(2, 6, 6) },
+		{ makeBatchNorm(ActivationFunc::Tanh) },
+		{ makePooling(2, 2, PoolingFunc::Max) },
+		{ makeBatchNorm(ActivationFunc::ReLU), { 2 } },
+		{ makeBatchNorm(ActivationFunc::Tanh), { 2 } },
+		{ makeMerge(MergeFunc::Add, ActivationFunc::None), { 3, 4 } },
+		{ makeMerge(MergeFunc::Concat, ActivationFunc::None), { 2, 5 } },
+		{ makeFlatten() },
+		{ makeBatchNorm(ActivationFunc::Softmax) }
+	};
+	return description;
+}
+
+// Runs steps batches of batchSize through model and returns the largest loss difference from
+// losses, recording them instead if it is empty
+template <typename Model>
+static float TrainLosses(Model &model, const Tensor &inputs, const Tensor &targets, size_t batchSize, size_t steps, std::vector<float> &losses)
+{
+	size_t numSamples = targets.channels();
+	size_t sampleChannels = inputs.channels() / numSamples;
+	bool record = losses.empty();
+
+	float difference = 0.0f;
+	for (size_t s = 0; s < steps; ++s)
+	{
+		size_t first = s * batchSize % numSamples;
+		model.feedForward(Tensor::slice(inputs, first * sampleChannels, batchSize * sampleChannels), batchSize);
+		float loss = model.feedBackward(Tensor::slice(targets, first, batchSize));
+		if (record)
+		{
+			losses.push_back(loss);
+		}
+		else
+		{
+			difference = std::max(difference, std::abs(loss - losses[s]));
+		}
+	}
+	return difference;
+}
+
+bool CheckGraph()
+{
+	const size_t batchSize = 4;
+	Tensor inputs = RandomTensor(16 * 2, 6, 6, 9);
+	Tensor targets = OneHotTargets(16, 36);
+	const Tensor first = Tensor::slice(inputs, 0, batchSize * 2);
+
+	bool passed = true;
+
+	// A graph without merges runs the layers of the same Sequential
+	{
+		GraphDesc chainDesc = BranchingGraph(1);
+		chainDesc.Nodes = { chainDesc.Nodes[0], chainDesc.Nodes[1], chainDesc.Nodes[2], chainDesc.Nodes[3], chainDesc.Nodes[7], chainDesc.Nodes[8] };
+
+		SequentialDesc sequentialDesc;
+		sequentialDesc.ObjectiveFunc = chainDesc.ObjectiveFunc;
+		sequentialDesc.LearningRate = chainDesc.LearningRate;
+		sequentialDesc.MaxBatchSize = chainDesc.MaxBatchSize;
+		sequentialDesc.LayerDescs = { makeInput(2, 6, 6), makeBatchNorm(ActivationFunc::Tanh), makePooling(2, 2, PoolingFunc::Max),
+			makeBatchNorm(ActivationFunc::ReLU), makeFlatten(), makeBatchNorm(ActivationFunc::Softmax) };
+
+		Graph chain(chainDesc);
+		Sequential sequential(sequentialDesc);
+		Tensor targetsChain = OneHotTargets(16, 18);
+
+		std::vector<float> losses;
+		TrainLosses(sequential, inputs, targetsChain, batchSize, 8, losses);
+		passed &= Expect("chain graph, losses vs Sequential", TrainLosses(chain, inputs, targetsChain, batchSize, 8, losses), 1e-6f);
+		passed &= Expect("chain graph, outputs after training vs Sequential",
+			MaxDifference(chain.feedForward(first, batchSize), sequential.feedForward(first, batchSize)), 1e-6f);
+	}
+
+	// Branches of a level write disjoint values and sum their deltas in a fixed order, so
+	// the thread count never changes a result
+	{
+		Graph serial(BranchingGraph(1));
+		Graph threaded(BranchingGraph(3));
+
+		std::vector<float> losses;
+		TrainLosses(serial, inputs, targets, batchSize, 8, losses);
+		passed &= Expect("three branch threads, losses vs one", TrainLosses(threaded, inputs, targets, batchSize, 8, losses), 0.0f);
+		passed &= Expect("three branch threads, outputs after training vs one",
+			MaxDifference(serial.feedForward(first, batchSize), threaded.feedForward(first, batchSize)), 0.0f);
+	}
+	return passed;
+}
\ No newline at end of file
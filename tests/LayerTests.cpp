@@ -0,0 +1,243 @@
+#include "Tests.h"
+#include "MmlLayer.h"
+
+#include <string>
+#include <vector>
+#include <tuple>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+using namespace maxml;
+
+// Step of the central differences, and the largest error allowed relative to the gradient
+static constexpr float k_Epsilon = 1e-3f;
+static constexpr float k_Tolerance = 1e-2f;
+
+// Samples uniform in [-1, 1)
+static Tensor SignedTensor(size_t channels, size_t rows, size_t cols, uint32_t seed)
+{
+	Tensor tensor = RandomTensor(channels, rows, cols, seed);
+	for (size_t i = 0; i < tensor.size(); ++i)
+	{
+		tensor[i] = 2.0f * tensor[i] - 1.0f;
+	}
+	return tensor;
+}
+
+// The loss the checks differentiate, the outputs weighted by the output delta given to
+// backward, so that backward's deltas are its gradients. Batches go through the batch passes.
+static double Loss(Layer &layer, const Tensor &input, Tensor &output, const Tensor &outputDelta, size_t batchSize = 1)
+{
+	if (batchSize > 1)
+	{
+		layer.forwardBatch(input, output, batchSize);
+	}
+	else
+	{
+		layer.forward(input, output);
+	}
+
+	double loss = 0.0;
+	for (size_t i = 0; i < output.size(); ++i)
+	{
+		loss += static_cast<double>(output[i]) * outputDelta[i];
+	}
+	return loss;
+}
+
+// Largest error of gradient against central differences of loss in each element of value,
+// relative to the larger of the two or one. Where the one-sided differences disagree the
+// element sits on a kink, such as a ReLU at zero, and is skipped.
+static float GradientError(Tensor &value, const Tensor &gradient, const std::function<double()> &loss)
+{
+	double center = loss();
+
+	float worst = 0.0f;
+	for (size_t k = 0; k < value.size(); ++k)
+	{
+		float original = value[k];
+		value[k] = original + k_Epsilon;
+		double up = loss();
+		value[k] = original - k_Epsilon;
+		double down = loss();
+		value[k] = original;
+
+		double right = (up - center) / k_Epsilon;
+		double left = (center - down) / k_Epsilon;
+		if (std::abs(right - left) > 0.1 * std::max(std::abs(right), std::abs(left)) + 1e-2)
+		{
+			continue;
+		}
+
+		double numeric = (up - down) / (2.0 * k_Epsilon);
+		double error = std::abs(numeric - gradient[k]) / std::max({ 1.0, std::abs(numeric), std::abs(static_cast<double>(gradient[k])) });
+		worst = std::max(worst, static_cast<float>(error));
+	}
+	return worst;
+}
+
+// Input delta of layer running in place, the output a view of the input buffer shaped like
+// outputDelta and the deltas sharing a buffer too, against the layer running out of place
+static float InPlaceError(Layer &layer, const Tensor &input, const Tensor &outputDelta)
+{
+	Tensor data(input);
+	Tensor output = Tensor::view(data, outputDelta.channels(), outputDelta.rows(), outputDelta.cols());
+	layer.forward(data, output);
+
+	Tensor delta(outputDelta);
+	Tensor inputDelta = Tensor::view(delta, input.channels(), input.rows(), input.cols());
+	layer.backward(output, output, inputDelta, delta);
+
+	Tensor x(input);
+	Tensor y(outputDelta.channels(), outputDelta.rows(), outputDelta.cols());
+	return GradientError(x, inputDelta, [&]() { return Loss(layer, x, y, outputDelta); });
+}
+
+// Runs backward once, then checks the input delta and each parameter's gradient
+static bool ExpectGradients(const std::string &name, Layer &layer, const Tensor &input, const Tensor &outputDelta,
+	const std::vector<std::tuple<const char *, Tensor *, const Tensor *>> &parameters, size_t batchSize = 1)
+{
+	// A model binds the parameter deltas to its delta arena, here each gets a tensor of its own
+	layer.reserveBackward();
+	for (Parameter &parameter : layer.parameters())
+	{
+		*parameter.Delta = Tensor(parameter.Value->channels(), parameter.Value->rows(), parameter.Value->cols());
+	}
+
+	Tensor x(input);
+	Tensor y(outputDelta.channels(), outputDelta.rows(), outputDelta.cols());
+	Tensor inputDelta(input.channels(), input.rows(), input.cols());
+	if (batchSize > 1)
+	{
+		layer.forwardBatch(x, y, batchSize);
+		layer.backwardBatch(x, y, inputDelta, outputDelta, batchSize);
+	}
+	else
+	{
+		layer.forward(x, y);
+		layer.backward(x, y, inputDelta, outputDelta);
+	}
+
+	auto loss = [&]() { return Loss(layer, x, y, outputDelta, batchSize); };
+	bool passed = Expect(name + ", input delta", GradientError(x, inputDelta, loss), k_Tolerance);
+	for (size_t p = 0; p < parameters.size(); ++p)
+	{
+		passed &= Expect(name + ", " + std::get<0>(parameters[p]), GradientError(*std::get<1>(parameters[p]), *std::get<2>(parameters[p]), loss), k_Tolerance);
+	}
+	return passed;
+}
+
+bool CheckGradients()
+{
+	bool passed = true;
+
+	// Sigmoid is left out, as its forward pass is a fast approximation of the logistic
+	// function that backward differentiates. Softmax normalizes over the whole tensor.
+	const std::pair<ActivationFunc, const char *> activations[] = {
+		{ ActivationFunc::None, "identity" },
+		{ ActivationFunc::Tanh, "tanh" },
+		{ ActivationFunc::ReLU, "ReLU" },
+		{ ActivationFunc::Softmax, "softmax" }
+	};
+	for (const auto &[activFunc, name] : activations)
+	{
+		size_t channels = activFunc == ActivationFunc::Softmax ? 1 : 3;
+		ActivationLayer layer(activFunc);
+		passed &= Expect(std::string(name) + " in place, input delta",
+			InPlaceError(layer, SignedTensor(channels, 4, 5, 1), SignedTensor(channels, 4, 5, 2)), k_Tolerance);
+	}
+
+	FlattenLayer flatten;
+	passed &= Expect("flatten in place, input delta", InPlaceError(flatten, SignedTensor(3, 4, 5, 3), SignedTensor(1, 60, 1, 4)), k_Tolerance);
+
+	FullyConnectedLayer fc(SignedTensor(1, 3, 4, 5), SignedTensor(1, 3, 1, 6));
+	passed &= ExpectGradients("fully connected", fc, SignedTensor(1, 4, 1, 7), SignedTensor(1, 3, 1, 8), {
+		{ "weights", &fc.Weights, &fc.DeltaWeights },
+		{ "biases", &fc.Biases, &fc.DeltaBiases } });
+
+	// Input elements covered by several windows gather a delta from each
+	ConvolutionalLayer conv(1, 4, 4, SignedTensor(2, 3, 3, 19));
+	passed &= ExpectGradients("convolution", conv, SignedTensor(1, 6, 6, 20), SignedTensor(2, 4, 4, 21), {
+		{ "kernel", &conv.KernelWindowed, &conv.DeltaKernelWindowed },
+		{ "biases", &conv.Biases, &conv.DeltaBiases } });
+
+	// Only the first input channel is read, so the kernel of the second has no gradient
+	ConvolutionalLayer twoChannelConv(2, 4, 4, SignedTensor(3, 3, 3, 42));
+	passed &= ExpectGradients("convolution of two input channels", twoChannelConv, SignedTensor(2, 6, 6, 43), SignedTensor(3, 4, 4, 44), {
+		{ "kernel", &twoChannelConv.KernelWindowed, &twoChannelConv.DeltaKernelWindowed },
+		{ "biases", &twoChannelConv.Biases, &twoChannelConv.DeltaBiases } });
+
+	// Blocked tensors carry input channel 0 in lane 0 only, and ten output channels leave the
+	// second block partial
+	ConvolutionalLayer blockedConv(1, 4, 4, SignedTensor(10, 3, 3, 22));
+	blockedConv.Layout = TensorLayout::NCHW8c;
+	passed &= ExpectGradients("blocked convolution", blockedConv, SignedTensor(1, 6, 6 * Tensor::k_BlockSize, 23), SignedTensor(2, 4, 4 * Tensor::k_BlockSize, 24), {
+		{ "kernel", &blockedConv.KernelWindowed, &blockedConv.DeltaKernelWindowed },
+		{ "biases", &blockedConv.Biases, &blockedConv.DeltaBiases } });
+
+	MaxPoolingLayer blockedPool(2, 2);
+	blockedPool.Layout = TensorLayout::NCHW8c;
+	passed &= ExpectGradients("blocked max pooling", blockedPool, SignedTensor(1, 6, 6 * Tensor::k_BlockSize, 25), SignedTensor(1, 3, 3 * Tensor::k_BlockSize, 26), {});
+
+	// A tile of equal values passes its delta on once, to the maximum forward kept
+	for (TensorLayout layout : { TensorLayout::NCHW, TensorLayout::NCHW8c })
+	{
+		size_t lanes = layout == TensorLayout::NCHW8c ? Tensor::k_BlockSize : 1;
+		MaxPoolingLayer pool(2, 2);
+		pool.Layout = layout;
+
+		Tensor input(1, 4, 4 * lanes);
+		Tensor output(1, 2, 2 * lanes);
+		Tensor inputDelta(1, 4, 4 * lanes);
+		Tensor outputDelta(1, 2, 2 * lanes);
+		outputDelta.fill(1.0f);
+		pool.forward(input, output);
+		pool.backward(input, output, inputDelta, outputDelta);
+
+		double total = 0.0;
+		for (size_t i = 0; i < inputDelta.size(); ++i)
+		{
+			total += inputDelta[i];
+		}
+		passed &= Expect(std::string(layout == TensorLayout::NCHW ? "planar" : "blocked") + " max pooling ties, delta passed on",
+			static_cast<float>(std::abs(total - static_cast<double>(outputDelta.size()))), 0.0f);
+	}
+
+	// Batch statistics of each channel of a convolution output
+	BatchNormLayer channelNorm(0.9f, 1e-5f, RandomTensor(3, 1, 1, 9), SignedTensor(3, 1, 1, 10), Tensor(3, 1, 1), Tensor(3, 1, 1));
+	passed &= ExpectGradients("batch norm channels", channelNorm, SignedTensor(3, 4, 5, 11), SignedTensor(3, 4, 5, 12), {
+		{ "gamma", &channelNorm.Gamma, &channelNorm.DeltaGamma },
+		{ "beta", &channelNorm.Beta, &channelNorm.DeltaBeta } });
+
+	// Running statistics of each feature of a flat input, as a single sample has none of its own
+	BatchNormLayer featureNorm(0.9f, 1e-5f, RandomTensor(6, 1, 1, 13), SignedTensor(6, 1, 1, 14), SignedTensor(6, 1, 1, 15), RandomTensor(6, 1, 1, 16));
+	featureNorm.Training = false;
+	passed &= ExpectGradients("batch norm features", featureNorm, SignedTensor(1, 6, 1, 17), SignedTensor(1, 6, 1, 18), {
+		{ "gamma", &featureNorm.Gamma, &featureNorm.DeltaGamma },
+		{ "beta", &featureNorm.Beta, &featureNorm.DeltaBeta } });
+
+	// Batches of samples stacked along the channels, their parameter deltas summed
+	FullyConnectedLayer fcBatch(SignedTensor(1, 3, 4, 27), SignedTensor(1, 3, 1, 28));
+	passed &= ExpectGradients("fully connected batch", fcBatch, SignedTensor(4, 4, 1, 29), SignedTensor(4, 3, 1, 30), {
+		{ "weights", &fcBatch.Weights, &fcBatch.DeltaWeights },
+		{ "biases", &fcBatch.Biases, &fcBatch.DeltaBiases } }, 4);
+
+	ConvolutionalLayer convBatch(1, 4, 4, SignedTensor(2, 3, 3, 31));
+	passed &= ExpectGradients("convolution batch", convBatch, SignedTensor(3, 6, 6, 32), SignedTensor(6, 4, 4, 33), {
+		{ "kernel", &convBatch.KernelWindowed, &convBatch.DeltaKernelWindowed },
+		{ "biases", &convBatch.Biases, &convBatch.DeltaBiases } }, 3);
+
+	BatchNormLayer channelBatchNorm(0.9f, 1e-5f, RandomTensor(3, 1, 1, 34), SignedTensor(3, 1, 1, 35), Tensor(3, 1, 1), Tensor(3, 1, 1));
+	passed &= ExpectGradients("batch norm channels, batch", channelBatchNorm, SignedTensor(6, 4, 5, 36), SignedTensor(6, 4, 5, 37), {
+		{ "gamma", &channelBatchNorm.Gamma, &channelBatchNorm.DeltaGamma },
+		{ "beta", &channelBatchNorm.Beta, &channelBatchNorm.DeltaBeta } }, 2);
+
+	// Each feature of a flat input normalized over the batch alone
+	BatchNormLayer featureBatchNorm(0.9f, 1e-5f, RandomTensor(6, 1, 1, 38), SignedTensor(6, 1, 1, 39), Tensor(6, 1, 1), Tensor(6, 1, 1));
+	passed &= ExpectGradients("batch norm features, batch", featureBatchNorm, SignedTensor(4, 6, 1, 40), SignedTensor(4, 6, 1, 41), {
+		{ "gamma", &featureBatchNorm.Gamma, &featureBatchNorm.DeltaGamma },
+		{ "beta", &featureBatchNorm.Beta, &featureBatchNorm.DeltaBeta } }, 4);
+
+	return passed;
+}
\ No newline at end of file
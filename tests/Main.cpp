@@ -0,0 +1,136 @@
+#include "Tests.h"
+
+#include <iostream>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+maxml::Tensor RandomTensor(size_t channels, size_t rows, size_t cols, uint32_t seed)
+{
+	std::mt19937 mt(seed);
+	std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+	maxml::Tensor tensor(channels, rows, cols);
+	for (size_t i = 0; i < tensor.size(); ++i)
+	{
+		tensor[i] = dist(mt);
+	}
+	return tensor;
+}
+
+maxml::Tensor OneHotTargets(size_t batchSize, size_t numClasses)
+{
+	maxml::Tensor targets(batchSize, numClasses, 1);
+	for (size_t n = 0; n < batchSize; ++n)
+	{
+		targets[n * numClasses + n % numClasses] = 1.0f;
+	}
+	return targets;
+}
+
+float MaxDifference(const maxml::Tensor &a, const maxml::Tensor &b)
+{
+	if (a.size() != b.size())
+	{
+		return std::numeric_limits<float>::infinity();
+	}
+
+	float difference = 0.0f;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		// NaNs fail every comparison, so they are turned into an infinite difference
+		float d = std::abs(a[i] - b[i]);
+		difference = d <= difference ? difference : std::isnan(d) ? std::numeric_limits<float>::infinity() : d;
+	}
+	return difference;
+}
+
+bool Expect(const std::string &what, float difference, float tolerance)
+{
+	bool passed = difference <= tolerance;
+	std::cout << (passed ? "  ok    " : "  FAIL  ") << what << ": " << difference << " (tolerance " << tolerance << ")" << std::endl;
+	return passed;
+}
+
+std::string TempPath(const std::string &name)
+{
+#if defined(__unix__) || defined(__APPLE__)
+	std::string process = std::to_string(getpid());
+#else
+	std::string process = "0";
+#endif
+	return (std::filesystem::temp_directory_path() / ("maxml_test_" + process + "_" + name)).string();
+}
+
+std::string SaveModel(const maxml::SequentialDesc &description, const std::string &name)
+{
+	std::string path = TempPath(name + ".nn");
+	maxml::Sequential model(description);
+	model.save(path);
+	return path;
+}
+
+struct Check
+{
+	const char *Name;
+	bool (*Run)();
+};
+
+static const Check k_Checks[] = {
+	{ "gradients", CheckGradients },
+	{ "layouts", CheckLayouts },
+	{ "fused_update", CheckFusedUpdate },
+	{ "parallel_trainer", CheckParallelTrainer },
+	{ "tensor_parallel", CheckTensorParallel },
+	{ "inference_session", CheckInferenceSession },
+	{ "checkpoints", CheckCheckpoints },
+	{ "graph", CheckGraph },
+	{ "codegen", CheckCodegen },
+	{ "static_sequential", CheckStaticSequential },
+	{ "compression", CheckCompression },
+	{ "all_reduce", CheckAllReduce },
+	{ "distributed_trainer", CheckDistributedTrainer },
+};
+
+// Usage: maxml_tests [check]
+// Runs the named check, or all of them, failing if any comparison is out of tolerance
+int main(int argc, char **argv)
+{
+	bool found = false;
+	bool passed = true;
+	for (const Check &check : k_Checks)
+	{
+		if (argc > 1 && std::strcmp(argv[1], check.Name) != 0)
+		{
+			continue;
+		}
+
+		std::cout << check.Name << std::endl;
+		found = true;
+		passed &= check.Run();
+	}
+
+	// Models of the checks
+	std::string prefix = std::filesystem::path(TempPath("")).filename().string();
+	for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(std::filesystem::temp_directory_path()))
+	{
+		if (entry.path().filename().string().rfind(prefix, 0) == 0)
+		{
+			std::filesystem::remove(entry.path());
+		}
+	}
+
+	if (!found)
+	{
+		std::cerr << "Unknown check " << argv[1] << std::endl;
+		return 1;
+	}
+	return passed ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include "maxml/MmlSequential.h"
+
+#include <iostream>
+#include <filesystem>
+#include <random>
+#include <string>
+
+using namespace maxml;
+
+// Models shaped like the example's, with batch normalization both folded into its producer
+// and left on its own
+static SequentialDesc MnistModel()
+{
+	SequentialDesc description;
+	description.ObjectiveFunc = LossFunc::CrossEntropy;
+	description.LearningRate = 0.05f;
+	description.MaxBatchSize = 8;
+	description.LayerDescs = {
+		makeInput(1, 28, 28),
+		makeConvolutional(32, 5, 5, ActivationFunc::ReLU),
+		makePooling(2, 2, PoolingFunc::Max),
+		makeConvolutional(32, 3, 3, ActivationFunc::None),
+		makeBatchNorm(ActivationFunc::ReLU),
+		makePooling(2, 2, PoolingFunc::Max),
+		makeFlatten(),
+		makeBatchNorm(ActivationFunc::None),
+		makeFullyConnected(64, ActivationFunc::None),
+		makeBatchNorm(ActivationFunc::ReLU),
+		makeFullyConnected(64, ActivationFunc::ReLU),
+		makeFullyConnected(10, ActivationFunc::Softmax)
+	};
+	return description;
+}
+
+static SequentialDesc RegressionModel()
+{
+	SequentialDesc description;
+	description.ObjectiveFunc = LossFunc::MSE;
+	description.LearningRate = 0.05f;
+	description.MaxBatchSize = 8;
+	description.LayerDescs = {
+		makeInput(1, 1, 1),
+		makeFullyConnected(16, ActivationFunc::ReLU),
+		makeFullyConnected(16, ActivationFunc::None),
+		makeBatchNorm(ActivationFunc::ReLU),
+		makeFullyConnected(16, ActivationFunc::Tanh),
+		makeFullyConnected(1, ActivationFunc::None)
+	};
+	return description;
+}
+
+// Trains description briefly on random samples, so that the batch norms' running statistics
+// and scales differ between features, and saves it to path
+static void WriteModel(const SequentialDesc &description, size_t outputSize, const std::string &path)
+{
+	const size_t batchSize = 8;
+	const InputDesc &input = std::get<InputDesc>(description.LayerDescs.front());
+
+	std::mt19937 mt(0);
+	std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+	Sequential model(description);
+	Tensor inputs(batchSize * input.Channels, input.Rows, input.Cols);
+	Tensor targets(batchSize, outputSize, 1);
+	for (size_t s = 0; s < 20; ++s)
+	{
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			inputs[i] = dist(mt);
+		}
+
+		// Regression targets are random, classes cycle through the batch
+		for (size_t i = 0; i < targets.size(); ++i)
+		{
+			targets[i] = outputSize == 1 ? dist(mt) : i % outputSize == (i / outputSize + s) % outputSize ? 1.0f : 0.0f;
+		}
+
+		model.feedForward(inputs, batchSize);
+		model.feedBackward(targets);
+	}
+	model.save(path);
+}
+
+// Usage: maxml_test_models <directory>
+// Writes the models the generated code of the checks is built from
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <directory>" << std::endl;
+		return 1;
+	}
+
+	std::filesystem::path directory = argv[1];
+	std::filesystem::create_directories(directory);
+
+	WriteModel(MnistModel(), 10, (directory / "mnist.nn").string());
+	WriteModel(RegressionModel(), 1, (directory / "regression.nn").string());
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#include "Tests.h"
+#include "maxml/MmlStaticSequential.h"
+
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+using namespace maxml;
+
+using StaticModel = StaticSequential<Input<1, 6, 1>, Dense<16, ActivationFunc::Tanh>, Dense<12, ActivationFunc::Sigmoid>, Dense<3, ActivationFunc::Softmax>>;
+
+bool CheckStaticSequential()
+{
+	std::string path = SaveModel(StaticModel::description(LossFunc::CrossEntropy, 0.1f), "static");
+	StaticModel staticModel(path);
+	Sequential model(path);
+
+	Tensor inputs = RandomTensor(16, 6, 1, 10);
+	Tensor targets = OneHotTargets(16, 3);
+
+	// Both run the same formulas one sample at a time, in a different order of summation
+	float lossDifference = 0.0f;
+	for (size_t s = 0; s < 32; ++s)
+	{
+		const Tensor input = Tensor::slice(inputs, s % 16, 1);
+		const Tensor expected = Tensor::slice(targets, s % 16, 1);
+
+		staticModel.feedForward(std::span<const float, StaticModel::InputSize>(&input[0], StaticModel::InputSize));
+		float staticLoss = staticModel.feedBackward(std::span<const float, StaticModel::OutputSize>(&expected[0], StaticModel::OutputSize));
+
+		model.feedForward(input);
+		lossDifference = std::max(lossDifference, std::abs(model.feedBackward(expected) - staticLoss));
+	}
+
+	bool passed = Expect("losses vs Sequential", lossDifference, 5e-7f);
+
+	// Saved by the static model, loaded by Sequential
+	std::string trainedPath = TempPath("static_trained.nn");
+	staticModel.save(trainedPath);
+	Sequential loaded(trainedPath);
+
+	float outputDifference = 0.0f;
+	float loadDifference = 0.0f;
+	for (size_t s = 0; s < 16; ++s)
+	{
+		const Tensor input = Tensor::slice(inputs, s, 1);
+		std::span<const float, StaticModel::OutputSize> output = staticModel.predict(std::span<const float, StaticModel::InputSize>(&input[0], StaticModel::InputSize));
+
+		Tensor staticOutput(StaticModel::OutputSize, 1, 1);
+		std::copy(output.begin(), output.end(), &staticOutput[0]);
+		outputDifference = std::max(outputDifference, MaxDifference(staticOutput, Tensor::view(model.predict(input), StaticModel::OutputSize, 1, 1)));
+		loadDifference = std::max(loadDifference, MaxDifference(staticOutput, Tensor::view(loaded.predict(input), StaticModel::OutputSize, 1, 1)));
+	}
+
+	passed &= Expect("outputs after training vs Sequential", outputDifference, 5e-7f);
+	passed &= Expect("outputs of the saved model loaded by Sequential", loadDifference, 5e-7f);
+
+	// A file of another model leaves the initialized parameters in place
+	using OtherModel = StaticSequential<Input<1, 6, 1>, Dense<8, ActivationFunc::Tanh>, Dense<3, ActivationFunc::Softmax>>;
+	StaticModel mismatched(SaveModel(OtherModel::description(LossFunc::CrossEntropy, 0.1f), "static_other"));
+	passed &= Expect("loaded flags, static and other model files", (staticModel.loaded() ? 0.0f : 1.0f) + (mismatched.loaded() ? 1.0f : 0.0f), 0.0f);
+	return passed;
+}
\ No newline at end of file
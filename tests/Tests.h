@@ -0,0 +1,38 @@
+#pragma once
+
+#include "maxml/MmlSequential.h"
+
+#include <string>
+
+// Each check returns whether it passed, printing what it compared either way
+bool CheckGradients();
+bool CheckLayouts();
+bool CheckFusedUpdate();
+bool CheckParallelTrainer();
+bool CheckTensorParallel();
+bool CheckInferenceSession();
+bool CheckCheckpoints();
+bool CheckGraph();
+bool CheckCodegen();
+bool CheckStaticSequential();
+bool CheckCompression();
+bool CheckAllReduce();
+bool CheckDistributedTrainer();
+
+// Samples uniform in [0, 1), the same for the same seed
+maxml::Tensor RandomTensor(size_t channels, size_t rows, size_t cols, uint32_t seed);
+
+// One-hot targets, sample n of class n % numClasses
+maxml::Tensor OneHotTargets(size_t batchSize, size_t numClasses);
+
+float MaxDifference(const maxml::Tensor &a, const maxml::Tensor &b);
+
+// Prints the comparison and returns whether difference is within tolerance
+bool Expect(const std::string &what, float difference, float tolerance);
+
+// Path in the temporary directory unique to this process
+std::string TempPath(const std::string &name);
+
+// Saves a freshly initialized model of description, so that every load starts from the same
+// parameters
+std::string SaveModel(const maxml::SequentialDesc &description, const std::string &name);
\ No newline at end of file
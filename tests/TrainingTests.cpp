@@ -0,0 +1,313 @@
+#include "Tests.h"
+#include "maxml/MmlParallelTrainer.h"
+#include "maxml/MmlInferenceSession.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+using namespace maxml;
+
+// Convolution, pooling and batch normalization of both convolutional and flat outputs, with
+// channel counts that leave the blocked layout partial blocks. Hidden layers avoid sigmoid,
+// whose fast approximation trains with the derivative of the logistic function, and ReLU,
+// which amplifies rounding wherever it switches.
+static SequentialDesc ConvolutionalModel()
+{
+	SequentialDesc description;
+	description.ObjectiveFunc = LossFunc::CrossEntropy;
+	description.LearningRate = 0.1f;
+	description.MaxBatchSize = 4;
+	description.LayerDescs = {
+		makeInput(2, 10, 10),
+		makeConvolutional(5, 3, 3, ActivationFunc::Tanh),
+		makePooling(2, 2, PoolingFunc::Max),
+		makeBatchNorm(ActivationFunc::Tanh),
+		makeConvolutional(11, 3, 3, ActivationFunc::Tanh),
+		makeFlatten(),
+		makeFullyConnected(12, ActivationFunc::Tanh),
+		makeBatchNorm(ActivationFunc::Tanh),
+		makeFullyConnected(3, ActivationFunc::Softmax)
+	};
+	return description;
+}
+
+// Samples [first, first + batchSize) of inputs, which stacks one sample per target
+static const Tensor Batch(const Tensor &inputs, const Tensor &targets, size_t first, size_t batchSize)
+{
+	size_t sampleChannels = inputs.channels() / targets.channels();
+	return Tensor::slice(inputs, first * sampleChannels, batchSize * sampleChannels);
+}
+
+// Runs steps batches of batchSize through model, cycling through the samples, and returns its
+// outputs on the first batch after
+static Tensor Train(Sequential &model, const Tensor &inputs, const Tensor &targets, size_t batchSize, size_t steps)
+{
+	size_t numSamples = targets.channels();
+	for (size_t s = 0; s < steps; ++s)
+	{
+		size_t first = s * batchSize % numSamples;
+		model.feedForward(Batch(inputs, targets, first, batchSize), batchSize);
+		model.feedBackward(Tensor::slice(targets, first, batchSize));
+	}
+	return Tensor(model.feedForward(Batch(inputs, targets, 0, batchSize), batchSize));
+}
+
+bool CheckLayouts()
+{
+	const size_t batchSize = 4;
+	std::string path = SaveModel(ConvolutionalModel(), "layouts");
+
+	Tensor inputs = RandomTensor(16 * 2, 10, 10, 3);
+	Tensor targets = OneHotTargets(16, 3);
+
+	Sequential planar(path, batchSize);
+	Sequential blocked(path, batchSize);
+	blocked.setLayout(TensorLayout::NCHW8c);
+
+	// Rounding differences grow with training, by how much depends on the weights drawn
+	const Tensor first = Batch(inputs, targets, 0, batchSize);
+	bool passed = Expect("blocked vs planar outputs", MaxDifference(planar.feedForward(first, batchSize), blocked.feedForward(first, batchSize)), 1e-5f);
+	passed &= Expect("blocked vs planar after training", MaxDifference(Train(planar, inputs, targets, batchSize, 8), Train(blocked, inputs, targets, batchSize, 8)), 1e-3f);
+	passed &= Expect("blocked vs planar predict", MaxDifference(planar.predict(first, batchSize), blocked.predict(first, batchSize)), 1e-3f);
+	return passed;
+}
+
+bool CheckFusedUpdate()
+{
+	const size_t batchSize = 4;
+	std::string path = SaveModel(ConvolutionalModel(), "fused");
+
+	Tensor inputs = RandomTensor(16 * 2, 10, 10, 4);
+	Tensor targets = OneHotTargets(16, 3);
+
+	bool passed = true;
+	for (TensorLayout layout : { TensorLayout::NCHW, TensorLayout::NCHW8c })
+	{
+		Sequential separate(path, batchSize);
+		Sequential fused(path, batchSize);
+		separate.setLayout(layout);
+		fused.setLayout(layout);
+		fused.setFusedUpdate(true);
+
+		passed &= Expect(std::string(layout == TensorLayout::NCHW ? "planar" : "blocked") + " fused vs separate updates",
+			MaxDifference(Train(separate, inputs, targets, batchSize, 8), Train(fused, inputs, targets, batchSize, 8)), 1e-3f);
+	}
+
+	// Switching modes rebuilds the arenas, which must carry the trained parameters across
+	Sequential separate(path, batchSize);
+	Sequential switched(path, batchSize);
+	Train(separate, inputs, targets, batchSize, 4);
+	Train(switched, inputs, targets, batchSize, 4);
+	switched.setFusedUpdate(true);
+	passed &= Expect("fused after separate updates", MaxDifference(Train(separate, inputs, targets, batchSize, 4), Train(switched, inputs, targets, batchSize, 4)), 1e-3f);
+	return passed;
+}
+
+bool CheckParallelTrainer()
+{
+	// Batch normalization would normalize every shard by its own statistics
+	const size_t batchSize = 12;
+	SequentialDesc description;
+	description.ObjectiveFunc = LossFunc::CrossEntropy;
+	description.LearningRate = 0.2f;
+	description.MaxBatchSize = batchSize;
+	description.LayerDescs = {
+		makeInput(1, 12, 12),
+		makeConvolutional(6, 3, 3, ActivationFunc::ReLU),
+		makePooling(2, 2, PoolingFunc::Max),
+		makeFlatten(),
+		makeFullyConnected(40, ActivationFunc::Tanh),
+		makeFullyConnected(4, ActivationFunc::Softmax)
+	};
+	std::string path = SaveModel(description, "parallel");
+
+	Tensor inputs = RandomTensor(48, 12, 12, 5);
+	Tensor targets = OneHotTargets(48, 4);
+
+	Sequential single(path, batchSize);
+	Tensor expected = Train(single, inputs, targets, batchSize, 8);
+
+	bool passed = true;
+	for (size_t numWorkers : { 2, 3 })
+	{
+		Sequential model(path, batchSize);
+		ParallelTrainer trainer(model, numWorkers, batchSize);
+		for (size_t s = 0; s < 8; ++s)
+		{
+			size_t first = s * batchSize % 48;
+			trainer.step(Tensor::slice(inputs, first, batchSize), Tensor::slice(targets, first, batchSize), batchSize);
+		}
+
+		Tensor outputs(model.feedForward(Tensor::slice(inputs, 0, batchSize), batchSize));
+		passed &= Expect(std::to_string(numWorkers) + " workers vs one thread", MaxDifference(expected, outputs), 1e-5f);
+	}
+
+	// A single Hogwild worker has nobody to race with, and steps as plain SGD does
+	Sequential hogwild(path, batchSize);
+	ParallelTrainer trainer(hogwild, 1, batchSize, TrainerMode::Hogwild);
+	for (size_t s = 0; s < 8; ++s)
+	{
+		size_t first = s * batchSize % 48;
+		trainer.step(Tensor::slice(inputs, first, batchSize), Tensor::slice(targets, first, batchSize), batchSize);
+	}
+
+	Tensor outputs(hogwild.feedForward(Tensor::slice(inputs, 0, batchSize), batchSize));
+	passed &= Expect("one Hogwild worker vs one thread", MaxDifference(expected, outputs), 1e-5f);
+	return passed;
+}
+
+bool CheckTensorParallel()
+{
+	// Wide enough for the hidden layer to be partitioned by default
+	SequentialDesc description;
+	description.ObjectiveFunc = LossFunc::CrossEntropy;
+	description.LearningRate = 0.05f;
+	description.MaxBatchSize = 8;
+	description.LayerDescs = {
+		makeInput(1, 16, 16),
+		makeFlatten(),
+		makeFullyConnected(4096, ActivationFunc::Tanh),
+		makeFullyConnected(5, ActivationFunc::Softmax)
+	};
+	std::string path = SaveModel(description, "tensor_parallel");
+
+	Tensor inputs = RandomTensor(16, 16, 16, 6);
+	Tensor targets = OneHotTargets(16, 5);
+
+	bool passed = true;
+	for (bool fused : { false, true })
+	{
+		for (size_t batchSize : { 1, 8 })
+		{
+			Sequential single(path, 8);
+			Sequential split(path, 8);
+			single.setFusedUpdate(fused);
+			split.setFusedUpdate(fused);
+			split.setTensorParallelism(3);
+
+			passed &= Expect(std::string(fused ? "fused" : "separate") + " batch " + std::to_string(batchSize) + ", 3 threads vs one",
+				MaxDifference(Train(single, inputs, targets, batchSize, 6), Train(split, inputs, targets, batchSize, 6)), 1e-5f);
+		}
+	}
+	return passed;
+}
+
+bool CheckInferenceSession()
+{
+	const size_t batchSize = 4;
+	std::string path = SaveModel(ConvolutionalModel(), "inference_session");
+	std::string trainedPath = TempPath("inference_session_trained.nn");
+
+	Tensor inputs = RandomTensor(16 * 2, 10, 10, 7);
+	Tensor targets = OneHotTargets(16, 3);
+	const Tensor sample = Batch(inputs, targets, 0, 1);
+	const Tensor first = Batch(inputs, targets, 0, batchSize);
+
+	bool passed = true;
+	for (TensorLayout layout : { TensorLayout::NCHW, TensorLayout::NCHW8c })
+	{
+		// Sessions are compared with a copy of the trained parameters whose batch normalization
+		// is folded or switched to running statistics
+		{
+			Sequential model(path, batchSize);
+			model.setLayout(layout);
+			Train(model, inputs, targets, batchSize, 8);
+			model.save(trainedPath);
+		}
+
+		Sequential reference(trainedPath, batchSize);
+		reference.setLayout(layout);
+		reference.foldBatchNorm();
+
+		Tensor expectedSample(reference.predict(sample, 1));
+		Tensor expectedBatch(reference.predict(first, batchSize));
+
+		Sequential inference(trainedPath, batchSize, ModelMode::Inference);
+		inference.setLayout(layout);
+		passed &= Expect(std::string(layout == TensorLayout::NCHW ? "planar" : "blocked") + " inference mode vs running statistics",
+			MaxDifference(expectedBatch, inference.predict(first, batchSize)), 1e-5f);
+
+		// Sessions share the packed parameters of an inference model, and read the unpacked
+		// ones of a model in training mode
+		for (ModelMode mode : { ModelMode::Training, ModelMode::Inference })
+		{
+			std::shared_ptr<Sequential> model = std::make_shared<Sequential>(trainedPath, batchSize, mode);
+			model->setLayout(layout);
+
+			std::vector<float> differences(3, 0.0f);
+			std::vector<std::thread> threads;
+			for (size_t t = 0; t < differences.size(); ++t)
+			{
+				threads.emplace_back([&, t]()
+				{
+					InferenceSession session(model, batchSize);
+					for (size_t i = 0; i < 10; ++i)
+					{
+						differences[t] = std::max(differences[t], MaxDifference(expectedSample, session.predict(sample, 1)));
+						differences[t] = std::max(differences[t], MaxDifference(expectedBatch, session.predict(first, batchSize)));
+					}
+				});
+			}
+			for (std::thread &thread : threads)
+			{
+				thread.join();
+			}
+
+			passed &= Expect(std::string(layout == TensorLayout::NCHW ? "planar" : "blocked") + " sessions of "
+				+ (mode == ModelMode::Training ? "a training" : "an inference") + " model on 3 threads vs running statistics",
+				*std::max_element(differences.begin(), differences.end()), 1e-5f);
+		}
+	}
+	return passed;
+}
+
+bool CheckCheckpoints()
+{
+	const size_t batchSize = 4;
+	std::string path = SaveModel(ConvolutionalModel(), "checkpoints");
+
+	Tensor inputs = RandomTensor(16 * 2, 10, 10, 8);
+	Tensor targets = OneHotTargets(16, 3);
+
+	// Recomputed segments run the same kernels on the same inputs, so losses match exactly
+	bool passed = true;
+	for (bool automatic : { false, true })
+	{
+		Sequential plain(path, batchSize);
+		Sequential checkpointed(path, batchSize);
+		if (automatic)
+		{
+			checkpointed.setAutoCheckpoints();
+		}
+		else
+		{
+			checkpointed.setCheckpoints({ 2, 5 });
+		}
+
+		float difference = 0.0f;
+		for (size_t s = 0; s < 8; ++s)
+		{
+			size_t first = s * batchSize % 16;
+			const Tensor batch = Batch(inputs, targets, first, batchSize);
+			const Tensor expected = Tensor::slice(targets, first, batchSize);
+
+			plain.feedForward(batch, batchSize);
+			checkpointed.feedForward(batch, batchSize);
+			difference = std::max(difference, std::abs(plain.feedBackward(expected) - checkpointed.feedBackward(expected)));
+		}
+
+		std::string name = automatic ? "automatic checkpoints" : "checkpoints 2 and 5";
+		passed &= Expect(name + ", losses vs none", difference, 0.0f);
+		passed &= Expect(name + ", outputs after training vs none",
+			MaxDifference(plain.feedForward(Batch(inputs, targets, 0, batchSize), batchSize), checkpointed.feedForward(Batch(inputs, targets, 0, batchSize), batchSize)), 0.0f);
+		if (automatic)
+		{
+			passed &= Expect(name + ", activation bytes over none",
+				static_cast<float>(checkpointed.activationBytes()) - static_cast<float>(plain.activationBytes()), 0.0f);
+		}
+	}
+	return passed;
+}
\ No newline at end of file